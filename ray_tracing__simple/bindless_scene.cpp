@@ -0,0 +1,270 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+#include "bindless_scene.h"
+#include "nvh/nvprint.hpp"
+
+void BindlessScene::setup(const vk::Device&         device,
+                          const vk::PhysicalDevice& physicalDevice,
+                          PoolAllocator*            allocator,
+                          uint32_t                  maxObjects,
+                          uint32_t                  maxTextures,
+                          uint32_t                  nbFrames)
+{
+  using vkDT = vk::DescriptorType;
+  using vkSS = vk::ShaderStageFlagBits;
+  using vkBF = vk::DescriptorBindingFlagBits;
+
+  m_device   = device;
+  m_alloc    = allocator;
+  m_nbFrames = nbFrames;
+  m_debug.setup(device);
+
+  auto chain = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                           vk::PhysicalDeviceVulkan12Features>();
+  const auto& features = chain.get<vk::PhysicalDeviceVulkan12Features>();
+  if(!features.runtimeDescriptorArray || !features.descriptorBindingPartiallyBound
+     || !features.descriptorBindingUpdateUnusedWhilePending
+     || !features.descriptorBindingSampledImageUpdateAfterBind)
+    throw std::runtime_error("Device fails to support update-after-bind descriptor arrays");
+  if(!features.bufferDeviceAddress
+     || !chain.get<vk::PhysicalDeviceFeatures2>().features.shaderInt64)
+    throw std::runtime_error("Device fails to support buffer references in shaders");
+
+  auto props = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2,
+                                             vk::PhysicalDeviceDescriptorIndexingProperties>();
+  const auto& limits    = props.get<vk::PhysicalDeviceDescriptorIndexingProperties>();
+  uint32_t    maxImages = std::min(limits.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                                limits.maxDescriptorSetUpdateAfterBindSampledImages);
+  m_maxObjects  = std::max(maxObjects, 1u);
+  m_maxTextures = std::max(std::min(maxTextures, maxImages), 1u);
+  if(m_maxTextures < maxTextures)
+    LOGW("Scene texture table limited to %u textures\n", m_maxTextures);
+
+  vkSS allStages = vkSS::eVertex | vkSS::eFragment | vkSS::eClosestHitKHR;
+  std::array<vk::DescriptorSetLayoutBinding, 4> bindings{
+      vk::DescriptorSetLayoutBinding(0, vkDT::eUniformBuffer, 1, vkSS::eVertex | vkSS::eRaygenKHR),
+      vk::DescriptorSetLayoutBinding(1, vkDT::eStorageBuffer, 1, allStages),
+      vk::DescriptorSetLayoutBinding(2, vkDT::eStorageBuffer, 1, allStages),
+      vk::DescriptorSetLayoutBinding(3, vkDT::eCombinedImageSampler, m_maxTextures,
+                                     vkSS::eFragment | vkSS::eClosestHitKHR)};
+
+  // The texture array is written while the set is in use, and only holds the live slots
+  vk::DescriptorBindingFlags arrayFlags =
+      vkBF::eUpdateAfterBind | vkBF::ePartiallyBound | vkBF::eUpdateUnusedWhilePending;
+  std::array<vk::DescriptorBindingFlags, 4> bindingFlags{{}, {}, {}, arrayFlags};
+
+  vk::DescriptorSetLayoutBindingFlagsCreateInfo flagsInfo;
+  flagsInfo.setBindingFlags(bindingFlags);
+  vk::DescriptorSetLayoutCreateInfo layoutInfo;
+  layoutInfo.setFlags(vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool);
+  layoutInfo.setBindings(bindings);
+  layoutInfo.setPNext(&flagsInfo);
+  m_layout = m_device.createDescriptorSetLayout(layoutInfo);
+
+  std::array<vk::DescriptorPoolSize, 3> poolSizes{
+      vk::DescriptorPoolSize(vkDT::eUniformBuffer, 1),
+      vk::DescriptorPoolSize(vkDT::eStorageBuffer, 2),
+      vk::DescriptorPoolSize(vkDT::eCombinedImageSampler, m_maxTextures)};
+  vk::DescriptorPoolCreateInfo poolInfo;
+  poolInfo.setFlags(vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind);
+  poolInfo.setMaxSets(1);
+  poolInfo.setPoolSizes(poolSizes);
+  m_pool    = m_device.createDescriptorPool(poolInfo);
+  m_descSet = m_device.allocateDescriptorSets({m_pool, 1, &m_layout})[0];
+
+  // Object table, read by every hit: device local, updated in the command buffers
+  m_objTable = m_alloc->createBuffer(
+      m_maxObjects * sizeof(ObjDesc),
+      vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+      vk::MemoryPropertyFlagBits::eDeviceLocal);
+  m_debug.setObjectName(m_objTable.buffer, "objTable");
+  m_objDescs.assign(m_maxObjects, ObjDesc());
+  m_dirtyObjects.clear();
+  vk::DescriptorBufferInfo tableInfo{m_objTable.buffer, 0, VK_WHOLE_SIZE};
+  vk::WriteDescriptorSet   tableWrite{m_descSet, 1, 0, 1, vkDT::eStorageBuffer, nullptr,
+                                    &tableInfo};
+  m_device.updateDescriptorSets(tableWrite, nullptr);
+
+  m_nbObjects  = 0;
+  m_nextObject = 0;
+  m_freeObjects.clear();
+  m_textureSlots.init(uint64_t(m_maxTextures) * Tlsf::kGranularity);
+  m_textureRanges.clear();
+  m_retired.clear();
+}
+
+void BindlessScene::destroy()
+{
+  m_alloc->destroy(m_objTable);
+  m_device.destroy(m_pool);
+  m_device.destroy(m_layout);
+}
+
+void BindlessScene::setCamera(vk::Buffer camera)
+{
+  vk::DescriptorBufferInfo info{camera, 0, VK_WHOLE_SIZE};
+  vk::WriteDescriptorSet   write{m_descSet, 0, 0, 1, vk::DescriptorType::eUniformBuffer, nullptr,
+                               &info};
+  m_device.updateDescriptorSets(write, nullptr);
+}
+
+void BindlessScene::setSceneDesc(vk::Buffer sceneDesc)
+{
+  vk::DescriptorBufferInfo info{sceneDesc, 0, VK_WHOLE_SIZE};
+  vk::WriteDescriptorSet   write{m_descSet, 2, 0, 1, vk::DescriptorType::eStorageBuffer, nullptr,
+                               &info};
+  m_device.updateDescriptorSets(write, nullptr);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The addresses of the object are written in its slot of the table: no descriptor update
+//
+uint32_t BindlessScene::addObject(const ObjDesc& desc)
+{
+  uint32_t slot;
+  if(!m_freeObjects.empty())
+  {
+    slot = m_freeObjects.back();
+    m_freeObjects.pop_back();
+  }
+  else if(m_nextObject < m_maxObjects)
+  {
+    slot = m_nextObject++;
+  }
+  else
+  {
+    throw std::runtime_error("Scene object table full");
+  }
+  m_nbObjects++;
+
+  m_objDescs[slot] = desc;
+  m_dirtyObjects.push_back(slot);
+  return slot;
+}
+
+void BindlessScene::removeObject(uint32_t slot)
+{
+  assert(slot < m_nextObject);
+  m_objDescs[slot] = ObjDesc();
+  m_retired.push_back({slot, false, m_frame + m_nbFrames});
+  m_nbObjects--;
+}
+
+uint32_t BindlessScene::addTextures(const std::vector<vk::DescriptorImageInfo>& textures)
+{
+  if(textures.empty())
+    return 0;
+  Tlsf::Handle handle = m_textureSlots.allocate(textures.size() * Tlsf::kGranularity);
+  if(handle == Tlsf::kInvalid)
+    return ~0u;
+  uint32_t firstSlot =
+      static_cast<uint32_t>(m_textureSlots.getOffset(handle) / Tlsf::kGranularity);
+  m_textureRanges[firstSlot] = handle;
+
+  vk::WriteDescriptorSet write(m_descSet, 3, firstSlot, static_cast<uint32_t>(textures.size()),
+                               vk::DescriptorType::eCombinedImageSampler, textures.data());
+  m_device.updateDescriptorSets(write, nullptr);
+  return firstSlot;
+}
+
+void BindlessScene::removeTextures(uint32_t firstSlot)
+{
+  assert(m_textureRanges.count(firstSlot));
+  m_retired.push_back({firstSlot, true, m_frame + m_nbFrames});
+}
+
+uint32_t BindlessScene::getNbTextures() const
+{
+  return static_cast<uint32_t>(m_textureSlots.getUsed() / Tlsf::kGranularity);
+}
+
+void BindlessScene::nextFrame()
+{
+  m_frame++;
+  auto released = std::stable_partition(m_retired.begin(), m_retired.end(),
+                                        [&](const Retired& r) { return r.frame > m_frame; });
+  for(auto it = released; it != m_retired.end(); ++it)
+  {
+    if(it->texture)
+    {
+      m_textureSlots.free(m_textureRanges[it->slot]);
+      m_textureRanges.erase(it->slot);
+    }
+    else
+    {
+      m_freeObjects.push_back(it->slot);
+    }
+  }
+  m_retired.erase(released, m_retired.end());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Runs of consecutive slots are copied with vkCmdUpdateBuffer, as the camera matrices. The slots
+// added are not read by the frames in flight, a barrier only makes them visible to this frame:
+// to the stages of the table binding, and to the compute passes of the frame.
+//
+void BindlessScene::cmdUpdateTable(const vk::CommandBuffer& cmdBuf)
+{
+  if(m_dirtyObjects.empty())
+    return;
+  std::sort(m_dirtyObjects.begin(), m_dirtyObjects.end());
+  m_dirtyObjects.erase(std::unique(m_dirtyObjects.begin(), m_dirtyObjects.end()),
+                       m_dirtyObjects.end());
+
+  const uint32_t maxRun = 65536 / sizeof(ObjDesc);  // Limit of vkCmdUpdateBuffer
+  for(size_t i = 0; i < m_dirtyObjects.size();)
+  {
+    uint32_t first = m_dirtyObjects[i];
+    uint32_t count = 1;
+    while(i + count < m_dirtyObjects.size() && m_dirtyObjects[i + count] == first + count
+          && count < maxRun)
+      count++;
+    cmdBuf.updateBuffer(m_objTable.buffer, first * sizeof(ObjDesc), count * sizeof(ObjDesc),
+                        &m_objDescs[first]);
+    i += count;
+  }
+  m_dirtyObjects.clear();
+
+  vk::BufferMemoryBarrier barrier;
+  barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+  barrier.setBuffer(m_objTable.buffer);
+  barrier.setOffset(0);
+  barrier.setSize(VK_WHOLE_SIZE);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                         vk::PipelineStageFlagBits::eVertexShader
+                             | vk::PipelineStageFlagBits::eFragmentShader
+                             | vk::PipelineStageFlagBits::eComputeShader
+                             | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                         {}, {}, {barrier}, {});
+}
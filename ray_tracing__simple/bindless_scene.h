@@ -0,0 +1,137 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <map>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "nvvk/debug_util_vk.hpp"
+
+#include "pool_allocator.h"
+#include "tlsf.h"
+
+//--------------------------------------------------------------------------------------------------
+// Descriptor set of the scene, shared by the raster and ray tracing pipelines
+// - Objects are entries of the object table, a storage buffer of the device addresses of their
+//   buffers: the shaders read them through buffer references, and the number of objects is not
+//   limited by the descriptor counts of the device. The table is device local, the entries added
+//   are copied by cmdUpdateTable().
+// - The array of textures has a fixed large capacity. It is partially bound and
+//   update-after-bind: the layout, and the pipelines using it, never change with the number of
+//   models
+// - Objects take a slot from a free list, textures a contiguous range of slots (the materials
+//   of a model index its textures from the first one)
+// - Slots being freed can still be read by the frames in flight: they are reused once nbFrames
+//   calls to nextFrame() went by. Writing unused slots while frames are pending is allowed by
+//   eUpdateUnusedWhilePending.
+//
+// Bindings
+//   0: camera (uniform)    1: object table    2: scene description    3: textures[maxTextures]
+//
+class BindlessScene
+{
+public:
+  // Entry of the object table: device addresses of the buffers of the object and the first slot
+  // of its textures, ObjDesc of the shaders
+  struct ObjDesc
+  {
+    uint64_t vertexAddress{0};
+    uint64_t indexAddress{0};
+    uint64_t materialAddress{0};
+    uint64_t matIndexAddress{0};
+    uint32_t txtOffset{0};
+    uint32_t padding{0};
+  };
+
+  // The texture capacity is clamped to the update-after-bind limit of the device. Throws if the
+  // device lacks descriptor indexing or buffer device addresses.
+  void setup(const vk::Device&         device,
+             const vk::PhysicalDevice& physicalDevice,
+             PoolAllocator*            allocator,
+             uint32_t                  maxObjects,
+             uint32_t                  maxTextures,
+             uint32_t                  nbFrames);
+  void destroy();
+
+  vk::DescriptorSetLayout getLayout() const { return m_layout; }
+  vk::DescriptorSet       getDescriptorSet() const { return m_descSet; }
+
+  void setCamera(vk::Buffer camera);
+  void setSceneDesc(vk::Buffer sceneDesc);
+
+  // Slot of the object: the objId of the shaders. Its entry is in the table after the next
+  // cmdUpdateTable().
+  uint32_t addObject(const ObjDesc& desc);
+  void     removeObject(uint32_t slot);
+  // First slot of the textures: the txtOffset of the shaders. ~0u when there is no room.
+  uint32_t addTextures(const std::vector<vk::DescriptorImageInfo>& textures);
+  void     removeTextures(uint32_t firstSlot);
+  // Releases the slots removed nbFrames frames ago
+  void nextFrame();
+  // Copies the entries added since the last call, before the shaders of the frame
+  void cmdUpdateTable(const vk::CommandBuffer& cmdBuf);
+
+  const ObjDesc& getObjDesc(uint32_t slot) const { return m_objDescs[slot]; }
+  uint32_t       getMaxObjects() const { return m_maxObjects; }
+  uint32_t       getMaxTextures() const { return m_maxTextures; }
+  uint32_t       getNbObjects() const { return m_nbObjects; }
+  uint32_t       getNbTextures() const;
+
+private:
+  struct Retired
+  {
+    uint32_t slot;
+    bool     texture;  // Else an object
+    uint64_t frame;    // Reusable from this frame on
+  };
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  nvvk::DebugUtil m_debug;
+  uint32_t        m_nbFrames{1};
+  uint64_t        m_frame{0};
+
+  vk::DescriptorSetLayout m_layout;
+  vk::DescriptorPool      m_pool;
+  vk::DescriptorSet       m_descSet;
+
+  // Objects: free list of slots, and the object table
+  uint32_t              m_maxObjects{0};
+  uint32_t              m_nbObjects{0};
+  std::vector<uint32_t> m_freeObjects;
+  uint32_t              m_nextObject{0};  // Slots above were never used
+  nvvk::Buffer          m_objTable;
+  std::vector<ObjDesc>  m_objDescs;      // Host copy of the table
+  std::vector<uint32_t> m_dirtyObjects;  // Slots added since the last cmdUpdateTable()
+
+  // Textures: ranges of slots, one slot being Tlsf::kGranularity units of the TLSF range
+  uint32_t                         m_maxTextures{0};
+  Tlsf                             m_textureSlots;
+  std::map<uint32_t, Tlsf::Handle> m_textureRanges;  // By first slot
+
+  std::vector<Retired> m_retired;
+};
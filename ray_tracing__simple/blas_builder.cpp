@@ -0,0 +1,604 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <numeric>
+
+#include "blas_builder.h"
+#include "nvh/alignment.hpp"
+#include "nvh/nvprint.hpp"
+
+void BlasBuilder::setup(const vk::Device&         device,
+                        const vk::PhysicalDevice& physicalDevice,
+                        PoolAllocator*            allocator,
+                        uint32_t                  queueFamily,
+                        vk::Queue                 queue)
+{
+  m_device      = device;
+  m_alloc       = allocator;
+  m_queueFamily = queueFamily;
+  m_queue       = queue;
+  m_cmdPool     = device.createCommandPool(
+      {vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queueFamily});
+  m_debug.setup(device);
+
+  vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+  vk::SemaphoreCreateInfo     semaphoreInfo;
+  semaphoreInfo.setPNext(&timelineInfo);
+  m_timeline      = device.createSemaphore(semaphoreInfo);
+  m_timelineValue = 0;
+
+  auto properties =
+      physicalDevice.getProperties2<vk::PhysicalDeviceProperties2,
+                                    vk::PhysicalDeviceAccelerationStructurePropertiesKHR>();
+  m_scratchAlignment =
+      properties.get<vk::PhysicalDeviceAccelerationStructurePropertiesKHR>()
+          .minAccelerationStructureScratchOffsetAlignment;
+}
+
+void BlasBuilder::destroy()
+{
+  waitIdle();
+  for(auto& blas : m_blas)
+  {
+    m_alloc->destroy(blas);
+  }
+  m_blas.clear();
+  m_ready.clear();
+  m_nbReady = 0;
+  m_stats.clear();
+  m_dynamic.clear();
+  m_dirty.clear();
+  m_alloc->destroy(m_refitScratch);
+  m_device.destroy(m_timeline);
+  m_timeline = vk::Semaphore();
+  m_device.destroy(m_cmdPool);
+  m_cmdPool = vk::CommandPool();
+}
+
+vk::AccelerationStructureKHR BlasBuilder::getAccelerationStructure(uint32_t blasId) const
+{
+  return isReady(blasId) ? m_blas[blasId].accel : vk::AccelerationStructureKHR();
+}
+
+// A null address makes an inactive instance in a TLAS
+vk::DeviceAddress BlasBuilder::getDeviceAddress(uint32_t blasId) const
+{
+  if(!isReady(blasId))
+    return 0;
+  return m_device.getAccelerationStructureAddressKHR({m_blas[blasId].accel});
+}
+
+//--------------------------------------------------------------------------------------------------
+// First-fit decreasing: BLAS come largest first and go in the first batch with room for both
+// their scratch and their uncompacted size. A BLAS larger than a batch is built alone.
+//
+std::vector<BlasBuilder::Batch> BlasBuilder::packBatches(const std::vector<uint32_t>& order) const
+{
+  const vk::DeviceSize batchBudget = m_memoryBudget / 4;
+
+  std::vector<Batch> batches;
+  for(uint32_t idx : order)
+  {
+    const BlasStats& s = m_stats[idx];
+    if(s.scratchSize > batchBudget || s.buildSize > batchBudget)
+    {
+      LOGW("BLAS %u needs %llu KB, more than a batch of the memory budget\n", idx,
+           static_cast<unsigned long long>((s.scratchSize + s.buildSize) >> 10));
+    }
+
+    auto batch = std::find_if(batches.begin(), batches.end(), [&](const Batch& b) {
+      return b.scratchSize + s.scratchSize <= batchBudget
+             && b.buildSize + s.buildSize <= batchBudget;
+    });
+    if(batch == batches.end())
+    {
+      batches.emplace_back();
+      batch = batches.end() - 1;
+    }
+    batch->blasIds.push_back(idx);
+    batch->scratchSize += s.scratchSize;
+    batch->buildSize += s.buildSize;
+  }
+  return batches;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Build all BLAS, and wait until they are all ready
+//
+void BlasBuilder::build(const std::vector<BlasInput>&          inputs,
+                        vk::BuildAccelerationStructureFlagsKHR flags)
+{
+  buildAsync(inputs, flags);
+  waitIdle();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Start building all BLAS
+// - Submission s builds batch s and compacts batch s-2, whose sizes were read while the GPU
+//   was busy with batch s-1. Two extra submissions flush the compaction of the last batches.
+// - The inputs are copied: the geometry descriptions must outlive the call, not the vector
+//
+void BlasBuilder::buildAsync(const std::vector<BlasInput>&          inputs,
+                             vk::BuildAccelerationStructureFlagsKHR flags,
+                             vk::Semaphore                          waitSemaphore,
+                             uint64_t                               waitValue)
+{
+  using vkBU = vk::BufferUsageFlagBits;
+
+  // The BLAS of a previous build may still be in use: only one build at a time
+  waitIdle();
+  for(auto& blas : m_blas)
+    m_alloc->destroy(blas);
+  m_alloc->destroy(m_refitScratch);
+  m_dynamic.clear();
+  m_dirty.clear();
+  m_refitScratchStride = 0;
+  m_refitSlots         = 0;
+
+  uint32_t nbBlas  = static_cast<uint32_t>(inputs.size());
+  m_inputs         = inputs;
+  m_compact        = false;
+  m_totalTriangles = 0;
+
+  m_blas.assign(nbBlas, {});
+  m_ready.assign(nbBlas, 0);
+  m_nbReady = 0;
+  m_stats.assign(nbBlas, {});
+  m_entries.assign(nbBlas, {});
+
+  // Query the memory needed by each BLAS
+  for(uint32_t idx = 0; idx < nbBlas; idx++)
+  {
+    BlasEntry& entry = m_entries[idx];
+    entry.input      = &m_inputs[idx];
+    entry.flags      = m_inputs[idx].flags ? m_inputs[idx].flags : flags;
+    entry.buildInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+    entry.buildInfo.setFlags(entry.flags);
+    entry.buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+    entry.buildInfo.setGeometryCount(static_cast<uint32_t>(m_inputs[idx].asGeometry.size()));
+    entry.buildInfo.setPGeometries(m_inputs[idx].asGeometry.data());
+
+    std::vector<uint32_t> maxPrimCount;
+    for(const auto& range : m_inputs[idx].asBuildOffsetInfo)
+    {
+      maxPrimCount.push_back(range.primitiveCount);
+      entry.nbTriangles += range.primitiveCount;
+    }
+    m_totalTriangles += entry.nbTriangles;
+
+    vk::AccelerationStructureBuildSizesInfoKHR sizeInfo =
+        m_device.getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eDevice, entry.buildInfo, maxPrimCount);
+    m_stats[idx].buildSize   = sizeInfo.accelerationStructureSize;
+    m_stats[idx].scratchSize = nvh::align_up(sizeInfo.buildScratchSize, m_scratchAlignment);
+    m_stats[idx].compactSize = sizeInfo.accelerationStructureSize;
+
+    if(entry.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)
+      m_compact = true;
+    if(entry.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate)
+    {
+      DynamicBlas& dynamic = m_dynamic[idx];
+      dynamic.input        = m_inputs[idx];
+      dynamic.flags        = entry.flags;
+      dynamic.scratchSize  = nvh::align_up(
+          std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize), m_scratchAlignment);
+      m_refitScratchStride = std::max(m_refitScratchStride, dynamic.scratchSize);
+    }
+  }
+
+  // Largest first
+  std::vector<uint32_t> order(nbBlas);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return m_stats[a].scratchSize + m_stats[a].buildSize
+           > m_stats[b].scratchSize + m_stats[b].buildSize;
+  });
+  m_batches = packBatches(order);
+
+  // One scratch buffer, large enough for any batch
+  vk::DeviceSize scratchSize = 0;
+  for(const auto& batch : m_batches)
+    scratchSize = std::max(scratchSize, batch.scratchSize);
+  m_scratch = m_alloc->createBuffer(std::max<vk::DeviceSize>(scratchSize, 1),
+                                    vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress);
+  m_debug.setObjectName(m_scratch.buffer, "BlasScratch");
+  m_scratchAddress = m_device.getBufferAddress({m_scratch.buffer});
+
+  // Two submissions in flight
+  auto cmdBufs = m_device.allocateCommandBuffers({m_cmdPool, vk::CommandBufferLevel::ePrimary, 2});
+  uint32_t maxBatchSize = 0;
+  for(const auto& batch : m_batches)
+    maxBatchSize = std::max(maxBatchSize, static_cast<uint32_t>(batch.blasIds.size()));
+  for(size_t i = 0; i < m_submissions.size(); i++)
+  {
+    m_submissions[i]        = Submission();
+    m_submissions[i].cmdBuf = cmdBufs[i];
+    if(m_compact)
+    {
+      m_submissions[i].queryPool = m_device.createQueryPool(
+          {{}, vk::QueryType::eAccelerationStructureCompactedSizeKHR, maxBatchSize});
+    }
+  }
+
+  // Scratch of the refits of one frame: each one has its own part, so they can overlap. The
+  // dynamic BLAS are refit once ready.
+  if(!m_dynamic.empty())
+  {
+    m_refitSlots   = std::max(1u, std::min(m_refitBudget, uint32_t(m_dynamic.size())));
+    m_refitScratch = m_alloc->createBuffer(m_refitScratchStride * m_refitSlots,
+                                           vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress);
+    m_debug.setObjectName(m_refitScratch.buffer, "BlasRefitScratch");
+    m_refitScratchAddress = m_device.getBufferAddress({m_refitScratch.buffer});
+  }
+
+  uint32_t nbBatches = static_cast<uint32_t>(m_batches.size());
+  m_waitSemaphore    = waitSemaphore;
+  m_waitValue        = waitValue;
+  m_nbSubmitted      = 0;
+  m_nbSubmissions    = m_compact ? nbBatches + 2 : nbBatches;
+  m_building         = true;
+  m_startTime        = std::chrono::high_resolution_clock::now();
+  update();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Record and submit submission `s` in its slot, which the GPU is done with
+//
+void BlasBuilder::submit(uint32_t s)
+{
+  Submission&       submission = m_submissions[s % 2];
+  vk::CommandBuffer cmdBuf     = submission.cmdBuf;
+  cmdBuf.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+  // The previous batches must be done with the scratch buffer before this batch reuses it, and
+  // their BLAS must be written before being compacted. This also orders after the previous
+  // submissions on the queue.
+  vk::MemoryBarrier barrier;
+  barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR
+                           | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR
+                           | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                         vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {barrier},
+                         {}, {});
+
+  if(m_compact && submission.batch >= 0)
+    recordCompaction(cmdBuf, submission);
+  submission.batch = -1;
+
+  if(s < m_batches.size())
+  {
+    Batch&                                    batch = m_batches[s];
+    std::vector<vk::AccelerationStructureKHR> builtAs;
+    vk::DeviceSize                            scratchOffset = 0;
+    for(uint32_t idx : batch.blasIds)
+    {
+      BlasEntry& entry = m_entries[idx];
+
+      vk::AccelerationStructureCreateInfoKHR createInfo;
+      createInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+      createInfo.setSize(m_stats[idx].buildSize);
+      entry.as = m_alloc->createAcceleration(createInfo);
+      m_debug.setObjectName(entry.as.accel, (std::string("Blas" + std::to_string(idx)).c_str()));
+      if(entry.flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction)
+      {
+        builtAs.push_back(entry.as.accel);
+        batch.compactIds.push_back(idx);
+      }
+
+      // Each BLAS uses its own part of the scratch buffer: builds of the batch can overlap
+      entry.buildInfo.setDstAccelerationStructure(entry.as.accel);
+      entry.buildInfo.setScratchData(m_scratchAddress + scratchOffset);
+      scratchOffset += m_stats[idx].scratchSize;
+
+      const vk::AccelerationStructureBuildRangeInfoKHR* pBuildOffset =
+          entry.input->asBuildOffsetInfo.data();
+      cmdBuf.buildAccelerationStructuresKHR(1, &entry.buildInfo, &pBuildOffset);
+    }
+
+    // The BLAS not compacted are final, and ready with this submission
+    for(uint32_t idx : batch.blasIds)
+    {
+      if(!(m_entries[idx].flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction))
+      {
+        m_blas[idx] = m_entries[idx].as;
+        submission.toPublish.push_back(idx);
+      }
+    }
+
+    if(!builtAs.empty())
+    {
+      // Wait for the builds before reading their compacted size
+      barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+      barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR);
+      cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                             vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {},
+                             {barrier}, {}, {});
+      cmdBuf.resetQueryPool(submission.queryPool, 0, static_cast<uint32_t>(builtAs.size()));
+      cmdBuf.writeAccelerationStructuresPropertiesKHR(
+          builtAs, vk::QueryType::eAccelerationStructureCompactedSizeKHR, submission.queryPool,
+          0);
+      submission.batch = static_cast<int>(s);
+    }
+  }
+  cmdBuf.end();
+
+  submission.value   = ++m_timelineValue;
+  submission.pending = true;
+
+  // The first submission waits for the inputs, the others follow it on the queue
+  bool                   waitInputs = s == 0 && m_waitSemaphore;
+  vk::PipelineStageFlags waitStage  = vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR;
+  vk::TimelineSemaphoreSubmitInfo timelineInfo;
+  timelineInfo.setWaitSemaphoreValueCount(waitInputs ? 1 : 0);
+  timelineInfo.setPWaitSemaphoreValues(&m_waitValue);
+  timelineInfo.setSignalSemaphoreValueCount(1);
+  timelineInfo.setPSignalSemaphoreValues(&submission.value);
+  vk::SubmitInfo submitInfo;
+  submitInfo.setPNext(&timelineInfo);
+  submitInfo.setWaitSemaphoreCount(waitInputs ? 1 : 0);
+  submitInfo.setPWaitSemaphores(&m_waitSemaphore);
+  submitInfo.setPWaitDstStageMask(&waitStage);
+  submitInfo.setCommandBufferCount(1);
+  submitInfo.setPCommandBuffers(&cmdBuf);
+  submitInfo.setSignalSemaphoreCount(1);
+  submitInfo.setPSignalSemaphores(&m_timeline);
+  m_queue.submit({submitInfo}, {});
+}
+
+//--------------------------------------------------------------------------------------------------
+// A submission completed: release what it no longer needs, its BLAS are ready
+//
+void BlasBuilder::retire(Submission& submission, std::vector<uint32_t>& ready)
+{
+  for(auto& as : submission.toDestroy)
+    m_alloc->destroy(as);
+  submission.toDestroy.clear();
+  for(uint32_t idx : submission.toPublish)
+  {
+    m_ready[idx] = 1;
+    ready.push_back(idx);
+  }
+  m_nbReady += static_cast<uint32_t>(submission.toPublish.size());
+  submission.toPublish.clear();
+  submission.pending = false;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called once per frame while building: never waits
+// - A slot is reused once the submission s-2 using it completed: the compacted sizes it
+//   queried can then be read without waiting
+//
+std::vector<uint32_t> BlasBuilder::update()
+{
+  std::vector<uint32_t> ready;
+  if(!m_building)
+    return ready;
+
+  uint64_t counter = m_device.getSemaphoreCounterValue(m_timeline);
+  for(auto& submission : m_submissions)
+  {
+    if(submission.pending && counter >= submission.value)
+      retire(submission, ready);
+  }
+  while(m_nbSubmitted < m_nbSubmissions && !m_submissions[m_nbSubmitted % 2].pending)
+  {
+    submit(m_nbSubmitted++);
+  }
+
+  bool pending = m_submissions[0].pending || m_submissions[1].pending;
+  if(m_nbSubmitted == m_nbSubmissions && !pending)
+    finishBuild();
+  return ready;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Wait for the build in progress to end
+//
+void BlasBuilder::waitIdle()
+{
+  while(m_building)
+  {
+    // Oldest submission in flight
+    uint64_t value = 0;
+    for(const auto& submission : m_submissions)
+    {
+      if(submission.pending && (value == 0 || submission.value < value))
+        value = submission.value;
+    }
+    if(value != 0)
+    {
+      vk::SemaphoreWaitInfo waitInfo({}, 1, &m_timeline, &value);
+      vk::Result            result = m_device.waitSemaphores(waitInfo, UINT64_MAX);
+      assert(result == vk::Result::eSuccess);
+    }
+    update();
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// All submissions completed: release the build resources
+//
+void BlasBuilder::finishBuild()
+{
+  for(auto& submission : m_submissions)
+  {
+    m_device.destroy(submission.queryPool);
+    m_device.freeCommandBuffers(m_cmdPool, submission.cmdBuf);
+    submission = Submission();
+  }
+  m_alloc->destroy(m_scratch);
+  m_building = false;
+
+  auto   endTime   = std::chrono::high_resolution_clock::now();
+  double elapsedMs = std::chrono::duration<double, std::milli>(endTime - m_startTime).count();
+  m_trianglesPerMs = elapsedMs > 0 ? double(m_totalTriangles) / elapsedMs : 0;
+
+  LOGI("Built %u BLAS in %u batches (budget %llu MB): %.2f ms, %.0f triangles/ms\n",
+       static_cast<uint32_t>(m_blas.size()), static_cast<uint32_t>(m_batches.size()),
+       static_cast<unsigned long long>(m_memoryBudget >> 20), elapsedMs, m_trianglesPerMs);
+  logStats();
+
+  m_entries.clear();
+  m_batches.clear();
+  m_inputs.clear();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Read the compacted sizes of the batch built by `built` (done), and record the copies of its
+// BLAS in right-sized ones. The originals are released, and the copies ready, when `cmdBuf`
+// completes.
+//
+void BlasBuilder::recordCompaction(vk::CommandBuffer cmdBuf, Submission& built)
+{
+  const Batch& batch = m_batches[built.batch];
+  uint32_t     count = static_cast<uint32_t>(batch.compactIds.size());
+
+  std::vector<vk::DeviceSize> compactSizes(count);
+  vk::Result                  result = m_device.getQueryPoolResults(
+      built.queryPool, 0, count, count * sizeof(vk::DeviceSize), compactSizes.data(),
+      sizeof(vk::DeviceSize), vk::QueryResultFlagBits::eWait | vk::QueryResultFlagBits::e64);
+  assert(result == vk::Result::eSuccess);
+
+  for(uint32_t i = 0; i < count; i++)
+  {
+    uint32_t idx             = batch.compactIds[i];
+    m_stats[idx].compactSize = compactSizes[i];
+
+    vk::AccelerationStructureCreateInfoKHR createInfo;
+    createInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+    createInfo.setSize(compactSizes[i]);
+    m_blas[idx] = m_alloc->createAcceleration(createInfo);
+    m_debug.setObjectName(m_blas[idx].accel, (std::string("Blas" + std::to_string(idx)).c_str()));
+
+    vk::CopyAccelerationStructureInfoKHR copyInfo{m_entries[idx].as.accel, m_blas[idx].accel,
+                                                  vk::CopyAccelerationStructureModeKHR::eCompact};
+    cmdBuf.copyAccelerationStructureKHR(copyInfo);
+    built.toDestroy.push_back(m_entries[idx].as);
+    built.toPublish.push_back(idx);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Memory used by each BLAS, and in total, before and after compaction
+//
+void BlasBuilder::logStats() const
+{
+  vk::DeviceSize totalBuild   = 0;
+  vk::DeviceSize totalCompact = 0;
+  for(size_t idx = 0; idx < m_stats.size(); idx++)
+  {
+    const BlasStats& s = m_stats[idx];
+    LOGI(" BLAS %3d: %8llu KB -> %8llu KB\n", static_cast<int>(idx),
+         static_cast<unsigned long long>(s.buildSize >> 10),
+         static_cast<unsigned long long>(s.compactSize >> 10));
+    totalBuild += s.buildSize;
+    totalCompact += s.compactSize;
+  }
+  LOGI(" BLAS total: %llu KB -> %llu KB (%.1f%%)\n",
+       static_cast<unsigned long long>(totalBuild >> 10),
+       static_cast<unsigned long long>(totalCompact >> 10),
+       totalBuild ? 100.0 * double(totalCompact) / double(totalBuild) : 100.0);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Queue a dynamic BLAS for the next cmdRefit()
+//
+void BlasBuilder::markDirty(uint32_t blasId)
+{
+  auto it = m_dynamic.find(blasId);
+  if(it == m_dynamic.end())
+  {
+    LOGW("BLAS %u was not built with eAllowUpdate and cannot be refit\n", blasId);
+    return;
+  }
+  if(!it->second.dirty)
+  {
+    it->second.dirty = true;
+    m_dirty.push_back(blasId);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Update the oldest dirty BLAS, up to the budget. A BLAS refit `m_rebuildPeriod` times is
+// rebuilt in place: the inputs did not change size, so it fits in its buffer.
+//
+uint32_t BlasBuilder::cmdRefit(const vk::CommandBuffer& cmdBuf)
+{
+  if(m_dirty.empty())
+    return 0;
+
+  // Previous frames may still trace or build the TLAS against these BLAS, or use the scratch
+  vk::MemoryBarrier barrier;
+  barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR
+                           | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR
+                           | vk::AccessFlagBits::eAccelerationStructureReadKHR);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR
+                             | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                         vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {barrier},
+                         {}, {});
+
+  uint32_t count = 0;
+  while(!m_dirty.empty() && count < std::min(m_refitBudget, m_refitSlots))
+  {
+    uint32_t     idx     = m_dirty.front();
+    DynamicBlas& dynamic = m_dynamic[idx];
+    m_dirty.pop_front();
+    dynamic.dirty = false;
+
+    bool rebuild = ++dynamic.nbRefits >= m_rebuildPeriod;
+    if(rebuild)
+      dynamic.nbRefits = 0;
+
+    vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+    buildInfo.setType(vk::AccelerationStructureTypeKHR::eBottomLevel);
+    buildInfo.setFlags(dynamic.flags);
+    buildInfo.setMode(rebuild ? vk::BuildAccelerationStructureModeKHR::eBuild :
+                                vk::BuildAccelerationStructureModeKHR::eUpdate);
+    buildInfo.setSrcAccelerationStructure(rebuild ? vk::AccelerationStructureKHR() :
+                                                    m_blas[idx].accel);
+    buildInfo.setDstAccelerationStructure(m_blas[idx].accel);
+    buildInfo.setGeometryCount(static_cast<uint32_t>(dynamic.input.asGeometry.size()));
+    buildInfo.setPGeometries(dynamic.input.asGeometry.data());
+    buildInfo.setScratchData(m_refitScratchAddress + count * m_refitScratchStride);
+
+    const vk::AccelerationStructureBuildRangeInfoKHR* pBuildOffset =
+        dynamic.input.asBuildOffsetInfo.data();
+    cmdBuf.buildAccelerationStructuresKHR(1, &buildInfo, &pBuildOffset);
+
+    if(rebuild)
+      m_nbRebuilds++;
+    else
+      m_nbRefits++;
+    count++;
+  }
+  return count;
+}
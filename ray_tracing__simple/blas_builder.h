@@ -0,0 +1,218 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <array>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <vulkan/vulkan.hpp>
+
+#include "nvvk/debug_util_vk.hpp"
+
+#include "pool_allocator.h"
+
+//--------------------------------------------------------------------------------------------------
+// Builds the bottom-level acceleration structures of the scene
+// - Inputs are sorted by size and packed in batches, so that one submission never holds more
+//   than a fraction of the memory budget and does not run long enough to trip a TDR
+// - All batches share one scratch buffer: a barrier orders each batch after the previous one
+// - Batches are pipelined over two submissions: while the GPU builds a batch, the host reads
+//   the compacted sizes of the previous one and records its compaction
+// - With eAllowCompaction, the BLAS are copied in right-sized buffers and the originals freed
+// - The memory used by each BLAS, before and after compaction, is kept in `getStats()`
+//
+// The builds run on the queue given to setup(), usually an async compute queue, and never wait
+// on the host: buildAsync() submits the first batches, and each update() submits the next ones
+// as the previous complete. The submissions signal a timeline semaphore. A BLAS is ready, and
+// has a device address, once the submission building or compacting it completed: the BLAS
+// becoming ready are returned by update(). build() is buildAsync() waiting for the end.
+//
+// The memory budget is split in four: the shared scratch buffer, and the uncompacted BLAS of
+// the three batches alive at once (building, waiting for its compacted size, being copied).
+//
+// BLAS built with eAllowUpdate are dynamic: once their vertices changed, `markDirty()` queues
+// them and `cmdRefit()` updates them in the frame command buffer. At most `refitBudget` BLAS
+// are processed per frame, the others stay queued. Every `rebuildPeriod` refits, a BLAS is
+// rebuilt in place instead, since the quality of a refit BVH decreases as the geometry moves.
+//
+class BlasBuilder
+{
+public:
+  // Inputs of one BLAS: one or many geometries
+  struct BlasInput
+  {
+    std::vector<vk::AccelerationStructureGeometryKHR>       asGeometry;
+    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> asBuildOffsetInfo;
+    vk::BuildAccelerationStructureFlagsKHR                  flags;  // Overrides build() flags
+  };
+
+  // Memory of one BLAS
+  struct BlasStats
+  {
+    vk::DeviceSize buildSize{0};    // Size of the acceleration structure as built
+    vk::DeviceSize scratchSize{0};  // Scratch needed to build it
+    vk::DeviceSize compactSize{0};  // Size after compaction (buildSize if not compacted)
+  };
+
+  // The queue must support acceleration structure builds: compute or graphics
+  void setup(const vk::Device&         device,
+             const vk::PhysicalDevice& physicalDevice,
+             PoolAllocator*            allocator,
+             uint32_t                  queueFamily,
+             vk::Queue                 queue);
+  void destroy();
+
+  // Maximum of scratch and uncompacted memory in flight while building
+  void setMemoryBudget(vk::DeviceSize budget) { m_memoryBudget = budget; }
+
+  void build(const std::vector<BlasInput>& inputs, vk::BuildAccelerationStructureFlagsKHR flags);
+  // Replaces all BLAS. The first submission waits for `waitValue` of the timeline semaphore
+  // `waitSemaphore`, e.g. the upload of the geometry.
+  void buildAsync(const std::vector<BlasInput>&          inputs,
+                  vk::BuildAccelerationStructureFlagsKHR flags,
+                  vk::Semaphore                          waitSemaphore = {},
+                  uint64_t                               waitValue     = 0);
+  // Submit what the completed submissions allow, returns the BLAS ready since the last call
+  std::vector<uint32_t> update();
+  void                  waitIdle();
+  bool                  isBuilding() const { return m_building; }
+  bool                  isReady(uint32_t blasId) const { return m_ready[blasId] != 0; }
+  uint32_t              getNbReady() const { return m_nbReady; }
+  uint32_t              getNbBlas() const { return static_cast<uint32_t>(m_blas.size()); }
+
+  // Null until the BLAS is ready
+  vk::AccelerationStructureKHR  getAccelerationStructure(uint32_t blasId) const;
+  vk::DeviceAddress             getDeviceAddress(uint32_t blasId) const;
+  const std::vector<BlasStats>& getStats() const { return m_stats; }
+  void                          logStats() const;
+  double                        getTrianglesPerMs() const { return m_trianglesPerMs; }
+
+  // Dynamic BLAS, set before build()
+  void setRefitBudget(uint32_t maxRefitsPerFrame) { m_refitBudget = maxRefitsPerFrame; }
+  void setRebuildPeriod(uint32_t nbRefits) { m_rebuildPeriod = nbRefits; }
+
+  // The vertices of a dynamic BLAS changed: the writes must be visible to
+  // eAccelerationStructureBuildKHR before the command buffer given to cmdRefit()
+  void markDirty(uint32_t blasId);
+  // Refit or rebuild up to the budget of dirty BLAS, returns how many were recorded
+  uint32_t cmdRefit(const vk::CommandBuffer& cmdBuf);
+  uint32_t getNbDirty() const { return static_cast<uint32_t>(m_dirty.size()); }
+  uint32_t getNbRefits() const { return m_nbRefits; }
+  uint32_t getNbRebuilds() const { return m_nbRebuilds; }
+
+private:
+  struct BlasEntry
+  {
+    nvvk::AccelKHR                                as;
+    vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+    const BlasInput*                              input{nullptr};
+    vk::BuildAccelerationStructureFlagsKHR        flags;
+    uint64_t                                      nbTriangles{0};
+  };
+
+  // Group of BLAS built in the same submission
+  struct Batch
+  {
+    std::vector<uint32_t> blasIds;
+    std::vector<uint32_t> compactIds;  // BLAS of the batch built with eAllowCompaction
+    vk::DeviceSize        scratchSize{0};
+    vk::DeviceSize        buildSize{0};
+  };
+
+  // One of the two submissions in flight
+  struct Submission
+  {
+    vk::CommandBuffer           cmdBuf;
+    uint64_t                    value{0};        // Signaled on the timeline when done
+    bool                        pending{false};  // Submitted, not retired yet
+    vk::QueryPool               queryPool;       // Compacted sizes of the batch built
+    int                         batch{-1};       // Batch built by this submission
+    std::vector<nvvk::AccelKHR> toDestroy;       // Released when the submission is done
+    std::vector<uint32_t>       toPublish;       // BLAS ready when the submission is done
+  };
+
+  // Inputs kept to update a dynamic BLAS
+  struct DynamicBlas
+  {
+    BlasInput                              input;
+    vk::BuildAccelerationStructureFlagsKHR flags;
+    vk::DeviceSize                         scratchSize{0};  // Largest of update and build
+    uint32_t                               nbRefits{0};     // Since the last rebuild
+    bool                                   dirty{false};
+  };
+
+  std::vector<Batch> packBatches(const std::vector<uint32_t>& order) const;
+  void               submit(uint32_t s);
+  void               retire(Submission& submission, std::vector<uint32_t>& ready);
+  void               finishBuild();
+  void               recordCompaction(vk::CommandBuffer cmdBuf, Submission& built);
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  nvvk::DebugUtil m_debug;
+  uint32_t        m_queueFamily{0};
+  vk::Queue       m_queue;
+  vk::CommandPool m_cmdPool;
+  vk::Semaphore   m_timeline;
+  uint64_t        m_timelineValue{0};  // Last value submitted
+  vk::DeviceSize  m_scratchAlignment{256};
+  vk::DeviceSize  m_memoryBudget{256ull << 20};
+
+  // State of the build in progress
+  std::vector<BlasInput>    m_inputs;
+  std::vector<BlasEntry>    m_entries;
+  std::vector<Batch>        m_batches;
+  std::array<Submission, 2> m_submissions;
+  nvvk::Buffer              m_scratch;
+  vk::DeviceAddress         m_scratchAddress{0};
+  vk::Semaphore             m_waitSemaphore;
+  uint64_t                  m_waitValue{0};
+  bool                      m_building{false};
+  bool                      m_compact{false};
+  uint32_t                  m_nbSubmitted{0};
+  uint32_t                  m_nbSubmissions{0};
+  uint64_t                  m_totalTriangles{0};
+
+  std::chrono::high_resolution_clock::time_point m_startTime;
+
+  std::vector<nvvk::AccelKHR> m_blas;
+  std::vector<uint8_t>        m_ready;
+  uint32_t                    m_nbReady{0};
+  std::vector<BlasStats>      m_stats;
+  double                      m_trianglesPerMs{0};
+
+  std::map<uint32_t, DynamicBlas> m_dynamic;
+  std::deque<uint32_t>            m_dirty;  // Oldest first
+  nvvk::Buffer                    m_refitScratch;
+  vk::DeviceAddress               m_refitScratchAddress{0};
+  vk::DeviceSize                  m_refitScratchStride{0};
+  uint32_t                        m_refitSlots{0};  // Refits the scratch can hold at once
+  uint32_t                        m_refitBudget{4};
+  uint32_t                        m_rebuildPeriod{60};
+  uint32_t                        m_nbRefits{0};
+  uint32_t                        m_nbRebuilds{0};
+};
@@ -0,0 +1,189 @@
+#include "shader_common.hxx"
+
+// Layouts match cull_math.h and cull_pass.h, the host reference is in cull_math.cpp.
+struct CullDraw {
+  vec3 bboxMin;
+  uint instanceId;
+  vec3 bboxMax;
+  uint cullable;
+  uint indexCount;
+  uint firstIndex;
+  int  vertexOffset;
+  uint pad;
+};
+
+struct DrawCommand {
+  uint indexCount;
+  uint instanceCount;
+  uint firstIndex;
+  int  vertexOffset;
+  uint firstInstance;
+};
+
+struct CullParams {
+  mat4 viewProj;     // Frustum test, this frame
+  mat4 hizViewProj;  // Occlusion test, frame the pyramid was built from
+  uint firstDraw;    // Region of the frame in cullDraws
+  uint nbDraws;
+  uint useHiZ;
+  uint hizWidth;
+  uint hizHeight;
+  uint hizLevels;
+  uint pad[2];
+  uint hizOffsets[16];
+};
+
+struct HiZPass {
+  uint srcOffset;
+  uint dstOffset;
+  uint srcWidth;
+  uint srcHeight;
+  uint dstWidth;
+  uint dstHeight;
+  uint fromDepth;  // Level 0: copy of the depth buffer
+};
+
+[[using spirv: buffer, binding(0)]]
+CullParams params[];
+
+[[using spirv: buffer, binding(1)]]
+SceneDesc sceneDescs[];
+
+[[using spirv: buffer, binding(2)]]
+CullDraw cullDraws[];
+
+[[using spirv: buffer, binding(3)]]
+DrawCommand outDraws[];
+
+[[using spirv: buffer, binding(4)]]
+uint drawCount[];
+
+[[using spirv: buffer, binding(5)]]
+float hiz[];
+
+[[using spirv: uniform, binding(6)]]
+sampler2D depthTexture;
+
+////////////////////////////////////////////////////////////////////////////////
+
+[[using spirv: comp, local_size(8, 8)]]
+void hiz_shader() {
+  HiZPass pass = shader_push<HiZPass>;
+  uint x = glcomp_GlobalInvocationID.x;
+  uint y = glcomp_GlobalInvocationID.y;
+  if(x >= pass.dstWidth || y >= pass.dstHeight)
+    return;
+
+  float z = 0;
+  if(pass.fromDepth) {
+    z = texelFetch(depthTexture, ivec2(x, y), 0).x;
+
+  } else {
+    // The last row and column take the remainder of odd sizes.
+    uint xEnd = (x + 1 == pass.dstWidth) ? pass.srcWidth : min(2 * x + 2, pass.srcWidth);
+    uint yEnd = (y + 1 == pass.dstHeight) ? pass.srcHeight : min(2 * y + 2, pass.srcHeight);
+    for(uint sy = 2 * y; sy < yEnd; ++sy)
+      for(uint sx = 2 * x; sx < xEnd; ++sx)
+        z = max(z, hiz[pass.srcOffset + sy * pass.srcWidth + sx]);
+  }
+  hiz[pass.dstOffset + y * pass.dstWidth + x] = z;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline vec4 boxCorner(vec3 bboxMin, vec3 bboxMax, int i) {
+  return vec4((i & 1) ? bboxMax.x : bboxMin.x, (i & 2) ? bboxMax.y : bboxMin.y,
+              (i & 4) ? bboxMax.z : bboxMin.z, 1);
+}
+
+inline bool isInFrustum(mat4 mvp, vec3 bboxMin, vec3 bboxMax) {
+  // One bit per clip plane, kept while all corners are outside of it.
+  uint outside = 0x3f;
+  for(int i = 0; i < 8; ++i) {
+    vec4 c = mvp * boxCorner(bboxMin, bboxMax, i);
+    uint mask = 0;
+    mask |= (c.x < -c.w) ? 0x01 : 0;
+    mask |= (c.x >  c.w) ? 0x02 : 0;
+    mask |= (c.y < -c.w) ? 0x04 : 0;
+    mask |= (c.y >  c.w) ? 0x08 : 0;
+    mask |= (c.z <  0)   ? 0x10 : 0;
+    mask |= (c.z >  c.w) ? 0x20 : 0;
+    outside &= mask;
+  }
+  return outside == 0;
+}
+
+inline float fetchHiZ(CullParams p, uint level, uint x, uint y) {
+  uint width = max(p.hizWidth >> level, 1u);
+  return hiz[p.hizOffsets[level] + y * width + x];
+}
+
+inline bool isOccluded(CullParams p, mat4 mvp, vec3 bboxMin, vec3 bboxMax) {
+  // Screen rectangle and closest depth of the box.
+  vec2 uvMin(1);
+  vec2 uvMax(0);
+  float zMin = 1;
+  for(int i = 0; i < 8; ++i) {
+    vec4 c = mvp * boxCorner(bboxMin, bboxMax, i);
+    if(c.w <= 0)
+      return false;
+    vec2 uv = clamp(c.xy / c.w * 0.5f + 0.5f, vec2(0), vec2(1));
+    uvMin = min(uvMin, uv);
+    uvMax = max(uvMax, uv);
+    zMin  = min(zMin, c.z / c.w);
+  }
+
+  // Level where the rectangle covers at most 2x2 texels.
+  uint x0 = min(uint(uvMin.x * p.hizWidth), p.hizWidth - 1);
+  uint x1 = min(uint(uvMax.x * p.hizWidth), p.hizWidth - 1);
+  uint y0 = min(uint(uvMin.y * p.hizHeight), p.hizHeight - 1);
+  uint y1 = min(uint(uvMax.y * p.hizHeight), p.hizHeight - 1);
+  uint level = 0;
+  while(level + 1 < p.hizLevels &&
+    ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+    ++level;
+
+  uint lastX = max(p.hizWidth >> level, 1u) - 1;
+  uint lastY = max(p.hizHeight >> level, 1u) - 1;
+  float zMax = 0;
+  for(uint y = min(y0 >> level, lastY); y <= min(y1 >> level, lastY); ++y)
+    for(uint x = min(x0 >> level, lastX); x <= min(x1 >> level, lastX); ++x)
+      zMax = max(zMax, fetchHiZ(p, level, x, y));
+  return zMin > zMax;
+}
+
+[[using spirv: comp, local_size(64)]]
+void cull_shader() {
+  CullParams p = params[0];
+  uint id = glcomp_GlobalInvocationID.x;
+  if(id >= p.nbDraws)
+    return;
+
+  CullDraw draw = cullDraws[p.firstDraw + id];
+  bool visible = true;
+  if(draw.cullable) {
+    mat4 model = instanceTransform(sceneDescs[draw.instanceId]);
+    visible = isInFrustum(p.viewProj * model, draw.bboxMin, draw.bboxMax);
+    if(visible && p.useHiZ)
+      visible = !isOccluded(p, p.hizViewProj * model, draw.bboxMin, draw.bboxMax);
+  }
+
+  // Compact the surviving draws.
+  if(visible) {
+    uint slot = atomicAdd(drawCount[0], 1);
+    DrawCommand cmd;
+    cmd.indexCount    = draw.indexCount;
+    cmd.instanceCount = 1;
+    cmd.firstIndex    = draw.firstIndex;
+    cmd.vertexOffset  = draw.vertexOffset;
+    cmd.firstInstance = draw.instanceId;
+    outDraws[slot] = cmd;
+  }
+}
+
+cull_shaders_t cull_shaders {
+  __spirv_data,
+  __spirv_size,
+  @spirv(hiz_shader),
+  @spirv(cull_shader)
+};
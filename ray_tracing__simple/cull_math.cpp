@@ -0,0 +1,171 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cull_math.h"
+
+//--------------------------------------------------------------------------------------------------
+// Levels down to 1x1, each half the size of the previous one. The texels are allocated by
+// buildHiZ(), the layout alone sizes the GPU pyramid.
+//
+void HiZPyramid::init(uint32_t w, uint32_t h)
+{
+  width    = std::max(w, 1u);
+  height   = std::max(h, 1u);
+  nbLevels = 0;
+
+  uint32_t offset = 0;
+  while(nbLevels < kMaxLevels)
+  {
+    offsets[nbLevels] = offset;
+    offset += getLevelWidth(nbLevels) * getLevelHeight(nbLevels);
+    nbLevels++;
+    if(getLevelWidth(nbLevels - 1) == 1 && getLevelHeight(nbLevels - 1) == 1)
+      break;
+  }
+  texels.clear();
+}
+
+uint32_t HiZPyramid::getNbTexels() const
+{
+  uint32_t last = nbLevels - 1;
+  return offsets[last] + getLevelWidth(last) * getLevelHeight(last);
+}
+
+void buildHiZ(const float* depth, HiZPyramid& hiz)
+{
+  hiz.texels.resize(hiz.getNbTexels());
+  std::copy(depth, depth + hiz.width * hiz.height, hiz.texels.begin());
+
+  for(uint32_t level = 1; level < hiz.nbLevels; level++)
+  {
+    uint32_t srcWidth  = hiz.getLevelWidth(level - 1);
+    uint32_t srcHeight = hiz.getLevelHeight(level - 1);
+    uint32_t dstWidth  = hiz.getLevelWidth(level);
+    uint32_t dstHeight = hiz.getLevelHeight(level);
+    for(uint32_t y = 0; y < dstHeight; y++)
+    {
+      // The last row takes the remainder of odd heights
+      uint32_t yEnd = (y + 1 == dstHeight) ? srcHeight : std::min(2 * y + 2, srcHeight);
+      for(uint32_t x = 0; x < dstWidth; x++)
+      {
+        uint32_t xEnd = (x + 1 == dstWidth) ? srcWidth : std::min(2 * x + 2, srcWidth);
+        float    z    = 0.f;
+        for(uint32_t sy = 2 * y; sy < yEnd; sy++)
+          for(uint32_t sx = 2 * x; sx < xEnd; sx++)
+            z = std::max(z, hiz.fetch(level - 1, sx, sy));
+        hiz.texels[hiz.offsets[level] + y * dstWidth + x] = z;
+      }
+    }
+  }
+}
+
+static nvmath::vec4f boxCorner(const nvmath::vec3f& bboxMin, const nvmath::vec3f& bboxMax, int i)
+{
+  return nvmath::vec4f((i & 1) ? bboxMax.x : bboxMin.x, (i & 2) ? bboxMax.y : bboxMin.y,
+                       (i & 4) ? bboxMax.z : bboxMin.z, 1.f);
+}
+
+bool isInFrustum(const nvmath::mat4f& mvp, const nvmath::vec3f& bboxMin,
+                 const nvmath::vec3f& bboxMax)
+{
+  // One bit per clip plane, kept while all corners are outside of it
+  uint32_t outside = 0x3f;
+  for(int i = 0; i < 8; i++)
+  {
+    nvmath::vec4f c    = mvp * boxCorner(bboxMin, bboxMax, i);
+    uint32_t      mask = 0;
+    mask |= (c.x < -c.w) ? 0x01 : 0;
+    mask |= (c.x > c.w) ? 0x02 : 0;
+    mask |= (c.y < -c.w) ? 0x04 : 0;
+    mask |= (c.y > c.w) ? 0x08 : 0;
+    mask |= (c.z < 0.f) ? 0x10 : 0;
+    mask |= (c.z > c.w) ? 0x20 : 0;
+    outside &= mask;
+  }
+  return outside == 0;
+}
+
+bool isOccluded(const HiZPyramid& hiz, const nvmath::mat4f& mvp, const nvmath::vec3f& bboxMin,
+                const nvmath::vec3f& bboxMax)
+{
+  // Screen rectangle and closest depth of the box
+  nvmath::vec2f uvMin(1.f, 1.f);
+  nvmath::vec2f uvMax(0.f, 0.f);
+  float         zMin = 1.f;
+  for(int i = 0; i < 8; i++)
+  {
+    nvmath::vec4f c = mvp * boxCorner(bboxMin, bboxMax, i);
+    if(c.w <= 0.f)
+      return false;
+    float u = std::min(std::max(c.x / c.w * 0.5f + 0.5f, 0.f), 1.f);
+    float v = std::min(std::max(c.y / c.w * 0.5f + 0.5f, 0.f), 1.f);
+    uvMin   = nvmath::vec2f(std::min(uvMin.x, u), std::min(uvMin.y, v));
+    uvMax   = nvmath::vec2f(std::max(uvMax.x, u), std::max(uvMax.y, v));
+    zMin    = std::min(zMin, c.z / c.w);
+  }
+
+  // Level where the rectangle covers at most 2x2 texels
+  uint32_t x0    = std::min(uint32_t(uvMin.x * hiz.width), hiz.width - 1);
+  uint32_t x1    = std::min(uint32_t(uvMax.x * hiz.width), hiz.width - 1);
+  uint32_t y0    = std::min(uint32_t(uvMin.y * hiz.height), hiz.height - 1);
+  uint32_t y1    = std::min(uint32_t(uvMax.y * hiz.height), hiz.height - 1);
+  uint32_t level = 0;
+  while(level + 1 < hiz.nbLevels
+        && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+    level++;
+
+  uint32_t lastX = hiz.getLevelWidth(level) - 1;
+  uint32_t lastY = hiz.getLevelHeight(level) - 1;
+  float    zMax  = 0.f;
+  for(uint32_t y = std::min(y0 >> level, lastY); y <= std::min(y1 >> level, lastY); y++)
+    for(uint32_t x = std::min(x0 >> level, lastX); x <= std::min(x1 >> level, lastX); x++)
+      zMax = std::max(zMax, hiz.fetch(level, x, y));
+  return zMin > zMax;
+}
+
+void cullDraws(const std::vector<CullDraw>&      draws,
+               const std::vector<nvmath::mat4f>& transforms,
+               const nvmath::mat4f&              viewProj,
+               const HiZPyramid*                 hiz,
+               const nvmath::mat4f*              hizViewProj,
+               std::vector<uint32_t>&            visible)
+{
+  visible.clear();
+  for(uint32_t i = 0; i < static_cast<uint32_t>(draws.size()); i++)
+  {
+    const CullDraw& draw = draws[i];
+    if(draw.cullable)
+    {
+      const nvmath::mat4f& model = transforms[draw.instanceId];
+      if(!isInFrustum(viewProj * model, draw.bboxMin, draw.bboxMax))
+        continue;
+      if(hiz && hizViewProj && isOccluded(*hiz, *hizViewProj * model, draw.bboxMin, draw.bboxMax))
+        continue;
+    }
+    visible.push_back(i);
+  }
+}
@@ -0,0 +1,99 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "nvmath/nvmath.h"
+
+//--------------------------------------------------------------------------------------------------
+// Culling of draws against the camera frustum and a Hi-Z depth pyramid
+// - Host reference of cull.cxx: the same tests on the same data layout, without Vulkan, so the
+//   culling can be checked on the host
+// - Boxes are in object space and tested through `mvp`, projection * view * model: the corners
+//   are projected, there is no plane extraction
+// - Depth is in [0, 1], smaller is closer: a box is occluded when its closest point is behind the
+//   farthest depth of the pyramid texels it covers
+//
+
+// Input of the cull shader, one per draw. Layout matches `CullDraw` in cull.cxx (std430).
+struct CullDraw
+{
+  nvmath::vec3f bboxMin;
+  uint32_t      instanceId{0};  // Index in the scene description, firstInstance of the draw
+  nvmath::vec3f bboxMax;
+  uint32_t      cullable{1};  // 0: always drawn, e.g. deforming models with unknown bounds
+  uint32_t      indexCount{0};
+  uint32_t      firstIndex{0};
+  int32_t       vertexOffset{0};
+  uint32_t      pad{0};
+};
+
+// Max-depth pyramid. Level 0 is the depth buffer, each level halves the previous one and keeps
+// the farthest depth. On odd sizes the last texel of a row or column also covers the remainder:
+// level-0 texel (x, y) is covered by texel (min(x >> l, w_l - 1), min(y >> l, h_l - 1)).
+struct HiZPyramid
+{
+  static constexpr uint32_t kMaxLevels = 16;
+
+  uint32_t           width{0};
+  uint32_t           height{0};
+  uint32_t           nbLevels{0};
+  uint32_t           offsets[kMaxLevels]{};  // First texel of each level in `texels`
+  std::vector<float> texels;
+
+  void     init(uint32_t w, uint32_t h);
+  uint32_t getLevelWidth(uint32_t level) const { return std::max(width >> level, 1u); }
+  uint32_t getLevelHeight(uint32_t level) const { return std::max(height >> level, 1u); }
+  uint32_t getNbTexels() const;
+  float    fetch(uint32_t level, uint32_t x, uint32_t y) const
+  {
+    return texels[offsets[level] + y * getLevelWidth(level) + x];
+  }
+};
+
+// Fills the levels of `hiz`, initialized to the size of `depth` (width * height values)
+void buildHiZ(const float* depth, HiZPyramid& hiz);
+
+// False when the 8 corners are outside the same clip plane
+bool isInFrustum(const nvmath::mat4f& mvp, const nvmath::vec3f& bboxMin,
+                 const nvmath::vec3f& bboxMax);
+
+// True when the box is behind the depth of the pyramid. `mvp` must be the matrix the depth was
+// rendered with. Boxes crossing the near plane are never occluded.
+bool isOccluded(const HiZPyramid& hiz, const nvmath::mat4f& mvp, const nvmath::vec3f& bboxMin,
+                const nvmath::vec3f& bboxMax);
+
+// Indices of the draws passing the tests, in input order. `transforms` are per instance, `hiz`
+// and `hizViewProj` can be null to skip the occlusion test.
+void cullDraws(const std::vector<CullDraw>&      draws,
+               const std::vector<nvmath::mat4f>& transforms,
+               const nvmath::mat4f&              viewProj,
+               const HiZPyramid*                 hiz,
+               const nvmath::mat4f*              hizViewProj,
+               std::vector<uint32_t>&            visible);
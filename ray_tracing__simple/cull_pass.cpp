@@ -0,0 +1,330 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+#include "cull_pass.h"
+#include "nvh/nvprint.hpp"
+#include "nvvk/shaders_vk.hpp"
+#include "shaders.hxx"
+
+// Push constants of one Hi-Z reduction, `HiZPass` in cull.cxx
+struct HiZPass
+{
+  uint32_t srcOffset;
+  uint32_t dstOffset;
+  uint32_t srcWidth;
+  uint32_t srcHeight;
+  uint32_t dstWidth;
+  uint32_t dstHeight;
+  uint32_t fromDepth;
+};
+
+void CullPass::setup(const vk::Device&         device,
+                     const vk::PhysicalDevice& physicalDevice,
+                     PoolAllocator*            allocator,
+                     uint32_t                  nbFrames,
+                     uint32_t                  maxDraws)
+{
+  using vkBU = vk::BufferUsageFlagBits;
+  using vkMP = vk::MemoryPropertyFlagBits;
+
+  m_device   = device;
+  m_alloc    = allocator;
+  m_nbFrames = nbFrames;
+  m_maxDraws = std::max(maxDraws, 1u);
+  m_debug.setup(device);
+
+  auto features = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                                              vk::PhysicalDeviceVulkan12Features>();
+
+  // The compacted draws keep the instance of each draw in firstInstance
+  m_supported = features.get<vk::PhysicalDeviceVulkan12Features>().drawIndirectCount == VK_TRUE
+                && features.get<vk::PhysicalDeviceFeatures2>().features.drawIndirectFirstInstance
+                       == VK_TRUE;
+  if(!m_supported)
+    LOGW("drawIndirectCount or drawIndirectFirstInstance not supported: no GPU culling\n");
+
+  m_params   = m_alloc->createBuffer(sizeof(Params), vkBU::eStorageBuffer | vkBU::eTransferDst);
+  m_outDraws = m_alloc->createBuffer(m_maxDraws * sizeof(vk::DrawIndexedIndirectCommand),
+                                     vkBU::eStorageBuffer | vkBU::eIndirectBuffer);
+  m_drawCount =
+      m_alloc->createBuffer(sizeof(uint32_t), vkBU::eStorageBuffer | vkBU::eIndirectBuffer
+                                                  | vkBU::eTransferDst | vkBU::eTransferSrc);
+  m_inDraws  = m_alloc->createBuffer(m_nbFrames * m_maxDraws * sizeof(CullDraw),
+                                     vkBU::eStorageBuffer,
+                                     vkMP::eHostVisible | vkMP::eHostCoherent);
+  m_readback = m_alloc->createBuffer(m_nbFrames * sizeof(uint32_t), vkBU::eTransferDst,
+                                     vkMP::eHostVisible | vkMP::eHostCoherent);
+  m_inMapped       = reinterpret_cast<CullDraw*>(m_alloc->map(m_inDraws));
+  m_readbackMapped = reinterpret_cast<uint32_t*>(m_alloc->map(m_readback));
+  memset(m_readbackMapped, 0, m_nbFrames * sizeof(uint32_t));
+  m_regionVersion.assign(m_nbFrames, 0);
+  m_debug.setObjectName(m_params.buffer, "cullParams");
+  m_debug.setObjectName(m_outDraws.buffer, "culledDraws");
+  m_debug.setObjectName(m_drawCount.buffer, "culledDrawCount");
+  m_debug.setObjectName(m_inDraws.buffer, "cullDraws");
+
+  // Depth is fetched texel by texel
+  vk::SamplerCreateInfo samplerInfo;
+  samplerInfo.setMagFilter(vk::Filter::eNearest);
+  samplerInfo.setMinFilter(vk::Filter::eNearest);
+  samplerInfo.setAddressModeU(vk::SamplerAddressMode::eClampToEdge);
+  samplerInfo.setAddressModeV(vk::SamplerAddressMode::eClampToEdge);
+  m_depthSampler = m_device.createSampler(samplerInfo);
+
+  using vkDS = vk::DescriptorSetLayoutBinding;
+  using vkDT = vk::DescriptorType;
+  using vkSS = vk::ShaderStageFlagBits;
+  m_descSetLayoutBind.addBinding(vkDS(0, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Params
+  m_descSetLayoutBind.addBinding(vkDS(1, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Scene
+  m_descSetLayoutBind.addBinding(vkDS(2, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Inputs
+  m_descSetLayoutBind.addBinding(vkDS(3, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Draws
+  m_descSetLayoutBind.addBinding(vkDS(4, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Count
+  m_descSetLayoutBind.addBinding(vkDS(5, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Hi-Z
+  m_descSetLayoutBind.addBinding(vkDS(6, vkDT::eCombinedImageSampler, 1, vkSS::eCompute));
+  m_descSetLayout = m_descSetLayoutBind.createLayout(m_device);
+  m_descPool      = m_descSetLayoutBind.createPool(m_device, 1);
+  m_descSet       = nvvk::allocateDescriptorSet(m_device, m_descPool, m_descSetLayout);
+
+  createPipelines();
+}
+
+void CullPass::createPipelines()
+{
+  vk::PushConstantRange pushConstant{vk::ShaderStageFlagBits::eCompute, 0, sizeof(HiZPass)};
+
+  vk::PipelineLayoutCreateInfo layoutInfo;
+  layoutInfo.setSetLayoutCount(1);
+  layoutInfo.setPSetLayouts(&m_descSetLayout);
+  layoutInfo.setPushConstantRangeCount(1);
+  layoutInfo.setPPushConstantRanges(&pushConstant);
+  m_pipelineLayout = m_device.createPipelineLayout(layoutInfo);
+
+  vk::ShaderModule cullSM = nvvk::createShaderModule(
+      m_device, (const uint32_t*)cull_shaders.module_data, cull_shaders.module_size);
+
+  vk::ComputePipelineCreateInfo pipelineInfo;
+  pipelineInfo.setLayout(m_pipelineLayout);
+  pipelineInfo.setStage({{}, vk::ShaderStageFlagBits::eCompute, cullSM, cull_shaders.hiz});
+  if(m_device.createComputePipelines({}, 1, &pipelineInfo, nullptr, &m_hizPipeline)
+     != vk::Result::eSuccess)
+    throw std::runtime_error("Failed to create the Hi-Z pipeline");
+  pipelineInfo.setStage({{}, vk::ShaderStageFlagBits::eCompute, cullSM, cull_shaders.cull});
+  if(m_device.createComputePipelines({}, 1, &pipelineInfo, nullptr, &m_cullPipeline)
+     != vk::Result::eSuccess)
+    throw std::runtime_error("Failed to create the cull pipeline");
+  m_debug.setObjectName(m_hizPipeline, "HiZ");
+  m_debug.setObjectName(m_cullPipeline, "Cull");
+
+  m_device.destroy(cullSM);
+}
+
+void CullPass::destroy()
+{
+  m_alloc->unmap(m_inDraws);
+  m_alloc->unmap(m_readback);
+  m_alloc->destroy(m_params);
+  m_alloc->destroy(m_inDraws);
+  m_alloc->destroy(m_outDraws);
+  m_alloc->destroy(m_drawCount);
+  m_alloc->destroy(m_readback);
+  m_alloc->destroy(m_hiz);
+  m_device.destroy(m_hizPipeline);
+  m_device.destroy(m_cullPipeline);
+  m_device.destroy(m_pipelineLayout);
+  m_device.destroy(m_descPool);
+  m_device.destroy(m_descSetLayout);
+  m_device.destroy(m_depthSampler);
+}
+
+void CullPass::setSceneDesc(vk::Buffer sceneDesc)
+{
+  m_sceneDesc = sceneDesc;
+  if(m_hiz.buffer)
+    updateDescriptors();
+}
+
+//--------------------------------------------------------------------------------------------------
+// New depth buffer, after a resize: the pyramid follows its size
+//
+void CullPass::setDepth(vk::ImageView depthView, vk::Image depthImage, const vk::Extent2D& size)
+{
+  m_depthView  = depthView;
+  m_depthImage = depthImage;
+  m_hizValid   = false;
+
+  m_alloc->destroy(m_hiz);
+  m_hizLayout.init(size.width, size.height);
+  m_hiz = m_alloc->createBuffer(m_hizLayout.getNbTexels() * sizeof(float),
+                                vk::BufferUsageFlagBits::eStorageBuffer);
+  m_debug.setObjectName(m_hiz.buffer, "hiz");
+  if(m_sceneDesc)
+    updateDescriptors();
+}
+
+void CullPass::updateDescriptors()
+{
+  vk::DescriptorBufferInfo params{m_params.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo sceneDesc{m_sceneDesc, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo inDraws{m_inDraws.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo outDraws{m_outDraws.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo drawCount{m_drawCount.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo hiz{m_hiz.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorImageInfo  depth{m_depthSampler, m_depthView,
+                                vk::ImageLayout::eShaderReadOnlyOptimal};
+
+  std::vector<vk::WriteDescriptorSet> writes;
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 0, &params));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 1, &sceneDesc));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 2, &inDraws));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 3, &outDraws));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 4, &drawCount));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 5, &hiz));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 6, &depth));
+  m_device.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+void CullPass::setDraws(const std::vector<CullDraw>& draws)
+{
+  assert(draws.size() <= m_maxDraws);
+  m_draws = draws;
+  m_drawVersion++;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Cull the draws in the frame command buffer, before the raster pass
+// - The region and the read back count of the frame are free: prepareFrame() waited for the
+//   previous use of its command buffer
+//
+void CullPass::cmdCull(const vk::CommandBuffer& cmdBuf,
+                       uint32_t                 frameIndex,
+                       const nvmath::mat4f&     viewProj)
+{
+  using vkPS = vk::PipelineStageFlagBits;
+  using vkAF = vk::AccessFlagBits;
+
+  m_nbVisible = m_readbackMapped[frameIndex];
+  if(m_regionVersion[frameIndex] != m_drawVersion)
+  {
+    memcpy(m_inMapped + frameIndex * m_maxDraws, m_draws.data(), m_draws.size() * sizeof(CullDraw));
+    m_regionVersion[frameIndex] = m_drawVersion;
+  }
+
+  Params params;
+  params.viewProj    = viewProj;
+  params.hizViewProj = m_hizViewProj;
+  params.firstDraw   = frameIndex * m_maxDraws;
+  params.nbDraws     = static_cast<uint32_t>(m_draws.size());
+  params.useHiZ      = m_hizValid ? 1 : 0;
+  params.hizWidth    = m_hizLayout.width;
+  params.hizHeight   = m_hizLayout.height;
+  params.hizLevels   = m_hizLayout.nbLevels;
+  memcpy(params.hizOffsets, m_hizLayout.offsets, sizeof(params.hizOffsets));
+
+  // Previous frames read the parameters, the draws and the count
+  vk::MemoryBarrier beforeBarrier{vkAF::eShaderRead | vkAF::eIndirectCommandRead,
+                                  vkAF::eTransferWrite};
+  cmdBuf.pipelineBarrier(vkPS::eComputeShader | vkPS::eDrawIndirect, vkPS::eTransfer, {},
+                         {beforeBarrier}, {}, {});
+  cmdBuf.updateBuffer(m_params.buffer, 0, sizeof(Params), &params);
+  cmdBuf.fillBuffer(m_drawCount.buffer, 0, sizeof(uint32_t), 0);
+  vk::MemoryBarrier clearBarrier{vkAF::eTransferWrite, vkAF::eShaderRead | vkAF::eShaderWrite};
+  cmdBuf.pipelineBarrier(vkPS::eTransfer, vkPS::eComputeShader, {}, {clearBarrier}, {}, {});
+
+  if(params.nbDraws > 0)
+  {
+    cmdBuf.bindPipeline(vk::PipelineBindPoint::eCompute, m_cullPipeline);
+    cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, m_pipelineLayout, 0, {m_descSet},
+                              {});
+    cmdBuf.dispatch((params.nbDraws + 63) / 64, 1, 1);
+  }
+
+  // Draws and count are read by drawIndexedIndirectCount, the count is also read back
+  vk::MemoryBarrier afterBarrier{vkAF::eShaderWrite,
+                                 vkAF::eIndirectCommandRead | vkAF::eTransferRead};
+  cmdBuf.pipelineBarrier(vkPS::eComputeShader, vkPS::eDrawIndirect | vkPS::eTransfer, {},
+                         {afterBarrier}, {}, {});
+  cmdBuf.copyBuffer(m_drawCount.buffer, m_readback.buffer,
+                    {vk::BufferCopy(0, frameIndex * sizeof(uint32_t), sizeof(uint32_t))});
+  vk::MemoryBarrier readbackBarrier{vkAF::eTransferWrite, vkAF::eHostRead};
+  cmdBuf.pipelineBarrier(vkPS::eTransfer, vkPS::eHost, {}, {readbackBarrier}, {}, {});
+}
+
+//--------------------------------------------------------------------------------------------------
+// Reduce the depth of the raster pass into the pyramid, one dispatch per level
+//
+void CullPass::cmdBuildHiZ(const vk::CommandBuffer& cmdBuf, const nvmath::mat4f& viewProj)
+{
+  using vkPS = vk::PipelineStageFlagBits;
+  using vkAF = vk::AccessFlagBits;
+
+  // Depth written by the raster pass is sampled, the pyramid was read by the cull of this frame
+  vk::ImageMemoryBarrier depthBarrier;
+  depthBarrier.setSrcAccessMask(vkAF::eDepthStencilAttachmentWrite);
+  depthBarrier.setDstAccessMask(vkAF::eShaderRead);
+  depthBarrier.setOldLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
+  depthBarrier.setNewLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+  depthBarrier.setImage(m_depthImage);
+  depthBarrier.setSubresourceRange({vk::ImageAspectFlagBits::eDepth, 0, 1, 0, 1});
+  cmdBuf.pipelineBarrier(vkPS::eLateFragmentTests | vkPS::eComputeShader, vkPS::eComputeShader,
+                         {}, {}, {}, {depthBarrier});
+
+  cmdBuf.bindPipeline(vk::PipelineBindPoint::eCompute, m_hizPipeline);
+  cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, m_pipelineLayout, 0, {m_descSet}, {});
+  vk::MemoryBarrier levelBarrier{vkAF::eShaderWrite, vkAF::eShaderRead | vkAF::eShaderWrite};
+  for(uint32_t level = 0; level < m_hizLayout.nbLevels; level++)
+  {
+    HiZPass pass;
+    pass.srcOffset = level > 0 ? m_hizLayout.offsets[level - 1] : 0;
+    pass.dstOffset = m_hizLayout.offsets[level];
+    pass.srcWidth  = m_hizLayout.getLevelWidth(level > 0 ? level - 1 : 0);
+    pass.srcHeight = m_hizLayout.getLevelHeight(level > 0 ? level - 1 : 0);
+    pass.dstWidth  = m_hizLayout.getLevelWidth(level);
+    pass.dstHeight = m_hizLayout.getLevelHeight(level);
+    pass.fromDepth = level == 0 ? 1 : 0;
+    cmdBuf.pushConstants<HiZPass>(m_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, pass);
+    cmdBuf.dispatch((pass.dstWidth + 7) / 8, (pass.dstHeight + 7) / 8, 1);
+    // Next level, or the cull of the next frame
+    cmdBuf.pipelineBarrier(vkPS::eComputeShader, vkPS::eComputeShader, {}, {levelBarrier}, {}, {});
+  }
+
+  // Back to the layout of the raster pass
+  depthBarrier.setSrcAccessMask(vkAF::eShaderRead);
+  depthBarrier.setDstAccessMask(vkAF::eDepthStencilAttachmentRead
+                                | vkAF::eDepthStencilAttachmentWrite);
+  depthBarrier.setOldLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
+  depthBarrier.setNewLayout(vk::ImageLayout::eDepthStencilAttachmentOptimal);
+  cmdBuf.pipelineBarrier(vkPS::eComputeShader,
+                         vkPS::eEarlyFragmentTests | vkPS::eLateFragmentTests, {}, {}, {},
+                         {depthBarrier});
+
+  m_hizViewProj = viewProj;
+  m_hizValid    = true;
+}
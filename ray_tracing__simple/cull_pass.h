@@ -0,0 +1,137 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "nvmath/nvmath.h"
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/descriptorsets_vk.hpp"
+
+#include "cull_math.h"
+#include "pool_allocator.h"
+
+//--------------------------------------------------------------------------------------------------
+// GPU-driven culling of the raster draws, see cull.cxx and the host reference in cull_math.h
+// - setDraws() gives the candidate draws. They are written in a persistently mapped region per
+//   frame, only when they changed since the frame last used its region
+// - cmdCull() tests each draw against the frustum and the Hi-Z pyramid, and appends the survivors
+//   to the draw buffer. The number of draws is in the count buffer, for drawIndexedIndirectCount
+// - cmdBuildHiZ(), after the raster pass, reduces the depth buffer into the pyramid used by the
+//   next frame. Its matrix is kept with it: the occlusion test projects the boxes as they were
+//   in that frame, so an instance which moved since can be culled one frame late
+// - Without pyramid (first frame, after a resize or a ray traced frame) only the frustum is used
+//
+class CullPass
+{
+public:
+  // Parameters of the cull shader, `CullParams` in cull.cxx (std430)
+  struct Params
+  {
+    nvmath::mat4f viewProj;
+    nvmath::mat4f hizViewProj;
+    uint32_t      firstDraw{0};
+    uint32_t      nbDraws{0};
+    uint32_t      useHiZ{0};
+    uint32_t      hizWidth{0};
+    uint32_t      hizHeight{0};
+    uint32_t      hizLevels{0};
+    uint32_t      pad[2]{};
+    uint32_t      hizOffsets[HiZPyramid::kMaxLevels]{};
+  };
+
+  void setup(const vk::Device&         device,
+             const vk::PhysicalDevice& physicalDevice,
+             PoolAllocator*            allocator,
+             uint32_t                  nbFrames,
+             uint32_t                  maxDraws);
+  void destroy();
+
+  // Scene description read by the cull shader, indexed by CullDraw::instanceId
+  void setSceneDesc(vk::Buffer sceneDesc);
+  // Depth buffer of the raster pass, in eDepthStencilAttachmentOptimal. Drops the pyramid.
+  void setDepth(vk::ImageView depthView, vk::Image depthImage, const vk::Extent2D& size);
+  void setDraws(const std::vector<CullDraw>& draws);
+
+  void cmdCull(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex, const nvmath::mat4f& viewProj);
+  void cmdBuildHiZ(const vk::CommandBuffer& cmdBuf, const nvmath::mat4f& viewProj);
+  // The next cmdCull() does not use the pyramid, e.g. no raster pass this frame
+  void invalidateHiZ() { m_hizValid = false; }
+
+  // drawIndexedIndirectCount and a firstInstance in the indirect draws are required to draw the
+  // compacted draws
+  bool       isSupported() const { return m_supported; }
+  vk::Buffer getDrawBuffer() const { return m_outDraws.buffer; }
+  vk::Buffer getCountBuffer() const { return m_drawCount.buffer; }
+  uint32_t   getMaxDraws() const { return m_maxDraws; }
+  const std::vector<CullDraw>& getDraws() const { return m_draws; }
+  // Surviving draws of a previous frame, read back once its command buffer completed
+  uint32_t getNbVisible() const { return m_nbVisible; }
+
+private:
+  void createPipelines();
+  void updateDescriptors();
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  nvvk::DebugUtil m_debug;
+  uint32_t        m_nbFrames{1};
+  uint32_t        m_maxDraws{0};
+  bool            m_supported{false};
+
+  nvvk::DescriptorSetBindings m_descSetLayoutBind;
+  vk::DescriptorPool          m_descPool;
+  vk::DescriptorSetLayout     m_descSetLayout;
+  vk::DescriptorSet           m_descSet;
+  vk::PipelineLayout          m_pipelineLayout;
+  vk::Pipeline                m_hizPipeline;
+  vk::Pipeline                m_cullPipeline;
+  vk::Sampler                 m_depthSampler;
+
+  // Candidate draws, and their regions in m_inDraws
+  std::vector<CullDraw> m_draws;
+  uint32_t              m_drawVersion{1};
+  std::vector<uint32_t> m_regionVersion;  // Version of the draws in each region
+
+  nvvk::Buffer m_params;    // Params, written in the command buffer
+  nvvk::Buffer m_inDraws;   // nbFrames regions of maxDraws CullDraw, host visible
+  CullDraw*    m_inMapped{nullptr};
+  nvvk::Buffer m_outDraws;  // maxDraws vk::DrawIndexedIndirectCommand
+  nvvk::Buffer m_drawCount;
+  nvvk::Buffer m_readback;  // Draw count of each frame, host visible
+  uint32_t*    m_readbackMapped{nullptr};
+  uint32_t     m_nbVisible{0};
+
+  // Max-depth pyramid of the last raster pass
+  vk::Buffer    m_sceneDesc;
+  vk::ImageView m_depthView;
+  vk::Image     m_depthImage;
+  HiZPyramid    m_hizLayout;  // Sizes and offsets of the levels, texels stay empty
+  nvvk::Buffer  m_hiz;
+  nvmath::mat4f m_hizViewProj{1};
+  bool          m_hizValid{false};
+};
@@ -0,0 +1,90 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+
+#include "deferred_ops.h"
+
+void DeferredOpExecutor::setup(const vk::Device& device, ThreadPool* pool)
+{
+  m_device = device;
+  m_pool   = pool;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Issue the command and, if deferred, help the driver finish it
+//
+vk::Result DeferredOpExecutor::execute(
+    const std::function<vk::Result(vk::DeferredOperationKHR)>& command)
+{
+  vk::DeferredOperationKHR operation = m_device.createDeferredOperationKHR();
+
+  vk::Result result = command(operation);
+  if(result == vk::Result::eOperationDeferredKHR)
+  {
+    // The calling thread is one of the participants
+    uint32_t maxConcurrency = m_device.getDeferredOperationMaxConcurrencyKHR(operation);
+    uint32_t nbHelpers      = std::min(maxConcurrency > 0 ? maxConcurrency - 1 : 0, m_pool->size());
+
+    std::vector<std::future<void>> helpers;
+    helpers.reserve(nbHelpers);
+    for(uint32_t i = 0; i < nbHelpers; i++)
+    {
+      helpers.emplace_back(m_pool->submit([this, operation]() { join(operation); }));
+    }
+    join(operation);
+    for(auto& h : helpers)
+    {
+      h.wait();
+    }
+
+    result = m_device.getDeferredOperationResultKHR(operation);
+  }
+  else if(result == vk::Result::eOperationNotDeferredKHR)
+  {
+    // Completed on this thread already
+    result = vk::Result::eSuccess;
+  }
+
+  m_device.destroyDeferredOperationKHR(operation);
+  return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+// eThreadIdleKHR means there is no work for this thread right now, but there may be later:
+// keep joining until the operation completes (eSuccess) or no more work will come (eThreadDoneKHR)
+//
+void DeferredOpExecutor::join(vk::DeferredOperationKHR operation)
+{
+  for(;;)
+  {
+    vk::Result r = m_device.deferredOperationJoinKHR(operation);
+    if(r != vk::Result::eThreadIdleKHR)
+      return;
+    std::this_thread::yield();
+  }
+}
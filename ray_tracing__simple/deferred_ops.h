@@ -0,0 +1,56 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <functional>
+#include <vulkan/vulkan.hpp>
+
+#include "thread_pool.h"
+
+//--------------------------------------------------------------------------------------------------
+// Runs deferrable commands (VK_KHR_deferred_host_operations) on the shared thread pool
+// - The command is issued with a fresh vk::DeferredOperationKHR
+// - If the driver defers it, up to getDeferredOperationMaxConcurrencyKHR() threads join the
+//   operation: the calling thread plus workers of the pool
+// - Returns when the operation is complete, with the result of the operation
+//
+// Everything referenced by the command (create infos, output handles) must stay alive until
+// execute() returns, and output handles must not live on the stack of a vulkan.hpp wrapper:
+// use the raw-pointer overloads.
+//
+class DeferredOpExecutor
+{
+public:
+  void setup(const vk::Device& device, ThreadPool* pool);
+
+  vk::Result execute(const std::function<vk::Result(vk::DeferredOperationKHR)>& command);
+
+private:
+  void join(vk::DeferredOperationKHR operation);
+
+  vk::Device  m_device;
+  ThreadPool* m_pool{nullptr};
+};
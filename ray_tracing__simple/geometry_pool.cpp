@@ -0,0 +1,136 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <numeric>
+
+#include "geometry_pool.h"
+#include "nvh/nvprint.hpp"
+
+//--------------------------------------------------------------------------------------------------
+// Alignment, in elements, making the byte offset of any range a multiple of `byteAlignment`
+// (a power of two): with a stride of 12 bytes and 256 bytes, ranges start every 64 elements
+//
+static uint64_t elementAlignment(vk::DeviceSize stride, vk::DeviceSize byteAlignment)
+{
+  uint64_t alignment = byteAlignment / std::gcd(stride, byteAlignment);
+  return std::max(alignment, Tlsf::kGranularity);
+}
+
+void GeometryPool::init(const vk::Device&         device,
+                        const vk::PhysicalDevice& physicalDevice,
+                        PoolAllocator*            allocator,
+                        vk::DeviceSize            vertexStride,
+                        uint32_t                  maxVertices,
+                        uint32_t                  maxIndices,
+                        vk::BufferUsageFlags      usage)
+{
+  using vkBU = vk::BufferUsageFlagBits;
+
+  m_alloc        = allocator;
+  m_vertexStride = vertexStride;
+
+  // Ranges are bound as storage buffers
+  vk::DeviceSize storageAlignment =
+      physicalDevice.getProperties().limits.minStorageBufferOffsetAlignment;
+  m_vertexAlignment = elementAlignment(vertexStride, storageAlignment);
+  m_indexAlignment  = elementAlignment(sizeof(uint32_t), storageAlignment);
+  m_vertices.init(maxVertices);
+  m_indices.init(maxIndices);
+
+  usage |= vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress | vkBU::eTransferDst;
+  m_vertexBuffer = m_alloc->createBuffer(vertexStride * maxVertices, usage | vkBU::eVertexBuffer);
+  m_indexBuffer  = m_alloc->createBuffer(sizeof(uint32_t) * maxIndices, usage | vkBU::eIndexBuffer);
+
+  m_vertexAddress = device.getBufferAddress({m_vertexBuffer.buffer});
+  m_indexAddress  = device.getBufferAddress({m_indexBuffer.buffer});
+}
+
+void GeometryPool::deinit()
+{
+  m_alloc->destroy(m_vertexBuffer);
+  m_alloc->destroy(m_indexBuffer);
+  m_vertices.init(0);
+  m_indices.init(0);
+}
+
+bool GeometryPool::allocate(uint32_t nbVertices, uint32_t nbIndices, Range& range)
+{
+  range              = Range();
+  range.vertexHandle = m_vertices.allocate(std::max(nbVertices, 1u), m_vertexAlignment);
+  range.indexHandle  = m_indices.allocate(std::max(nbIndices, 1u), m_indexAlignment);
+  if(range.vertexHandle == Tlsf::kInvalid || range.indexHandle == Tlsf::kInvalid)
+  {
+    LOGE("Geometry pool full: %u vertices and %u indices do not fit\n", nbVertices, nbIndices);
+    free(range);
+    return false;
+  }
+  range.vertexOffset = static_cast<uint32_t>(m_vertices.getOffset(range.vertexHandle));
+  range.firstIndex   = static_cast<uint32_t>(m_indices.getOffset(range.indexHandle));
+  range.nbVertices   = nbVertices;
+  range.nbIndices    = nbIndices;
+  return true;
+}
+
+void GeometryPool::free(Range& range)
+{
+  if(range.vertexHandle != Tlsf::kInvalid)
+    m_vertices.free(range.vertexHandle);
+  if(range.indexHandle != Tlsf::kInvalid)
+    m_indices.free(range.indexHandle);
+  range = Range();
+}
+
+vk::DeviceSize GeometryPool::getVertexOffset(const Range& range) const
+{
+  return vk::DeviceSize(range.vertexOffset) * m_vertexStride;
+}
+
+vk::DeviceSize GeometryPool::getVertexSize(const Range& range) const
+{
+  return vk::DeviceSize(range.nbVertices) * m_vertexStride;
+}
+
+vk::DeviceSize GeometryPool::getIndexOffset(const Range& range) const
+{
+  return vk::DeviceSize(range.firstIndex) * sizeof(uint32_t);
+}
+
+vk::DeviceSize GeometryPool::getIndexSize(const Range& range) const
+{
+  return vk::DeviceSize(range.nbIndices) * sizeof(uint32_t);
+}
+
+vk::DeviceAddress GeometryPool::getVertexAddress(const Range& range) const
+{
+  return m_vertexAddress + getVertexOffset(range);
+}
+
+vk::DeviceAddress GeometryPool::getIndexAddress(const Range& range) const
+{
+  return m_indexAddress + getIndexOffset(range);
+}
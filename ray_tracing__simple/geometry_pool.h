@@ -0,0 +1,96 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <vulkan/vulkan.hpp>
+
+#include "pool_allocator.h"
+#include "tlsf.h"
+
+//--------------------------------------------------------------------------------------------------
+// Vertices and indices of all models, sub-allocated from two shared buffers
+// - The two buffers are bound once: a model is a range of each, drawn with its vertexOffset
+//   and firstIndex, so that all the draws of a frame can be one indirect draw
+// - The ranges are placed by Tlsf policies counting elements, not bytes: vertex offsets are
+//   whole vertices, and aligned so that a range can also be bound as a storage buffer
+// - The capacity is fixed by init(): allocate() fails once the buffers are full
+//
+class GeometryPool
+{
+public:
+  struct Range
+  {
+    uint32_t     vertexOffset{0};  // In vertices, from the start of the vertex buffer
+    uint32_t     firstIndex{0};    // In indices, from the start of the index buffer
+    uint32_t     nbVertices{0};
+    uint32_t     nbIndices{0};
+    Tlsf::Handle vertexHandle{Tlsf::kInvalid};
+    Tlsf::Handle indexHandle{Tlsf::kInvalid};
+  };
+
+  // `usage` is added to the usage of both buffers
+  void init(const vk::Device&         device,
+            const vk::PhysicalDevice& physicalDevice,
+            PoolAllocator*            allocator,
+            vk::DeviceSize            vertexStride,
+            uint32_t                  maxVertices,
+            uint32_t                  maxIndices,
+            vk::BufferUsageFlags      usage);
+  void deinit();
+
+  // False when there is no room for the vertices or the indices
+  bool allocate(uint32_t nbVertices, uint32_t nbIndices, Range& range);
+  void free(Range& range);
+
+  const nvvk::Buffer& getVertexBuffer() const { return m_vertexBuffer; }
+  const nvvk::Buffer& getIndexBuffer() const { return m_indexBuffer; }
+
+  // Bytes
+  vk::DeviceSize    getVertexOffset(const Range& range) const;
+  vk::DeviceSize    getVertexSize(const Range& range) const;
+  vk::DeviceSize    getIndexOffset(const Range& range) const;
+  vk::DeviceSize    getIndexSize(const Range& range) const;
+  vk::DeviceAddress getVertexAddress(const Range& range) const;
+  vk::DeviceAddress getIndexAddress(const Range& range) const;
+
+  // Elements
+  uint64_t getUsedVertices() const { return m_vertices.getUsed(); }
+  uint64_t getUsedIndices() const { return m_indices.getUsed(); }
+  uint64_t getMaxVertices() const { return m_vertices.getCapacity(); }
+  uint64_t getMaxIndices() const { return m_indices.getCapacity(); }
+
+private:
+  PoolAllocator*    m_alloc{nullptr};
+  nvvk::Buffer      m_vertexBuffer;
+  nvvk::Buffer      m_indexBuffer;
+  vk::DeviceAddress m_vertexAddress{0};
+  vk::DeviceAddress m_indexAddress{0};
+  vk::DeviceSize    m_vertexStride{0};
+  Tlsf              m_vertices;
+  Tlsf              m_indices;
+  uint64_t          m_vertexAlignment{Tlsf::kGranularity};  // Elements
+  uint64_t          m_indexAlignment{Tlsf::kGranularity};
+};
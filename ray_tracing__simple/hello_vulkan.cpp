@@ -25,6 +25,12 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <sstream>
 #include <vulkan/vulkan.hpp>
 
@@ -34,6 +40,7 @@ extern std::vector<std::string> defaultSearchPaths;
 #include "fileformats/stb_image.h"
 #include "obj_loader.h"
 
+#include "fnv_hash.h"
 #include "hello_vulkan.h"
 #include "nvh/alignment.hpp"
 #include "nvh/cameramanipulator.hpp"
@@ -45,6 +52,7 @@ extern std::vector<std::string> defaultSearchPaths;
 #include "nvvk/shaders_vk.hpp"
 
 #include "shaders.hxx"
+#include "wavefront_math.h"
 
 // Holding the camera matrices
 struct CameraMatrices
@@ -69,6 +77,34 @@ void HelloVulkan::setup(const vk::Instance&       instance,
   AppBase::setup(instance, device, physicalDevice, queueFamily);
   m_alloc.init(device, physicalDevice);
   m_debug.setup(m_device);
+  m_deferredOps.setup(m_device, &m_threadPool);
+
+  // The textures of the models are found as in createTextureImages()
+  std::vector<std::string> textureDirs;
+  for(const std::string& path : defaultSearchPaths)
+    textureDirs.push_back(path + "/media/textures");
+  m_modelRegistry.setTextureDirs(textureDirs);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Queues working next to the graphics queue, before creating any resource
+// - Uploads go through the transfer queue, acceleration structures are built on the compute
+//   queue. Without them, the graphics queue does it.
+// - Buffers are shared by the three queue families: geometry uploaded by the transfer queue is
+//   read by the BLAS builds, and the BLAS by the TLAS builds, without ownership transfers
+//
+void HelloVulkan::initQueues(uint32_t  transferQueueFamily,
+                             vk::Queue transferQueue,
+                             uint32_t  computeQueueFamily,
+                             vk::Queue computeQueue)
+{
+  m_computeQueueFamily = computeQueue ? computeQueueFamily : m_graphicsQueueIndex;
+  m_computeQueue       = computeQueue ? computeQueue : m_queue;
+  m_alloc.setQueueFamilies({m_graphicsQueueIndex,
+                            transferQueue ? transferQueueFamily : m_graphicsQueueIndex,
+                            m_computeQueueFamily});
+  m_uploads.setup(m_device, &m_alloc, m_graphicsQueueIndex, m_queue, transferQueueFamily,
+                  transferQueue);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -85,6 +121,12 @@ void HelloVulkan::updateUniformBuffer(const vk::CommandBuffer& cmdBuf)
   hostUBO.viewInverse = nvmath::invert(hostUBO.view);
   // #VKRay
   hostUBO.projInverse = nvmath::invert(hostUBO.proj);
+  m_viewProj          = hostUBO.proj * hostUBO.view;
+
+  // Host culling: the camera position, and the scale of the projected sizes (cot(fovy / 2))
+  nvmath::vec4f eye = hostUBO.viewInverse * nvmath::vec4f(0.f, 0.f, 0.f, 1.f);
+  m_eye             = nvmath::vec3f(eye.x, eye.y, eye.z);
+  m_projScale       = hostUBO.proj.a11;
 
   // UBO on the device, and what stages access it.
   vk::Buffer deviceUBO = m_cameraMat.buffer;
@@ -121,42 +163,13 @@ void HelloVulkan::updateUniformBuffer(const vk::CommandBuffer& cmdBuf)
 }
 
 //--------------------------------------------------------------------------------------------------
-// Describing the layout pushed when rendering
+// Describing the layout pushed when rendering: sized for the whole scene, so that it can be created
+// before the models are loaded
 //
-void HelloVulkan::createDescriptorSetLayout()
+void HelloVulkan::createDescriptorSetLayout(uint32_t maxObjects, uint32_t maxTextures)
 {
-  using vkDS     = vk::DescriptorSetLayoutBinding;
-  using vkDT     = vk::DescriptorType;
-  using vkSS     = vk::ShaderStageFlagBits;
-  uint32_t nbTxt = static_cast<uint32_t>(m_textures.size());
-  uint32_t nbObj = static_cast<uint32_t>(m_objModel.size());
-
-  // Camera matrices (binding = 0)
-  m_descSetLayoutBind.addBinding(
-      vkDS(0, vkDT::eUniformBuffer, 1, vkSS::eVertex | vkSS::eRaygenKHR));
-  // Materials (binding = 1)
-  m_descSetLayoutBind.addBinding(
-      vkDS(1, vkDT::eStorageBuffer, nbObj, vkSS::eVertex | vkSS::eFragment | vkSS::eClosestHitKHR));
-  // Scene description (binding = 2)
-  m_descSetLayoutBind.addBinding(  //
-      vkDS(2, vkDT::eStorageBuffer, 1, vkSS::eVertex | vkSS::eFragment | vkSS::eClosestHitKHR));
-  // Textures (binding = 3)
-  m_descSetLayoutBind.addBinding(
-      vkDS(3, vkDT::eCombinedImageSampler, nbTxt, vkSS::eFragment | vkSS::eClosestHitKHR));
-  // Materials (binding = 4)
-  m_descSetLayoutBind.addBinding(
-      vkDS(4, vkDT::eStorageBuffer, nbObj, vkSS::eFragment | vkSS::eClosestHitKHR));
-  // Storing vertices (binding = 5)
-  m_descSetLayoutBind.addBinding(  //
-      vkDS(5, vkDT::eStorageBuffer, nbObj, vkSS::eClosestHitKHR));
-  // Storing indices (binding = 6)
-  m_descSetLayoutBind.addBinding(  //
-      vkDS(6, vkDT::eStorageBuffer, nbObj, vkSS::eClosestHitKHR));
-
-
-  m_descSetLayout = m_descSetLayoutBind.createLayout(m_device);
-  m_descPool      = m_descSetLayoutBind.createPool(m_device, 1);
-  m_descSet       = nvvk::allocateDescriptorSet(m_device, m_descPool, m_descSetLayout);
+  m_scene.setup(m_device, m_physicalDevice, &m_alloc, maxObjects, maxTextures,
+                static_cast<uint32_t>(getCommandBuffers().size()));
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -164,41 +177,9 @@ void HelloVulkan::createDescriptorSetLayout()
 //
 void HelloVulkan::updateDescriptorSet()
 {
-  std::vector<vk::WriteDescriptorSet> writes;
-
-  // Camera matrices and scene description
-  vk::DescriptorBufferInfo dbiUnif{m_cameraMat.buffer, 0, VK_WHOLE_SIZE};
-  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 0, &dbiUnif));
-  vk::DescriptorBufferInfo dbiSceneDesc{m_sceneDesc.buffer, 0, VK_WHOLE_SIZE};
-  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 2, &dbiSceneDesc));
-
-  // All material buffers, 1 buffer per OBJ
-  std::vector<vk::DescriptorBufferInfo> dbiMat;
-  std::vector<vk::DescriptorBufferInfo> dbiMatIdx;
-  std::vector<vk::DescriptorBufferInfo> dbiVert;
-  std::vector<vk::DescriptorBufferInfo> dbiIdx;
-  for(auto& obj : m_objModel)
-  {
-    dbiMat.emplace_back(obj.matColorBuffer.buffer, 0, VK_WHOLE_SIZE);
-    dbiMatIdx.emplace_back(obj.matIndexBuffer.buffer, 0, VK_WHOLE_SIZE);
-    dbiVert.emplace_back(obj.vertexBuffer.buffer, 0, VK_WHOLE_SIZE);
-    dbiIdx.emplace_back(obj.indexBuffer.buffer, 0, VK_WHOLE_SIZE);
-  }
-  writes.emplace_back(m_descSetLayoutBind.makeWriteArray(m_descSet, 1, dbiMat.data()));
-  writes.emplace_back(m_descSetLayoutBind.makeWriteArray(m_descSet, 4, dbiMatIdx.data()));
-  writes.emplace_back(m_descSetLayoutBind.makeWriteArray(m_descSet, 5, dbiVert.data()));
-  writes.emplace_back(m_descSetLayoutBind.makeWriteArray(m_descSet, 6, dbiIdx.data()));
-
-  // All texture samplers
-  std::vector<vk::DescriptorImageInfo> diit;
-  for(auto& texture : m_textures)
-  {
-    diit.emplace_back(texture.descriptor);
-  }
-  writes.emplace_back(m_descSetLayoutBind.makeWriteArray(m_descSet, 3, diit.data()));
-
-  // Writing the information
-  m_device.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  // The buffers and textures of the models are written as they load, see loadModel()
+  m_scene.setCamera(m_cameraMat.buffer);
+  m_scene.setSceneDesc(m_sceneDesc.buffer);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -220,7 +201,7 @@ void HelloVulkan::createGraphicsPipeline()
 
   // Creating the Pipeline Layout
   vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo;
-  vk::DescriptorSetLayout      descSetLayout(m_descSetLayout);
+  vk::DescriptorSetLayout      descSetLayout(m_scene.getLayout());
   pipelineLayoutCreateInfo.setSetLayoutCount(1);
   pipelineLayoutCreateInfo.setPSetLayouts(&descSetLayout);
   pipelineLayoutCreateInfo.setPushConstantRangeCount(1);
@@ -245,14 +226,258 @@ void HelloVulkan::createGraphicsPipeline()
 }
 
 //--------------------------------------------------------------------------------------------------
-// Loading the OBJ file and setting up all buffers
+// Vertex and index buffers shared by all models, sized for the whole scene
 //
-void HelloVulkan::loadModel(const std::string& filename, nvmath::mat4f transform)
+void HelloVulkan::createGeometryBuffers(uint32_t maxVertices, uint32_t maxIndices)
 {
-  using vkBU = vk::BufferUsageFlagBits;
+  m_geometry.init(m_device, m_physicalDevice, &m_alloc, sizeof(VertexObj), maxVertices, maxIndices,
+                  vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR);
+  m_debug.setObjectName(m_geometry.getVertexBuffer().buffer, "vertices");
+  m_debug.setObjectName(m_geometry.getIndexBuffer().buffer, "indices");
+}
+
+//--------------------------------------------------------------------------------------------------
+// Loading the OBJ file and setting up all buffers, unless the registry has the model already.
+// The model stays loaded until its last instance is removed. Without instances, it is unloaded
+// when the scene buffers are created.
+//
+uint32_t HelloVulkan::loadModel(const std::string& filename, bool dynamic)
+{
+  uint32_t objIndex = m_modelRegistry.find(filename, dynamic);
+  if(objIndex != ModelRegistry::kInvalid)
+  {
+    LOGI("Model already loaded: %s \n", filename.c_str());
+    return objIndex;
+  }
+
+  HostModel host = prepareModel(filename, dynamic);
+  objIndex       = addModel(host);
+  m_modelRegistry.add(filename, dynamic, objIndex);
+  return objIndex;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Instances are added and removed while the scene is put together: the scene description, the
+// draws and the TLAS are sized for them when created, see createSceneDescriptionBuffer()
+//
+uint32_t HelloVulkan::addInstance(uint32_t objIndex, const nvmath::mat4f& transform)
+{
+  if(m_sceneDesc.buffer)
+    throw std::runtime_error("Instances are added before the scene buffers are created");
+
+  ObjInstance instance;
+  instance.objIndex  = objIndex;
+  instance.transform = transform;
+  m_objInstance.push_back(instance);
+  m_modelRegistry.addRef(objIndex);
+  return static_cast<uint32_t>(m_objInstance.size() - 1);
+}
+
+// The instances after it move down by one. The model goes away with its last instance.
+void HelloVulkan::removeInstance(uint32_t instanceId)
+{
+  if(m_sceneDesc.buffer)
+    throw std::runtime_error("Instances are removed before the scene buffers are created");
+
+  uint32_t objIndex = m_objInstance[instanceId].objIndex;
+  m_objInstance.erase(m_objInstance.begin() + instanceId);
+  if(m_modelRegistry.release(objIndex))
+    unloadModel(objIndex);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Which rays see the instance, kMask* bits. Once the TLAS exists, the change is in the next
+// update of the TLAS.
+//
+void HelloVulkan::setInstanceMask(uint32_t instanceId, uint32_t mask)
+{
+  m_objInstance[instanceId].mask = mask;
+  if(m_tlasBuilder.getAccelerationStructure())
+    m_tlasBuilder.setMask(instanceId, mask);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The last instance of the model went away, or it never had one. No frame was drawn yet, only
+// the upload of the model can be in flight. The slots of the model in the scene tables are reused
+// once the frames in flight are done, see BindlessScene.
+//
+void HelloVulkan::unloadModel(uint32_t objIndex)
+{
+  ObjModel& model = m_objModel[objIndex];
+  m_uploads.wait(model.uploadTicket);
+  m_geometry.free(model.geometry);
+  m_alloc.destroy(model.matColorBuffer);
+  m_alloc.destroy(model.matIndexBuffer);
+  for(uint32_t t = model.firstTexture; t < model.firstTexture + model.nbTextures; t++)
+    m_alloc.destroy(m_textures[t]);  // Leaves an empty texture
+  if(model.nbTextures > 0)
+    m_scene.removeTextures(model.txtOffset);
+  m_scene.removeObject(objIndex);
+  model = ObjModel();
+  LOGI("Unloaded model %u\n", objIndex);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Instances of a scene file
+// - Each model file is loaded once, also when declared several times. The models are read and
+//   simplified in parallel on the thread pool, then uploaded in order.
+// - The instances are added to m_objInstance, before createSceneDescriptionBuffer()
+//
+void HelloVulkan::loadScene(const SceneFile& scene, const std::vector<std::string>& searchPaths)
+{
+  if(scene.m_instances.empty())
+    throw std::runtime_error("Scene without instances");
+  if(m_sceneDesc.buffer)
+    throw std::runtime_error("Instances are added before the scene buffers are created");
+
+  // Models without instances are not loaded
+  std::vector<uint32_t> nbRefs(scene.m_models.size(), 0);
+  for(const SceneFile::Instance& instance : scene.m_instances)
+    nbRefs[instance.model]++;
+
+  // Model files to load, and the one of each declared model not in the registry
+  std::vector<uint32_t> modelIds(scene.m_models.size(), ModelRegistry::kInvalid);
+  std::vector<uint32_t> modelFiles(scene.m_models.size(), 0);
+
+  std::map<std::pair<std::string, bool>, uint32_t> fileIds;
+  std::vector<std::pair<std::string, bool>>        files;
+  for(size_t m = 0; m < scene.m_models.size(); m++)
+  {
+    const SceneFile::Model& model = scene.m_models[m];
+    if(nbRefs[m] == 0)
+      continue;
+    std::string filename = nvh::findFile(model.path, searchPaths, true);
+    if(filename.empty())
+      throw std::runtime_error("Cannot find model " + model.path);
+    modelIds[m] = m_modelRegistry.find(filename, model.dynamic);
+    if(modelIds[m] != ModelRegistry::kInvalid)
+      continue;
+    auto inserted = fileIds.emplace(std::make_pair(filename, model.dynamic),
+                                    static_cast<uint32_t>(files.size()));
+    if(inserted.second)
+      files.emplace_back(filename, model.dynamic);
+    modelFiles[m] = inserted.first->second;
+  }
+
+  // Exceptions cannot leave the pool jobs
+  auto                     startTime = std::chrono::high_resolution_clock::now();
+  std::vector<HostModel>   hostModels(files.size());
+  std::vector<std::string> errors(files.size());
+  m_threadPool.parallelFor(files.size(), 1, [&](size_t begin, size_t end) {
+    for(size_t f = begin; f < end; f++)
+    {
+      try
+      {
+        hostModels[f] = prepareModel(files[f].first, files[f].second);
+      }
+      catch(const std::exception& e)
+      {
+        errors[f] = files[f].first + ": " + e.what();
+      }
+    }
+  });
+  for(const std::string& error : errors)
+  {
+    if(!error.empty())
+      throw std::runtime_error(error);
+  }
+
+  // Files of the same content as one loaded before are found by the registry
+  std::vector<uint32_t> fileModels(files.size());
+  for(size_t f = 0; f < files.size(); f++)
+  {
+    fileModels[f] = m_modelRegistry.find(files[f].first, files[f].second);
+    if(fileModels[f] == ModelRegistry::kInvalid)
+    {
+      fileModels[f] = addModel(hostModels[f]);
+      m_modelRegistry.add(files[f].first, files[f].second, fileModels[f]);
+    }
+    hostModels[f] = HostModel();  // Frees the host copy
+  }
+  for(size_t m = 0; m < scene.m_models.size(); m++)
+  {
+    if(nbRefs[m] == 0)
+      continue;
+    if(modelIds[m] == ModelRegistry::kInvalid)
+      modelIds[m] = fileModels[modelFiles[m]];
+    m_modelRegistry.addRef(modelIds[m], nbRefs[m]);
+  }
+
+  // Rows of the 3x4 transforms into the column-major matrices. Material overrides the model
+  // does not have are dropped.
+  size_t                firstInstance = m_objInstance.size();
+  std::atomic<uint32_t> nbDropped{0};
+  m_objInstance.resize(firstInstance + scene.m_instances.size());
+  m_threadPool.parallelFor(scene.m_instances.size(), 4096, [&](size_t begin, size_t end) {
+    for(size_t i = begin; i < end; i++)
+    {
+      const SceneFile::Instance& src      = scene.m_instances[i];
+      ObjInstance&               instance = m_objInstance[firstInstance + i];
+      const ObjModel&            model    = m_objModel[modelIds[src.model]];
+      instance.objIndex                   = modelIds[src.model];
+      instance.mask                       = src.mask;
+      if(src.material < static_cast<int32_t>(model.nbMaterials))
+        instance.matOverride = src.material;
+      else
+        nbDropped++;
+
+      float m[16] = {};
+      m[15]       = 1.f;
+      for(int r = 0; r < 3; r++)
+        for(int c = 0; c < 4; c++)
+          m[c * 4 + r] = src.transform[r * 4 + c];
+      memcpy(&instance.transform, m, sizeof(m));
+    }
+  });
+  if(nbDropped > 0)
+    LOGW("%u instances override their material with one their model does not have\n",
+         nbDropped.load());
+
+  auto   endTime = std::chrono::high_resolution_clock::now();
+  double ms      = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+  LOGI("Scene: %zu model files, %zu instances, loaded in %.1f ms\n", files.size(),
+       scene.m_instances.size(), ms);
+}
 
+//--------------------------------------------------------------------------------------------------
+// The triangles of materials with a dissolve below 1 are alpha tested: they are moved after the
+// opaque ones of the range, both keeping their order. Returns the number of opaque indices.
+//
+static uint32_t splitAlphaTested(ObjLoader& loader, uint32_t firstIndex, uint32_t nbIndices)
+{
+  std::vector<uint32_t> alphaIndices;
+  std::vector<uint32_t> alphaMatIndices;
+  uint32_t              nbOpaque = 0;  // Triangles
+  for(uint32_t t = firstIndex / 3; t < (firstIndex + nbIndices) / 3; t++)
+  {
+    auto     indices  = loader.m_indices.begin() + 3 * t;
+    uint32_t matIndex = loader.m_matIndx[t];
+    if(loader.m_materials[matIndex].dissolve < 1.f)
+    {
+      alphaIndices.insert(alphaIndices.end(), indices, indices + 3);
+      alphaMatIndices.push_back(matIndex);
+      continue;
+    }
+    uint32_t dst = firstIndex / 3 + nbOpaque++;
+    std::copy(indices, indices + 3, loader.m_indices.begin() + 3 * dst);
+    loader.m_matIndx[dst] = matIndex;
+  }
+  std::copy(alphaIndices.begin(), alphaIndices.end(),
+            loader.m_indices.begin() + firstIndex + 3 * nbOpaque);
+  std::copy(alphaMatIndices.begin(), alphaMatIndices.end(),
+            loader.m_matIndx.begin() + firstIndex / 3 + nbOpaque);
+  return 3 * nbOpaque;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Reading the OBJ file, and the host work on it: bounds, LODs and the alpha-tested triangles
+//
+HelloVulkan::HostModel HelloVulkan::prepareModel(const std::string& filename, bool dynamic)
+{
   LOGI("Loading File:  %s \n", filename.c_str());
-  ObjLoader loader;
+  HostModel host;
+  host.filename     = filename;
+  ObjLoader& loader = host.loader;
   loader.loadModel(filename);
 
   // Converting from Srgb to linear
@@ -263,42 +488,127 @@ void HelloVulkan::loadModel(const std::string& filename, nvmath::mat4f transform
     m.specular = nvmath::pow(m.specular, 2.2f);
   }
 
-  ObjInstance instance;
-  instance.objIndex    = static_cast<uint32_t>(m_objModel.size());
-  instance.transform   = transform;
-  instance.transformIT = nvmath::transpose(nvmath::invert(transform));
-  instance.txtOffset   = static_cast<uint32_t>(m_textures.size());
-
-  ObjModel model;
-  model.nbIndices  = static_cast<uint32_t>(loader.m_indices.size());
-  model.nbVertices = static_cast<uint32_t>(loader.m_vertices.size());
-
-  // Create the buffers on Device and copy vertices, indices and materials
-  nvvk::CommandPool cmdBufGet(m_device, m_graphicsQueueIndex);
-  vk::CommandBuffer cmdBuf = cmdBufGet.createCommandBuffer();
-  model.vertexBuffer =
-      m_alloc.createBuffer(cmdBuf, loader.m_vertices,
-                           vkBU::eVertexBuffer | vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress
-                               | vkBU::eAccelerationStructureBuildInputReadOnlyKHR);
-  model.indexBuffer =
-      m_alloc.createBuffer(cmdBuf, loader.m_indices,
-                           vkBU::eIndexBuffer | vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress
-                               | vkBU::eAccelerationStructureBuildInputReadOnlyKHR);
-  model.matColorBuffer = m_alloc.createBuffer(cmdBuf, loader.m_materials, vkBU::eStorageBuffer);
-  model.matIndexBuffer = m_alloc.createBuffer(cmdBuf, loader.m_matIndx, vkBU::eStorageBuffer);
-  // Creates all textures found
-  createTextureImages(cmdBuf, loader.m_textures);
-  cmdBufGet.submitAndWait(cmdBuf);
-  m_alloc.finalizeAndReleaseStaging();
+  ObjModel& model   = host.model;
+  model.nbIndices   = static_cast<uint32_t>(loader.m_indices.size());
+  model.nbVertices  = static_cast<uint32_t>(loader.m_vertices.size());
+  model.nbMaterials = static_cast<uint32_t>(loader.m_materials.size());
+  model.dynamic     = dynamic;
+  if(dynamic)
+    model.restVertices = loader.m_vertices;
+  model.bboxMin = nvmath::vec3f(FLT_MAX, FLT_MAX, FLT_MAX);
+  model.bboxMax = nvmath::vec3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for(const auto& v : loader.m_vertices)
+  {
+    model.bboxMin = {std::min(model.bboxMin.x, v.pos.x), std::min(model.bboxMin.y, v.pos.y),
+                     std::min(model.bboxMin.z, v.pos.z)};
+    model.bboxMax = {std::max(model.bboxMax.x, v.pos.x), std::max(model.bboxMax.y, v.pos.y),
+                     std::max(model.bboxMax.z, v.pos.z)};
+  }
+
+  // LODs of static models, appended to the indices and triangle materials of the model
+  model.lods.push_back({0, model.nbIndices, 0.f});
+  if(!dynamic)
+  {
+    auto                 startTime = std::chrono::high_resolution_clock::now();
+    std::vector<MeshLod> lods = buildLodChain(loader.m_vertices, loader.m_indices, loader.m_matIndx,
+                                              {0.5f, 0.25f, 0.125f}, MeshSimplifier::Settings());
+    auto   endTime = std::chrono::high_resolution_clock::now();
+    double ms      = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+
+    std::stringstream triangles;
+    triangles << model.nbIndices / 3;
+    for(const MeshLod& lod : lods)
+    {
+      model.lods.push_back({static_cast<uint32_t>(loader.m_indices.size()),
+                            static_cast<uint32_t>(lod.indices.size()), lod.error});
+      loader.m_indices.insert(loader.m_indices.end(), lod.indices.begin(), lod.indices.end());
+      loader.m_matIndx.insert(loader.m_matIndx.end(), lod.matIndices.begin(),
+                              lod.matIndices.end());
+      triangles << " > " << lod.indices.size() / 3;
+    }
+    LOGI("  LODs: %s triangles, simplified in %.1f ms (%.0f triangles/ms)\n",
+         triangles.str().c_str(), ms, ms > 0. ? model.nbIndices / 3 / ms : 0.);
+  }
+
+  // Opaque and alpha-tested triangles of each LOD
+  for(ObjModel::Lod& lod : model.lods)
+    lod.nbOpaqueIndices = splitAlphaTested(loader, lod.firstIndex, lod.nbIndices);
+
+  // Closest-hit permutation: the specialized one when the materials agree on the texturing and
+  // the illumination model, else the general one
+  for(const MaterialObj& m : loader.m_materials)
+  {
+    int illum = std::min(std::max(m.illum, 0), 2);  // Above 2, shaded as 2
+    model.matPermutations.push_back(static_cast<uint8_t>(1 + 3 * (m.textureID >= 0) + illum));
+  }
+  model.matPermutation = model.matPermutations.empty() ? 0 : model.matPermutations[0];
+  for(uint8_t permutation : model.matPermutations)
+  {
+    if(permutation != model.matPermutation)
+      model.matPermutation = 0;
+  }
+  uint32_t nbAlphaIndices = model.nbIndices - model.lods[0].nbOpaqueIndices;
+  if(nbAlphaIndices > 0)
+    LOGI("  %u of %u triangles are alpha tested\n", nbAlphaIndices / 3, model.nbIndices / 3);
+  return host;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Setting up all buffers of a prepared model
+//
+uint32_t HelloVulkan::addModel(HostModel& host)
+{
+  using vkBU = vk::BufferUsageFlagBits;
 
-  std::string objNb = std::to_string(instance.objIndex);
-  m_debug.setObjectName(model.vertexBuffer.buffer, (std::string("vertex_" + objNb).c_str()));
-  m_debug.setObjectName(model.indexBuffer.buffer, (std::string("index_" + objNb).c_str()));
+  const std::string& filename = host.filename;
+  ObjLoader&         loader   = host.loader;
+  ObjModel&          model    = host.model;
+
+  // Upload vertices and indices in the shared geometry buffers, create the material buffers:
+  // the model can be used once its upload ticket completed
+  uint32_t nbIndices = static_cast<uint32_t>(loader.m_indices.size());  // All LODs
+  if(!m_geometry.allocate(model.nbVertices, nbIndices, model.geometry))
+    throw std::runtime_error("Geometry buffers full, cannot load " + filename);
+  m_uploads.uploadBuffer(m_geometry.getVertexBuffer(), m_geometry.getVertexOffset(model.geometry),
+                         loader.m_vertices.data(), m_geometry.getVertexSize(model.geometry));
+  m_uploads.uploadBuffer(m_geometry.getIndexBuffer(), m_geometry.getIndexOffset(model.geometry),
+                         loader.m_indices.data(), m_geometry.getIndexSize(model.geometry));
+  model.matColorBuffer =
+      m_uploads.createBuffer(loader.m_materials, vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress);
+  model.matIndexBuffer =
+      m_uploads.createBuffer(loader.m_matIndx, vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress);
+  // Creates all textures found
+  model.firstTexture = static_cast<uint32_t>(m_textures.size());
+  createTextureImages(loader.m_textures);
+  model.nbTextures = static_cast<uint32_t>(m_textures.size()) - model.firstTexture;
+  model.uploadTicket = m_uploads.flush();
+
+  // Adding the model to the object table of the scene and its textures to the descriptor set:
+  // the layout and the pipelines are unchanged, and nothing reads them before the upload completed
+  std::vector<vk::DescriptorImageInfo> textureInfos;
+  for(size_t t = model.firstTexture; t < m_textures.size(); t++)
+    textureInfos.push_back(m_textures[t].descriptor);
+  model.txtOffset = m_scene.addTextures(textureInfos);
+  if(model.txtOffset == ~0u)
+    throw std::runtime_error("Scene texture table full, cannot load " + filename);
+
+  BindlessScene::ObjDesc desc;
+  desc.vertexAddress   = m_geometry.getVertexAddress(model.geometry);
+  desc.indexAddress    = m_geometry.getIndexAddress(model.geometry);
+  desc.materialAddress = m_device.getBufferAddress({model.matColorBuffer.buffer});
+  desc.matIndexAddress = m_device.getBufferAddress({model.matIndexBuffer.buffer});
+  desc.txtOffset       = model.txtOffset;
+  uint32_t objIndex    = m_scene.addObject(desc);
+
+  std::string objNb = std::to_string(objIndex);
   m_debug.setObjectName(model.matColorBuffer.buffer, (std::string("mat_" + objNb).c_str()));
   m_debug.setObjectName(model.matIndexBuffer.buffer, (std::string("matIdx_" + objNb).c_str()));
 
-  m_objModel.emplace_back(model);
-  m_objInstance.emplace_back(instance);
+  // Models are stored at their slot, which can be one freed by an unloaded model
+  if(objIndex >= m_objModel.size())
+    m_objModel.resize(objIndex + 1);
+  m_objModel[objIndex] = std::move(model);
+  return objIndex;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -324,20 +634,548 @@ void HelloVulkan::createUniformBuffer()
 void HelloVulkan::createSceneDescriptionBuffer()
 {
   using vkBU = vk::BufferUsageFlagBits;
-  nvvk::CommandPool cmdGen(m_device, m_graphicsQueueIndex);
 
-  auto cmdBuf = cmdGen.createCommandBuffer();
-  m_sceneDesc = m_alloc.createBuffer(cmdBuf, m_objInstance, vkBU::eStorageBuffer);
-  cmdGen.submitAndWait(cmdBuf);
-  m_alloc.finalizeAndReleaseStaging();
+  // Models loaded but never instanced are not part of the scene
+  for(uint32_t objIndex : m_modelRegistry.releaseUnreferenced())
+    unloadModel(objIndex);
+
+  // Transforms in a structure of arrays, packed in batches in the scene description and the TLAS
+  uint32_t nbInstances = static_cast<uint32_t>(m_objInstance.size());
+  m_transforms.resize(nbInstances);
+  m_threadPool.parallelFor(nbInstances, 4096, [&](size_t begin, size_t end) {
+    for(size_t i = begin; i < end; i++)
+      m_transforms.set(static_cast<uint32_t>(i), m_objInstance[i].transform);
+  });
+
+  // Every frame reads the scene description: it must be there before the first one
+  std::vector<SceneDesc> sceneDescs(nbInstances);
+  for(uint32_t i = 0; i < nbInstances; i++)
+  {
+    sceneDescs[i].objIndex    = m_objInstance[i].objIndex;
+    sceneDescs[i].primOffset  = m_objInstance[i].primOffset;
+    sceneDescs[i].matOverride = m_objInstance[i].matOverride;
+  }
+  m_transforms.pack(reinterpret_cast<uint8_t*>(sceneDescs.data()) + offsetof(SceneDesc, transform),
+                    sizeof(SceneDesc), 0, nbInstances, &m_threadPool);
+  m_sceneDesc = m_uploads.createBuffer(sceneDescs, vkBU::eStorageBuffer | vkBU::eTransferDst);
+  m_uploads.wait(m_uploads.flush());
   m_debug.setObjectName(m_sceneDesc.buffer, "sceneDesc");
+
+  const size_t fullSize = 3 * sizeof(uint32_t) + 2 * sizeof(nvmath::mat4f);  // 4x4 matrices
+  LOGI("Scene description: %zu instances, %.1f KB (%zu bytes per instance, %.1f KB with %zu)\n",
+       sceneDescs.size(), sceneDescs.size() * sizeof(SceneDesc) / 1024.0, sizeof(SceneDesc),
+       sceneDescs.size() * fullSize / 1024.0, fullSize);
+
+  // Persistently mapped staging for the instances changed by animation, one region per frame
+  vk::DeviceSize regionSize = m_objInstance.size() * sizeof(SceneDesc);
+  m_sceneDescStaging =
+      m_alloc.createBuffer(regionSize * getCommandBuffers().size(), vkBU::eTransferSrc,
+                           vk::MemoryPropertyFlagBits::eHostVisible
+                               | vk::MemoryPropertyFlagBits::eHostCoherent);
+  m_debug.setObjectName(m_sceneDescStaging.buffer, "sceneDescStaging");
+  m_sceneDescMapped = reinterpret_cast<SceneDesc*>(m_alloc.map(m_sceneDescStaging));
+  m_instanceDirty.assign(m_objInstance.size(), 0);
+
+  m_instanceCuller.resize(static_cast<uint32_t>(m_objInstance.size()));
+  for(uint32_t i = 0; i < static_cast<uint32_t>(m_objInstance.size()); i++)
+    updateInstanceBounds(i);
+  m_instanceLod.assign(m_objInstance.size(), 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The 3x4 transform is stored row-major, as in the TLAS instances: the first 12 values of the
+// transposed matrix
+//
+HelloVulkan::SceneDesc HelloVulkan::toSceneDesc(const ObjInstance& instance)
+{
+  SceneDesc desc;
+  desc.objIndex        = instance.objIndex;
+  desc.primOffset      = instance.primOffset;
+  desc.matOverride     = instance.matOverride;
+  nvmath::mat4f transp = nvmath::transpose(instance.transform);
+  memcpy(desc.transform, &transp, sizeof(desc.transform));
+  return desc;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Bounds of the instance for the host culling, from its transform and the AABB of its model
+//
+void HelloVulkan::updateInstanceBounds(uint32_t instanceId)
+{
+  const ObjInstance& instance = m_objInstance[instanceId];
+  const ObjModel&    model    = m_objModel[instance.objIndex];
+  if(model.dynamic)
+    m_instanceCuller.setUnbounded(instanceId);  // Deformed vertices can leave the bounds
+  else
+    m_instanceCuller.setBounds(instanceId, instance.transform, model.bboxMin, model.bboxMax);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Persistently mapped indirect draws, one region per frame: a region is rewritten when the
+// list of draws changed since the frame last used it
+//
+void HelloVulkan::createDrawBuffer()
+{
+  vk::DeviceSize regionSize = m_objInstance.size() * sizeof(vk::DrawIndexedIndirectCommand);
+  m_drawBuffer = m_alloc.createBuffer(regionSize * getCommandBuffers().size(),
+                                      vk::BufferUsageFlagBits::eIndirectBuffer,
+                                      vk::MemoryPropertyFlagBits::eHostVisible
+                                          | vk::MemoryPropertyFlagBits::eHostCoherent);
+  m_debug.setObjectName(m_drawBuffer.buffer, "draws");
+  m_drawMapped = reinterpret_cast<vk::DrawIndexedIndirectCommand*>(m_alloc.map(m_drawBuffer));
+  m_drawRegionVersion.assign(getCommandBuffers().size(), 0);
+
+  // Without multiDrawIndirect, a single indirect call can only issue one draw. Without
+  // drawIndirectFirstInstance, the firstInstance of indirect draws must be 0: the shaders would
+  // not find the instance of the draw. Either way, each instance has its own drawIndexed().
+  vk::PhysicalDeviceFeatures features = m_physicalDevice.getFeatures();
+  m_multiDrawIndirect                 = features.multiDrawIndirect == VK_TRUE;
+  m_drawIndirectFirstInstance         = features.drawIndirectFirstInstance == VK_TRUE;
+  if(!m_multiDrawIndirect)
+    LOGW("multiDrawIndirect not supported: one draw call per instance\n");
+  if(!m_drawIndirectFirstInstance)
+    LOGW("drawIndirectFirstInstance not supported: one draw call per instance\n");
+}
+
+//--------------------------------------------------------------------------------------------------
+// GPU culling of the raster draws, after the scene description and the offscreen depth exist
+//
+void HelloVulkan::createCullPass()
+{
+  m_cullPass.setup(m_device, m_physicalDevice, &m_alloc,
+                   static_cast<uint32_t>(getCommandBuffers().size()),
+                   static_cast<uint32_t>(m_objInstance.size()));
+  m_cullPass.setSceneDesc(m_sceneDesc.buffer);
+  m_cullPass.setDepth(m_offscreenDepth.descriptor.imageView, m_offscreenDepth.image, m_size);
+}
+
+bool HelloVulkan::isCulling() const
+{
+  return m_useCulling && m_cullPass.isSupported();
+}
+
+bool HelloVulkan::isHostCulling() const
+{
+  return m_useHostCulling && !isCulling();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Before the raster pass: the visible draws are compacted in the draw buffer of m_cullPass.
+// Else the host culls the instances and keeps the visible draws in m_visibleDraws.
+//
+void HelloVulkan::cullDraws(const vk::CommandBuffer& cmdBuf)
+{
+  if(isHostCulling())
+  {
+    // Instances culled by updateLods()
+    const std::vector<uint8_t>& lods = m_instanceCuller.getLods();
+    m_visibleDraws.clear();
+    for(const vk::DrawIndexedIndirectCommand& draw : m_draws)
+      if(lods[draw.firstInstance] != InstanceCuller::kCulled)
+        m_visibleDraws.push_back(draw);
+  }
+  if(!isCulling())
+    return;
+  m_debug.beginLabel(cmdBuf, "Cull");
+  m_cullPass.cmdCull(cmdBuf, getCurFrame(), m_viewProj);
+  m_debug.endLabel(cmdBuf);
+}
+
+//--------------------------------------------------------------------------------------------------
+// After the raster pass: its depth is the occluders of the next frame
+//
+void HelloVulkan::buildHiZ(const vk::CommandBuffer& cmdBuf)
+{
+  if(!isCulling())
+  {
+    m_cullPass.invalidateHiZ();
+    return;
+  }
+  m_debug.beginLabel(cmdBuf, "Hi-Z");
+  m_cullPass.cmdBuildHiZ(cmdBuf, m_viewProj);
+  m_debug.endLabel(cmdBuf);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Draws passing the frustum test on the host, the reference of the GPU culling without Hi-Z
+//
+uint32_t HelloVulkan::countFrustumVisible() const
+{
+  std::vector<nvmath::mat4f> transforms;
+  transforms.reserve(m_objInstance.size());
+  for(const auto& instance : m_objInstance)
+    transforms.push_back(instance.transform);
+
+  std::vector<uint32_t> visible;
+  ::cullDraws(m_cullPass.getDraws(), transforms, m_viewProj, nullptr, nullptr, visible);
+  return static_cast<uint32_t>(visible.size());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Move an instance
+// - The scene description and the TLAS are updated by the next updateInstances()
+//
+void HelloVulkan::setInstanceTransform(uint32_t instanceId, const nvmath::mat4f& transform)
+{
+  m_objInstance[instanceId].transform = transform;
+  m_transforms.set(instanceId, transform);
+  markInstanceDirty(instanceId);
+  m_tlasBuilder.setTransform(instanceId, transform);
+  updateInstanceBounds(instanceId);
+}
+
+// The scene description of the instance is uploaded by the next updateInstances()
+void HelloVulkan::markInstanceDirty(uint32_t instanceId)
+{
+  if(!m_instanceDirty[instanceId])
+  {
+    m_instanceDirty[instanceId] = 1;
+    m_dirtyInstances.push_back(instanceId);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Spin instances around the vertical axis, each at its own speed
+//
+void HelloVulkan::animateInstances(float time, uint32_t firstInstance, uint32_t nbInstances)
+{
+  if(m_animationBase.empty())
+  {
+    for(const auto& inst : m_objInstance)
+      m_animationBase.push_back(inst.transform);
+  }
+
+  uint32_t lastInstance = std::min(firstInstance + nbInstances, uint32_t(m_objInstance.size()));
+  for(uint32_t i = firstInstance; i < lastInstance; i++)
+  {
+    float speed = 0.1f + 0.1f * static_cast<float>(i % 7);
+    setInstanceTransform(i, nvmath::rotation_mat4_y(time * speed) * m_animationBase[i]);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called at each frame, before updateDynamicGeometry() and updateInstances()
+// - Models are drawn once their uploads completed, and traced once their BLAS is ready: the
+//   TLAS rebuilt in the frame then activates their instances
+//
+void HelloVulkan::updateResidency()
+{
+  m_uploads.update();
+  bool newResident = false;
+  for(auto& model : m_objModel)
+  {
+    if(!model.resident && m_uploads.isComplete(model.uploadTicket))
+    {
+      model.resident = true;
+      newResident    = true;
+    }
+  }
+
+  if(newResident)
+    updateDraws();
+
+  for(uint32_t blasId : m_blasBuilder.update())
+  {
+    vk::DeviceAddress address = m_blasBuilder.getDeviceAddress(blasId);
+    for(uint32_t i : m_blasInstances[blasId])
+      m_tlasBuilder.setBlasAddress(i, address);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// One indexed draw per resident instance, of its current LOD, firstInstance giving the instance
+// to the shaders. The same draws, with the bounds of their model, are the candidates of the GPU
+// culling.
+//
+void HelloVulkan::updateDraws()
+{
+  std::vector<CullDraw> cullDraws;
+  m_draws.clear();
+  m_nbDrawnTriangles = 0;
+  m_nbFullTriangles  = 0;
+  for(uint32_t i = 0; i < static_cast<uint32_t>(m_objInstance.size()); i++)
+  {
+    const ObjModel& model = m_objModel[m_objInstance[i].objIndex];
+    if(!model.resident)
+      continue;
+    const ObjModel::Lod& lod        = model.lods[m_instanceLod[i]];
+    uint32_t             firstIndex = model.geometry.firstIndex + lod.firstIndex;
+    m_draws.emplace_back(lod.nbIndices, 1, firstIndex,
+                         static_cast<int32_t>(model.geometry.vertexOffset), i);
+    m_nbDrawnTriangles += lod.nbIndices / 3;
+    m_nbFullTriangles += model.nbIndices / 3;
+
+    CullDraw cullDraw;
+    cullDraw.bboxMin      = model.bboxMin;
+    cullDraw.instanceId   = i;
+    cullDraw.bboxMax      = model.bboxMax;
+    cullDraw.cullable     = model.dynamic ? 0 : 1;  // Deformed vertices can leave the bounds
+    cullDraw.indexCount   = lod.nbIndices;
+    cullDraw.firstIndex   = firstIndex;
+    cullDraw.vertexOffset = static_cast<int32_t>(model.geometry.vertexOffset);
+    cullDraws.push_back(cullDraw);
+  }
+  m_drawVersion++;
+  m_cullPass.setDraws(cullDraws);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called at each frame, before updateInstances()
+// - The instances are culled on the host, which also gives the LOD of the visible ones from
+//   their size on screen. Instances outside the frustum keep their LOD: they can still be seen
+//   by the secondary rays.
+// - A new LOD changes the triangles offset of the instance in the scene description and its
+//   BLAS in the TLAS, which must agree: the instance only changes to a LOD whose BLAS is ready
+//
+void HelloVulkan::updateLods()
+{
+  m_instanceCuller.cull(m_viewProj, m_eye, m_projScale, &m_threadPool);
+  const std::vector<uint8_t>& lods = m_instanceCuller.getLods();
+
+  bool changed = false;
+  for(uint32_t i = 0; i < static_cast<uint32_t>(m_objInstance.size()); i++)
+  {
+    const ObjModel& model = m_objModel[m_objInstance[i].objIndex];
+    uint32_t        lod   = 0;
+    if(m_useLods)
+    {
+      if(lods[i] == InstanceCuller::kCulled)
+        continue;
+      lod = std::min<uint32_t>(lods[i], static_cast<uint32_t>(model.lods.size()) - 1);
+    }
+    if(lod == m_instanceLod[i])
+      continue;
+
+    uint32_t blasId = model.firstBlas + lod;
+    bool     traced = m_blasBuilder.isReady(getInstanceBlas(i));
+    if(traced && !m_blasBuilder.isReady(blasId))
+      continue;
+    setInstanceLod(i, lod);
+    m_objInstance[i].primOffset = model.lods[lod].firstIndex / 3;
+    markInstanceDirty(i);
+    // The hit records of the LOD, an update is enough if the BLAS does not change
+    m_tlasBuilder.setHitGroup(i, getInstanceHitGroup(i));
+    // Else the instance is activated by updateResidency() once the BLAS is ready
+    if(m_blasBuilder.isReady(blasId))
+      m_tlasBuilder.setBlasAddress(i, m_blasBuilder.getDeviceAddress(blasId));
+    changed = true;
+  }
+  if(changed)
+    updateDraws();
+}
+
+uint32_t HelloVulkan::getInstanceBlas(uint32_t instanceId) const
+{
+  return m_objModel[m_objInstance[instanceId].objIndex].firstBlas + m_instanceLod[instanceId];
+}
+
+// Moves the instance to the instances of its new BLAS
+void HelloVulkan::setInstanceLod(uint32_t instanceId, uint32_t lod)
+{
+  std::vector<uint32_t>& instances = m_blasInstances[getInstanceBlas(instanceId)];
+  instances.erase(std::find(instances.begin(), instances.end(), instanceId));
+  m_instanceLod[instanceId] = static_cast<uint8_t>(lod);
+  m_blasInstances[getInstanceBlas(instanceId)].push_back(instanceId);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called at each frame, before rendering
+// - Changed instances are written in the staging region of the frame and copied to the
+//   scene description
+// - The TLAS update (or rebuild) is recorded in the frame command buffer
+//
+void HelloVulkan::updateInstances(const vk::CommandBuffer& cmdBuf)
+{
+  uint32_t frame = getCurFrame();
+  if(!m_dirtyInstances.empty())
+  {
+    size_t     nbInstances = m_objInstance.size();
+    SceneDesc* staging     = m_sceneDescMapped + frame * nbInstances;
+
+    std::vector<vk::BufferCopy> regions;
+    regions.reserve(m_dirtyInstances.size());
+    for(size_t k = 0; k < m_dirtyInstances.size(); k++)
+    {
+      uint32_t id = m_dirtyInstances[k];
+      staging[k]  = toSceneDesc(m_objInstance[id]);
+      regions.emplace_back((frame * nbInstances + k) * sizeof(SceneDesc), id * sizeof(SceneDesc),
+                           sizeof(SceneDesc));
+      m_instanceDirty[id] = 0;
+    }
+    m_dirtyInstances.clear();
+
+    auto shaderStages = vk::PipelineStageFlagBits::eComputeShader
+                        | vk::PipelineStageFlagBits::eVertexShader
+                        | vk::PipelineStageFlagBits::eFragmentShader
+                        | vk::PipelineStageFlagBits::eRayTracingShaderKHR;
+
+    // Previous frames are reading the scene description
+    vk::BufferMemoryBarrier beforeBarrier;
+    beforeBarrier.setSrcAccessMask(vk::AccessFlagBits::eShaderRead);
+    beforeBarrier.setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+    beforeBarrier.setBuffer(m_sceneDesc.buffer);
+    beforeBarrier.setSize(VK_WHOLE_SIZE);
+    cmdBuf.pipelineBarrier(shaderStages, vk::PipelineStageFlagBits::eTransfer, {}, {},
+                           {beforeBarrier}, {});
+
+    cmdBuf.copyBuffer(m_sceneDescStaging.buffer, m_sceneDesc.buffer, regions);
+
+    vk::BufferMemoryBarrier afterBarrier;
+    afterBarrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    afterBarrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+    afterBarrier.setBuffer(m_sceneDesc.buffer);
+    afterBarrier.setSize(VK_WHOLE_SIZE);
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, shaderStages, {}, {},
+                           {afterBarrier}, {});
+  }
+
+  m_tlasBuilder.cmdUpdate(cmdBuf, frame);
+}
+
+//--------------------------------------------------------------------------------------------------
+// New vertices of a dynamic model, uploaded by the next updateDynamicGeometry()
+// - Only the last vertices given before the upload are kept
+// - Ignored until the BLAS is ready: its build on the compute queue reads the vertex buffer
+//
+void HelloVulkan::setModelVertices(uint32_t objIndex, const std::vector<VertexObj>& vertices)
+{
+  const ObjModel& model = m_objModel[objIndex];
+  if(!model.dynamic || vertices.size() != model.nbVertices)
+  {
+    LOGW("Model %u is not dynamic or its number of vertices changed\n", objIndex);
+    return;
+  }
+  if(m_blasBuilder.isReady(model.firstBlas))
+    m_pendingVertices[objIndex] = vertices;
+}
+
+//--------------------------------------------------------------------------------------------------
+// The vertex buffer of a dynamic model was written on the GPU (e.g. skinning in a compute
+// shader recorded before updateDynamicGeometry()): only its BLAS needs a refit
+//
+void HelloVulkan::markModelDeformed(uint32_t objIndex)
+{
+  uint32_t blasId = m_objModel[objIndex].firstBlas;  // Dynamic models have a single LOD
+  if(m_blasBuilder.isReady(blasId))
+    m_blasBuilder.markDirty(blasId);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Sway a dynamic model: vertices bend sideways with their height
+//
+void HelloVulkan::deformModel(float time, uint32_t objIndex)
+{
+  const ObjModel& model = m_objModel[objIndex];
+  if(!model.dynamic || !m_blasBuilder.isReady(model.firstBlas))
+    return;
+
+  std::vector<VertexObj> vertices(model.restVertices.size());
+  m_threadPool.parallelFor(vertices.size(), 4096, [&](size_t begin, size_t end) {
+    for(size_t v = begin; v < end; v++)
+    {
+      vertices[v] = model.restVertices[v];
+      float bend  = 0.05f * vertices[v].pos.y * std::sin(time * 2.f + vertices[v].pos.y * 0.5f);
+      vertices[v].pos.x += bend;
+    }
+  });
+  setModelVertices(objIndex, vertices);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called at each frame, before updateInstances()
+// - Pending vertices are copied through the staging region of the frame; what does not fit
+//   waits for the next frame. Vertices larger than a region get a staging buffer of their own,
+//   destroyed when the frame comes again.
+// - The BLAS of changed models are refit, within the per-frame budget of the BLAS builder. A
+//   deferred BLAS keeps its old bounds until its turn comes.
+//
+void HelloVulkan::updateDynamicGeometry(const vk::CommandBuffer& cmdBuf)
+{
+  // The staging of the frame is no longer read by the GPU, see prepareFrame()
+  uint32_t frame = getCurFrame();
+  m_vertexStaging.beginRegion(frame);
+  for(nvvk::Buffer& staging : m_largeVertexStaging[frame])
+    m_alloc.destroy(staging);
+  m_largeVertexStaging[frame].clear();
+
+  std::vector<vk::BufferMemoryBarrier> beforeBarriers;
+  std::vector<vk::BufferMemoryBarrier> afterBarriers;
+  std::vector<uint32_t>                uploaded;
+  std::vector<vk::Buffer>              sources;
+  std::vector<vk::DeviceSize>          offsets;
+  for(const auto& pending : m_pendingVertices)
+  {
+    vk::DeviceSize size   = pending.second.size() * sizeof(VertexObj);
+    vk::Buffer     source = m_vertexStaging.getBuffer();
+    vk::DeviceSize offset = 0;
+    void*          dst    = nullptr;
+    if(size > m_vertexStaging.getRegionSize())
+    {
+      nvvk::Buffer staging =
+          m_alloc.createBuffer(size, vk::BufferUsageFlagBits::eTransferSrc,
+                               vk::MemoryPropertyFlagBits::eHostVisible
+                                   | vk::MemoryPropertyFlagBits::eHostCoherent);
+      m_largeVertexStaging[frame].push_back(staging);
+      source = staging.buffer;
+      dst    = m_alloc.map(staging);
+    }
+    else
+    {
+      dst = m_vertexStaging.allocate(size, offset);
+      if(dst == nullptr)
+        continue;  // The next models may still fit
+    }
+    memcpy(dst, pending.second.data(), size);
+    uploaded.push_back(pending.first);
+    sources.push_back(source);
+    offsets.push_back(offset);
+
+    vk::BufferMemoryBarrier barrier;
+    const GeometryPool::Range& range = m_objModel[pending.first].geometry;
+    barrier.setBuffer(m_geometry.getVertexBuffer().buffer);
+    barrier.setOffset(m_geometry.getVertexOffset(range));
+    barrier.setSize(m_geometry.getVertexSize(range));
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eVertexAttributeRead
+                             | vk::AccessFlagBits::eShaderRead);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+    beforeBarriers.push_back(barrier);
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead
+                             | vk::AccessFlagBits::eShaderRead);
+    afterBarriers.push_back(barrier);
+  }
+  if(!uploaded.empty())
+  {
+    // Previous frames draw, trace and build with the vertices
+    auto readStages = vk::PipelineStageFlagBits::eVertexInput
+                      | vk::PipelineStageFlagBits::eFragmentShader
+                      | vk::PipelineStageFlagBits::eRayTracingShaderKHR
+                      | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR;
+    cmdBuf.pipelineBarrier(readStages, vk::PipelineStageFlagBits::eTransfer, {}, {},
+                           beforeBarriers, {});
+    for(size_t k = 0; k < uploaded.size(); k++)
+    {
+      uint32_t       objIndex = uploaded[k];
+      vk::DeviceSize size     = m_pendingVertices[objIndex].size() * sizeof(VertexObj);
+      vk::DeviceSize dst      = m_geometry.getVertexOffset(m_objModel[objIndex].geometry);
+      cmdBuf.copyBuffer(sources[k], m_geometry.getVertexBuffer().buffer,
+                        {vk::BufferCopy(offsets[k], dst, size)});
+      m_blasBuilder.markDirty(m_objModel[objIndex].firstBlas);
+      m_pendingVertices.erase(objIndex);
+    }
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, readStages, {}, {},
+                           afterBarriers, {});
+  }
+
+  // Refit BLAS change the bounds of their instances: the TLAS must be updated as well
+  if(m_blasBuilder.cmdRefit(cmdBuf) > 0)
+    m_tlasBuilder.markDirty();
 }
 
 //--------------------------------------------------------------------------------------------------
 // Creating all textures and samplers
 //
-void HelloVulkan::createTextureImages(const vk::CommandBuffer&        cmdBuf,
-                                      const std::vector<std::string>& textures)
+void HelloVulkan::createTextureImages(const std::vector<std::string>& textures)
 {
   using vkIU = vk::ImageUsageFlagBits;
 
@@ -346,67 +1184,43 @@ void HelloVulkan::createTextureImages(const vk::CommandBuffer&        cmdBuf,
   samplerCreateInfo.setMaxLod(FLT_MAX);
   vk::Format format = vk::Format::eR8G8B8A8Srgb;
 
-  // If no textures are present, create a dummy one to accommodate the pipeline layout
-  if(textures.empty() && m_textures.empty())
+  // Uploading all images: a model without textures needs none, the texture array being
+  // partially bound
+  for(const auto& texture : textures)
   {
-    nvvk::Texture texture;
+    std::stringstream o;
+    int               texWidth, texHeight, texChannels;
+    o << "media/textures/" << texture;
+    std::string txtFile = nvh::findFile(o.str(), defaultSearchPaths, true);
 
-    std::array<uint8_t, 4> color{255u, 255u, 255u, 255u};
-    vk::DeviceSize         bufferSize      = sizeof(color);
-    auto                   imgSize         = vk::Extent2D(1, 1);
-    auto                   imageCreateInfo = nvvk::makeImage2DCreateInfo(imgSize, format);
+    stbi_uc* stbi_pixels =
+        stbi_load(txtFile.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
 
-    // Creating the dummy texture
-    nvvk::Image image = m_alloc.createImage(cmdBuf, bufferSize, color.data(), imageCreateInfo);
-    vk::ImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
-    texture                        = m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
+    std::array<stbi_uc, 4> color{255u, 0u, 255u, 255u};
 
-    // The image format must be in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
-    nvvk::cmdBarrierImageLayout(cmdBuf, texture.image, vk::ImageLayout::eUndefined,
-                                vk::ImageLayout::eShaderReadOnlyOptimal);
-    m_textures.push_back(texture);
-  }
-  else
-  {
-    // Uploading all images
-    for(const auto& texture : textures)
+    stbi_uc* pixels = stbi_pixels;
+    // Handle failure
+    if(!stbi_pixels)
     {
-      std::stringstream o;
-      int               texWidth, texHeight, texChannels;
-      o << "media/textures/" << texture;
-      std::string txtFile = nvh::findFile(o.str(), defaultSearchPaths, true);
-
-      stbi_uc* stbi_pixels =
-          stbi_load(txtFile.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-
-      std::array<stbi_uc, 4> color{255u, 0u, 255u, 255u};
-
-      stbi_uc* pixels = stbi_pixels;
-      // Handle failure
-      if(!stbi_pixels)
-      {
-        texWidth = texHeight = 1;
-        texChannels          = 4;
-        pixels               = reinterpret_cast<stbi_uc*>(color.data());
-      }
+      texWidth = texHeight = 1;
+      texChannels          = 4;
+      pixels               = reinterpret_cast<stbi_uc*>(color.data());
+    }
 
-      vk::DeviceSize bufferSize = static_cast<uint64_t>(texWidth) * texHeight * sizeof(uint8_t) * 4;
-      auto           imgSize    = vk::Extent2D(texWidth, texHeight);
-      auto imageCreateInfo = nvvk::makeImage2DCreateInfo(imgSize, format, vkIU::eSampled, true);
+    vk::DeviceSize bufferSize = static_cast<uint64_t>(texWidth) * texHeight * sizeof(uint8_t) * 4;
+    auto           imgSize    = vk::Extent2D(texWidth, texHeight);
+    auto imageCreateInfo = nvvk::makeImage2DCreateInfo(imgSize, format, vkIU::eSampled, true);
 
-      {
-        nvvk::ImageDedicated image =
-            m_alloc.createImage(cmdBuf, bufferSize, pixels, imageCreateInfo);
-        nvvk::cmdGenerateMipmaps(cmdBuf, image.image, format, imgSize, imageCreateInfo.mipLevels);
-        vk::ImageViewCreateInfo ivInfo =
-            nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
-        nvvk::Texture texture = m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
-
-        m_textures.push_back(texture);
-      }
+    {
+      // Mip levels are generated on the graphics queue, once uploaded
+      nvvk::Image image = m_uploads.createImage(imageCreateInfo, pixels, bufferSize);
+      vk::ImageViewCreateInfo ivInfo = nvvk::makeImageViewCreateInfo(image.image, imageCreateInfo);
+      nvvk::Texture texture = m_alloc.createTexture(image, ivInfo, samplerCreateInfo);
 
-      stbi_image_free(stbi_pixels);
+      m_textures.push_back(texture);
     }
+
+    stbi_image_free(stbi_pixels);
   }
 }
 
@@ -415,17 +1229,25 @@ void HelloVulkan::createTextureImages(const vk::CommandBuffer&        cmdBuf,
 //
 void HelloVulkan::destroyResources()
 {
+  // Work still running on the transfer and compute queues: the BLAS builds wait for the uploads
+  m_uploads.waitIdle();
+  m_blasBuilder.waitIdle();
+
   m_device.destroy(m_graphicsPipeline);
   m_device.destroy(m_pipelineLayout);
-  m_device.destroy(m_descPool);
-  m_device.destroy(m_descSetLayout);
+  m_scene.destroy();
   m_alloc.destroy(m_cameraMat);
   m_alloc.destroy(m_sceneDesc);
+  m_alloc.unmap(m_sceneDescStaging);
+  m_alloc.destroy(m_sceneDescStaging);
 
+  m_alloc.unmap(m_drawBuffer);
+  m_alloc.destroy(m_drawBuffer);
+  m_cullPass.destroy();
+
+  m_geometry.deinit();
   for(auto& m : m_objModel)
   {
-    m_alloc.destroy(m.vertexBuffer);
-    m_alloc.destroy(m.indexBuffer);
     m_alloc.destroy(m.matColorBuffer);
     m_alloc.destroy(m.matIndexBuffer);
   }
@@ -446,12 +1268,36 @@ void HelloVulkan::destroyResources()
   m_device.destroy(m_offscreenFramebuffer);
 
   // #VKRay
-  m_rtBuilder.destroy();
+  m_tlasBuilder.destroy();
+  m_blasBuilder.destroy();
+  m_vertexStaging.deinit();
+  for(auto& frameStaging : m_largeVertexStaging)
+  {
+    for(nvvk::Buffer& staging : frameStaging)
+      m_alloc.destroy(staging);
+  }
+  m_largeVertexStaging.clear();
+  m_uploads.destroy();
   m_device.destroy(m_rtDescPool);
   m_device.destroy(m_rtDescSetLayout);
   m_device.destroy(m_rtPipeline);
+  for(auto& library : m_rtLibraries)
+  {
+    m_device.destroy(library.second.pipeline);
+  }
+  for(vk::Pipeline pipeline : m_rtRetiredPipelines)
+    m_device.destroy(pipeline);
+  m_rtRetiredPipelines.clear();
   m_device.destroy(m_rtPipelineLayout);
-  m_alloc.destroy(m_rtSBTBuffer);
+  for(auto& sbt : m_sbt)
+    sbt.destroy();
+  m_device.destroy(m_rtTimerPool);
+  m_alloc.unmap(m_rtRayCounts);
+  m_alloc.destroy(m_rtRayCounts);
+  m_wavefront.destroy();
+
+  // Memory blocks, once all resources are gone
+  m_alloc.deinit();
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -459,8 +1305,9 @@ void HelloVulkan::destroyResources()
 //
 void HelloVulkan::rasterize(const vk::CommandBuffer& cmdBuf)
 {
-  using vkPBP = vk::PipelineBindPoint;
-  using vkSS  = vk::ShaderStageFlagBits;
+  using vkPBP   = vk::PipelineBindPoint;
+  using vkSS    = vk::ShaderStageFlagBits;
+  using DrawCmd = vk::DrawIndexedIndirectCommand;
   vk::DeviceSize offset{0};
 
   m_debug.beginLabel(cmdBuf, "Rasterize");
@@ -471,18 +1318,47 @@ void HelloVulkan::rasterize(const vk::CommandBuffer& cmdBuf)
 
   // Drawing all triangles
   cmdBuf.bindPipeline(vkPBP::eGraphics, m_graphicsPipeline);
-  cmdBuf.bindDescriptorSets(vkPBP::eGraphics, m_pipelineLayout, 0, {m_descSet}, {});
-  for(int i = 0; i < m_objInstance.size(); ++i)
+  cmdBuf.bindDescriptorSets(vkPBP::eGraphics, m_pipelineLayout, 0, {m_scene.getDescriptorSet()},
+                            {});
+  cmdBuf.pushConstants<ObjPushConstant>(m_pipelineLayout, vkSS::eVertex | vkSS::eFragment, 0,
+                                        m_pushConstant);
+  cmdBuf.bindVertexBuffers(0, {m_geometry.getVertexBuffer().buffer}, {offset});
+  cmdBuf.bindIndexBuffer(m_geometry.getIndexBuffer().buffer, 0, vk::IndexType::eUint32);
+
+  uint32_t drawCount = static_cast<uint32_t>(m_draws.size());
+  if(isCulling())
   {
-    auto& inst                = m_objInstance[i];
-    auto& model               = m_objModel[inst.objIndex];
-    m_pushConstant.instanceId = i;  // Telling which instance is drawn
-    cmdBuf.pushConstants<ObjPushConstant>(m_pipelineLayout, vkSS::eVertex | vkSS::eFragment, 0,
-                                          m_pushConstant);
-
-    cmdBuf.bindVertexBuffers(0, {model.vertexBuffer.buffer}, {offset});
-    cmdBuf.bindIndexBuffer(model.indexBuffer.buffer, 0, vk::IndexType::eUint32);
-    cmdBuf.drawIndexed(model.nbIndices, 1, 0, 0, 0);
+    // Draws and count written by cullDraws()
+    cmdBuf.drawIndexedIndirectCount(m_cullPass.getDrawBuffer(), 0, m_cullPass.getCountBuffer(), 0,
+                                    m_cullPass.getMaxDraws(), sizeof(DrawCmd));
+  }
+  else if(m_useIndirectDraws && m_multiDrawIndirect && m_drawIndirectFirstInstance)
+  {
+    // The region of this frame is no longer read by the GPU, see prepareFrame(). The draws kept
+    // by the host culling change every frame, version 0 has the region rewritten after them.
+    uint32_t       frame        = getCurFrame();
+    vk::DeviceSize regionOffset = frame * m_objInstance.size() * sizeof(DrawCmd);
+    if(isHostCulling())
+    {
+      drawCount = static_cast<uint32_t>(m_visibleDraws.size());
+      memcpy(m_drawMapped + frame * m_objInstance.size(), m_visibleDraws.data(),
+             m_visibleDraws.size() * sizeof(DrawCmd));
+      m_drawRegionVersion[frame] = 0;
+    }
+    else if(m_drawRegionVersion[frame] != m_drawVersion)
+    {
+      memcpy(m_drawMapped + frame * m_objInstance.size(), m_draws.data(),
+             m_draws.size() * sizeof(DrawCmd));
+      m_drawRegionVersion[frame] = m_drawVersion;
+    }
+    if(drawCount > 0)
+      cmdBuf.drawIndexedIndirect(m_drawBuffer.buffer, regionOffset, drawCount, sizeof(DrawCmd));
+  }
+  else
+  {
+    for(const DrawCmd& draw : isHostCulling() ? m_visibleDraws : m_draws)
+      cmdBuf.drawIndexed(draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset,
+                         draw.firstInstance);
   }
   m_debug.endLabel(cmdBuf);
 }
@@ -494,7 +1370,9 @@ void HelloVulkan::onResize(int /*w*/, int /*h*/)
 {
   createOffscreenRender();
   updatePostDescriptorSet();
+  m_wavefront.setSize(m_size);
   updateRtDescriptorSet();
+  m_cullPass.setDepth(m_offscreenDepth.descriptor.imageView, m_offscreenDepth.image, m_size);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -526,7 +1404,8 @@ void HelloVulkan::createOffscreenRender()
   // Creating the depth buffer
   auto depthCreateInfo =
       nvvk::makeImage2DCreateInfo(m_size, m_offscreenDepthFormat,
-                                  vk::ImageUsageFlagBits::eDepthStencilAttachment);
+                                  vk::ImageUsageFlagBits::eDepthStencilAttachment
+                                      | vk::ImageUsageFlagBits::eSampled);  // Hi-Z
   {
     nvvk::Image image = m_alloc.createImage(depthCreateInfo);
 
@@ -671,19 +1550,47 @@ void HelloVulkan::initRayTracing()
       m_physicalDevice.getProperties2<vk::PhysicalDeviceProperties2,
                                       vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
   m_rtProperties = properties.get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
-  m_rtBuilder.setup(m_device, &m_alloc, m_graphicsQueueIndex);
+  m_blasBuilder.setup(m_device, m_physicalDevice, &m_alloc, m_computeQueueFamily, m_computeQueue);
+  m_blasBuilder.setMemoryBudget(256ull << 20);  // Transient BLAS memory: scratch + uncompacted
+  m_tlasBuilder.setup(m_device, &m_alloc, m_graphicsQueueIndex,
+                      static_cast<uint32_t>(getCommandBuffers().size()));
+  for(auto& sbt : m_sbt)
+    sbt.setup(m_device, m_rtProperties, &m_alloc, &m_uploads);
+
+  // Dynamic models: BLAS refit per frame, and rebuilt after many refits
+  m_blasBuilder.setRefitBudget(4);
+  m_blasBuilder.setRebuildPeriod(60);
+  m_vertexStaging.init(&m_alloc, 16ull << 20, static_cast<uint32_t>(getCommandBuffers().size()));
+  m_largeVertexStaging.resize(getCommandBuffers().size());
+
+  uint32_t nbFrames = static_cast<uint32_t>(getCommandBuffers().size());
+  m_rtTimerPool     = m_device.createQueryPool({{}, vk::QueryType::eTimestamp, 4 * nbFrames});
+  m_rtTimerWritten.assign(nbFrames, 0);
+  m_timestampPeriod = m_physicalDevice.getProperties().limits.timestampPeriod;
+
+  // Reset by the host when read, the frame being done
+  m_rtRayCounts = m_alloc.createBuffer(nbFrames * sizeof(uint32_t),
+                                       vk::BufferUsageFlagBits::eStorageBuffer,
+                                       vk::MemoryPropertyFlagBits::eHostVisible
+                                           | vk::MemoryPropertyFlagBits::eHostCoherent);
+  m_debug.setObjectName(m_rtRayCounts.buffer, "rtRayCounts");
+  m_rtRayCountsMapped = reinterpret_cast<uint32_t*>(m_alloc.map(m_rtRayCounts));
+  std::fill_n(m_rtRayCountsMapped, nbFrames, 0u);
+
+  m_wavefront.setup(m_device, &m_alloc, nbFrames);
+  m_wavefront.setSize(m_size);
 }
 
 //--------------------------------------------------------------------------------------------------
 // Convert an OBJ model into the ray tracing geometry used to build the BLAS
 //
-nvvk::RaytracingBuilderKHR::BlasInput HelloVulkan::objectToVkGeometryKHR(const ObjModel& model)
+BlasBuilder::BlasInput HelloVulkan::objectToVkGeometryKHR(const ObjModel& model, uint32_t lod)
 {
   // BLAS builder requires raw device addresses.
-  vk::DeviceAddress vertexAddress = m_device.getBufferAddress({model.vertexBuffer.buffer});
-  vk::DeviceAddress indexAddress  = m_device.getBufferAddress({model.indexBuffer.buffer});
+  vk::DeviceAddress vertexAddress = m_geometry.getVertexAddress(model.geometry);
+  vk::DeviceAddress indexAddress  = m_geometry.getIndexAddress(model.geometry);
 
-  uint32_t maxPrimitiveCount = model.nbIndices / 3;
+  const ObjModel::Lod& range = model.lods[lod];
 
   // Describe buffer as array of VertexObj.
   vk::AccelerationStructureGeometryTrianglesDataKHR triangles;
@@ -697,60 +1604,135 @@ nvvk::RaytracingBuilderKHR::BlasInput HelloVulkan::objectToVkGeometryKHR(const O
   triangles.setTransformData({});
   triangles.setMaxVertex(model.nbVertices);
 
-  // Identify the above data as containing opaque triangles.
   vk::AccelerationStructureGeometryKHR asGeom;
   asGeom.setGeometryType(vk::GeometryTypeKHR::eTriangles);
-  asGeom.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
   asGeom.geometry.setTriangles(triangles);
 
-  // The entire array will be used to build the BLAS.
+  // The indices of the LOD are used to build the BLAS.
   vk::AccelerationStructureBuildRangeInfoKHR offset;
   offset.setFirstVertex(0);
-  offset.setPrimitiveCount(maxPrimitiveCount);
-  offset.setPrimitiveOffset(0);
   offset.setTransformOffset(0);
 
-  // Our blas is made from only one geometry, but could be made of many geometries
-  nvvk::RaytracingBuilderKHR::BlasInput input;
+  // Geometry 0: the opaque triangles, with no any-hit shader. Always there, even empty, since
+  // the geometry index selects the hit group of the triangles.
+  BlasBuilder::BlasInput input;
+  asGeom.setFlags(vk::GeometryFlagBitsKHR::eOpaque);
+  offset.setPrimitiveCount(range.nbOpaqueIndices / 3);
+  offset.setPrimitiveOffset(range.firstIndex * sizeof(uint32_t));
   input.asGeometry.emplace_back(asGeom);
   input.asBuildOffsetInfo.emplace_back(offset);
 
+  // Geometry 1: the alpha-tested triangles, their any-hit shader is invoked once per triangle
+  uint32_t nbAlphaIndices = range.nbIndices - range.nbOpaqueIndices;
+  if(nbAlphaIndices > 0)
+  {
+    asGeom.setFlags(vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation);
+    offset.setPrimitiveCount(nbAlphaIndices / 3);
+    offset.setPrimitiveOffset((range.firstIndex + range.nbOpaqueIndices) * sizeof(uint32_t));
+    input.asGeometry.emplace_back(asGeom);
+    input.asBuildOffsetInfo.emplace_back(offset);
+  }
+
   return input;
 }
 
 //--------------------------------------------------------------------------------------------------
-//
+// Build one BLAS per LOD of each model, on the compute queue once the geometry is uploaded
+// - The BLAS are compacted, the memory before and after compaction is logged
+// - The BLAS of dynamic models are built for fast updates instead
+// - Nothing waits: the models join the TLAS as their BLAS get ready, see updateResidency()
 //
 void HelloVulkan::createBottomLevelAS()
 {
   // BLAS - Storing each primitive in a geometry
-  std::vector<nvvk::RaytracingBuilderKHR::BlasInput> allBlas;
+  std::vector<BlasBuilder::BlasInput> allBlas;
   allBlas.reserve(m_objModel.size());
-  for(const auto& obj : m_objModel)
+  for(auto& obj : m_objModel)
   {
-    auto blas = objectToVkGeometryKHR(obj);
+    obj.firstBlas = static_cast<uint32_t>(allBlas.size());
+    for(uint32_t lod = 0; lod < static_cast<uint32_t>(obj.lods.size()); lod++)
+    {
+      auto blas = objectToVkGeometryKHR(obj, lod);
+      if(obj.dynamic)
+      {
+        blas.flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild
+                     | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+      }
 
-    // We could add more geometry in each BLAS, but we add only one for now
-    allBlas.emplace_back(blas);
+      // One geometry for the opaque triangles, one for the alpha-tested ones if any
+      allBlas.emplace_back(blas);
+    }
   }
-  m_rtBuilder.buildBlas(allBlas, vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+
+  // The instances are all added by now: they start at LOD 0, updateLods() moves them
+  m_blasInstances.assign(allBlas.size(), {});
+  for(uint32_t i = 0; i < static_cast<uint32_t>(m_objInstance.size()); i++)
+    m_blasInstances[getInstanceBlas(i)].push_back(i);
+
+  m_blasBuilder.buildAsync(allBlas,
+                           vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace
+                               | vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction,
+                           m_uploads.getSemaphore(), m_uploads.flush());
 }
 
 void HelloVulkan::createTopLevelAS()
 {
-  std::vector<nvvk::RaytracingBuilderKHR::Instance> tlas;
+  createHitRecords();
+
+  std::vector<TlasBuilder::Instance> tlas;
   tlas.reserve(m_objInstance.size());
   for(int i = 0; i < static_cast<int>(m_objInstance.size()); i++)
   {
-    nvvk::RaytracingBuilderKHR::Instance rayInst;
-    rayInst.transform        = m_objInstance[i].transform;  // Position of the instance
-    rayInst.instanceCustomId = i;                           // gl_InstanceCustomIndexEXT
-    rayInst.blasId           = m_objInstance[i].objIndex;
-    rayInst.hitGroupId       = 0;  // We will use the same hit group for all objects
-    rayInst.flags            = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+    TlasBuilder::Instance rayInst;
+    rayInst.instanceCustomId = i;  // gl_InstanceCustomIndexEXT
+    rayInst.blasId           = getInstanceBlas(i);
+    rayInst.hitGroupId       = getInstanceHitGroup(i);
+    rayInst.mask             = m_objInstance[i].mask;
+    rayInst.flags            = vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable;
+    rayInst.bboxMin          = m_objModel[m_objInstance[i].objIndex].bboxMin;
+    rayInst.bboxMax          = m_objModel[m_objInstance[i].objIndex].bboxMax;
     tlas.emplace_back(rayInst);
   }
-  m_rtBuilder.buildTlas(tlas, vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace);
+  // Instances can move: the TLAS is updated in the frame command buffer (see updateInstances).
+  // Instances of BLAS not ready yet are inactive until updateResidency() activates them.
+  // The transforms are packed from m_transforms.
+  m_tlasBuilder.build(tlas, m_blasBuilder,
+                      vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace
+                          | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate,
+                      &m_threadPool, &m_transforms);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Hit records of the instances: the instances of a model sharing their material override share
+// their records. The keys do not change with the LODs, only the record of each instance does.
+//
+void HelloVulkan::createHitRecords()
+{
+  std::map<std::pair<uint32_t, int32_t>, uint32_t> firstRecords;
+  m_hitRecords.clear();
+  m_instanceHitRecord.resize(m_objInstance.size());
+  for(size_t i = 0; i < m_objInstance.size(); i++)
+  {
+    const ObjInstance& instance = m_objInstance[i];
+    auto inserted = firstRecords.emplace(std::make_pair(instance.objIndex, instance.matOverride),
+                                         static_cast<uint32_t>(m_hitRecords.size()));
+    if(inserted.second)
+    {
+      uint32_t nbLods = static_cast<uint32_t>(m_objModel[instance.objIndex].lods.size());
+      for(uint32_t lod = 0; lod < nbLods; lod++)
+        m_hitRecords.push_back({instance.objIndex, lod, instance.matOverride});
+    }
+    m_instanceHitRecord[i] = inserted.first->second;
+  }
+  LOGI("Hit records: %zu per light type and geometry, for %zu instances\n", m_hitRecords.size(),
+       m_objInstance.size());
+}
+
+// Each key has its record for the opaque geometry then the one for the alpha-tested geometry:
+// the geometry index selects between the two. The tables of all light types share the layout.
+uint32_t HelloVulkan::getInstanceHitGroup(uint32_t instanceId) const
+{
+  return 2 * (m_instanceHitRecord[instanceId] + m_instanceLod[instanceId]);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -762,25 +1744,51 @@ void HelloVulkan::createRtDescriptorSet()
   using vkSS   = vk::ShaderStageFlagBits;
   using vkDSLB = vk::DescriptorSetLayoutBinding;
 
-  m_rtDescSetLayoutBind.addBinding(vkDSLB(0, vkDT::eAccelerationStructureKHR, 1,
-                                          vkSS::eRaygenKHR | vkSS::eClosestHitKHR));  // TLAS
+  m_rtDescSetLayoutBind.addBinding(
+      vkDSLB(0, vkDT::eAccelerationStructureKHR, 1, vkSS::eRaygenKHR));  // TLAS
   m_rtDescSetLayoutBind.addBinding(
       vkDSLB(1, vkDT::eStorageImage, 1, vkSS::eRaygenKHR));  // Output image
+  m_rtDescSetLayoutBind.addBinding(
+      vkDSLB(2, vkDT::eStorageBuffer, 1, vkSS::eRaygenKHR));  // Ray counters
+  // Wavefront mode: hits, keys, bins, sorted shadow rays and their count
+  for(uint32_t binding = 3; binding <= 7; binding++)
+    m_rtDescSetLayoutBind.addBinding(vkDSLB(binding, vkDT::eStorageBuffer, 1, vkSS::eRaygenKHR));
 
   m_rtDescPool      = m_rtDescSetLayoutBind.createPool(m_device);
   m_rtDescSetLayout = m_rtDescSetLayoutBind.createLayout(m_device);
   m_rtDescSet       = m_device.allocateDescriptorSets({m_rtDescPool, 1, &m_rtDescSetLayout})[0];
 
-  vk::AccelerationStructureKHR                   tlas = m_rtBuilder.getAccelerationStructure();
+  vk::AccelerationStructureKHR                   tlas = m_tlasBuilder.getAccelerationStructure();
   vk::WriteDescriptorSetAccelerationStructureKHR descASInfo;
   descASInfo.setAccelerationStructureCount(1);
   descASInfo.setPAccelerationStructures(&tlas);
   vk::DescriptorImageInfo imageInfo{
       {}, m_offscreenColor.descriptor.imageView, vk::ImageLayout::eGeneral};
+  vk::DescriptorBufferInfo countsInfo{m_rtRayCounts.buffer, 0, VK_WHOLE_SIZE};
 
   std::vector<vk::WriteDescriptorSet> writes;
   writes.emplace_back(m_rtDescSetLayoutBind.makeWrite(m_rtDescSet, 0, &descASInfo));
   writes.emplace_back(m_rtDescSetLayoutBind.makeWrite(m_rtDescSet, 1, &imageInfo));
+  writes.emplace_back(m_rtDescSetLayoutBind.makeWrite(m_rtDescSet, 2, &countsInfo));
+  m_device.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+  updateRtWavefrontDescriptors();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Buffers of the wavefront mode, which follow the size of the output image
+//
+void HelloVulkan::updateRtWavefrontDescriptors()
+{
+  std::array<vk::DescriptorBufferInfo, 5> infos{
+      vk::DescriptorBufferInfo{m_wavefront.getHitBuffer(), 0, VK_WHOLE_SIZE},
+      vk::DescriptorBufferInfo{m_wavefront.getKeyBuffer(), 0, VK_WHOLE_SIZE},
+      vk::DescriptorBufferInfo{m_wavefront.getBinBuffer(), 0, VK_WHOLE_SIZE},
+      vk::DescriptorBufferInfo{m_wavefront.getRayBuffer(), 0, VK_WHOLE_SIZE},
+      vk::DescriptorBufferInfo{m_wavefront.getCountBuffer(), 0, VK_WHOLE_SIZE}};
+
+  std::vector<vk::WriteDescriptorSet> writes;
+  for(uint32_t i = 0; i < static_cast<uint32_t>(infos.size()); i++)
+    writes.emplace_back(m_rtDescSetLayoutBind.makeWrite(m_rtDescSet, 3 + i, &infos[i]));
   m_device.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
 }
 
@@ -798,14 +1806,45 @@ void HelloVulkan::updateRtDescriptorSet()
       {}, m_offscreenColor.descriptor.imageView, vk::ImageLayout::eGeneral};
   vk::WriteDescriptorSet wds{m_rtDescSet, 1, 0, 1, vkDT::eStorageImage, &imageInfo};
   m_device.updateDescriptorSets(wds, nullptr);
+
+  // (3-7) Wavefront buffers
+  updateRtWavefrontDescriptors();
 }
 
 
+//--------------------------------------------------------------------------------------------------
+// Library of the hit groups of a closest-hit permutation, see shaders.hxx
+//
+static std::string rtHitLibraryName(uint32_t light, uint32_t permutation)
+{
+  return "hit_" + std::to_string(light) + "_" + std::to_string(permutation);
+}
+
 //--------------------------------------------------------------------------------------------------
 // Pipeline for the ray tracer: all shaders, raygen, chit, miss
+// - The raygen shaders, the miss shaders and each closest-hit permutation are compiled in their
+//   own pipeline library, cached in m_rtLibraries: a new permutation only compiles its library
+// - The libraries are then linked in the final ray tracing pipeline
 //
 void HelloVulkan::createRtPipeline()
 {
+  vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo;
+
+  // Push constant: we want to be able to update constants used by the shaders
+  vk::PushConstantRange pushConstant{vk::ShaderStageFlagBits::eRaygenKHR
+                                         | vk::ShaderStageFlagBits::eClosestHitKHR
+                                         | vk::ShaderStageFlagBits::eMissKHR,
+                                     0, sizeof(RtPushConstant)};
+  pipelineLayoutCreateInfo.setPushConstantRangeCount(1);
+  pipelineLayoutCreateInfo.setPPushConstantRanges(&pushConstant);
+
+  // Descriptor sets: one specific to ray tracing, and one shared with the rasterization pipeline
+  std::vector<vk::DescriptorSetLayout> rtDescSetLayouts = {m_rtDescSetLayout,
+                                                           m_scene.getLayout()};
+  pipelineLayoutCreateInfo.setSetLayoutCount(static_cast<uint32_t>(rtDescSetLayouts.size()));
+  pipelineLayoutCreateInfo.setPSetLayouts(rtDescSetLayouts.data());
+
+  m_rtPipelineLayout = m_device.createPipelineLayout(pipelineLayoutCreateInfo);
 
   // Load the Circle module.
   vk::ShaderModule raytraceSM = nvvk::createShaderModule(
@@ -820,119 +1859,305 @@ void HelloVulkan::createRtPipeline()
     shadow_shaders.module_size
   );
 
-  std::vector<vk::PipelineShaderStageCreateInfo> stages;
-
-  // Raygen
-  vk::RayTracingShaderGroupCreateInfoKHR rg{vk::RayTracingShaderGroupTypeKHR::eGeneral,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR};
-  stages.push_back({{}, vk::ShaderStageFlagBits::eRaygenKHR, raytraceSM, raytrace_shaders.rgen});
-  rg.setGeneralShader(static_cast<uint32_t>(stages.size() - 1));
-  m_rtShaderGroups.push_back(rg);
-
-  // Miss
-  vk::RayTracingShaderGroupCreateInfoKHR mg{vk::RayTracingShaderGroupTypeKHR::eGeneral,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR};
-  stages.push_back({{}, vk::ShaderStageFlagBits::eMissKHR, raytraceSM, raytrace_shaders.rmiss});
-  mg.setGeneralShader(static_cast<uint32_t>(stages.size() - 1));
-  m_rtShaderGroups.push_back(mg);
-
-  // Shadow Miss
-  stages.push_back({{}, vk::ShaderStageFlagBits::eMissKHR, shadowSM, shadow_shaders.rmiss_shadow});
-  mg.setGeneralShader(static_cast<uint32_t>(stages.size() - 1));
-  m_rtShaderGroups.push_back(mg);
-  vk::RayTracingShaderGroupCreateInfoKHR hg{vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR,
-                                            VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR};
-   stages.push_back({{}, vk::ShaderStageFlagBits::eClosestHitKHR, raytraceSM, raytrace_shaders.rchit});
-  hg.setClosestHitShader(static_cast<uint32_t>(stages.size() - 1));
-  m_rtShaderGroups.push_back(hg);
+  vk::RayTracingShaderGroupCreateInfoKHR generalGroup{
+      vk::RayTracingShaderGroupTypeKHR::eGeneral, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR,
+      VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR};
+  vk::RayTracingShaderGroupCreateInfoKHR hitGroup{
+      vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup, VK_SHADER_UNUSED_KHR,
+      VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR};
 
-  vk::PipelineLayoutCreateInfo pipelineLayoutCreateInfo;
+  // Raygen: the bounce loop, then the camera and the shadow rays of the wavefront mode
+  {
+    std::vector<vk::PipelineShaderStageCreateInfo> stages{
+        {{}, vk::ShaderStageFlagBits::eRaygenKHR, raytraceSM, raytrace_shaders.rgen},
+        {{}, vk::ShaderStageFlagBits::eRaygenKHR, raytraceSM, raytrace_shaders.rgen_primary},
+        {{}, vk::ShaderStageFlagBits::eRaygenKHR, raytraceSM, raytrace_shaders.rgen_shadow}};
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups(stages.size(), generalGroup);
+    for(uint32_t i = 0; i < static_cast<uint32_t>(groups.size()); i++)
+      groups[i].setGeneralShader(i);
+    createRtLibrary("raygen", stages, groups);
+  }
 
-  // Push constant: we want to be able to update constants used by the shaders
-  vk::PushConstantRange pushConstant{vk::ShaderStageFlagBits::eRaygenKHR
-                                         | vk::ShaderStageFlagBits::eClosestHitKHR
-                                         | vk::ShaderStageFlagBits::eMissKHR,
-                                     0, sizeof(RtPushConstant)};
-  pipelineLayoutCreateInfo.setPushConstantRangeCount(1);
-  pipelineLayoutCreateInfo.setPPushConstantRanges(&pushConstant);
+  // Miss and Shadow Miss: group indices are local to the library
+  {
+    std::vector<vk::PipelineShaderStageCreateInfo> stages{
+        {{}, vk::ShaderStageFlagBits::eMissKHR, raytraceSM, raytrace_shaders.rmiss},
+        {{}, vk::ShaderStageFlagBits::eMissKHR, shadowSM, shadow_shaders.rmiss_shadow}};
+    vk::RayTracingShaderGroupCreateInfoKHR mg = generalGroup;
+    vk::RayTracingShaderGroupCreateInfoKHR smg = generalGroup;
+    mg.setGeneralShader(0);
+    smg.setGeneralShader(1);
+    createRtLibrary("miss", stages, {mg, smg});
+  }
 
-  // Descriptor sets: one specific to ray tracing, and one shared with the rasterization pipeline
-  std::vector<vk::DescriptorSetLayout> rtDescSetLayouts = {m_rtDescSetLayout, m_descSetLayout};
-  pipelineLayoutCreateInfo.setSetLayoutCount(static_cast<uint32_t>(rtDescSetLayouts.size()));
-  pipelineLayoutCreateInfo.setPSetLayouts(rtDescSetLayouts.data());
+  // Hit groups: one library per closest-hit permutation, by light type then material
+  // permutation (see shaders.hxx). Each has a group for the opaque triangles and one for the
+  // alpha-tested ones with the any-hit shader, selected by the geometry index with a record
+  // stride of 1.
+  m_rtLibraryOrder = {"raygen", "miss"};
+  for(uint32_t light = 0; light < RT_NB_LIGHT_TYPES; light++)
+  {
+    for(uint32_t material = 0; material < RT_NB_MATERIAL_PERMUTATIONS; material++)
+    {
+      std::vector<vk::PipelineShaderStageCreateInfo> stages{
+          {{}, vk::ShaderStageFlagBits::eAnyHitKHR, raytraceSM, raytrace_shaders.rahit_alpha},
+          {{}, vk::ShaderStageFlagBits::eClosestHitKHR, raytraceSM,
+           raytrace_shaders.rchit[light][material]}};
+      vk::RayTracingShaderGroupCreateInfoKHR opaque = hitGroup;
+      opaque.setClosestHitShader(1);
+      vk::RayTracingShaderGroupCreateInfoKHR alpha = opaque;
+      alpha.setAnyHitShader(0);
+      std::string name = rtHitLibraryName(light, material);
+      createRtLibrary(name, stages, {opaque, alpha});
+      m_rtLibraryOrder.push_back(name);
+    }
+  }
 
-  m_rtPipelineLayout = m_device.createPipelineLayout(pipelineLayoutCreateInfo);
+  // The libraries own the compiled shaders
+  m_device.destroy(shadowSM);
+  m_device.destroy(raytraceSM);
 
-  // Assemble the shader stages and recursion depth info into the ray tracing pipeline
+  // SBT layout: raygen, 2 miss, hit groups
+  linkRtPipeline();
+}
 
-  vk::RayTracingPipelineCreateInfoKHR rayPipelineInfo;
-  rayPipelineInfo.setStageCount(static_cast<uint32_t>(stages.size()));  // Stages are shaders
-  rayPipelineInfo.setPStages(stages.data());
+//--------------------------------------------------------------------------------------------------
+// Compile stages and groups in a ray tracing pipeline library
+// - Libraries are cached by name and by the hash of their description: the stages with their
+//   entry points and specialization data, the groups. Asking again for the same library does not
+//   recompile it. A library whose description changed replaces the cached one, which is retired
+//   by the next linkRtPipeline(): the pipeline has to be linked again.
+// - Group shader indices refer to `stages` of this library
+//
+vk::Pipeline HelloVulkan::createRtLibrary(
+    const std::string&                                         name,
+    const std::vector<vk::PipelineShaderStageCreateInfo>&      stages,
+    const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups)
+{
+  uint64_t hash = fnv1a(name.data(), name.size());
+  for(const auto& stage : stages)
+  {
+    VkShaderStageFlags stageBits = static_cast<VkShaderStageFlags>(stage.stage);
+    hash                         = fnv1a(&stageBits, sizeof(stageBits), hash);
+    hash                         = fnv1a(stage.pName, strlen(stage.pName) + 1, hash);
+    if(const vk::SpecializationInfo* spec = stage.pSpecializationInfo)
+    {
+      hash = fnv1a(spec->pMapEntries, spec->mapEntryCount * sizeof(vk::SpecializationMapEntry),
+                   hash);
+      hash = fnv1a(spec->pData, spec->dataSize, hash);
+    }
+  }
+  for(const auto& group : groups)
+  {
+    uint32_t fields[] = {static_cast<uint32_t>(group.type), group.generalShader,
+                         group.closestHitShader, group.anyHitShader, group.intersectionShader};
+    hash              = fnv1a(fields, sizeof(fields), hash);
+  }
 
-  // In this case, m_rtShaderGroups.size() == 4: we have one raygen group,
-  // two miss shader groups, and one hit group.
-  rayPipelineInfo.setGroupCount(static_cast<uint32_t>(m_rtShaderGroups.size()));
-  rayPipelineInfo.setPGroups(m_rtShaderGroups.data());
+  auto it = m_rtLibraries.find(name);
+  if(it != m_rtLibraries.end())
+  {
+    if(it->second.hash == hash)
+      return it->second.pipeline;
+    // The linked pipeline may still use it
+    m_rtRetiredPipelines.push_back(it->second.pipeline);
+    m_rtLibraries.erase(it);
+  }
+
+  RtLibrary library;
+  library.hash   = hash;
+  library.groups = groups;
+
+  vk::RayTracingPipelineCreateInfoKHR libraryInfo;
+  libraryInfo.setFlags(vk::PipelineCreateFlagBits::eLibraryKHR);
+  libraryInfo.setStageCount(static_cast<uint32_t>(stages.size()));
+  libraryInfo.setPStages(stages.data());
+  libraryInfo.setGroupCount(static_cast<uint32_t>(library.groups.size()));
+  libraryInfo.setPGroups(library.groups.data());
+  libraryInfo.setPLibraryInterface(&m_rtLibraryInterface);
+  libraryInfo.setMaxPipelineRayRecursionDepth(1);  // Bounces are a loop of the raygen shader
+  libraryInfo.setLayout(m_rtPipelineLayout);
+
+  // The pipeline handle is written when the deferred operation completes, so it must point to
+  // the library and not to a temporary.
+  auto       startTime = std::chrono::high_resolution_clock::now();
+  vk::Result result    = m_deferredOps.execute([&](vk::DeferredOperationKHR deferredOp) {
+    return m_device.createRayTracingPipelinesKHR(deferredOp, {}, 1, &libraryInfo, nullptr,
+                                                 &library.pipeline);
+  });
+  if(result != vk::Result::eSuccess)
+  {
+    throw std::runtime_error("Failed to create the ray tracing pipeline library " + name);
+  }
+  auto endTime = std::chrono::high_resolution_clock::now();
+  LOGI("Ray tracing library %s: %.2f ms\n", name.c_str(),
+       std::chrono::duration<double, std::milli>(endTime - startTime).count());
+
+  m_debug.setObjectName(library.pipeline, ("rtLibrary_" + name).c_str());
+  m_rtLibraries[name] = library;
+  return library.pipeline;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Link the libraries of m_rtLibraryOrder in the ray tracing pipeline
+// - The groups of the linked pipeline are the groups of the libraries, in that order
+// - Nothing is compiled here, adding a shader only costs its own library and this link
+// - The Shader Binding Table has to be recreated after linking
+// - The previous pipeline and the libraries replaced since are destroyed once the device is idle
+//
+void HelloVulkan::linkRtPipeline()
+{
+  if(m_rtPipeline)
+    m_rtRetiredPipelines.push_back(m_rtPipeline);
+  m_rtPipeline = vk::Pipeline();
+
+  std::vector<vk::Pipeline> libraries;
+  m_rtShaderGroups.clear();
+  for(const auto& name : m_rtLibraryOrder)
+  {
+    const RtLibrary& library = m_rtLibraries.at(name);
+    libraries.push_back(library.pipeline);
+    m_rtShaderGroups.insert(m_rtShaderGroups.end(), library.groups.begin(), library.groups.end());
+  }
+
+  vk::PipelineLibraryCreateInfoKHR libraryInfo;
+  libraryInfo.setLibraryCount(static_cast<uint32_t>(libraries.size()));
+  libraryInfo.setPLibraries(libraries.data());
 
-  rayPipelineInfo.setMaxPipelineRayRecursionDepth(2);  // Ray depth
+  vk::RayTracingPipelineCreateInfoKHR rayPipelineInfo;
+  rayPipelineInfo.setPLibraryInfo(&libraryInfo);
+  rayPipelineInfo.setPLibraryInterface(&m_rtLibraryInterface);
+  rayPipelineInfo.setMaxPipelineRayRecursionDepth(1);  // Only raygen traces rays
   rayPipelineInfo.setLayout(m_rtPipelineLayout);
-  m_rtPipeline = static_cast<const vk::Pipeline&>(
-      m_device.createRayTracingPipelineKHR({}, {}, rayPipelineInfo));
 
-  // Spec only guarantees 1 level of "recursion". Check for that sad possibility here.
-  if (m_rtProperties.maxRayRecursionDepth <= 1) {
-    throw std::runtime_error("Device fails to support ray recursion (m_rtProperties.maxRayRecursionDepth <= 1)");
+  auto       startTime = std::chrono::high_resolution_clock::now();
+  vk::Result result    = m_deferredOps.execute([&](vk::DeferredOperationKHR deferredOp) {
+    return m_device.createRayTracingPipelinesKHR(deferredOp, {}, 1, &rayPipelineInfo, nullptr,
+                                                 &m_rtPipeline);
+  });
+  if(result != vk::Result::eSuccess)
+  {
+    throw std::runtime_error("Failed to link the ray tracing pipeline");
   }
+  auto endTime = std::chrono::high_resolution_clock::now();
+  LOGI("Ray tracing pipeline link (%d libraries): %.2f ms\n", static_cast<int>(libraries.size()),
+       std::chrono::duration<double, std::milli>(endTime - startTime).count());
+  m_debug.setObjectName(m_rtPipeline, "rtPipeline");
+  logRtStackSize();
 
-  m_device.destroy(shadowSM);
-  m_device.destroy(raytraceSM);
+  if(!m_rtRetiredPipelines.empty())
+  {
+    m_device.waitIdle();
+    for(vk::Pipeline pipeline : m_rtRetiredPipelines)
+      m_device.destroy(pipeline);
+    m_rtRetiredPipelines.clear();
+  }
 }
 
 //--------------------------------------------------------------------------------------------------
-// The Shader Binding Table (SBT)
-// - getting all shader handles and write them in a SBT buffer
-// - Besides exception, this could be always done like this
-//   See how the SBT buffer is used in run()
+// Stack of the linked pipeline, as the driver sizes it by default from the largest shaders of
+// each stage. With only the raygen shader tracing rays, it is the raygen stack plus the largest
+// hit or miss stack, whatever the number of bounces. Tracing the shadow ray from the closest-hit
+// shader needed a depth of 2: a second closest-hit or miss stack on top, and a depth growing with
+// each recursive bounce.
 //
-void HelloVulkan::createRtShaderBindingTable()
+void HelloVulkan::logRtStackSize()
 {
-  auto groupCount =
-      static_cast<uint32_t>(m_rtShaderGroups.size());  // 4 shaders: raygen, 2 miss, chit
-  uint32_t groupHandleSize = m_rtProperties.shaderGroupHandleSize;  // Size of a program identifier
-  // Compute the actual size needed per SBT entry (round-up to alignment needed).
-  uint32_t groupSizeAligned =
-      nvh::align_up(groupHandleSize, m_rtProperties.shaderGroupBaseAlignment);
-  // Bytes needed for the SBT.
-  uint32_t sbtSize = groupCount * groupSizeAligned;
-
-  // Fetch all the shader handles used in the pipeline. This is opaque data,
-  // so we store it in a vector of bytes.
-  std::vector<uint8_t> shaderHandleStorage(sbtSize);
-  auto result = m_device.getRayTracingShaderGroupHandlesKHR(m_rtPipeline, 0, groupCount, sbtSize,
-                                                            shaderHandleStorage.data());
-  assert(result == vk::Result::eSuccess);
+  using Stage = vk::ShaderGroupShaderKHR;
+  vk::DeviceSize raygen = 0, closestHit = 0, anyHit = 0, miss = 0;
+  // The raygen shaders come first, see m_rtLibraryOrder
+  uint32_t nbRaygen = static_cast<uint32_t>(m_rtLibraries.at("raygen").groups.size());
+  for(uint32_t g = 0; g < static_cast<uint32_t>(m_rtShaderGroups.size()); g++)
+  {
+    const vk::RayTracingShaderGroupCreateInfoKHR& group = m_rtShaderGroups[g];
+    if(group.type == vk::RayTracingShaderGroupTypeKHR::eGeneral)
+    {
+      vk::DeviceSize size =
+          m_device.getRayTracingShaderGroupStackSizeKHR(m_rtPipeline, g, Stage::eGeneral);
+      if(g < nbRaygen)
+        raygen = std::max(raygen, size);
+      else
+        miss = std::max(miss, size);
+      continue;
+    }
+    if(group.closestHitShader != VK_SHADER_UNUSED_KHR)
+      closestHit = std::max(closestHit, m_device.getRayTracingShaderGroupStackSizeKHR(
+                                            m_rtPipeline, g, Stage::eClosestHit));
+    if(group.anyHitShader != VK_SHADER_UNUSED_KHR)
+      anyHit = std::max(anyHit, m_device.getRayTracingShaderGroupStackSizeKHR(m_rtPipeline, g,
+                                                                              Stage::eAnyHit));
+  }
+  vk::DeviceSize depth1 = raygen + std::max({closestHit, miss, anyHit});
+  vk::DeviceSize depth2 = depth1 + std::max(closestHit, miss);
+  LOGI("Ray tracing stack: %llu bytes per ray (raygen %llu, closest hit %llu, miss %llu, any hit "
+       "%llu), %llu at depth 2\n",
+       static_cast<unsigned long long>(depth1), static_cast<unsigned long long>(raygen),
+       static_cast<unsigned long long>(closestHit), static_cast<unsigned long long>(miss),
+       static_cast<unsigned long long>(anyHit), static_cast<unsigned long long>(depth2));
+}
 
-  // Allocate a buffer for storing the SBT. Give it a debug name for NSight.
-  m_rtSBTBuffer = m_alloc.createBuffer(
-      sbtSize,
-      vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eShaderDeviceAddress
-          | vk::BufferUsageFlagBits::eShaderBindingTableKHR,
-      vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
-  m_debug.setObjectName(m_rtSBTBuffer.buffer, std::string("SBT").c_str());
+//--------------------------------------------------------------------------------------------------
+// The Shader Binding Tables (SBT), one per light type
+// - The three raygen shaders, the miss shaders of the camera and the shadow rays, then two hit
+//   records per key of m_hitRecords (see createHitRecords)
+// - A hit record references the hit group of the closest-hit permutation of its key and of the
+//   light type, and holds the object, the first triangle of the geometry and the material
+//   override
+// - The light type selects the table: sbtRecordOffset only has 4 bits, too few to offset the
+//   hit records of the other light types
+// - Created again after each link of the pipeline, the groups having changed
+//
+void HelloVulkan::createRtShaderBindingTable()
+{
+  // First group of each library in the linked pipeline
+  std::map<std::string, uint32_t> firstGroups;
+  uint32_t                        nbGroups = 0;
+  for(const auto& name : m_rtLibraryOrder)
+  {
+    firstGroups[name] = nbGroups;
+    nbGroups += static_cast<uint32_t>(m_rtLibraries.at(name).groups.size());
+  }
 
-  // Map the SBT buffer and write in the handles.
-  void* mapped = m_alloc.map(m_rtSBTBuffer);
-  auto* pData  = reinterpret_cast<uint8_t*>(mapped);
-  for(uint32_t g = 0; g < groupCount; g++)
+  uint64_t ticket = 0;
+  for(uint32_t light = 0; light < RT_NB_LIGHT_TYPES; light++)
   {
-    memcpy(pData, shaderHandleStorage.data() + g * groupHandleSize, groupHandleSize);
-    pData += groupSizeAligned;
+    SbtBuilder& sbt = m_sbt[light];
+    sbt.clear();
+    sbt.addRecord(SbtBuilder::eRaygen, firstGroups["raygen"]);      // Bounce loop
+    sbt.addRecord(SbtBuilder::eRaygen, firstGroups["raygen"] + 1);  // Wavefront camera rays
+    sbt.addRecord(SbtBuilder::eRaygen, firstGroups["raygen"] + 2);  // Wavefront shadow rays
+    sbt.addRecord(SbtBuilder::eMiss, firstGroups["miss"]);      // Camera rays
+    sbt.addRecord(SbtBuilder::eMiss, firstGroups["miss"] + 1);  // Shadow rays
+    for(const HitRecordKey& key : m_hitRecords)
+    {
+      const ObjModel&               model = m_objModel[key.objIndex];
+      const ObjModel::Lod&          lod   = model.lods[key.lod];
+      const BindlessScene::ObjDesc& desc  = m_scene.getObjDesc(key.objIndex);
+
+      uint32_t permutation = key.matOverride >= 0 ? model.matPermutations[key.matOverride] :
+                                                    model.matPermutation;
+      uint32_t group = firstGroups[rtHitLibraryName(light, permutation)];
+
+      HitRecord record;
+      record.vertexAddress   = desc.vertexAddress;
+      record.indexAddress    = desc.indexAddress;
+      record.materialAddress = desc.materialAddress;
+      record.matIndexAddress = desc.matIndexAddress;
+      record.txtOffset       = desc.txtOffset;
+      record.matOverride     = key.matOverride;
+      record.primOffset      = lod.firstIndex / 3;
+      sbt.addRecord(SbtBuilder::eHit, group, record);
+      record.primOffset = (lod.firstIndex + lod.nbOpaqueIndices) / 3;
+      sbt.addRecord(SbtBuilder::eHit, group + 1, record);
+    }
+    ticket = sbt.create(m_rtPipeline, nbGroups);
   }
-  m_alloc.unmap(m_rtSBTBuffer);
-  m_alloc.finalizeAndReleaseStaging();
+  m_uploads.wait(ticket);
+
+  const SbtBuilder::Layout& layout = m_sbt[0].getLayout();
+  LOGI("Shader binding tables: %u hit records of %u bytes, %.1f KB per light type\n",
+       m_sbt[0].getNbRecords(SbtBuilder::eHit),
+       static_cast<uint32_t>(layout.stride[SbtBuilder::eHit]), layout.totalSize / 1024.0);
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -941,38 +2166,105 @@ void HelloVulkan::createRtShaderBindingTable()
 void HelloVulkan::raytrace(const vk::CommandBuffer& cmdBuf, const nvmath::vec4f& clearColor)
 {
   m_debug.beginLabel(cmdBuf, "Ray trace");
+  m_cullPass.invalidateHiZ();  // No depth this frame
+  uint32_t frame = getCurFrame();
+
   // Initializing push constant values
+  nvmath::vec3f eye, center, up;
+  CameraManip.getLookat(eye, center, up);
+  ShadowBinGrid grid = ShadowBinGrid::centered(eye, m_rtBinExtent);
   m_rtPushConstants.clearColor     = clearColor;
   m_rtPushConstants.lightPosition  = m_pushConstant.lightPosition;
   m_rtPushConstants.lightIntensity = m_pushConstant.lightIntensity;
   m_rtPushConstants.lightType      = m_pushConstant.lightType;
+  m_rtPushConstants.maxBounces     = m_rtMaxBounces;
+  m_rtPushConstants.frame          = static_cast<int>(frame);
+  m_rtPushConstants.gridScale      = grid.scale;
+  m_rtPushConstants.gridOrigin     = grid.origin;
+  m_rtPushConstants.sortShadows    = m_rtSortShadows ? 1 : 0;
+
+  if(m_rtWavefront)
+    m_wavefront.cmdClear(cmdBuf, frame);
 
   cmdBuf.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, m_rtPipeline);
   cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, m_rtPipelineLayout, 0,
-                            {m_rtDescSet, m_descSet}, {});
-  cmdBuf.pushConstants<RtPushConstant>(m_rtPipelineLayout,
-                                       vk::ShaderStageFlagBits::eRaygenKHR
-                                           | vk::ShaderStageFlagBits::eClosestHitKHR
-                                           | vk::ShaderStageFlagBits::eMissKHR,
-                                       0, m_rtPushConstants);
-
-  // Size of a program identifier
-  uint32_t groupSize =
-      nvh::align_up(m_rtProperties.shaderGroupHandleSize, m_rtProperties.shaderGroupBaseAlignment);
-  uint32_t          groupStride = groupSize;
-  vk::DeviceAddress sbtAddress  = m_device.getBufferAddress({m_rtSBTBuffer.buffer});
-
-  using Stride = vk::StridedDeviceAddressRegionKHR;
-  std::array<Stride, 4> strideAddresses{
-      Stride{sbtAddress + 0u * groupSize, groupStride, groupSize * 1},  // raygen
-      Stride{sbtAddress + 1u * groupSize, groupStride, groupSize * 2},  // miss
-      Stride{sbtAddress + 3u * groupSize, groupStride, groupSize * 1},  // hit
-      Stride{0u, 0u, 0u}};                                              // callable
-
-  cmdBuf.traceRaysKHR(&strideAddresses[0], &strideAddresses[1], &strideAddresses[2],
-                      &strideAddresses[3],              //
-                      m_size.width, m_size.height, 1);  //
-
+                            {m_rtDescSet, m_scene.getDescriptorSet()}, {});
+  auto pushConstants = [&]() {
+    cmdBuf.pushConstants<RtPushConstant>(m_rtPipelineLayout,
+                                         vk::ShaderStageFlagBits::eRaygenKHR
+                                             | vk::ShaderStageFlagBits::eClosestHitKHR
+                                             | vk::ShaderStageFlagBits::eMissKHR,
+                                         0, m_rtPushConstants);
+  };
+  pushConstants();
+
+  const SbtBuilder& sbt     = m_sbt[m_rtPushConstants.lightType];
+  const auto&       regions = sbt.getRegions();
+  auto              trace   = [&](uint32_t raygen) {
+    vk::StridedDeviceAddressRegionKHR raygenRegion = sbt.getRaygenRegion(raygen);
+    cmdBuf.traceRaysKHR(&raygenRegion, &regions[SbtBuilder::eMiss], &regions[SbtBuilder::eHit],
+                        &regions[SbtBuilder::eCallable],  //
+                        m_size.width, m_size.height, 1);  //
+  };
+
+  using vkPS = vk::PipelineStageFlagBits;
+  cmdBuf.resetQueryPool(m_rtTimerPool, 4 * frame, 4);
+  cmdBuf.writeTimestamp(vkPS::eTopOfPipe, m_rtTimerPool, 4 * frame);
+  if(m_rtWavefront)
+  {
+    // Camera rays, binning of their shadow rays, then the shadow rays in the order of the bins
+    trace(1);
+    cmdBuf.writeTimestamp(vkPS::eRayTracingShaderKHR, m_rtTimerPool, 4 * frame + 1);
+    m_wavefront.cmdBin(cmdBuf, frame);
+    cmdBuf.writeTimestamp(vkPS::eComputeShader, m_rtTimerPool, 4 * frame + 2);
+    // The ray tracing pipeline and descriptor sets stay bound, but the push constants of the
+    // compute passes use another layout
+    pushConstants();
+    trace(2);
+    cmdBuf.writeTimestamp(vkPS::eRayTracingShaderKHR, m_rtTimerPool, 4 * frame + 3);
+    m_rtTimerWritten[frame] = 4;
+  }
+  else
+  {
+    trace(0);
+    cmdBuf.writeTimestamp(vkPS::eRayTracingShaderKHR, m_rtTimerPool, 4 * frame + 1);
+    m_rtTimerWritten[frame] = 2;
+  }
 
   m_debug.endLabel(cmdBuf);
 }
+
+//--------------------------------------------------------------------------------------------------
+// Time of the ray tracing pass of the frame being reused: called after prepareFrame(), which
+// waited for it
+//
+void HelloVulkan::updateRtTimer()
+{
+  uint32_t frame     = getCurFrame();
+  uint32_t nbWritten = m_rtTimerWritten[frame];
+  if(nbWritten == 0)
+    return;
+  m_rtTimerWritten[frame] = 0;
+
+  std::array<uint64_t, 4> ticks{};
+  vk::Result              result = m_device.getQueryPoolResults(
+      m_rtTimerPool, 4 * frame, nbWritten, nbWritten * sizeof(uint64_t), ticks.data(),
+      sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+  if(result == vk::Result::eSuccess)
+  {
+    auto toMs = [&](uint32_t from, uint32_t to) {
+      return (ticks[to] - ticks[from]) * m_timestampPeriod * 1e-6;
+    };
+    m_rtTimeMs = toMs(0, nbWritten - 1);
+    if(nbWritten == 4)
+    {
+      m_rtPrimaryMs = toMs(0, 1);
+      m_rtBinMs     = toMs(1, 2);
+      m_rtShadowMs  = toMs(2, 3);
+    }
+  }
+
+  // Coherent memory, and the frame is done: no barrier to read and reset its counter
+  m_rtNbRays                 = m_rtRayCountsMapped[frame];
+  m_rtRayCountsMapped[frame] = 0;
+}
@@ -25,16 +25,33 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #pragma once
+#include <array>
+#include <map>
 #include <vulkan/vulkan.hpp>
 
-#define NVVK_ALLOC_DEDICATED
-#include "nvvk/allocator_vk.hpp"
 #include "nvvk/appbase_vkpp.hpp"
 #include "nvvk/debug_util_vk.hpp"
 #include "nvvk/descriptorsets_vk.hpp"
+#include "obj_loader.h"
 
-// #VKRay
-#include "nvvk/raytraceKHR_vk.hpp"
+#include "bindless_scene.h"
+#include "blas_builder.h"
+#include "cull_pass.h"
+#include "deferred_ops.h"
+#include "geometry_pool.h"
+#include "instance_culler.h"
+#include "mesh_simplifier.h"
+#include "model_registry.h"
+#include "pool_allocator.h"
+#include "sbt_builder.h"
+#include "scene_file.h"
+#include "shaders.hxx"
+#include "staging_ring.h"
+#include "thread_pool.h"
+#include "tlas_builder.h"
+#include "transform_store.h"
+#include "upload_service.h"
+#include "wavefront_pass.h"
 
 //--------------------------------------------------------------------------------------------------
 // Simple rasterizer of OBJ objects
@@ -50,44 +67,165 @@ public:
              const vk::Device&         device,
              const vk::PhysicalDevice& physicalDevice,
              uint32_t                  queueFamily) override;
-  void createDescriptorSetLayout();
+  void initQueues(uint32_t  transferQueueFamily,
+                  vk::Queue transferQueue,
+                  uint32_t  computeQueueFamily,
+                  vk::Queue computeQueue);
+  void createGeometryBuffers(uint32_t maxVertices, uint32_t maxIndices);
+  void createDescriptorSetLayout(uint32_t maxObjects, uint32_t maxTextures);
   void createGraphicsPipeline();
-  void loadModel(const std::string& filename, nvmath::mat4f transform = nvmath::mat4f(1));
+  uint32_t loadModel(const std::string& filename, bool dynamic = false);
+  uint32_t addInstance(uint32_t objIndex, const nvmath::mat4f& transform = nvmath::mat4f(1));
+  void     removeInstance(uint32_t instanceId);
+  void     setInstanceMask(uint32_t instanceId, uint32_t mask);
+  void     loadScene(const SceneFile& scene, const std::vector<std::string>& searchPaths);
   void updateDescriptorSet();
   void createUniformBuffer();
   void createSceneDescriptionBuffer();
-  void createTextureImages(const vk::CommandBuffer&        cmdBuf,
-                           const std::vector<std::string>& textures);
+  void createDrawBuffer();
+  void createCullPass();
+  void createTextureImages(const std::vector<std::string>& textures);
   void updateUniformBuffer(const vk::CommandBuffer& cmdBuf);
   void onResize(int /*w*/, int /*h*/) override;
   void destroyResources();
   void rasterize(const vk::CommandBuffer& cmdBuff);
+  // GPU culling of the raster draws, around the raster pass
+  void     cullDraws(const vk::CommandBuffer& cmdBuf);
+  void     buildHiZ(const vk::CommandBuffer& cmdBuf);
+  bool     isCulling() const;
+  uint32_t countFrustumVisible() const;
+  // Host culling of the instances, when the GPU does not cull
+  bool isHostCulling() const;
+  void updateInstanceBounds(uint32_t instanceId);
+  // LOD of each instance from its size on screen, for the raster draws and the TLAS. Called at
+  // each frame after the animation, before updateInstances().
+  void     updateLods();
+  uint32_t getInstanceBlas(uint32_t instanceId) const;
+  void     setInstanceLod(uint32_t instanceId, uint32_t lod);
+
+  // Instance animation: changes are uploaded and the TLAS updated in updateInstances()
+  void setInstanceTransform(uint32_t instanceId, const nvmath::mat4f& transform);
+  void markInstanceDirty(uint32_t instanceId);
+  void animateInstances(float time, uint32_t firstInstance, uint32_t nbInstances);
+  void updateInstances(const vk::CommandBuffer& cmdBuf);
+  // Models whose uploads and BLAS completed join the frame
+  void updateResidency();
+  void updateDraws();
+
+  // Deforming geometry of dynamic models: the vertices are uploaded and the BLAS refit in
+  // updateDynamicGeometry(), called before updateInstances()
+  void setModelVertices(uint32_t objIndex, const std::vector<VertexObj>& vertices);
+  void markModelDeformed(uint32_t objIndex);  // Vertex buffer written on the GPU
+  void deformModel(float time, uint32_t objIndex);
+  void updateDynamicGeometry(const vk::CommandBuffer& cmdBuf);
 
   // The OBJ model
   struct ObjModel
   {
-    uint32_t     nbIndices{0};
-    uint32_t     nbVertices{0};
-    nvvk::Buffer vertexBuffer;    // Device buffer of all 'Vertex'
-    nvvk::Buffer indexBuffer;     // Device buffer of the indices forming triangles
-    nvvk::Buffer matColorBuffer;  // Device buffer of array of 'Wavefront material'
-    nvvk::Buffer matIndexBuffer;  // Device buffer of array of 'Wavefront material'
+    uint32_t               nbIndices{0};
+    uint32_t               nbVertices{0};
+    uint32_t               nbMaterials{0};
+    uint32_t               txtOffset{0};     // First slot of its textures in the scene
+    uint32_t               firstTexture{0};  // Its textures in `m_textures`
+    uint32_t               nbTextures{0};
+    GeometryPool::Range    geometry;         // Vertices and indices in `m_geometry`
+    nvvk::Buffer           matColorBuffer;   // Device buffer of array of 'Wavefront material'
+    nvvk::Buffer           matIndexBuffer;   // Device buffer of array of 'Wavefront material'
+    bool                   dynamic{false};   // Vertices can change, the BLAS is refit
+    std::vector<VertexObj> restVertices;     // Dynamic models: vertices as loaded
+    uint64_t               uploadTicket{0};  // Buffers and textures usable once complete
+    bool                   resident{false};  // Upload ticket completed: the model can be drawn
+    nvmath::vec3f          bboxMin;          // Bounds of the vertices as loaded
+    nvmath::vec3f          bboxMax;
+    // Closest-hit permutations, RT_NB_MATERIAL_PERMUTATIONS of shaders.hxx: the one of all
+    // the materials, and the one of each for the instances overriding their material
+    uint32_t               matPermutation{0};
+    std::vector<uint8_t>   matPermutations;
+
+    // Levels of detail, LOD 0 is the model as loaded. All use the same vertices: the indices
+    // and triangle materials of the LODs follow each other in the buffers of the model.
+    struct Lod
+    {
+      uint32_t firstIndex{0};  // In the indices of the model
+      uint32_t nbIndices{0};
+      float    error{0.f};  // Largest geometric error, object units
+      // The opaque triangles come first, then the alpha-tested ones: their materials have a
+      // dissolve below 1. Each part is a geometry of the BLAS, see objectToVkGeometryKHR().
+      uint32_t nbOpaqueIndices{0};
+    };
+    std::vector<Lod> lods;
+    uint32_t         firstBlas{0};  // BLAS of LOD i is firstBlas + i
   };
 
+  // Bits of the instance masks, MASK_* of the shaders: the rays of each type only hit the
+  // instances with its bit
+  static constexpr uint32_t kMaskPrimary    = 0x01;  // Seen by the camera rays
+  static constexpr uint32_t kMaskShadow     = 0x02;  // Casts shadows
+  static constexpr uint32_t kMaskReflection = 0x04;  // Seen by the reflected rays
+
   // Instance of the OBJ
   struct ObjInstance
   {
-    uint32_t      objIndex{0};     // Reference to the `m_objModel`
-    uint32_t      txtOffset{0};    // Offset in `m_textures`
-    nvmath::mat4f transform{1};    // Position of the instance
-    nvmath::mat4f transformIT{1};  // Inverse transpose
+    uint32_t      objIndex{0};      // Reference to the `m_objModel`
+    uint32_t      primOffset{0};    // First triangle of the LOD drawn, in the model
+    int32_t       matOverride{-1};  // Material of all triangles, -1 for their own
+    uint32_t      mask{0xFF};       // Visibility to the rays, kMask* bits
+    nvmath::mat4f transform{1};     // Position of the instance
+  };
+
+  // Instance in the scene description buffer, SceneDesc of the shaders: 64 bytes, instead of 140
+  // with the 4x4 transform and its inverse transpose. The shaders derive the normal matrix.
+  struct SceneDesc
+  {
+    uint32_t objIndex{0};
+    uint32_t primOffset{0};
+    int32_t  matOverride{-1};
+    uint32_t reserved{0};
+    float    transform[12]{};  // Rows of the 3x4 object-to-world matrix
   };
+  static SceneDesc toSceneDesc(const ObjInstance& instance);
+
+  // Shader record of the hit groups, HitRecord of the shaders: the hit shaders find the object,
+  // the LOD and the material override of the instance in it instead of the scene description
+  struct HitRecord
+  {
+    uint64_t vertexAddress{0};
+    uint64_t indexAddress{0};
+    uint64_t materialAddress{0};
+    uint64_t matIndexAddress{0};
+    uint32_t txtOffset{0};
+    uint32_t primOffset{0};  // First triangle of the geometry, in the model
+    int32_t  matOverride{-1};
+    uint32_t padding{0};
+  };
+  // Hit records of the SBT of each light type: for each (model, material override) of the
+  // instances, its LODs, each with a record for the opaque and one for the alpha-tested geometry
+  struct HitRecordKey
+  {
+    uint32_t objIndex{0};
+    uint32_t lod{0};
+    int32_t  matOverride{-1};
+  };
+  void createHitRecords();
+  // First hit record of the instance in the TLAS: the one of its LOD
+  uint32_t getInstanceHitGroup(uint32_t instanceId) const;
+
+  // Model read and simplified on the host, not uploaded yet
+  struct HostModel
+  {
+    std::string filename;
+    ObjLoader   loader;
+    ObjModel    model;
+  };
+  // Thread safe: models are prepared in parallel
+  static HostModel prepareModel(const std::string& filename, bool dynamic);
+  uint32_t         addModel(HostModel& host);  // Slot of the model in m_objModel
+  void             unloadModel(uint32_t objIndex);
 
   // Information pushed at each draw call
   struct ObjPushConstant
   {
     nvmath::vec3f lightPosition{10.f, 15.f, 8.f};
-    int           instanceId{0};  // To retrieve the transformation matrix
     float         lightIntensity{100.f};
     int           lightType{0};  // 0: point, 1: infinite
   };
@@ -96,21 +234,63 @@ public:
   // Array of objects and instances in the scene
   std::vector<ObjModel>    m_objModel;
   std::vector<ObjInstance> m_objInstance;
+  ModelRegistry            m_modelRegistry;  // Models of m_objModel, shared by their instances
 
   // Graphic pipeline
   vk::PipelineLayout          m_pipelineLayout;
   vk::Pipeline                m_graphicsPipeline;
-  nvvk::DescriptorSetBindings m_descSetLayoutBind;
-  vk::DescriptorPool          m_descPool;
-  vk::DescriptorSetLayout     m_descSetLayout;
-  vk::DescriptorSet           m_descSet;
+  BindlessScene               m_scene;  // Descriptor set of the models, grows as they load
 
   nvvk::Buffer               m_cameraMat;  // Device-Host of the camera matrices
   nvvk::Buffer               m_sceneDesc;  // Device buffer of the OBJ instances
+  nvvk::Buffer               m_sceneDescStaging;  // Changed instances, one region per frame
+  SceneDesc*                 m_sceneDescMapped{nullptr};
+  std::vector<uint32_t>      m_dirtyInstances;   // Instances changed since the last frame
+  std::vector<uint8_t>       m_instanceDirty;    // Per instance: is in m_dirtyInstances
+  std::vector<nvmath::mat4f> m_animationBase;    // Transform of the instances before animation
+  TransformStore             m_transforms;       // Of m_objInstance, for the batch kernels
   std::vector<nvvk::Texture> m_textures;   // vector of all textures of the scene
 
-  nvvk::AllocatorDedicated m_alloc;  // Allocator for buffer, images, acceleration structures
-  nvvk::DebugUtil          m_debug;  // Utility to name objects
+  // Raster draws: one indirect draw per resident instance, firstInstance is the instance index.
+  // The draws change with the residency of the models, the regions of the frames follow.
+  GeometryPool                                m_geometry;    // Vertices and indices of all models
+  nvvk::Buffer                                m_drawBuffer;  // One region of draws per frame
+  vk::DrawIndexedIndirectCommand*             m_drawMapped{nullptr};
+  std::vector<vk::DrawIndexedIndirectCommand> m_draws;
+  uint32_t                                    m_drawVersion{1};
+  std::vector<uint32_t>                       m_drawRegionVersion;  // Version of each region
+  bool                                        m_multiDrawIndirect{false};
+  bool                                        m_drawIndirectFirstInstance{false};
+  bool                                        m_useIndirectDraws{true};  // Else a call per draw
+
+  CullPass      m_cullPass;          // Frustum and Hi-Z culling of m_draws
+  bool          m_useCulling{true};  // Needs drawIndirectCount
+  nvmath::mat4f m_viewProj{1};       // Camera of the frame
+  nvmath::vec3f m_eye{0.f};
+  float         m_projScale{1.f};  // proj[1][1]
+
+  InstanceCuller                              m_instanceCuller;  // Bounds of all instances
+  bool                                        m_useHostCulling{true};
+  std::vector<vk::DrawIndexedIndirectCommand> m_visibleDraws;  // m_draws kept by m_instanceCuller
+
+  std::vector<uint8_t> m_instanceLod;  // Current LOD of each instance
+  bool                 m_useLods{true};
+  uint32_t             m_nbDrawnTriangles{0};  // In m_draws
+  uint32_t             m_nbFullTriangles{0};   // Same instances at LOD 0
+
+  StagingRing                                m_vertexStaging;       // Vertex uploads, per frame
+  std::vector<std::vector<nvvk::Buffer>>     m_largeVertexStaging;  // Larger than a region
+  std::map<uint32_t, std::vector<VertexObj>> m_pendingVertices;     // Not uploaded yet, by model
+
+  PoolAllocator   m_alloc;    // Allocator for buffer, images, acceleration structures
+  UploadService   m_uploads;  // Uploads through the transfer queue
+  nvvk::DebugUtil m_debug;    // Utility to name objects
+
+  uint32_t  m_computeQueueFamily{0};  // Builds the BLAS
+  vk::Queue m_computeQueue;
+
+  ThreadPool         m_threadPool;   // Worker threads shared by the host-side work
+  DeferredOpExecutor m_deferredOps;  // Deferred host operations run on m_threadPool
 
   // #Post
   void createOffscreenRender();
@@ -134,18 +314,28 @@ public:
 
   // #VKRay
   void                                  initRayTracing();
-  nvvk::RaytracingBuilderKHR::BlasInput objectToVkGeometryKHR(const ObjModel& model);
+  BlasBuilder::BlasInput                objectToVkGeometryKHR(const ObjModel& model, uint32_t lod);
   void                                  createBottomLevelAS();
   void                                  createTopLevelAS();
   void                                  createRtDescriptorSet();
   void                                  updateRtDescriptorSet();
+  void                                  updateRtWavefrontDescriptors();
   void                                  createRtPipeline();
+  vk::Pipeline createRtLibrary(
+      const std::string&                                         name,
+      const std::vector<vk::PipelineShaderStageCreateInfo>&      stages,
+      const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups);
+  void                                  linkRtPipeline();
   void                                  createRtShaderBindingTable();
   void raytrace(const vk::CommandBuffer& cmdBuf, const nvmath::vec4f& clearColor);
+  void updateRtTimer();
+  void logRtStackSize();
 
 
   vk::PhysicalDeviceRayTracingPipelinePropertiesKHR   m_rtProperties;
-  nvvk::RaytracingBuilderKHR                          m_rtBuilder;
+  BlasBuilder                                         m_blasBuilder;
+  std::vector<std::vector<uint32_t>>                  m_blasInstances;  // Instances of each BLAS
+  TlasBuilder                                         m_tlasBuilder;
   nvvk::DescriptorSetBindings                         m_rtDescSetLayoutBind;
   vk::DescriptorPool                                  m_rtDescPool;
   vk::DescriptorSetLayout                             m_rtDescSetLayout;
@@ -153,7 +343,46 @@ public:
   std::vector<vk::RayTracingShaderGroupCreateInfoKHR> m_rtShaderGroups;
   vk::PipelineLayout                                  m_rtPipelineLayout;
   vk::Pipeline                                        m_rtPipeline;
-  nvvk::Buffer                                        m_rtSBTBuffer;
+  std::array<SbtBuilder, RT_NB_LIGHT_TYPES>           m_sbt;  // One table per light type
+  std::vector<HitRecordKey>                           m_hitRecords;
+  std::vector<uint32_t>                               m_instanceHitRecord;  // Of its LOD 0
+
+  // GPU time of the ray tracing pass: up to four timestamps per frame, read once the frame is
+  // done. The wavefront mode also times its passes.
+  vk::QueryPool        m_rtTimerPool;
+  std::vector<uint8_t> m_rtTimerWritten;        // Per frame: number of timestamps recorded
+  float                m_timestampPeriod{1.f};  // Nanoseconds per tick
+  double               m_rtTimeMs{0.};
+  double               m_rtPrimaryMs{0.};  // Wavefront mode: camera rays
+  double               m_rtBinMs{0.};      // Binning of the shadow rays
+  double               m_rtShadowMs{0.};   // Shadow rays
+  // Rays traced by the pass, counted by the raygen shader: one counter per frame
+  nvvk::Buffer m_rtRayCounts;
+  uint32_t*    m_rtRayCountsMapped{nullptr};
+  uint32_t     m_rtNbRays{0};      // Of the last frame read
+  int          m_rtMaxBounces{1};  // Reflected rays after the camera ray
+
+  // Wavefront mode: the shadow rays of the camera hits are binned, then traced in a second pass
+  WavefrontPass m_wavefront;
+  bool          m_rtWavefront{false};
+  bool          m_rtSortShadows{true};  // Else a single bin: the shadow rays keep the pixel order
+  float         m_rtBinExtent{48.f};    // Size of the grid of the bins, around the camera
+
+  // Pipeline libraries linked in m_rtPipeline
+  struct RtLibrary
+  {
+    vk::Pipeline                                        pipeline;
+    uint64_t                                            hash{0};  // Of its stages and groups
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups;  // Stage indices local to library
+  };
+  std::map<std::string, RtLibrary> m_rtLibraries;     // Compiled libraries, by name and content
+  std::vector<std::string>         m_rtLibraryOrder;  // Libraries linked in m_rtPipeline, SBT order
+  // Pipelines replaced while frames may still use them, destroyed by the next link
+  std::vector<vk::Pipeline> m_rtRetiredPipelines;
+  // Payload: HitPayload of raytrace.cxx (location 0, at most 4 vec4) or bool shadow (location 1),
+  // hit attributes: vec2 barycentrics
+  vk::RayTracingPipelineInterfaceCreateInfoKHR m_rtLibraryInterface{4 * sizeof(nvmath::vec4f),
+                                                                    sizeof(nvmath::vec2f)};
 
   struct RtPushConstant
   {
@@ -161,5 +390,10 @@ public:
     nvmath::vec3f lightPosition;
     float         lightIntensity;
     int           lightType;
+    int           maxBounces;
+    int           frame;      // Counter of the rays in m_rtRayCounts
+    float         gridScale;  // Grid of the shadow bins, see ShadowBinGrid
+    nvmath::vec3f gridOrigin;
+    int           sortShadows;
   } m_rtPushConstants;
 };
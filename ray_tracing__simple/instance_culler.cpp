@@ -0,0 +1,345 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "instance_culler.h"
+#include "nvh/nvprint.hpp"
+
+// Chunks of the thread pool, a multiple of the SIMD width
+static constexpr size_t kChunkSize = 4096;
+
+void InstanceCuller::resize(uint32_t nbInstances)
+{
+  for(auto* v : {&m_centerX, &m_centerY, &m_centerZ, &m_radius, &m_minX, &m_minY, &m_minZ,
+                 &m_maxX, &m_maxY, &m_maxZ})
+    v->resize(nbInstances, 0.f);
+  m_lods.resize(nbInstances, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+// World bounds of an instance
+// - AABB: center transformed, extents summed over the absolute values of the 3x3 part
+// - Sphere: same center, half diagonal of the model box times the largest scale
+//
+void InstanceCuller::setBounds(uint32_t             instanceId,
+                               const nvmath::mat4f& transform,
+                               const nvmath::vec3f& bboxMin,
+                               const nvmath::vec3f& bboxMax)
+{
+  float m[16];  // Column-major
+  memcpy(m, &transform, sizeof(m));
+
+  float c[3] = {(bboxMin.x + bboxMax.x) * 0.5f, (bboxMin.y + bboxMax.y) * 0.5f,
+                (bboxMin.z + bboxMax.z) * 0.5f};
+  float e[3] = {(bboxMax.x - bboxMin.x) * 0.5f, (bboxMax.y - bboxMin.y) * 0.5f,
+                (bboxMax.z - bboxMin.z) * 0.5f};
+
+  float center[3];
+  float extent[3];
+  for(int r = 0; r < 3; r++)
+  {
+    center[r] = m[12 + r];
+    extent[r] = 0.f;
+    for(int k = 0; k < 3; k++)
+    {
+      center[r] += m[k * 4 + r] * c[k];
+      extent[r] += std::abs(m[k * 4 + r]) * e[k];
+    }
+  }
+
+  float maxScale2 = 0.f;
+  for(int k = 0; k < 3; k++)
+    maxScale2 = std::max(maxScale2, m[k * 4] * m[k * 4] + m[k * 4 + 1] * m[k * 4 + 1]
+                                        + m[k * 4 + 2] * m[k * 4 + 2]);
+
+  m_centerX[instanceId] = center[0];
+  m_centerY[instanceId] = center[1];
+  m_centerZ[instanceId] = center[2];
+  m_radius[instanceId]  = std::sqrt((e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * maxScale2);
+  m_minX[instanceId]    = center[0] - extent[0];
+  m_minY[instanceId]    = center[1] - extent[1];
+  m_minZ[instanceId]    = center[2] - extent[2];
+  m_maxX[instanceId]    = center[0] + extent[0];
+  m_maxY[instanceId]    = center[1] + extent[1];
+  m_maxZ[instanceId]    = center[2] + extent[2];
+}
+
+void InstanceCuller::setUnbounded(uint32_t instanceId)
+{
+  // Large but finite: the plane distances stay positive, without infinities or NaN
+  const float kHuge = 1e30f;
+  m_centerX[instanceId] = 0.f;
+  m_centerY[instanceId] = 0.f;
+  m_centerZ[instanceId] = 0.f;
+  m_radius[instanceId]  = kHuge;
+  m_minX[instanceId]    = -kHuge;
+  m_minY[instanceId]    = -kHuge;
+  m_minZ[instanceId]    = -kHuge;
+  m_maxX[instanceId]    = kHuge;
+  m_maxY[instanceId]    = kHuge;
+  m_maxZ[instanceId]    = kHuge;
+}
+
+bool InstanceCuller::hasSimd()
+{
+#if defined(__AVX2__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Planes of the frustum from the rows of viewProj, with a [0, 1] depth range
+//
+uint32_t InstanceCuller::cull(const nvmath::mat4f& viewProj,
+                              const nvmath::vec3f& eye,
+                              float                projScale,
+                              ThreadPool*          pool,
+                              bool                 useSimd)
+{
+  float m[16];  // Column-major: row r is m[r], m[4 + r], m[8 + r], m[12 + r]
+  memcpy(m, &viewProj, sizeof(m));
+
+  Frustum frustum;
+  for(int i = 0; i < 4; i++)
+  {
+    float r0 = m[i * 4 + 0];
+    float r1 = m[i * 4 + 1];
+    float r2 = m[i * 4 + 2];
+    float r3 = m[i * 4 + 3];
+    frustum.planes[0][i] = r3 + r0;  // Left
+    frustum.planes[1][i] = r3 - r0;  // Right
+    frustum.planes[2][i] = r3 + r1;  // Top and bottom, Y is flipped by perspectiveVK
+    frustum.planes[3][i] = r3 - r1;
+    frustum.planes[4][i] = r2;       // Near
+    frustum.planes[5][i] = r3 - r2;  // Far
+  }
+  for(auto& plane : frustum.planes)
+  {
+    float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+    for(float& p : plane)
+      p /= length;
+  }
+  frustum.eye[0]    = eye.x;
+  frustum.eye[1]    = eye.y;
+  frustum.eye[2]    = eye.z;
+  frustum.projScale = std::abs(projScale);
+
+  bool simd   = useSimd && hasSimd();
+  auto kernel = [&](size_t begin, size_t end, uint32_t& nbVisible) {
+    if(simd)
+      cullSimd(begin, end, frustum, nbVisible);
+    else
+      cullScalar(begin, end, frustum, nbVisible);
+  };
+
+  uint32_t count = 0;
+  if(pool)
+  {
+    std::atomic<uint32_t> total{0};
+    pool->parallelFor(m_radius.size(), kChunkSize, [&](size_t begin, size_t end) {
+      uint32_t nbVisible = 0;
+      kernel(begin, end, nbVisible);
+      total += nbVisible;
+    });
+    count = total;
+  }
+  else
+  {
+    kernel(0, m_radius.size(), count);
+  }
+  m_nbVisible = count;
+  return count;
+}
+
+void InstanceCuller::cullScalar(size_t         begin,
+                                size_t         end,
+                                const Frustum& frustum,
+                                uint32_t&      nbVisible)
+{
+  for(size_t i = begin; i < end; i++)
+  {
+    bool culled = false;
+    for(const auto& p : frustum.planes)
+    {
+      // Sphere, then the corner of the AABB farthest along the normal
+      float d = p[0] * m_centerX[i] + p[1] * m_centerY[i] + p[2] * m_centerZ[i] + p[3];
+      float x = p[0] > 0.f ? m_maxX[i] : m_minX[i];
+      float y = p[1] > 0.f ? m_maxY[i] : m_minY[i];
+      float z = p[2] > 0.f ? m_maxZ[i] : m_minZ[i];
+      culled |= d < -m_radius[i];
+      culled |= p[0] * x + p[1] * y + p[2] * z + p[3] < 0.f;
+    }
+    if(culled)
+    {
+      m_lods[i] = kCulled;
+      continue;
+    }
+
+    float   dx   = m_centerX[i] - frustum.eye[0];
+    float   dy   = m_centerY[i] - frustum.eye[1];
+    float   dz   = m_centerZ[i] - frustum.eye[2];
+    float   dist = std::max(std::sqrt(dx * dx + dy * dy + dz * dz), 1e-6f);
+    float   size = m_radius[i] * frustum.projScale / dist;
+    uint8_t lod  = 0;
+    for(float threshold : m_lodThresholds)
+      lod += size < threshold ? 1 : 0;
+    m_lods[i] = lod;
+    nbVisible++;
+  }
+}
+
+void InstanceCuller::cullSimd(size_t         begin,
+                              size_t         end,
+                              const Frustum& frustum,
+                              uint32_t&      nbVisible)
+{
+#if defined(__AVX2__)
+  const __m256 zero      = _mm256_setzero_ps();
+  const __m256 eyeX      = _mm256_set1_ps(frustum.eye[0]);
+  const __m256 eyeY      = _mm256_set1_ps(frustum.eye[1]);
+  const __m256 eyeZ      = _mm256_set1_ps(frustum.eye[2]);
+  const __m256 projScale = _mm256_set1_ps(frustum.projScale);
+  const __m256 minDist   = _mm256_set1_ps(1e-6f);
+
+  size_t i = begin;
+  for(; i + 8 <= end; i += 8)
+  {
+    __m256 cx = _mm256_loadu_ps(&m_centerX[i]);
+    __m256 cy = _mm256_loadu_ps(&m_centerY[i]);
+    __m256 cz = _mm256_loadu_ps(&m_centerZ[i]);
+    __m256 r  = _mm256_loadu_ps(&m_radius[i]);
+
+    __m256 culled = zero;
+    for(const auto& p : frustum.planes)
+    {
+      __m256 nx = _mm256_set1_ps(p[0]);
+      __m256 ny = _mm256_set1_ps(p[1]);
+      __m256 nz = _mm256_set1_ps(p[2]);
+      __m256 nw = _mm256_set1_ps(p[3]);
+
+      // Sphere
+      __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, cx), _mm256_mul_ps(ny, cy)),
+                               _mm256_add_ps(_mm256_mul_ps(nz, cz), nw));
+      culled   = _mm256_or_ps(culled, _mm256_cmp_ps(d, _mm256_sub_ps(zero, r), _CMP_LT_OQ));
+
+      // AABB: the normal is the same for all lanes, so is the corner to pick
+      __m256 x = _mm256_loadu_ps(p[0] > 0.f ? &m_maxX[i] : &m_minX[i]);
+      __m256 y = _mm256_loadu_ps(p[1] > 0.f ? &m_maxY[i] : &m_minY[i]);
+      __m256 z = _mm256_loadu_ps(p[2] > 0.f ? &m_maxZ[i] : &m_minZ[i]);
+      __m256 e = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, x), _mm256_mul_ps(ny, y)),
+                               _mm256_add_ps(_mm256_mul_ps(nz, z), nw));
+      culled   = _mm256_or_ps(culled, _mm256_cmp_ps(e, zero, _CMP_LT_OQ));
+    }
+
+    // LOD: number of thresholds above the size on screen
+    __m256 dx   = _mm256_sub_ps(cx, eyeX);
+    __m256 dy   = _mm256_sub_ps(cy, eyeY);
+    __m256 dz   = _mm256_sub_ps(cz, eyeZ);
+    __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+    __m256  size = _mm256_div_ps(_mm256_mul_ps(r, projScale), _mm256_max_ps(dist, minDist));
+    __m256i lod  = _mm256_setzero_si256();
+    for(float threshold : m_lodThresholds)
+    {
+      __m256 smaller = _mm256_cmp_ps(size, _mm256_set1_ps(threshold), _CMP_LT_OQ);
+      lod            = _mm256_sub_epi32(lod, _mm256_castps_si256(smaller));  // -1 when true
+    }
+    lod = _mm256_blendv_epi8(lod, _mm256_set1_epi32(kCulled), _mm256_castps_si256(culled));
+
+    alignas(32) int32_t lods[8];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lods), lod);
+    for(int k = 0; k < 8; k++)
+      m_lods[i + k] = static_cast<uint8_t>(lods[k]);
+    nbVisible += 8 - static_cast<uint32_t>(std::bitset<8>(_mm256_movemask_ps(culled)).count());
+  }
+  cullScalar(i, end, frustum, nbVisible);
+#else
+  cullScalar(begin, end, frustum, nbVisible);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Best of a few runs of each variant
+//
+void InstanceCuller::benchmark(uint32_t nbInstances, ThreadPool& pool)
+{
+  InstanceCuller culler;
+  culler.resize(nbInstances);
+
+  std::mt19937                          gen(42);
+  std::uniform_real_distribution<float> disPos(-500.f, 500.f);
+  std::uniform_real_distribution<float> disScale(0.5f, 5.f);
+  std::uniform_real_distribution<float> disAngle(0.f, 2.f * nv_pi);
+  for(uint32_t i = 0; i < nbInstances; i++)
+  {
+    nvmath::mat4f mat =
+        nvmath::translation_mat4(nvmath::vec3f(disPos(gen), disPos(gen), disPos(gen)));
+    mat = mat * nvmath::rotation_mat4_y(disAngle(gen));
+    mat = mat * nvmath::scale_mat4(nvmath::vec3f(disScale(gen)));
+    culler.setBounds(i, mat, nvmath::vec3f(-1.f, -1.f, -1.f), nvmath::vec3f(1.f, 1.f, 1.f));
+  }
+
+  nvmath::vec3f eye(0.f, 0.f, 0.f);
+  nvmath::vec3f up(0.f, 1.f, 0.f);
+  nvmath::mat4f view      = nvmath::look_at(eye, nvmath::vec3f(0.f, 0.f, -1.f), up);
+  nvmath::mat4f proj      = nvmath::perspectiveVK(60.f, 16.f / 9.f, 0.1f, 1000.f);
+  float         projScale = 1.f / std::tan(30.f * nv_pi / 180.f);
+
+  auto run = [&](const char* name, ThreadPool* runPool, bool simd) {
+    double   bestUs    = 1e30;
+    uint32_t nbVisible = 0;
+    for(int iteration = 0; iteration < 10; iteration++)
+    {
+      auto startTime = std::chrono::high_resolution_clock::now();
+      nbVisible      = culler.cull(proj * view, eye, projScale, runPool, simd);
+      auto endTime   = std::chrono::high_resolution_clock::now();
+      bestUs = std::min(bestUs,
+                        std::chrono::duration<double, std::micro>(endTime - startTime).count());
+    }
+    LOGI("%-16s %8.1f us, %8.1f instances/us (%u of %u visible)\n", name, bestUs,
+         nbInstances / bestUs, nbVisible, nbInstances);
+  };
+
+  LOGI("Culling %u instances\n", nbInstances);
+  run("scalar", nullptr, false);
+  if(hasSimd())
+    run("AVX2", nullptr, true);
+  run(hasSimd() ? "AVX2, threaded" : "scalar, threaded", &pool, true);
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "nvmath/nvmath.h"
+
+#include "thread_pool.h"
+
+//--------------------------------------------------------------------------------------------------
+// Host frustum culling and LOD selection of the instances
+// - The bounds of the instances are kept in a structure of arrays: world bounding sphere and
+//   world AABB, derived from the instance transform and the AABB of its model
+// - An instance is culled when its sphere or its AABB is outside one of the frustum planes
+// - The LOD of a visible instance comes from its size on screen: the projected radius of its
+//   sphere, relative to half the viewport height. LOD i is used down to thresholds[i].
+// - cull() runs over chunks of instances on the thread pool. Built with AVX2 (INSTANCE_CULLER_AVX2
+//   in CMake), the chunks are processed 8 instances at a time
+//
+class InstanceCuller
+{
+public:
+  static constexpr uint8_t kCulled = 0xFF;
+
+  void     resize(uint32_t nbInstances);
+  uint32_t size() const { return static_cast<uint32_t>(m_radius.size()); }
+
+  // Bounds of the model in object space, placed by `transform`
+  void setBounds(uint32_t             instanceId,
+                 const nvmath::mat4f& transform,
+                 const nvmath::vec3f& bboxMin,
+                 const nvmath::vec3f& bboxMax);
+  // Never culled, always at LOD 0: bounds unknown, e.g. deforming models
+  void setUnbounded(uint32_t instanceId);
+
+  // Decreasing screen sizes, one per LOD after the first. Default: {0.25, 0.1, 0.04}
+  void     setLodThresholds(const std::vector<float>& thresholds) { m_lodThresholds = thresholds; }
+  uint32_t getNbLods() const { return static_cast<uint32_t>(m_lodThresholds.size()) + 1; }
+
+  // Returns the number of visible instances. `projScale` is proj[1][1], cot(fovy / 2).
+  // Without pool, runs on the calling thread.
+  uint32_t cull(const nvmath::mat4f& viewProj,
+                const nvmath::vec3f& eye,
+                float                projScale,
+                ThreadPool*          pool,
+                bool                 useSimd = true);
+
+  // LOD of each instance, kCulled if outside the frustum
+  const std::vector<uint8_t>& getLods() const { return m_lods; }
+  uint32_t                    getNbVisible() const { return m_nbVisible; }
+
+  static bool hasSimd();
+
+  // Random instances in front of a camera: logs instances culled per microsecond, single thread
+  // and SIMD or not, then SIMD over the thread pool
+  static void benchmark(uint32_t nbInstances, ThreadPool& pool);
+
+private:
+  struct Frustum
+  {
+    float planes[6][4];  // Normalized, inside when dot(n, p) + w >= 0
+    float eye[3];
+    float projScale;
+  };
+
+  void cullScalar(size_t begin, size_t end, const Frustum& frustum, uint32_t& nbVisible);
+  void cullSimd(size_t begin, size_t end, const Frustum& frustum, uint32_t& nbVisible);
+
+  // Structure of arrays, one entry per instance
+  std::vector<float>   m_centerX, m_centerY, m_centerZ, m_radius;      // Sphere
+  std::vector<float>   m_minX, m_minY, m_minZ, m_maxX, m_maxY, m_maxZ;  // AABB
+  std::vector<uint8_t> m_lods;
+
+  std::vector<float> m_lodThresholds{0.25f, 0.1f, 0.04f};
+  uint32_t           m_nbVisible{0};
+};
@@ -29,7 +29,11 @@
 // pipeline If you are new to ImGui, see examples/README.txt and documentation
 // at the top of imgui.cpp.
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstring>
+#include <random>
 #include <vulkan/vulkan.hpp>
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
@@ -40,10 +44,12 @@ VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 #include "imgui_camera_widget.h"
 #include "nvh/cameramanipulator.hpp"
 #include "nvh/fileoperations.hpp"
+#include "nvh/nvprint.hpp"
 #include "nvpsystem.hpp"
 #include "nvvk/appbase_vkpp.hpp"
 #include "nvvk/commands_vk.hpp"
 #include "nvvk/context_vk.hpp"
+#include "wavefront_math.h"
 
 
 //////////////////////////////////////////////////////////////////////////
@@ -85,7 +91,73 @@ static int const SAMPLE_HEIGHT = 720;
 //
 int main(int argc, char** argv)
 {
-  UNUSED(argc);
+  // Command line
+  // -scene <file>  : loads the scene file instead of the default models
+  // -genscene <N> <file>: writes a synthetic scene of N instances, binary for .sceneb, then exits
+  // -instances <N> : adds N instances of the first model, to stress the instance updates
+  // -animate       : starts with the instances moving
+  // -deform        : the first default model is dynamic and sways, its BLAS is refit each frame
+  // -cullbench <N> : logs the speed of the host culling of N instances, then exits
+  // -xformbench <N>: logs the speed of the batch inverses and packing of N transforms, then exits
+  // -bouncebench <N>: ray traces with 0 to N bounces, logs the rays/s of each, then exits
+  // -wavefrontbench: logs the speed of the shadow rays of the bounce loop and of the wavefront
+  //                  mode, unbinned and binned, then exits
+  // -binbench <N>  : logs the speed and the coherence gains of the host binning of N shadow rays,
+  //                  then exits
+  int         nbExtraInstances = 0;
+  bool        animate          = false;
+  bool        deform           = false;
+  int         nbBenchInstances = 0;
+  int         nbXformInstances = 0;
+  int         maxBenchBounces  = -1;
+  bool        wavefrontBench   = false;
+  int         nbBinRays        = 0;
+  std::string sceneFile;
+  int         nbGenInstances = 0;
+  std::string genSceneFile;
+  for(int a = 1; a < argc; a++)
+  {
+    if(strcmp(argv[a], "-scene") == 0 && a + 1 < argc)
+      sceneFile = argv[++a];
+    else if(strcmp(argv[a], "-genscene") == 0 && a + 2 < argc)
+    {
+      nbGenInstances = std::max(atoi(argv[++a]), 1);
+      genSceneFile   = argv[++a];
+    }
+    else if(strcmp(argv[a], "-instances") == 0 && a + 1 < argc)
+      nbExtraInstances = std::max(atoi(argv[++a]), 0);
+    else if(strcmp(argv[a], "-animate") == 0)
+      animate = true;
+    else if(strcmp(argv[a], "-deform") == 0)
+      deform = true;
+    else if(strcmp(argv[a], "-cullbench") == 0 && a + 1 < argc)
+      nbBenchInstances = std::max(atoi(argv[++a]), 1);
+    else if(strcmp(argv[a], "-xformbench") == 0 && a + 1 < argc)
+      nbXformInstances = std::max(atoi(argv[++a]), 1);
+    else if(strcmp(argv[a], "-bouncebench") == 0 && a + 1 < argc)
+      maxBenchBounces = std::max(atoi(argv[++a]), 0);
+    else if(strcmp(argv[a], "-wavefrontbench") == 0)
+      wavefrontBench = true;
+    else if(strcmp(argv[a], "-binbench") == 0 && a + 1 < argc)
+      nbBinRays = std::max(atoi(argv[++a]), 1);
+  }
+  if(nbGenInstances > 0)
+  {
+    SceneFile::generate(static_cast<uint32_t>(nbGenInstances)).save(genSceneFile);
+    LOGI("Scene of %d instances written to %s\n", nbGenInstances, genSceneFile.c_str());
+    return 0;
+  }
+  if(nbBenchInstances > 0 || nbXformInstances > 0 || nbBinRays > 0)
+  {
+    ThreadPool pool;
+    if(nbBenchInstances > 0)
+      InstanceCuller::benchmark(static_cast<uint32_t>(nbBenchInstances), pool);
+    if(nbXformInstances > 0)
+      TransformStore::benchmark(static_cast<uint32_t>(nbXformInstances), pool);
+    if(nbBinRays > 0)
+      benchmarkShadowBinning(static_cast<uint32_t>(nbBinRays));
+    return 0;
+  }
 
   // Setup GLFW window
   glfwSetErrorCallback(onErrorCallback);
@@ -147,6 +219,8 @@ int main(int argc, char** argv)
   contextInfo.addDeviceExtension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
   contextInfo.addDeviceExtension(VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
   contextInfo.addDeviceExtension(VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
+  // The context enables every core feature the device supports, the ones of the indirect draws
+  // (multiDrawIndirect, drawIndirectFirstInstance, drawIndirectCount) are checked before use
 
 
   // Creating Vulkan base application
@@ -168,6 +242,9 @@ int main(int argc, char** argv)
 
   helloVk.setup(vkctx.m_instance, vkctx.m_device, vkctx.m_physicalDevice,
                 vkctx.m_queueGCT.familyIndex);
+  helloVk.initQueues(vkctx.m_queueT.familyIndex, vkctx.m_queueT.queue, vkctx.m_queueC.familyIndex,
+                     vkctx.m_queueC.queue);
+  helloVk.createGeometryBuffers(1 << 20, 4 << 20);
   helloVk.createSwapchain(surface, SAMPLE_WIDTH, SAMPLE_HEIGHT);
   helloVk.createDepthBuffer();
   helloVk.createRenderPass();
@@ -176,16 +253,49 @@ int main(int argc, char** argv)
   // Setup Imgui
   helloVk.initGUI(0);  // Using sub-pass 0
 
-  // Creation of the example
-  helloVk.loadModel(nvh::findFile("media/scenes/Medieval_building.obj", defaultSearchPaths, true));
-  helloVk.loadModel(nvh::findFile("media/scenes/plane.obj", defaultSearchPaths, true));
+  // Creation of the example: the descriptor set is sized for the models, loaded in its free slots
+  helloVk.createDescriptorSetLayout(1024, 4096);
+  if(!sceneFile.empty())
+  {
+    SceneFile scene;
+    scene.load(nvh::findFile(sceneFile, defaultSearchPaths, true), helloVk.m_threadPool);
+    helloVk.loadScene(scene, defaultSearchPaths);
+  }
+  else
+  {
+    std::string building = nvh::findFile("media/scenes/Medieval_building.obj", defaultSearchPaths,
+                                         true);
+    std::string plane    = nvh::findFile("media/scenes/plane.obj", defaultSearchPaths, true);
+    helloVk.addInstance(helloVk.loadModel(building, deform));
+    uint32_t ground = helloVk.addInstance(helloVk.loadModel(plane));
+    // Nothing is under the ground: its shadows are never seen, the shadow rays skip it
+    helloVk.setInstanceMask(ground, HelloVulkan::kMaskPrimary | HelloVulkan::kMaskReflection);
+  }
+
+  // Many small copies of the first model, scattered over the plane
+  uint32_t nbLoadedInstances = static_cast<uint32_t>(helloVk.m_objInstance.size());
+  std::mt19937                          gen(42);
+  std::uniform_real_distribution<float> disPos(-20.f, 20.f);
+  std::uniform_real_distribution<float> disScale(0.02f, 0.1f);
+  std::uniform_real_distribution<float> disAngle(0.f, 2.f * nv_pi);
+  for(int n = 0; n < nbExtraInstances; n++)
+  {
+    nvmath::mat4f mat = nvmath::translation_mat4(nvmath::vec3f(disPos(gen), 0.f, disPos(gen)));
+    mat               = mat * nvmath::rotation_mat4_y(disAngle(gen));
+    mat               = mat * nvmath::scale_mat4(nvmath::vec3f(disScale(gen)));
+    helloVk.addInstance(helloVk.m_objInstance[0].objIndex, mat);
+  }
+  // Animating the extra instances, or the first model if there are none
+  uint32_t firstAnimated = nbExtraInstances > 0 ? nbLoadedInstances : 0;
+  uint32_t nbAnimated    = nbExtraInstances > 0 ? nbExtraInstances : 1;
 
 
   helloVk.createOffscreenRender();
-  helloVk.createDescriptorSetLayout();
   helloVk.createGraphicsPipeline();
   helloVk.createUniformBuffer();
   helloVk.createSceneDescriptionBuffer();
+  helloVk.createDrawBuffer();
+  helloVk.createCullPass();
   helloVk.updateDescriptorSet();
 
   // #VKRay
@@ -195,6 +305,7 @@ int main(int argc, char** argv)
   helloVk.createRtDescriptorSet();
   helloVk.createRtPipeline();
   helloVk.createRtShaderBindingTable();
+  helloVk.m_alloc.logStats();
 
   helloVk.createPostDescriptor();
   helloVk.createPostPipeline();
@@ -203,6 +314,41 @@ int main(int argc, char** argv)
 
   nvmath::vec4f clearColor   = nvmath::vec4f(1, 1, 1, 1.00f);
   bool          useRaytracer = true;
+  float         animTime     = 0.f;
+  double        animMs       = 0.;  // Host time to animate and record the instance updates
+  float         deformTime   = 0.f;
+  double        deformMs     = 0.;  // Host time to deform, upload and record the BLAS refits
+  double        rasterMs     = 0.;  // Host time to record the raster draws
+  double        lodMs        = 0.;  // Host time to cull the instances and select their LOD
+
+  // Ray tracing benchmarks: frames of each configuration, the first ones still timing the
+  // previous configuration
+  struct BenchConfig
+  {
+    std::string name;
+    int         bounces{0};
+    bool        wavefront{false};
+    bool        sortShadows{true};
+  };
+  struct BenchTotals
+  {
+    double ms{0.}, nbRays{0.}, primaryMs{0.}, binMs{0.}, shadowMs{0.}, nbShadowRays{0.};
+  };
+  const int                kBenchWarmup = 8;
+  const int                kBenchFrames = 64;
+  std::vector<BenchConfig> benchConfigs;
+  for(int bounces = 0; bounces <= maxBenchBounces; bounces++)
+    benchConfigs.push_back({"Bounces " + std::to_string(bounces), bounces, false, true});
+  if(wavefrontBench)
+  {
+    benchConfigs.push_back({"Shadow rays from the bounce loop", 0, false, true});
+    benchConfigs.push_back({"Wavefront, shadow rays in pixel order", 0, true, false});
+    benchConfigs.push_back({"Wavefront, binned shadow rays", 0, true, true});
+  }
+  size_t      benchConfig = 0;
+  int         benchFrame  = 0;
+  BenchTotals benchTotals;
+  double      pixelOrderShadowMs = 0.;
 
 
   helloVk.setupGlfwCallbacks(window);
@@ -226,8 +372,95 @@ int main(int argc, char** argv)
       ImGuiH::Panel::Begin();
       ImGui::ColorEdit3("Clear color", reinterpret_cast<float*>(&clearColor));
       ImGui::Checkbox("Ray Tracer mode", &useRaytracer);  // Switch between raster and ray tracing
+      if(useRaytracer)
+      {
+        ImGui::Checkbox("Wavefront (binned shadow rays)", &helloVk.m_rtWavefront);
+        if(helloVk.m_rtWavefront)
+        {
+          ImGui::Checkbox("Sort shadow rays", &helloVk.m_rtSortShadows);
+          ImGui::SliderFloat("Bin grid size", &helloVk.m_rtBinExtent, 1.f, 200.f);
+        }
+        else
+          ImGui::SliderInt("Bounces", &helloVk.m_rtMaxBounces, 0, 8);
+      }
+      if(useRaytracer && helloVk.m_rtTimeMs > 0.)
+      {
+        double nbPixels = double(helloVk.getSize().width) * helloVk.getSize().height;
+        ImGui::Text("Ray trace: %.3f ms, %.2f rays/pixel, %.0f M rays/s", helloVk.m_rtTimeMs,
+                    helloVk.m_rtNbRays / nbPixels, helloVk.m_rtNbRays / (helloVk.m_rtTimeMs * 1e3));
+        if(helloVk.m_rtWavefront && helloVk.m_rtShadowMs > 0.)
+          ImGui::Text("Camera %.3f ms, binning %.3f ms, shadows %.3f ms, %.0f M shadow rays/s",
+                      helloVk.m_rtPrimaryMs, helloVk.m_rtBinMs, helloVk.m_rtShadowMs,
+                      helloVk.m_wavefront.getNbShadowRays() / (helloVk.m_rtShadowMs * 1e3));
+      }
 
       renderUI(helloVk);
+      if(ImGui::CollapsingHeader("Memory"))
+      {
+        PoolAllocator::Stats mem = helloVk.m_alloc.getStats();
+        ImGui::Text("%u resources in %u allocations (%u dedicated)", mem.nbAllocations,
+                    mem.nbBlocks, mem.nbDedicated);
+        ImGui::Text("%.1f MB used of %.1f MB, fragmentation %.0f%%", mem.usedBytes / 1048576.0,
+                    mem.blockBytes / 1048576.0, 100.f * mem.fragmentation);
+        ImGui::Text("%.1f MB uploaded (%s)", helloVk.m_uploads.getUploadedBytes() / 1048576.0,
+                    helloVk.m_uploads.hasTransferQueue() ? "transfer queue" : "graphics queue");
+        ImGui::Text("%u of %u BLAS ready", helloVk.m_blasBuilder.getNbReady(),
+                    helloVk.m_blasBuilder.getNbBlas());
+        ImGui::Text("Scene tables: %u of %u objects, %u of %u textures",
+                    helloVk.m_scene.getNbObjects(), helloVk.m_scene.getMaxObjects(),
+                    helloVk.m_scene.getNbTextures(), helloVk.m_scene.getMaxTextures());
+        ImGui::Text("Models: %u, %u loads shared a loaded model",
+                    helloVk.m_modelRegistry.getNbModels(), helloVk.m_modelRegistry.getNbShared());
+      }
+      if(ImGui::CollapsingHeader("Animation"))
+      {
+        ImGui::Checkbox("Animate instances", &animate);
+        ImGui::Text("%u moving instances: %.3f ms", nbAnimated, animMs);
+        ImGui::Text("TLAS: %u updates, %u rebuilds, degradation %.3f",
+                    helloVk.m_tlasBuilder.getNbUpdates(), helloVk.m_tlasBuilder.getNbRebuilds(),
+                    helloVk.m_tlasBuilder.getDegradation());
+      }
+      if(helloVk.m_objModel[0].dynamic && ImGui::CollapsingHeader("Deformation"))
+      {
+        ImGui::Checkbox("Deform model", &deform);
+        ImGui::Text("Deform and refit: %.3f ms", deformMs);
+        ImGui::Text("BLAS: %u refits, %u rebuilds, %u deferred",
+                    helloVk.m_blasBuilder.getNbRefits(), helloVk.m_blasBuilder.getNbRebuilds(),
+                    helloVk.m_blasBuilder.getNbDirty());
+      }
+      if(!useRaytracer && ImGui::CollapsingHeader("Raster"))
+      {
+        ImGui::Checkbox("Indirect draws", &helloVk.m_useIndirectDraws);
+        ImGui::Text("%u draws recorded in %.3f ms", static_cast<uint32_t>(helloVk.m_draws.size()),
+                    rasterMs);
+        ImGui::Checkbox("GPU culling", &helloVk.m_useCulling);
+        if(helloVk.isCulling())
+        {
+          ImGui::Text("%u draws visible, %u in the frustum (host)",
+                      helloVk.m_cullPass.getNbVisible(), helloVk.countFrustumVisible());
+        }
+        else
+        {
+          ImGui::Checkbox("Host culling", &helloVk.m_useHostCulling);
+        }
+        if(helloVk.isHostCulling())
+          ImGui::Text("%u instances visible", helloVk.m_instanceCuller.getNbVisible());
+      }
+      if(ImGui::CollapsingHeader("LOD"))
+      {
+        const InstanceCuller& culler = helloVk.m_instanceCuller;
+        ImGui::Checkbox("Use LODs", &helloVk.m_useLods);
+        ImGui::Text("Culled and selected in %.3f ms (%s)", lodMs,
+                    InstanceCuller::hasSimd() ? "AVX2" : "scalar");
+        uint32_t full = std::max(helloVk.m_nbFullTriangles, 1u);
+        ImGui::Text("%u triangles, %u at full resolution (%.0f%%)", helloVk.m_nbDrawnTriangles,
+                    helloVk.m_nbFullTriangles, 100.f * helloVk.m_nbDrawnTriangles / full);
+        std::vector<uint32_t> nbPerLod(culler.getNbLods(), 0);
+        for(uint8_t lod : helloVk.m_instanceLod)
+          nbPerLod[std::min<uint32_t>(lod, culler.getNbLods() - 1)]++;
+        for(uint32_t lod = 0; lod < culler.getNbLods(); lod++)
+          ImGui::Text("  LOD %u: %u instances", lod, nbPerLod[lod]);
+      }
       ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
                   1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
@@ -235,8 +468,54 @@ int main(int argc, char** argv)
       ImGuiH::Panel::End();
     }
 
-    // Start rendering the scene
+    // Hand over the uploads done on the transfer queue, move the BLAS builds of the compute
+    // queue forward: models join the scene as they get ready
+    helloVk.updateResidency();
+
+    // Start rendering the scene. The frame waited for is done: slots freed by the scene can be
+    // reused once all the frames in flight went by.
     helloVk.prepareFrame();
+    helloVk.m_scene.nextFrame();
+    helloVk.updateRtTimer();
+    if(benchConfig < benchConfigs.size())
+    {
+      const BenchConfig& config = benchConfigs[benchConfig];
+      useRaytracer              = true;
+      helloVk.m_rtMaxBounces    = config.bounces;
+      helloVk.m_rtWavefront     = config.wavefront;
+      helloVk.m_rtSortShadows   = config.sortShadows;
+      if(++benchFrame > kBenchWarmup)
+      {
+        benchTotals.ms += helloVk.m_rtTimeMs;
+        benchTotals.nbRays += helloVk.m_rtNbRays;
+        benchTotals.primaryMs += helloVk.m_rtPrimaryMs;
+        benchTotals.binMs += helloVk.m_rtBinMs;
+        benchTotals.shadowMs += helloVk.m_rtShadowMs;
+        benchTotals.nbShadowRays += helloVk.m_wavefront.getNbShadowRays();
+      }
+      if(benchFrame == kBenchWarmup + kBenchFrames)
+      {
+        LOGI("%s: %.3f ms, %.2f M rays/frame, %.0f M rays/s\n", config.name.c_str(),
+             benchTotals.ms / kBenchFrames, benchTotals.nbRays / kBenchFrames * 1e-6,
+             benchTotals.nbRays / (benchTotals.ms * 1e3));
+        if(config.wavefront)
+        {
+          LOGI("  camera rays %.3f ms, binning %.3f ms, shadow rays %.3f ms (%.0f M rays/s)\n",
+               benchTotals.primaryMs / kBenchFrames, benchTotals.binMs / kBenchFrames,
+               benchTotals.shadowMs / kBenchFrames,
+               benchTotals.nbShadowRays / (benchTotals.shadowMs * 1e3));
+          if(!config.sortShadows)
+            pixelOrderShadowMs = benchTotals.shadowMs;
+          else if(pixelOrderShadowMs > 0.)
+            LOGI("  binned shadow rays: %.2fx the speed of the pixel order\n",
+                 pixelOrderShadowMs / benchTotals.shadowMs);
+        }
+        benchFrame  = 0;
+        benchTotals = BenchTotals();
+        if(++benchConfig == benchConfigs.size())
+          glfwSetWindowShouldClose(window, GLFW_TRUE);
+      }
+    }
 
     // Start command buffer of this frame
     auto                     curFrame = helloVk.getCurFrame();
@@ -244,8 +523,39 @@ int main(int argc, char** argv)
 
     cmdBuf.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
-    // Updating camera buffer
+    // Updating camera buffer, and the objects added to the scene
     helloVk.updateUniformBuffer(cmdBuf);
+    helloVk.m_scene.cmdUpdateTable(cmdBuf);
+
+    // Deforming models: vertices and BLAS, before the TLAS update which uses their bounds
+    {
+      auto startTime = std::chrono::high_resolution_clock::now();
+      if(deform)
+      {
+        deformTime += ImGui::GetIO().DeltaTime;
+        helloVk.deformModel(deformTime, 0);
+      }
+      helloVk.updateDynamicGeometry(cmdBuf);
+      auto endTime = std::chrono::high_resolution_clock::now();
+      deformMs     = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
+
+    // Moving instances: scene description and TLAS
+    {
+      auto startTime = std::chrono::high_resolution_clock::now();
+      if(animate)
+      {
+        animTime += ImGui::GetIO().DeltaTime;
+        helloVk.animateInstances(animTime, firstAnimated, nbAnimated);
+      }
+      auto lodStart = std::chrono::high_resolution_clock::now();
+      helloVk.updateLods();
+      auto lodEnd = std::chrono::high_resolution_clock::now();
+      lodMs       = std::chrono::duration<double, std::milli>(lodEnd - lodStart).count();
+      helloVk.updateInstances(cmdBuf);
+      auto endTime = std::chrono::high_resolution_clock::now();
+      animMs       = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
 
     // Clearing screen
     vk::ClearValue clearValues[2];
@@ -269,9 +579,14 @@ int main(int argc, char** argv)
       }
       else
       {
+        helloVk.cullDraws(cmdBuf);
         cmdBuf.beginRenderPass(offscreenRenderPassBeginInfo, vk::SubpassContents::eInline);
+        auto startTime = std::chrono::high_resolution_clock::now();
         helloVk.rasterize(cmdBuf);
+        auto endTime = std::chrono::high_resolution_clock::now();
+        rasterMs     = std::chrono::duration<double, std::milli>(endTime - startTime).count();
         cmdBuf.endRenderPass();
+        helloVk.buildHiZ(cmdBuf);
       }
     }
 
@@ -0,0 +1,461 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+#include "mesh_simplifier.h"
+
+// Weight of the planes along the borders, relative to the planes of the triangles
+static const double kBorderWeight = 10.;
+// A collapse is rejected when a triangle normal turns by more than about 78 degrees
+static const float kMinNormalDot = 0.2f;
+
+void MeshSimplifier::Quadric::addPlane(const nvmath::vec3f& n, float d, double weight)
+{
+  a[0] += weight * n.x * n.x;
+  a[1] += weight * n.x * n.y;
+  a[2] += weight * n.x * n.z;
+  a[3] += weight * n.x * d;
+  a[4] += weight * n.y * n.y;
+  a[5] += weight * n.y * n.z;
+  a[6] += weight * n.y * d;
+  a[7] += weight * n.z * n.z;
+  a[8] += weight * n.z * d;
+  a[9] += weight * d * d;
+}
+
+void MeshSimplifier::Quadric::add(const Quadric& q)
+{
+  for(int i = 0; i < 10; i++)
+    a[i] += q.a[i];
+}
+
+double MeshSimplifier::Quadric::evaluate(const nvmath::vec3f& p) const
+{
+  double x = p.x, y = p.y, z = p.z;
+  double e = a[0] * x * x + 2. * a[1] * x * y + 2. * a[2] * x * z + 2. * a[3] * x + a[4] * y * y
+             + 2. * a[5] * y * z + 2. * a[6] * y + a[7] * z * z + 2. * a[8] * z + a[9];
+  return std::max(e, 0.);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Welds the positions, finds the borders and sums the quadrics of each position
+//
+MeshSimplifier::MeshSimplifier(const std::vector<VertexObj>& vertices,
+                               const std::vector<uint32_t>&  indices,
+                               const std::vector<uint32_t>&  matIndices,
+                               const Settings&               settings)
+    : m_vertices(vertices)
+    , m_settings(settings)
+{
+  // Model scaled to a unit diagonal: the costs do not depend on its size
+  nvmath::vec3f bboxMin(FLT_MAX), bboxMax(-FLT_MAX);
+  for(const VertexObj& v : vertices)
+  {
+    bboxMin = nvmath::vec3f(std::min(bboxMin.x, v.pos.x), std::min(bboxMin.y, v.pos.y),
+                            std::min(bboxMin.z, v.pos.z));
+    bboxMax = nvmath::vec3f(std::max(bboxMax.x, v.pos.x), std::max(bboxMax.y, v.pos.y),
+                            std::max(bboxMax.z, v.pos.z));
+  }
+  float diagonal = vertices.empty() ? 0.f : nvmath::length(bboxMax - bboxMin);
+  m_scale        = diagonal > 0.f ? 1.f / diagonal : 1.f;
+
+  // Weld: vertices sorted by position, one position per run of equal ones
+  std::vector<uint32_t> order(vertices.size());
+  for(uint32_t i = 0; i < static_cast<uint32_t>(order.size()); i++)
+    order[i] = i;
+  auto lessPos = [&](uint32_t a, uint32_t b) {
+    const nvmath::vec3f& pa = vertices[a].pos;
+    const nvmath::vec3f& pb = vertices[b].pos;
+    if(pa.x != pb.x)
+      return pa.x < pb.x;
+    if(pa.y != pb.y)
+      return pa.y < pb.y;
+    return pa.z < pb.z;
+  };
+  std::sort(order.begin(), order.end(), lessPos);
+  m_posOf.resize(vertices.size());
+  for(size_t i = 0; i < order.size(); i++)
+  {
+    uint32_t vertex = order[i];
+    if(i == 0 || lessPos(order[i - 1], vertex))
+    {
+      m_positions.push_back((vertices[vertex].pos - bboxMin) * m_scale);
+      m_candidates.emplace_back();
+    }
+    uint32_t pos    = static_cast<uint32_t>(m_positions.size()) - 1;
+    m_posOf[vertex] = pos;
+
+    // Vertices with the same attributes are interchangeable: one candidate for all of them
+    bool known = false;
+    for(uint32_t c : m_candidates[pos])
+      known = known || attributeDistance(c, vertex) == 0.f;
+    if(!known)
+      m_candidates[pos].push_back(vertex);
+  }
+
+  size_t nbPositions = m_positions.size();
+  m_posTriangles.resize(nbPositions);
+  m_quadrics.resize(nbPositions);
+  m_border.assign(nbPositions, 0);
+  m_removed.assign(nbPositions, 0);
+
+  // Triangles and their planes
+  uint32_t nbTriangles = static_cast<uint32_t>(indices.size() / 3);
+  m_triangles.reserve(nbTriangles);
+  std::vector<nvmath::vec3f> normals(nbTriangles);
+  for(uint32_t t = 0; t < nbTriangles; t++)
+  {
+    Triangle triangle;
+    for(int k = 0; k < 3; k++)
+      triangle.corners[k] = indices[3 * t + k];
+    triangle.material = t < matIndices.size() ? matIndices[t] : 0;
+    m_triangles.push_back(triangle);
+
+    const nvmath::vec3f& p0 = m_positions[getPos(triangle.corners[0])];
+    const nvmath::vec3f& p1 = m_positions[getPos(triangle.corners[1])];
+    const nvmath::vec3f& p2 = m_positions[getPos(triangle.corners[2])];
+    nvmath::vec3f        n   = nvmath::cross(p1 - p0, p2 - p0);
+    float                len = nvmath::length(n);
+    if(len > 0.f)
+    {
+      n /= len;
+      for(int k = 0; k < 3; k++)
+        m_quadrics[getPos(triangle.corners[k])].addPlane(n, -nvmath::dot(n, p0), 1.);
+    }
+    normals[t] = n;
+    for(int k = 0; k < 3; k++)
+      m_posTriangles[getPos(triangle.corners[k])].push_back(t);
+  }
+  m_nbTriangles = nbTriangles;
+
+  // Borders: edges of one triangle, of more than two, or between two materials
+  struct Edge
+  {
+    uint32_t a, b, triangle;
+    bool     operator<(const Edge& e) const { return a != e.a ? a < e.a : b < e.b; }
+  };
+  std::vector<Edge> edges;
+  edges.reserve(3 * nbTriangles);
+  for(uint32_t t = 0; t < nbTriangles; t++)
+  {
+    for(int k = 0; k < 3; k++)
+    {
+      uint32_t a = getPos(m_triangles[t].corners[k]);
+      uint32_t b = getPos(m_triangles[t].corners[(k + 1) % 3]);
+      if(a != b)
+        edges.push_back({std::min(a, b), std::max(a, b), t});
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  for(size_t first = 0; first < edges.size();)
+  {
+    size_t last = first + 1;
+    while(last < edges.size() && !(edges[first] < edges[last]))
+      last++;
+    bool border = (last - first) != 2;
+    if(!border)
+      border = m_triangles[edges[first].triangle].material
+               != m_triangles[edges[first + 1].triangle].material;
+    if(border)
+    {
+      // Planes through the edge, perpendicular to its triangles: moving off the border costs
+      const nvmath::vec3f& pa = m_positions[edges[first].a];
+      const nvmath::vec3f& pb = m_positions[edges[first].b];
+      for(size_t e = first; e < last; e++)
+      {
+        nvmath::vec3f n   = nvmath::cross(pb - pa, normals[edges[e].triangle]);
+        float         len = nvmath::length(n);
+        if(len == 0.f)
+          continue;
+        n /= len;
+        m_quadrics[edges[e].a].addPlane(n, -nvmath::dot(n, pa), kBorderWeight);
+        m_quadrics[edges[e].b].addPlane(n, -nvmath::dot(n, pa), kBorderWeight);
+      }
+      m_border[edges[first].a] = 1;
+      m_border[edges[first].b] = 1;
+    }
+    first = last;
+  }
+
+  for(uint32_t pos = 0; pos < static_cast<uint32_t>(nbPositions); pos++)
+    pushCollapses(pos, false);
+}
+
+float MeshSimplifier::attributeDistance(uint32_t a, uint32_t b) const
+{
+  const VertexObj& va = m_vertices[a];
+  const VertexObj& vb = m_vertices[b];
+  nvmath::vec3f    dn = va.nrm - vb.nrm;
+  nvmath::vec3f    dc = va.color - vb.color;
+  nvmath::vec2f    dt = va.texCoord - vb.texCoord;
+  return nvmath::dot(dn, dn) + nvmath::dot(dc, dc) + nvmath::dot(dt, dt);
+}
+
+uint32_t MeshSimplifier::closestVertex(uint32_t vertex, uint32_t pos) const
+{
+  uint32_t best     = m_candidates[pos][0];
+  float    bestDist = FLT_MAX;
+  for(uint32_t c : m_candidates[pos])
+  {
+    float dist = attributeDistance(vertex, c);
+    if(dist < bestDist)
+    {
+      best     = c;
+      bestDist = dist;
+    }
+  }
+  return best;
+}
+
+void MeshSimplifier::getNeighbours(uint32_t pos, std::vector<uint32_t>& neighbours) const
+{
+  neighbours.clear();
+  for(uint32_t t : m_posTriangles[pos])
+  {
+    if(m_triangles[t].removed)
+      continue;
+    for(uint32_t corner : m_triangles[t].corners)
+      if(getPos(corner) != pos)
+        neighbours.push_back(getPos(corner));
+  }
+  std::sort(neighbours.begin(), neighbours.end());
+  neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Cost of moving `from` onto `to`: quadric error at `to`, plus the attribute changes of the
+// corners moved
+//
+double MeshSimplifier::evaluate(uint32_t from, uint32_t to, double& geometric)
+{
+  const double kRejected = std::numeric_limits<double>::infinity();
+
+  // Triangles of the edge, and whether it is a border
+  uint32_t nbShared  = 0;
+  uint32_t materials[2]{};
+  for(uint32_t t : m_posTriangles[from])
+  {
+    const Triangle& triangle = m_triangles[t];
+    if(triangle.removed)
+      continue;
+    for(uint32_t corner : triangle.corners)
+    {
+      if(getPos(corner) == to)
+      {
+        if(nbShared < 2)
+          materials[nbShared] = triangle.material;
+        nbShared++;
+      }
+    }
+  }
+  if(nbShared == 0)
+    return kRejected;  // No longer an edge
+  bool borderEdge = nbShared != 2 || materials[0] != materials[1];
+  if(m_border[from] && !borderEdge)
+    return kRejected;  // Would move a border vertex off its border
+
+  Quadric q = m_quadrics[from];
+  q.add(m_quadrics[to]);
+  geometric = q.evaluate(m_positions[to]);
+
+  double attributes = 0.;
+  for(uint32_t t : m_posTriangles[from])
+  {
+    const Triangle& triangle = m_triangles[t];
+    if(triangle.removed)
+      continue;
+    nvmath::vec3f before[3], after[3];
+    bool          hasTo = false;
+    for(int k = 0; k < 3; k++)
+    {
+      uint32_t pos = getPos(triangle.corners[k]);
+      hasTo        = hasTo || pos == to;
+      before[k]    = m_positions[pos];
+      after[k]     = pos == from ? m_positions[to] : before[k];
+    }
+    if(hasTo)
+      continue;  // Removed by the collapse
+
+    nvmath::vec3f nBefore = nvmath::cross(before[1] - before[0], before[2] - before[0]);
+    nvmath::vec3f nAfter  = nvmath::cross(after[1] - after[0], after[2] - after[0]);
+    float         lenSq   = nvmath::dot(nBefore, nBefore) * nvmath::dot(nAfter, nAfter);
+    if(lenSq > 0.f && nvmath::dot(nBefore, nAfter) <= kMinNormalDot * std::sqrt(lenSq))
+      return kRejected;
+    if(lenSq == 0.f && nvmath::dot(nBefore, nBefore) > 0.f)
+      return kRejected;  // Degenerates
+
+    for(uint32_t corner : triangle.corners)
+      if(getPos(corner) == from)
+        attributes += attributeDistance(corner, closestVertex(corner, to));
+  }
+
+  // Link condition: the edge has as many common neighbours as triangles, else the collapse
+  // pinches the surface
+  getNeighbours(from, m_neighbours[0]);
+  getNeighbours(to, m_neighbours[1]);
+  uint32_t nbCommon = 0;
+  for(size_t i = 0, j = 0; i < m_neighbours[0].size() && j < m_neighbours[1].size();)
+  {
+    if(m_neighbours[0][i] == m_neighbours[1][j])
+    {
+      nbCommon++;
+      i++;
+      j++;
+    }
+    else if(m_neighbours[0][i] < m_neighbours[1][j])
+      i++;
+    else
+      j++;
+  }
+  if(nbCommon > std::min(nbShared, 2u))
+    return kRejected;
+
+  return geometric + m_settings.attributeWeight * attributes;
+}
+
+void MeshSimplifier::collapse(uint32_t from, uint32_t to)
+{
+  for(uint32_t t : m_posTriangles[from])
+  {
+    Triangle& triangle = m_triangles[t];
+    if(triangle.removed)
+      continue;
+    bool hasTo = false;
+    for(uint32_t corner : triangle.corners)
+      hasTo = hasTo || getPos(corner) == to;
+    if(hasTo)
+    {
+      triangle.removed = true;
+      m_nbTriangles--;
+      continue;
+    }
+    for(uint32_t& corner : triangle.corners)
+      if(getPos(corner) == from)
+        corner = closestVertex(corner, to);
+    m_posTriangles[to].push_back(t);
+  }
+  m_posTriangles[from].clear();
+  m_removed[from] = 1;
+  m_quadrics[to].add(m_quadrics[from]);
+
+  std::vector<uint32_t>& triangles = m_posTriangles[to];
+  triangles.erase(std::remove_if(triangles.begin(), triangles.end(),
+                                 [&](uint32_t t) { return m_triangles[t].removed; }),
+                  triangles.end());
+  pushCollapses(to, true);
+}
+
+// Collapses of `pos` onto its neighbours, and of the neighbours onto `pos` if `both`
+void MeshSimplifier::pushCollapses(uint32_t pos, bool both)
+{
+  std::vector<uint32_t> neighbours;
+  getNeighbours(pos, neighbours);
+  for(uint32_t n : neighbours)
+  {
+    double geometric = 0.;
+    double cost      = evaluate(pos, n, geometric);
+    if(cost < std::numeric_limits<double>::infinity())
+      m_heap.push({cost, pos, n});
+    cost = both ? evaluate(n, pos, geometric) : std::numeric_limits<double>::infinity();
+    if(cost < std::numeric_limits<double>::infinity())
+      m_heap.push({cost, n, pos});
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Cheapest collapse first. Costs in the heap can be stale: each collapse is evaluated again
+// when popped, and pushed back if it got more expensive.
+//
+void MeshSimplifier::simplify(uint32_t nbTriangles)
+{
+  double maxCost = double(m_settings.maxError) * m_settings.maxError;
+  while(m_nbTriangles > nbTriangles && !m_heap.empty())
+  {
+    Collapse c = m_heap.top();
+    m_heap.pop();
+    if(m_removed[c.from] || m_removed[c.to])
+      continue;
+
+    double geometric = 0.;
+    double cost      = evaluate(c.from, c.to, geometric);
+    if(cost == std::numeric_limits<double>::infinity())
+      continue;
+    if(cost > c.cost * 1.0001 + 1e-12)
+    {
+      m_heap.push({cost, c.from, c.to});
+      continue;
+    }
+    if(cost > maxCost)
+    {
+      m_heap.push({cost, c.from, c.to});
+      break;
+    }
+    collapse(c.from, c.to);
+    m_maxGeometric = std::max(m_maxGeometric, geometric);
+  }
+}
+
+MeshLod MeshSimplifier::getLod() const
+{
+  MeshLod lod;
+  lod.indices.reserve(3 * m_nbTriangles);
+  lod.matIndices.reserve(m_nbTriangles);
+  for(const Triangle& triangle : m_triangles)
+  {
+    if(triangle.removed)
+      continue;
+    lod.indices.insert(lod.indices.end(), triangle.corners, triangle.corners + 3);
+    lod.matIndices.push_back(triangle.material);
+  }
+  lod.error = static_cast<float>(std::sqrt(m_maxGeometric)) / m_scale;
+  return lod;
+}
+
+std::vector<MeshLod> buildLodChain(const std::vector<VertexObj>&   vertices,
+                                   const std::vector<uint32_t>&    indices,
+                                   const std::vector<uint32_t>&    matIndices,
+                                   const std::vector<float>&       ratios,
+                                   const MeshSimplifier::Settings& settings)
+{
+  std::vector<MeshLod> lods;
+  MeshSimplifier       simplifier(vertices, indices, matIndices, settings);
+  uint32_t             nbTriangles = static_cast<uint32_t>(indices.size() / 3);
+  uint32_t             previous    = nbTriangles;
+  for(float ratio : ratios)
+  {
+    simplifier.simplify(static_cast<uint32_t>(nbTriangles * ratio));
+    if(simplifier.getNbTriangles() * 5 > previous * 4)
+      break;
+    previous = simplifier.getNbTriangles();
+    lods.push_back(simplifier.getLod());
+  }
+  return lods;
+}
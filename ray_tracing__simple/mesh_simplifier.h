@@ -0,0 +1,141 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "nvmath/nvmath.h"
+#include "obj_loader.h"
+
+//--------------------------------------------------------------------------------------------------
+// Simplification of the OBJ models into levels of detail, by edge collapses ordered by the
+// quadric error metric (Garland and Heckbert)
+// - Half-edge collapses: a vertex moves onto one of its neighbours, so a LOD is only a new list
+//   of triangles over the vertices of the model, and all the LODs share its vertex buffer
+// - The OBJ vertices are per corner: the topology comes from welding the positions. A corner
+//   moved by a collapse takes the vertex of its new position with the closest attributes
+//   (normal, UV, color), and the attribute change is added to the cost of the collapse.
+// - Open borders and borders between materials are kept: their vertices only move along them,
+//   and planes perpendicular to them are added to the quadrics
+// - Collapses folding a triangle over, or making the mesh non-manifold, are rejected
+// - Costs are computed on the model scaled to a unit diagonal
+//
+
+// One level of detail of a model
+struct MeshLod
+{
+  std::vector<uint32_t> indices;     // Vertices of the model, 3 per triangle
+  std::vector<uint32_t> matIndices;  // Material of each triangle
+  float                 error{0.f};  // Largest distance to the planes of the model, object units
+};
+
+class MeshSimplifier
+{
+public:
+  struct Settings
+  {
+    float attributeWeight{0.01f};  // Cost of a squared attribute change: normals, UV and color
+    float maxError{0.05f};         // Largest error of a collapse, relative to the model size
+  };
+
+  // The vertices must outlive the simplifier
+  MeshSimplifier(const std::vector<VertexObj>& vertices,
+                 const std::vector<uint32_t>&  indices,
+                 const std::vector<uint32_t>&  matIndices,
+                 const Settings&               settings);
+
+  // Collapses edges until at most `nbTriangles` remain, or the cheapest collapse is over
+  // maxError. A later call with a lower target continues from there.
+  void     simplify(uint32_t nbTriangles);
+  uint32_t getNbTriangles() const { return m_nbTriangles; }
+  MeshLod  getLod() const;
+
+private:
+  // Symmetric 4x4 matrix of the squared distance to a set of planes
+  struct Quadric
+  {
+    double a[10]{};
+
+    void   addPlane(const nvmath::vec3f& n, float d, double weight);
+    void   add(const Quadric& q);
+    double evaluate(const nvmath::vec3f& p) const;
+  };
+
+  struct Triangle
+  {
+    uint32_t corners[3];  // Vertices of the model
+    uint32_t material{0};
+    bool     removed{false};
+  };
+
+  struct Collapse
+  {
+    double   cost;
+    uint32_t from;  // Position removed
+    uint32_t to;
+    bool     operator>(const Collapse& other) const { return cost > other.cost; }
+  };
+
+  // Infinite when the collapse is not allowed. `geometric` is the quadric part of the cost.
+  double   evaluate(uint32_t from, uint32_t to, double& geometric);
+  void     collapse(uint32_t from, uint32_t to);
+  void     pushCollapses(uint32_t pos, bool both);
+  void     getNeighbours(uint32_t pos, std::vector<uint32_t>& neighbours) const;
+  uint32_t getPos(uint32_t vertex) const { return m_posOf[vertex]; }
+  uint32_t closestVertex(uint32_t vertex, uint32_t pos) const;
+  float    attributeDistance(uint32_t a, uint32_t b) const;
+
+  const std::vector<VertexObj>& m_vertices;
+  Settings                      m_settings;
+  float                         m_scale{1.f};  // Object units to unit diagonal
+
+  // Welded positions
+  std::vector<uint32_t>              m_posOf;         // Position of each vertex of the model
+  std::vector<nvmath::vec3f>         m_positions;     // Scaled
+  std::vector<std::vector<uint32_t>> m_candidates;    // Vertices of distinct attributes
+  std::vector<std::vector<uint32_t>> m_posTriangles;  // Triangles using each position
+  std::vector<Quadric>               m_quadrics;
+  std::vector<uint8_t>               m_border;   // On an open or material border
+  std::vector<uint8_t>               m_removed;  // Collapsed onto a neighbour
+
+  std::vector<Triangle> m_triangles;
+  uint32_t              m_nbTriangles{0};
+  double                m_maxGeometric{0.};  // Largest quadric cost of the collapses done
+
+  std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> m_heap;
+  std::vector<uint32_t> m_neighbours[2];  // Scratch of evaluate()
+};
+
+// LODs 1 and up of a model: LOD i keeps about `ratios[i - 1]` of the triangles of the model.
+// The chain stops at the first LOD which cannot remove a fifth of the triangles of the previous.
+std::vector<MeshLod> buildLodChain(const std::vector<VertexObj>&   vertices,
+                                   const std::vector<uint32_t>&    indices,
+                                   const std::vector<uint32_t>&    matIndices,
+                                   const std::vector<float>&       ratios,
+                                   const MeshSimplifier::Settings& settings);
@@ -0,0 +1,204 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "fnv_hash.h"
+#include "model_registry.h"
+
+//--------------------------------------------------------------------------------------------------
+// 64-bit FNV-1a of the bytes of the file
+//
+static uint64_t hashFile(const std::string& filename)
+{
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+    throw std::runtime_error("Cannot open " + filename);
+
+  uint64_t             hash = kFnv1aOffset;
+  std::vector<uint8_t> buffer(1 << 20);
+  size_t               read;
+  while((read = fread(buffer.data(), 1, buffer.size(), file)) > 0)
+    hash = fnv1a(buffer.data(), read, hash);
+  fclose(file);
+  return hash;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Files named by an OBJ file, its material libraries, or by a material library, its diffuse
+// textures. Parsed as the OBJ loader does: the libraries are relative to the OBJ file, the
+// texture is the last argument of map_Kd, after the options. Textures are names, found in the
+// texture directories when hashed: a texture added to a directory earlier in the search order
+// changes the model without changing the material library.
+//
+std::vector<std::string> ModelRegistry::readRefs(const std::filesystem::path& path,
+                                                 FileKind                     kind) const
+{
+  std::vector<std::string> refs;
+  std::ifstream            file(path);
+  std::string              line;
+  while(std::getline(file, line))
+  {
+    std::istringstream       tokens(line);
+    std::string              keyword;
+    std::vector<std::string> args;
+    tokens >> keyword;
+    for(std::string arg; tokens >> arg;)
+      args.push_back(arg);
+
+    if(kind == FileKind::eObj && keyword == "mtllib")
+    {
+      for(const std::string& arg : args)
+        refs.push_back((path.parent_path() / arg).string());
+    }
+    else if(kind == FileKind::eMaterials && keyword == "map_Kd" && !args.empty())
+      refs.push_back(args.back());
+  }
+  return refs;
+}
+
+// Path of the texture in the first directory having it, else the name
+std::string ModelRegistry::findTexture(const std::string& name) const
+{
+  for(const std::string& dir : m_textureDirs)
+  {
+    std::error_code       error;
+    std::filesystem::path path = std::filesystem::path(dir) / name;
+    if(std::filesystem::exists(path, error))
+      return path.string();
+  }
+  return name;
+}
+
+uint64_t ModelRegistry::getHash(const std::string& filename, FileKind kind)
+{
+  namespace fs = std::filesystem;
+  std::error_code error;
+  fs::path        path = fs::weakly_canonical(filename, error);
+  if(error)
+    path = filename;
+
+  // The loader goes on without the library or the texture
+  if(kind != FileKind::eObj && !fs::is_regular_file(path, error))
+  {
+    std::string name = path.string();
+    return fnv1a(name.data(), name.size());
+  }
+
+  uint64_t           size = fs::file_size(path, error);
+  fs::file_time_type time = fs::last_write_time(path, error);
+  FileInfo&          info = m_files[path.string()];
+  if(info.hash == 0 || info.size != size || info.time != time)
+  {
+    info.hash = hashFile(path.string());
+    info.size = size;
+    info.time = time;
+    info.refs = kind != FileKind::eTexture ? readRefs(path, kind) : std::vector<std::string>();
+  }
+
+  // The references insert in m_files: nothing of `info` is used past this point
+  uint64_t                 hash = info.hash;
+  std::vector<std::string> refs = info.refs;
+  FileKind refKind = kind == FileKind::eObj ? FileKind::eMaterials : FileKind::eTexture;
+  for(const std::string& ref : refs)
+  {
+    uint64_t refHash = getHash(refKind == FileKind::eTexture ? findTexture(ref) : ref, refKind);
+    hash             = fnv1a(&refHash, sizeof(refHash), hash);
+  }
+  return hash;
+}
+
+ModelRegistry::ContentKey ModelRegistry::getKey(const std::string& filename, bool dynamic)
+{
+  std::error_code error;
+  uint64_t        size = std::filesystem::file_size(filename, error);
+  return ContentKey(getHash(filename, FileKind::eObj), size, dynamic);
+}
+
+uint32_t ModelRegistry::find(const std::string& filename, bool dynamic)
+{
+  auto it = m_byContent.find(getKey(filename, dynamic));
+  if(it == m_byContent.end())
+    return kInvalid;
+  m_nbShared++;
+  return it->second;
+}
+
+void ModelRegistry::add(const std::string& filename, bool dynamic, uint32_t modelId)
+{
+  ContentKey key = getKey(filename, dynamic);
+  assert(m_byContent.count(key) == 0 && m_models.count(modelId) == 0);
+  m_byContent[key]  = modelId;
+  m_models[modelId] = {key, 0};
+}
+
+void ModelRegistry::addRef(uint32_t modelId, uint32_t count)
+{
+  assert(m_models.count(modelId));
+  m_models[modelId].refCount += count;
+}
+
+bool ModelRegistry::release(uint32_t modelId)
+{
+  auto it = m_models.find(modelId);
+  assert(it != m_models.end() && it->second.refCount > 0);
+  if(--it->second.refCount > 0)
+    return false;
+  m_byContent.erase(it->second.key);
+  m_models.erase(it);
+  return true;
+}
+
+std::vector<uint32_t> ModelRegistry::releaseUnreferenced()
+{
+  std::vector<uint32_t> modelIds;
+  for(auto it = m_models.begin(); it != m_models.end();)
+  {
+    if(it->second.refCount > 0)
+    {
+      ++it;
+      continue;
+    }
+    modelIds.push_back(it->first);
+    m_byContent.erase(it->second.key);
+    it = m_models.erase(it);
+  }
+  std::sort(modelIds.begin(), modelIds.end());
+  return modelIds;
+}
+
+uint32_t ModelRegistry::getRefCount(uint32_t modelId) const
+{
+  auto it = m_models.find(modelId);
+  return it != m_models.end() ? it->second.refCount : 0;
+}
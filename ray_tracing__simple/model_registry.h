@@ -0,0 +1,108 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+//--------------------------------------------------------------------------------------------------
+// Models loaded by the application, shared by their instances
+// - A file is known by its canonical path, and its model by the hash and size of its content:
+//   the same asset placed twice, or found under two paths, is loaded once. The hash of a path is
+//   computed again when the size or the time of the file changed.
+// - The content of an OBJ file is also the one of its material libraries, and of the diffuse
+//   textures they name, the only ones the loader reads: two copies of an OBJ file with different
+//   textures are two models. A missing library or texture counts by its path.
+// - Static and dynamic loads of a file are different models
+// - Models are reference counted by their instances: release() tells when the last one went
+//   away, and the model can be unloaded. releaseUnreferenced() hands out the models loaded but
+//   never instanced.
+//
+class ModelRegistry
+{
+public:
+  static constexpr uint32_t kInvalid = ~0u;
+
+  // Directories the texture names of the material libraries are relative to, in search order
+  void setTextureDirs(const std::vector<std::string>& dirs) { m_textureDirs = dirs; }
+
+  // Model loaded from this file, or from one of the same content, else kInvalid
+  uint32_t find(const std::string& filename, bool dynamic);
+  // Registers the model loaded from the file, with no reference yet
+  void add(const std::string& filename, bool dynamic, uint32_t modelId);
+
+  void addRef(uint32_t modelId, uint32_t count = 1);
+  // True when the last reference went away: the model left the registry
+  bool release(uint32_t modelId);
+  // Models without references leave the registry, to be unloaded by the caller
+  std::vector<uint32_t> releaseUnreferenced();
+
+  uint32_t getRefCount(uint32_t modelId) const;
+  uint32_t getNbModels() const { return static_cast<uint32_t>(m_models.size()); }
+  uint32_t getNbShared() const { return m_nbShared; }  // find() calls that returned a model
+
+private:
+  // Hash, size of the content, dynamic
+  using ContentKey = std::tuple<uint64_t, uint64_t, bool>;
+
+  enum class FileKind
+  {
+    eObj,
+    eMaterials,
+    eTexture,
+  };
+
+  struct FileInfo
+  {
+    uint64_t                        hash{0};
+    uint64_t                        size{0};
+    std::filesystem::file_time_type time;
+    std::vector<std::string>        refs;  // Files named by the content, read with it
+  };
+
+  struct Model
+  {
+    ContentKey key;
+    uint32_t   refCount{0};
+  };
+
+  ContentKey getKey(const std::string& filename, bool dynamic);
+  // Hash of the file and of the files it names
+  uint64_t                 getHash(const std::string& filename, FileKind kind);
+  std::vector<std::string> readRefs(const std::filesystem::path& path, FileKind kind) const;
+  std::string              findTexture(const std::string& name) const;
+
+  std::vector<std::string>                  m_textureDirs;
+  std::unordered_map<std::string, FileInfo> m_files;  // By canonical path
+  std::map<ContentKey, uint32_t>            m_byContent;
+  std::unordered_map<uint32_t, Model>       m_models;
+  uint32_t                                  m_nbShared{0};
+};
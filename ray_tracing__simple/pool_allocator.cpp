@@ -0,0 +1,647 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "nvh/alignment.hpp"
+#include "nvh/nvprint.hpp"
+#include "pool_allocator.h"
+
+void PoolAllocator::init(const vk::Device&         device,
+                         const vk::PhysicalDevice& physicalDevice,
+                         vk::DeviceSize            blockSize)
+{
+  m_device           = device;
+  m_memoryProperties = physicalDevice.getMemoryProperties();
+  m_blockSize        = blockSize;
+
+  m_pools.resize(2 * m_memoryProperties.memoryTypeCount);
+  for(uint32_t i = 0; i < m_pools.size(); i++)
+  {
+    m_pools[i].memoryTypeIndex = i / 2;
+    m_pools[i].images          = (i % 2) == 1;
+  }
+}
+
+void PoolAllocator::deinit()
+{
+  finalizeAndReleaseStaging();
+  releaseDefragmented();
+  if(!m_buffers.empty() || !m_images.empty())
+  {
+    LOGW("PoolAllocator: %u buffers and %u images were not destroyed\n",
+         static_cast<uint32_t>(m_buffers.size()), static_cast<uint32_t>(m_images.size()));
+  }
+
+  for(auto& pool : m_pools)
+  {
+    for(auto& block : pool.blocks)
+    {
+      if(!block.memory)
+        continue;
+      if(block.mapped)
+        m_device.unmapMemory(block.memory);
+      m_device.freeMemory(block.memory);
+    }
+  }
+  m_pools.clear();
+  m_buffers.clear();
+  m_images.clear();
+}
+
+uint32_t PoolAllocator::findMemoryType(uint32_t typeBits, vk::MemoryPropertyFlags memProps) const
+{
+  for(uint32_t i = 0; i < m_memoryProperties.memoryTypeCount; i++)
+  {
+    if((typeBits & (1u << i))
+       && (m_memoryProperties.memoryTypes[i].propertyFlags & memProps) == memProps)
+      return i;
+  }
+  throw std::runtime_error("PoolAllocator: no memory type matches the requirements");
+}
+
+//--------------------------------------------------------------------------------------------------
+// Place a resource: in its own block when dedicated or large, else in the first block of the
+// pool with room, else in a new block
+//
+PoolAllocator::Allocation PoolAllocator::allocate(const vk::MemoryRequirements& req,
+                                                  vk::MemoryPropertyFlags       memProps,
+                                                  bool                          image,
+                                                  bool                          dedicated,
+                                                  vk::Buffer                    dedicatedBuffer,
+                                                  vk::Image                     dedicatedImage)
+{
+  uint32_t poolIndex = 2 * findMemoryType(req.memoryTypeBits, memProps) + (image ? 1 : 0);
+
+  Allocation alloc;
+  uint32_t   blockIndex;
+  if(dedicated || req.size > m_blockSize / 2)
+  {
+    blockIndex = createBlock(poolIndex, req.size, true, dedicated ? dedicatedBuffer : vk::Buffer(),
+                             dedicated ? dedicatedImage : vk::Image());
+  }
+  else if(allocateInPool(poolIndex, req, Tlsf::kInvalid, alloc))
+  {
+    return alloc;
+  }
+  else
+  {
+    blockIndex = createBlock(poolIndex, m_blockSize, false, {}, {});
+  }
+
+  Block& block = m_pools[poolIndex].blocks[blockIndex];
+  alloc.pool   = poolIndex;
+  alloc.block  = blockIndex;
+  alloc.handle = block.policy.allocate(req.size, req.alignment);
+  if(alloc.handle == Tlsf::kInvalid)
+    throw std::runtime_error("PoolAllocator: allocation failed in a new block");
+  alloc.offset = block.policy.getOffset(alloc.handle);
+  return alloc;
+}
+
+bool PoolAllocator::allocateInPool(uint32_t                      poolIndex,
+                                   const vk::MemoryRequirements& req,
+                                   uint32_t                      skipBlock,
+                                   Allocation&                   alloc)
+{
+  Pool& pool = m_pools[poolIndex];
+  for(uint32_t b = 0; b < pool.blocks.size(); b++)
+  {
+    Block& block = pool.blocks[b];
+    if(!block.memory || block.dedicated || b == skipBlock)
+      continue;
+    Tlsf::Handle handle = block.policy.allocate(req.size, req.alignment);
+    if(handle == Tlsf::kInvalid)
+      continue;
+    alloc.pool   = poolIndex;
+    alloc.block  = b;
+    alloc.handle = handle;
+    alloc.offset = block.policy.getOffset(handle);
+    return true;
+  }
+  return false;
+}
+
+uint32_t PoolAllocator::createBlock(uint32_t       poolIndex,
+                                    vk::DeviceSize size,
+                                    bool           dedicated,
+                                    vk::Buffer     dedicatedBuffer,
+                                    vk::Image      dedicatedImage)
+{
+  Pool& pool = m_pools[poolIndex];
+
+  // A dedicated allocation has the exact size of its resource, the policy works on a multiple
+  // of its granularity: the one range it hands out still fits in the memory
+  vk::MemoryAllocateInfo          allocInfo(size, pool.memoryTypeIndex);
+  vk::MemoryAllocateFlagsInfo     flagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress);
+  vk::MemoryDedicatedAllocateInfo dedicatedInfo(dedicatedImage, dedicatedBuffer);
+  // Buffers may be used through their device address
+  if(!pool.images)
+  {
+    flagsInfo.setPNext(allocInfo.pNext);
+    allocInfo.setPNext(&flagsInfo);
+  }
+  if(dedicatedBuffer || dedicatedImage)
+  {
+    dedicatedInfo.setPNext(allocInfo.pNext);
+    allocInfo.setPNext(&dedicatedInfo);
+  }
+
+  Block block;
+  block.memory    = m_device.allocateMemory(allocInfo);
+  block.size      = size;
+  block.dedicated = dedicated;
+  block.policy.init(nvh::align_up(size, Tlsf::kGranularity));
+  if(m_memoryProperties.memoryTypes[pool.memoryTypeIndex].propertyFlags
+     & vk::MemoryPropertyFlagBits::eHostVisible)
+  {
+    block.mapped = reinterpret_cast<uint8_t*>(m_device.mapMemory(block.memory, 0, VK_WHOLE_SIZE));
+  }
+
+  // Reuse the slot of a released block
+  auto slot = std::find_if(pool.blocks.begin(), pool.blocks.end(),
+                           [](const Block& b) { return !b.memory; });
+  if(slot != pool.blocks.end())
+  {
+    *slot = std::move(block);
+    return static_cast<uint32_t>(slot - pool.blocks.begin());
+  }
+  pool.blocks.push_back(std::move(block));
+  return static_cast<uint32_t>(pool.blocks.size() - 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Return the range to its block. An empty block is released, unless it is the last one of its
+// pool: it is kept to avoid reallocating memory on the next resource.
+//
+void PoolAllocator::free(const Allocation& alloc)
+{
+  Pool&  pool  = m_pools[alloc.pool];
+  Block& block = pool.blocks[alloc.block];
+  block.policy.free(alloc.handle);
+  if(!block.policy.isEmpty())
+    return;
+
+  uint32_t nbShared = 0;
+  for(const auto& b : pool.blocks)
+  {
+    if(b.memory && !b.dedicated)
+      nbShared++;
+  }
+  if(block.dedicated || nbShared > 1)
+  {
+    if(block.mapped)
+      m_device.unmapMemory(block.memory);
+    m_device.freeMemory(block.memory);
+    block = Block();
+  }
+}
+
+vk::DeviceMemory PoolAllocator::getMemory(const Allocation& alloc) const
+{
+  return m_pools[alloc.pool].blocks[alloc.block].memory;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Buffers
+//
+//--------------------------------------------------------------------------------------------------
+// Queue families using the buffers: with more than one, buffers are created concurrent and need
+// no ownership transfer between these families
+//
+void PoolAllocator::setQueueFamilies(const std::vector<uint32_t>& queueFamilies)
+{
+  assert(m_buffers.empty());
+  m_queueFamilies.clear();
+  for(uint32_t family : queueFamilies)
+  {
+    if(std::find(m_queueFamilies.begin(), m_queueFamilies.end(), family) == m_queueFamilies.end())
+      m_queueFamilies.push_back(family);
+  }
+}
+
+nvvk::Buffer PoolAllocator::createBuffer(const vk::BufferCreateInfo& info,
+                                         vk::MemoryPropertyFlags     memProps)
+{
+  vk::BufferCreateInfo createInfo = info;
+  bool shared = sharesBuffers() && info.sharingMode == vk::SharingMode::eExclusive;
+  if(shared)
+  {
+    createInfo.setSharingMode(vk::SharingMode::eConcurrent);
+    createInfo.setQueueFamilyIndexCount(static_cast<uint32_t>(m_queueFamilies.size()));
+    createInfo.setPQueueFamilyIndices(m_queueFamilies.data());
+  }
+
+  vk::Buffer buffer = m_device.createBuffer(createInfo);
+  auto       reqs   = m_device.getBufferMemoryRequirements2<vk::MemoryRequirements2,
+                                                    vk::MemoryDedicatedRequirements>({buffer});
+  const auto& dedicatedReqs = reqs.get<vk::MemoryDedicatedRequirements>();
+  bool        dedicated     = dedicatedReqs.prefersDedicatedAllocation
+                     || dedicatedReqs.requiresDedicatedAllocation;
+
+  Allocation alloc = allocate(reqs.get<vk::MemoryRequirements2>().memoryRequirements, memProps,
+                              false, dedicated, buffer, {});
+  m_device.bindBufferMemory(buffer, getMemory(alloc), alloc.offset);
+
+  // Kept to recreate the buffer when it moves
+  BufferAllocation& tracked = m_buffers[buffer];
+  tracked.alloc             = alloc;
+  tracked.info              = createInfo;
+  tracked.info.setPNext(nullptr);
+  if(!shared)
+  {
+    tracked.info.setQueueFamilyIndexCount(0);
+    tracked.info.setPQueueFamilyIndices(nullptr);
+  }
+
+  nvvk::Buffer result;
+  result.buffer     = buffer;
+  result.allocation = getMemory(alloc);
+  return result;
+}
+
+nvvk::Buffer PoolAllocator::createBuffer(vk::DeviceSize          size,
+                                         vk::BufferUsageFlags    usage,
+                                         vk::MemoryPropertyFlags memProps)
+{
+  return createBuffer(vk::BufferCreateInfo({}, size, usage), memProps);
+}
+
+nvvk::Buffer PoolAllocator::createBuffer(const vk::CommandBuffer& cmdBuf,
+                                         vk::DeviceSize           size,
+                                         const void*              data,
+                                         vk::BufferUsageFlags     usage,
+                                         vk::MemoryPropertyFlags  memProps)
+{
+  nvvk::Buffer result = createBuffer(size, usage | vk::BufferUsageFlagBits::eTransferDst, memProps);
+  if(data && size)
+  {
+    nvvk::Buffer staging = createBuffer(size, vk::BufferUsageFlagBits::eTransferSrc,
+                                        vk::MemoryPropertyFlagBits::eHostVisible
+                                            | vk::MemoryPropertyFlagBits::eHostCoherent);
+    memcpy(map(staging), data, size);
+    cmdBuf.copyBuffer(staging.buffer, result.buffer, {vk::BufferCopy(0, 0, size)});
+    m_staging.push_back(staging);
+  }
+  return result;
+}
+
+void PoolAllocator::finalizeAndReleaseStaging()
+{
+  for(auto& staging : m_staging)
+    destroy(staging);
+  m_staging.clear();
+}
+
+void* PoolAllocator::map(const nvvk::Buffer& buffer)
+{
+  const Allocation& alloc = m_buffers.at(buffer.buffer).alloc;
+  uint8_t*          base  = m_pools[alloc.pool].blocks[alloc.block].mapped;
+  assert(base != nullptr && "Buffer is not host visible");
+  return base + alloc.offset;
+}
+
+void PoolAllocator::destroy(nvvk::Buffer& buffer)
+{
+  if(!buffer.buffer)
+    return;
+  auto it = m_buffers.find(buffer.buffer);
+  assert(it != m_buffers.end());
+  free(it->second.alloc);
+  m_buffers.erase(it);
+  m_device.destroy(buffer.buffer);
+  buffer = nvvk::Buffer();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Images
+//
+nvvk::Image PoolAllocator::createImage(const vk::ImageCreateInfo& info,
+                                       vk::MemoryPropertyFlags    memProps)
+{
+  vk::Image image = m_device.createImage(info);
+  auto      reqs  = m_device.getImageMemoryRequirements2<vk::MemoryRequirements2,
+                                                  vk::MemoryDedicatedRequirements>({image});
+  const auto& dedicatedReqs = reqs.get<vk::MemoryDedicatedRequirements>();
+  bool        dedicated     = dedicatedReqs.prefersDedicatedAllocation
+                     || dedicatedReqs.requiresDedicatedAllocation;
+
+  // Linear images follow the rules of buffers for the granularity
+  bool       optimal = info.tiling == vk::ImageTiling::eOptimal;
+  Allocation alloc   = allocate(reqs.get<vk::MemoryRequirements2>().memoryRequirements, memProps,
+                              optimal, dedicated, {}, image);
+  m_device.bindImageMemory(image, getMemory(alloc), alloc.offset);
+  m_images[image] = alloc;
+
+  nvvk::Image result;
+  result.image      = image;
+  result.allocation = getMemory(alloc);
+  return result;
+}
+
+nvvk::Image PoolAllocator::createImage(const vk::CommandBuffer&   cmdBuf,
+                                       size_t                     size,
+                                       const void*                data,
+                                       const vk::ImageCreateInfo& info,
+                                       vk::ImageLayout            layout)
+{
+  vk::ImageCreateInfo createInfo = info;
+  createInfo.usage |= vk::ImageUsageFlagBits::eTransferDst;
+  nvvk::Image result = createImage(createInfo);
+
+  vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, info.mipLevels, 0,
+                                  info.arrayLayers);
+  vk::ImageMemoryBarrier    barrier;
+  barrier.setImage(result.image);
+  barrier.setSubresourceRange(range);
+  barrier.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+  barrier.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+
+  if(data && size)
+  {
+    nvvk::Buffer staging = createBuffer(size, vk::BufferUsageFlagBits::eTransferSrc,
+                                        vk::MemoryPropertyFlagBits::eHostVisible
+                                            | vk::MemoryPropertyFlagBits::eHostCoherent);
+    memcpy(map(staging), data, size);
+    m_staging.push_back(staging);
+
+    barrier.setOldLayout(vk::ImageLayout::eUndefined);
+    barrier.setNewLayout(vk::ImageLayout::eTransferDstOptimal);
+    barrier.setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                           vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, {barrier});
+
+    vk::BufferImageCopy region;
+    region.setImageSubresource({vk::ImageAspectFlagBits::eColor, 0, 0, info.arrayLayers});
+    region.setImageExtent(info.extent);
+    cmdBuf.copyBufferToImage(staging.buffer, result.image, vk::ImageLayout::eTransferDstOptimal,
+                             {region});
+
+    barrier.setOldLayout(vk::ImageLayout::eTransferDstOptimal);
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+  }
+  else
+  {
+    barrier.setOldLayout(vk::ImageLayout::eUndefined);
+  }
+
+  barrier.setNewLayout(layout);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eTransferRead);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                         vk::PipelineStageFlagBits::eAllCommands, {}, {}, {}, {barrier});
+  return result;
+}
+
+nvvk::Texture PoolAllocator::createTexture(const nvvk::Image&             image,
+                                           const vk::ImageViewCreateInfo& ivInfo)
+{
+  nvvk::Texture result;
+  result.image                  = image.image;
+  result.allocation             = image.allocation;
+  result.descriptor.imageView   = static_cast<VkImageView>(m_device.createImageView(ivInfo));
+  result.descriptor.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  return result;
+}
+
+nvvk::Texture PoolAllocator::createTexture(const nvvk::Image&             image,
+                                           const vk::ImageViewCreateInfo& ivInfo,
+                                           const vk::SamplerCreateInfo&   samplerInfo)
+{
+  nvvk::Texture result      = createTexture(image, ivInfo);
+  result.descriptor.sampler = static_cast<VkSampler>(m_device.createSampler(samplerInfo));
+  return result;
+}
+
+void PoolAllocator::destroy(nvvk::Image& image)
+{
+  if(!image.image)
+    return;
+  auto it = m_images.find(image.image);
+  assert(it != m_images.end());
+  free(it->second);
+  m_images.erase(it);
+  m_device.destroy(image.image);
+  image = nvvk::Image();
+}
+
+void PoolAllocator::destroy(nvvk::Texture& texture)
+{
+  m_device.destroy(vk::ImageView(texture.descriptor.imageView));
+  m_device.destroy(vk::Sampler(texture.descriptor.sampler));
+  nvvk::Image image;
+  image.image      = texture.image;
+  image.allocation = texture.allocation;
+  destroy(image);
+  texture = nvvk::Texture();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Acceleration structures live in a buffer
+//
+nvvk::AccelKHR PoolAllocator::createAcceleration(vk::AccelerationStructureCreateInfoKHR& info)
+{
+  nvvk::AccelKHR result;
+  result.buffer = createBuffer(info.size, vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR
+                                              | vk::BufferUsageFlagBits::eShaderDeviceAddress);
+  info.setBuffer(result.buffer.buffer);
+  result.accel = m_device.createAccelerationStructureKHR(info);
+  return result;
+}
+
+void PoolAllocator::destroy(nvvk::AccelKHR& accel)
+{
+  m_device.destroy(accel.accel);
+  destroy(accel.buffer);
+  accel = nvvk::AccelKHR();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Defragmentation
+// - Only buffers of device-local, not host-visible memory move: host pointers stay valid
+// - The storage of acceleration structures stays: a structure cannot be moved by a copy
+// - The moved buffers are new handles: the owners learn about them through `onMove`, and must
+//   also refresh anything holding the device address of the old one
+//
+uint32_t PoolAllocator::defragment(const vk::CommandBuffer& cmdBuf,
+                                   vk::DeviceSize           maxBytes,
+                                   const MoveCallback&      onMove)
+{
+  uint32_t       nbMoves    = 0;
+  vk::DeviceSize movedBytes = 0;
+  for(uint32_t p = 0; p < m_pools.size() && movedBytes < maxBytes; p += 2)  // Buffer pools
+  {
+    const Pool& pool  = m_pools[p];
+    auto        flags = m_memoryProperties.memoryTypes[pool.memoryTypeIndex].propertyFlags;
+    if(flags & vk::MemoryPropertyFlagBits::eHostVisible)
+      continue;
+
+    // Emptiest shared block
+    uint32_t source   = Tlsf::kInvalid;
+    uint32_t nbShared = 0;
+    for(uint32_t b = 0; b < pool.blocks.size(); b++)
+    {
+      const Block& block = pool.blocks[b];
+      if(!block.memory || block.dedicated || block.policy.isEmpty())
+        continue;
+      nbShared++;
+      if(source == Tlsf::kInvalid || block.policy.getUsed() < pool.blocks[source].policy.getUsed())
+        source = b;
+    }
+    if(nbShared < 2)
+      continue;
+
+    std::vector<vk::Buffer> candidates;
+    for(const auto& tracked : m_buffers)
+    {
+      if(tracked.second.alloc.pool != p || tracked.second.alloc.block != source)
+        continue;
+      if(tracked.second.info.usage & vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR)
+        continue;
+      candidates.push_back(tracked.first);
+    }
+
+    for(vk::Buffer from : candidates)
+    {
+      BufferAllocation tracked = m_buffers[from];
+      if(movedBytes + tracked.info.size > maxBytes)
+        break;
+
+      vk::Buffer             to  = m_device.createBuffer(tracked.info);
+      vk::MemoryRequirements req = m_device.getBufferMemoryRequirements(to);
+      Allocation             alloc;
+      if(!allocateInPool(p, req, source, alloc))
+      {
+        m_device.destroy(to);
+        break;
+      }
+      m_device.bindBufferMemory(to, getMemory(alloc), alloc.offset);
+      m_buffers[to] = {alloc, tracked.info};
+
+      if(nbMoves == 0)
+      {
+        // Pending writes to the buffers must land before they are copied
+        vk::MemoryBarrier barrier(vk::AccessFlagBits::eMemoryWrite,
+                                  vk::AccessFlagBits::eTransferRead);
+        cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands,
+                               vk::PipelineStageFlagBits::eTransfer, {}, {barrier}, {}, {});
+      }
+      cmdBuf.copyBuffer(from, to, {vk::BufferCopy(0, 0, tracked.info.size)});
+
+      nvvk::Buffer oldBuffer;
+      oldBuffer.buffer     = from;
+      oldBuffer.allocation = getMemory(tracked.alloc);
+      nvvk::Buffer newBuffer;
+      newBuffer.buffer     = to;
+      newBuffer.allocation = getMemory(alloc);
+      onMove(oldBuffer, newBuffer);
+      m_defragmented.push_back(oldBuffer);
+
+      movedBytes += tracked.info.size;
+      nbMoves++;
+    }
+  }
+
+  if(nbMoves > 0)
+  {
+    vk::MemoryBarrier barrier(vk::AccessFlagBits::eTransferWrite,
+                              vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite);
+    cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                           vk::PipelineStageFlagBits::eAllCommands, {}, {barrier}, {}, {});
+    LOGI("Defragmentation: %u buffers moved, %llu KB\n", nbMoves,
+         static_cast<unsigned long long>(movedBytes >> 10));
+  }
+  return nbMoves;
+}
+
+void PoolAllocator::releaseDefragmented()
+{
+  for(auto& buffer : m_defragmented)
+    destroy(buffer);
+  m_defragmented.clear();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Statistics
+//
+void PoolAllocator::accumulate(const Pool& pool, Stats& stats) const
+{
+  for(const auto& block : pool.blocks)
+  {
+    if(!block.memory)
+      continue;
+    stats.nbBlocks++;
+    stats.nbDedicated += block.dedicated ? 1 : 0;
+    stats.nbAllocations += block.policy.getNbAllocations();
+    stats.blockBytes += block.size;
+    stats.usedBytes += block.policy.getUsed();
+    if(!block.dedicated)
+    {
+      stats.largestFree   = std::max(stats.largestFree, block.policy.getLargestFree());
+      stats.fragmentation = std::max(stats.fragmentation, block.policy.getFragmentation());
+    }
+  }
+}
+
+PoolAllocator::Stats PoolAllocator::getStats() const
+{
+  Stats stats;
+  for(const auto& pool : m_pools)
+    accumulate(pool, stats);
+  return stats;
+}
+
+PoolAllocator::Stats PoolAllocator::getStats(uint32_t memoryTypeIndex) const
+{
+  Stats stats;
+  accumulate(m_pools[2 * memoryTypeIndex], stats);
+  accumulate(m_pools[2 * memoryTypeIndex + 1], stats);
+  return stats;
+}
+
+void PoolAllocator::logStats() const
+{
+  for(uint32_t type = 0; type < m_memoryProperties.memoryTypeCount; type++)
+  {
+    Stats stats = getStats(type);
+    if(stats.nbBlocks == 0)
+      continue;
+    auto flags = m_memoryProperties.memoryTypes[type].propertyFlags;
+    LOGI(" Memory type %u (%s%s): %u blocks (%u dedicated), %u resources, %llu KB used of %llu KB, "
+         "fragmentation %.0f%%\n",
+         type, (flags & vk::MemoryPropertyFlagBits::eDeviceLocal) ? "device" : "",
+         (flags & vk::MemoryPropertyFlagBits::eHostVisible) ? " host" : "", stats.nbBlocks,
+         stats.nbDedicated, stats.nbAllocations,
+         static_cast<unsigned long long>(stats.usedBytes >> 10),
+         static_cast<unsigned long long>(stats.blockBytes >> 10), 100.f * stats.fragmentation);
+  }
+  Stats total = getStats();
+  LOGI(" Memory total: %u resources in %u allocations, %llu KB used of %llu KB\n",
+       total.nbAllocations, total.nbBlocks, static_cast<unsigned long long>(total.usedBytes >> 10),
+       static_cast<unsigned long long>(total.blockBytes >> 10));
+}
@@ -0,0 +1,204 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <functional>
+#include <unordered_map>
+#include <vulkan/vulkan.hpp>
+
+// Resource handles are the ones of the dedicated allocator: `allocation` is the memory block
+#define NVVK_ALLOC_DEDICATED
+#include "nvvk/allocator_vk.hpp"
+
+#include "tlsf.h"
+
+//--------------------------------------------------------------------------------------------------
+// Allocator of buffers, images and acceleration structures sub-allocating large memory blocks
+// - Same interface as nvvk::AllocatorDedicated, and the same resource structures
+// - One pool of blocks per memory type, and per kind of resource: buffers and optimal-tiling
+//   images never share a block, so bufferImageGranularity does not constrain the placement
+// - Placement in a block follows the Tlsf policy, at the alignment the resource requires
+// - Host-visible blocks are mapped once: map() returns a pointer in the block
+// - Resources the driver wants dedicated, or larger than half a block, get their own memory
+// - Empty blocks are released, except the last one of each pool
+// - Buffers can be shared by several queue families, see setQueueFamilies()
+//
+class PoolAllocator
+{
+public:
+  struct Stats
+  {
+    uint32_t       nbBlocks{0};       // vkAllocateMemory calls alive, dedicated included
+    uint32_t       nbDedicated{0};    // Blocks holding one resource
+    uint32_t       nbAllocations{0};  // Resources placed
+    vk::DeviceSize blockBytes{0};     // Memory allocated
+    vk::DeviceSize usedBytes{0};      // Memory used by resources
+    vk::DeviceSize largestFree{0};    // Largest free range of a block
+    float          fragmentation{0};  // Largest over the blocks, see Tlsf::getFragmentation
+  };
+
+  // Called by defragment() for each moved buffer, to update the references to it
+  using MoveCallback = std::function<void(const nvvk::Buffer& from, const nvvk::Buffer& to)>;
+
+  void init(const vk::Device&         device,
+            const vk::PhysicalDevice& physicalDevice,
+            vk::DeviceSize            blockSize = 64ull << 20);
+  void deinit();
+
+  // Before creating any buffer: graphics, transfer and compute queues then use the same buffers
+  // without queue-family ownership transfers. Images stay exclusive, to keep their compression.
+  void setQueueFamilies(const std::vector<uint32_t>& queueFamilies);
+  bool sharesBuffers() const { return m_queueFamilies.size() > 1; }
+
+  nvvk::Buffer createBuffer(
+      const vk::BufferCreateInfo& info,
+      vk::MemoryPropertyFlags     memProps = vk::MemoryPropertyFlagBits::eDeviceLocal);
+  nvvk::Buffer createBuffer(
+      vk::DeviceSize          size,
+      vk::BufferUsageFlags    usage,
+      vk::MemoryPropertyFlags memProps = vk::MemoryPropertyFlagBits::eDeviceLocal);
+  // Staged upload of `data`, recorded in cmdBuf
+  nvvk::Buffer createBuffer(
+      const vk::CommandBuffer& cmdBuf,
+      vk::DeviceSize           size,
+      const void*              data,
+      vk::BufferUsageFlags     usage,
+      vk::MemoryPropertyFlags  memProps = vk::MemoryPropertyFlagBits::eDeviceLocal);
+  template <typename T>
+  nvvk::Buffer createBuffer(
+      const vk::CommandBuffer& cmdBuf,
+      const std::vector<T>&    data,
+      vk::BufferUsageFlags     usage,
+      vk::MemoryPropertyFlags  memProps = vk::MemoryPropertyFlagBits::eDeviceLocal)
+  {
+    return createBuffer(cmdBuf, sizeof(T) * data.size(), data.data(), usage, memProps);
+  }
+
+  nvvk::Image createImage(
+      const vk::ImageCreateInfo& info,
+      vk::MemoryPropertyFlags    memProps = vk::MemoryPropertyFlagBits::eDeviceLocal);
+  // Staged upload of the first mip level, all levels end up in `layout`
+  nvvk::Image createImage(const vk::CommandBuffer&   cmdBuf,
+                          size_t                     size,
+                          const void*                data,
+                          const vk::ImageCreateInfo& info,
+                          vk::ImageLayout layout = vk::ImageLayout::eShaderReadOnlyOptimal);
+
+  nvvk::Texture createTexture(const nvvk::Image& image, const vk::ImageViewCreateInfo& ivInfo);
+  nvvk::Texture createTexture(const nvvk::Image&             image,
+                              const vk::ImageViewCreateInfo& ivInfo,
+                              const vk::SamplerCreateInfo&   samplerInfo);
+
+  nvvk::AccelKHR createAcceleration(vk::AccelerationStructureCreateInfoKHR& info);
+
+  // Staging buffers of the uploads: release once the command buffers recording them completed
+  void finalizeAndReleaseStaging();
+
+  void* map(const nvvk::Buffer& buffer);
+  void  unmap(const nvvk::Buffer& /*buffer*/) {}  // Blocks stay mapped
+
+  void destroy(nvvk::Buffer& buffer);
+  void destroy(nvvk::Image& image);
+  void destroy(nvvk::Texture& texture);
+  void destroy(nvvk::AccelKHR& accel);
+
+  // Defragmentation hook: moves the buffers out of the emptiest device-local block of each
+  // pool into the other blocks, up to `maxBytes`, and records the copies in `cmdBuf`. `onMove`
+  // is where the owners rebind the descriptors and device addresses of each moved buffer.
+  // The old buffers are released by releaseDefragmented(), once `cmdBuf` completed.
+  uint32_t defragment(const vk::CommandBuffer& cmdBuf,
+                      vk::DeviceSize           maxBytes,
+                      const MoveCallback&      onMove);
+  void     releaseDefragmented();
+
+  Stats getStats() const;
+  Stats getStats(uint32_t memoryTypeIndex) const;
+  void  logStats() const;
+
+private:
+  struct Block
+  {
+    vk::DeviceMemory memory;
+    vk::DeviceSize   size{0};
+    Tlsf             policy;
+    uint8_t*         mapped{nullptr};
+    bool             dedicated{false};
+  };
+
+  struct Pool
+  {
+    uint32_t           memoryTypeIndex{0};
+    bool               images{false};
+    std::vector<Block> blocks;  // Released blocks have no memory and are reused
+  };
+
+  // Where a resource lives
+  struct Allocation
+  {
+    uint32_t       pool{0};
+    uint32_t       block{0};
+    Tlsf::Handle   handle{Tlsf::kInvalid};
+    vk::DeviceSize offset{0};
+  };
+
+  // Buffers are kept with their creation info, to be recreated when moved
+  struct BufferAllocation
+  {
+    Allocation           alloc;
+    vk::BufferCreateInfo info;
+  };
+
+  uint32_t         findMemoryType(uint32_t typeBits, vk::MemoryPropertyFlags memProps) const;
+  Allocation       allocate(const vk::MemoryRequirements& req,
+                            vk::MemoryPropertyFlags       memProps,
+                            bool                          image,
+                            bool                          dedicated,
+                            vk::Buffer                    dedicatedBuffer,
+                            vk::Image                     dedicatedImage);
+  bool             allocateInPool(uint32_t                      poolIndex,
+                                  const vk::MemoryRequirements& req,
+                                  uint32_t                      skipBlock,
+                                  Allocation&                   alloc);
+  uint32_t         createBlock(uint32_t       poolIndex,
+                               vk::DeviceSize size,
+                               bool           dedicated,
+                               vk::Buffer     dedicatedBuffer,
+                               vk::Image      dedicatedImage);
+  void             free(const Allocation& alloc);
+  vk::DeviceMemory getMemory(const Allocation& alloc) const;
+  void             accumulate(const Pool& pool, Stats& stats) const;
+
+  vk::Device                         m_device;
+  vk::PhysicalDeviceMemoryProperties m_memoryProperties;
+  vk::DeviceSize                     m_blockSize{64ull << 20};
+  std::vector<Pool>                  m_pools;          // 2 per memory type: buffers, then images
+  std::vector<uint32_t>              m_queueFamilies;  // Sharing the buffers, if more than one
+
+  std::unordered_map<VkBuffer, BufferAllocation> m_buffers;
+  std::unordered_map<VkImage, Allocation>        m_images;
+  std::vector<nvvk::Buffer>                      m_staging;
+  std::vector<nvvk::Buffer>                      m_defragmented;
+};
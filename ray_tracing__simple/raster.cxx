@@ -9,11 +9,17 @@ struct {
 
 struct Constants {
   vec3  lightPosition;
-  uint  instanceId;
   float lightIntensity;
   int   lightType;
 };
 
+// Index of the instance drawn: the firstInstance of its indirect draw.
+[[using spirv: out, location(5), flat]]
+uint vert_instanceId;
+
+[[using spirv: in, location(5), flat]]
+uint frag_instanceId;
+
 
 [[using spirv: buffer, binding(2)]]
 SceneDesc sceneDescs[];
@@ -21,41 +27,35 @@ SceneDesc sceneDescs[];
 [[spirv::vert]]
 void vert_shader() {
   // Load interface variables.
-  Constants constants = shader_push<Constants>;
   vec3 position       = shader_in<vec3, 0>;
   vec3 normal         = shader_in<vec3, 1>;
   vec3 color          = shader_in<vec3, 2>;
   vec2 texCoord       = shader_in<vec2, 3>;
 
-  SceneDesc desc = sceneDescs[constants.instanceId];
-  mat4 objMatrix(desc.transfo);
-  mat4 objMatrixIT(desc.transfoIT);
+  uint instanceId = glvert_InstanceIndex;
+  SceneDesc desc = sceneDescs[instanceId];
+  mat4 objMatrix = instanceTransform(desc);
+  mat3 normalMatrix = instanceNormalMatrix(desc);
 
   vec3 origin = (ubo.viewI * vec4(0, 0, 0, 1)).xyz;
   vec3 worldPos = (objMatrix * vec4(shader_in<vec3, 0>, 1)).xyz;
 
   // Output interface variables.
   shader_out<vec2, 1> = texCoord;
-  shader_out<vec3, 2> = (objMatrixIT * vec4(normal, 0)).xyz;
+  shader_out<vec3, 2> = normalMatrix * normal;
   shader_out<vec3, 3> = worldPos - origin;
   shader_out<vec3, 4> = worldPos;
+  vert_instanceId     = instanceId;
 
   glvert_Output.Position = ubo.proj * (ubo.view * vec4(worldPos, 1));
 }
 
 [[using spirv: buffer, binding(1)]]
-struct [[spirv::block]] {
-  WaveFrontMaterial m[];
-} materials[];
+ObjDesc objDescs[];
 
 [[using spirv: uniform, binding(3)]]
 sampler2D textureSamplers[];
 
-[[using spirv: buffer, binding(4)]]
-struct [[spirv::block]] {
-  int i[];
-} matIndices[];
-
 [[spirv::frag]]
 void frag_shader() {
   // Load interface variables.
@@ -65,14 +65,19 @@ void frag_shader() {
   vec3 viewDir        = shader_in<vec3, 3>;
   vec3 worldPos       = shader_in<vec3, 4>;
 
-  // Object of this instance.
-  SceneDesc desc = sceneDescs[constants.instanceId];
-  int objId = desc.objId;
+  // Object of this instance, only its ids.
+  int objId = sceneDescs[frag_instanceId].objId;
+  int primOffset = sceneDescs[frag_instanceId].primOffset;
+  int matOverride = sceneDescs[frag_instanceId].matOverride;
+  ObjDesc obj = objDescs[objId];
+  int txtOffset = obj.txtOffset;
 
-  // Material of the object.
-  // Note an implicit nonuniformEXT.
-  int matIndex = matIndices[objId].i[glfrag_PrimitiveID];
-  WaveFrontMaterial mat = materials[objId].m[matIndex];
+  // Material of the object, the primitive ID starts at the LOD drawn.
+  // Read through the device addresses of the object.
+  const int* matIndices = (const int*)obj.matIndexAddress;
+  const WaveFrontMaterial* materials = (const WaveFrontMaterial*)obj.materialAddress;
+  int matIndex = matOverride >= 0 ? matOverride : matIndices[primOffset + glfrag_PrimitiveID];
+  WaveFrontMaterial mat = materials[matIndex];
 
   normal = normalize(normal);
 
@@ -94,7 +99,7 @@ void frag_shader() {
   // Diffuse
   vec3 diffuse = computeDiffuse(mat, L, normal);
   if(mat.textureId >= 0) {
-    int txtId = desc.txtOffset + mat.textureId;
+    int txtId = txtOffset + mat.textureId;
 
     // Note the implicit nonuniformEXT.
     diffuse *= texture(textureSamplers[txtId], texCoord).xyz;
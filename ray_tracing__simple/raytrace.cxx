@@ -4,32 +4,9 @@
 [[using spirv: uniform, binding(0), set(1)]]
 camera_t cam;
 
-[[using spirv: buffer, binding(1), set(1)]]
-struct [[spirv::block]] {
-  WaveFrontMaterial m[];
-} materials[];
-
-[[using spirv: buffer, binding(2), set(1)]]
-SceneDesc sceneDescs[];
-
 [[using spirv: uniform, binding(3), set(1)]]
 sampler2D textureSamplers[];
 
-[[using spirv: buffer, binding(4), set(1)]]
-struct [[spirv::block]] {
-  int i[];
-} matIndices[];
-
-[[using spirv: buffer, binding(5), set(1)]]
-struct [[spirv::block]] {
-  Vertex v[];
-} vertices[];
-
-[[using spirv: buffer, binding(6), set(1)]]
-struct [[spirv::block]] {
-  int i[];
-} indices[];
-
 // Ray tracing interface varibales.
 [[using spirv: uniform, binding(0)]]
 accelerationStructure topLevelAS;
@@ -40,8 +17,72 @@ image2D image;
 [[using spirv: hitAttribute]]
 vec2 hit_attribs;
 
-[[spirv::rgen]]
-void rgen_shader() {
+// Object, geometry and material override of the hit, see HitRecord.
+[[using spirv: shaderRecord]]
+HitRecord hit_record;
+
+// Rays traced per frame, by frame in flight, read back by the host.
+[[using spirv: buffer, binding(2)]]
+uint rayCounts[];
+
+// Wavefront mode, see wavefront_pass.h: the hits of the camera rays, the key
+// of their shadow ray by pixel, the bins of the keys, then the pixels of the
+// shadow rays sorted by bin and their count.
+struct WavefrontHit {
+  vec4 position;
+  vec4 color;     // Lit, not shadowed.
+  vec4 specular;  // Added when the light is not shadowed.
+};
+
+[[using spirv: buffer, binding(3)]]
+WavefrontHit wavefrontHits[];
+
+[[using spirv: buffer, binding(4)]]
+uint shadowKeys[];
+
+[[using spirv: buffer, binding(5)]]
+uint shadowBins[];
+
+[[using spirv: buffer, binding(6)]]
+uint shadowRays[];
+
+[[using spirv: buffer, binding(7)]]
+uint shadowCount[];
+
+struct Constants {
+  float clearColor[4];
+  vec3  lightPosition;
+  float lightIntensity;
+  int   lightType;
+  int   maxBounces;   // Reflections after the camera ray.
+  int   frame;        // Slot of rayCounts.
+  float gridScale;    // Cells per unit of the grid of the shadow bins.
+  vec3  gridOrigin;
+  int   sortShadows;  // 0: a single bin, the shadow rays stay in pixel order.
+};
+
+// Payload of the camera and the reflected rays: the hit shaders trace no ray,
+// they return what rgen needs to shade the hit and to bounce.
+struct HitPayload {
+  vec3  color;        // Diffuse and ambient light; the background on a miss.
+  float hitT;         // Distance along the ray, negative on a miss.
+  vec3  specular;     // Added when the light is not shadowed.
+  int   lit;          // The surface faces the light: rgen traces a shadow ray.
+  vec3  normal;       // World space, facing the ray.
+  vec3  reflectance;  // Throughput of the reflected ray, 0 without reflection.
+};
+
+struct Ray {
+  vec3 origin;
+  vec3 direction;
+};
+
+// The geometries tell which triangles are opaque: the alpha-tested ones run
+// their any-hit shader.
+constexpr float kTMin = 0.001;
+constexpr float kTMax = 10000.0;
+
+inline Ray cameraRay() {
   vec2 pixelCenter = vec2(glray_LaunchID.xy) + vec2(0.5);
   vec2 inUV        = pixelCenter / vec2(glray_LaunchSize.xy);
   vec2 d           = 2 * inUV - 1;
@@ -49,26 +90,170 @@ void rgen_shader() {
   vec4 origin    = cam.viewInv * vec4(0, 0, 0, 1);
   vec4 target    = cam.projInv * vec4(d.x, d.y, 1, 1);
   vec4 direction = cam.viewInv * vec4(normalize(target.xyz), 0);
+  return Ray { origin.xyz, direction.xyz };
+}
 
-  uint  rayFlags = gl_RayFlagsOpaque;
-  float tMin     = 0.001;
-  float tMax     = 10000.0;
-
-  glray_Trace(topLevelAS,     // acceleration structure
-              rayFlags,       // rayFlags
-              0xFF,           // cullMask
-              0,              // sbtRecordOffset
-              0,              // sbtRecordStride
-              0,              // missIndex
-              origin.xyz,     // ray origin
-              tMin,           // ray min range
-              direction.xyz,  // ray direction
-              tMax,           // ray max range
-              0               // payload (location = 0)
+// Direction to the light in xyz, its distance in w.
+inline vec4 lightDirection(Constants constants, vec3 position) {
+  if(constants.lightType == 0) {
+    vec3 lDir = constants.lightPosition - position;
+    float lightDist = length(lDir);
+    return vec4(lDir / lightDist, lightDist);
+  }
+  return vec4(normalize(constants.lightPosition), 100000.0f);
+}
+
+inline HitPayload traceHit(Ray ray, uint cullMask) {
+  glray_Trace(topLevelAS,      // acceleration structure
+              gl_RayFlagsNone, // rayFlags
+              cullMask,        // cullMask
+              0,               // sbtRecordOffset
+              1,               // sbtRecordStride: hit group of the geometry
+              0,               // missIndex
+              ray.origin,      // ray origin
+              kTMin,           // ray min range
+              ray.direction,   // ray direction
+              kTMax,           // ray max range
+              0                // payload (location = 0)
   );
+  return shader_rayPayload<HitPayload, 0>;
+}
+
+inline bool traceShadow(vec3 position, vec4 light) {
+  // Not opaque: the cutouts let the light through. Mark the fragment as
+  // shadowed, rmiss_shadow_shader resets this to false.
+  shader_rayPayload<bool, 1> = true;
+  glray_Trace(topLevelAS,  // acceleration structure
+              gl_RayFlagsTerminateOnFirstHit | 
+                gl_RayFlagsSkipClosestHitShader,  // rayFlags
+              MASK_SHADOW, // cullMask: instances casting shadows
+              0,           // sbtRecordOffset
+              1,           // sbtRecordStride: any-hit of the alpha-tested geometry
+              1,           // missIndex
+              position,    // ray origin
+              kTMin,       // ray min range
+              light.xyz,   // ray direction
+              light.w,     // ray max range
+              1            // payload (location = 1)
+  );
+  return shader_rayPayload<bool, 1>;
+}
+
+[[spirv::rgen]]
+void rgen_shader() {
+  Constants constants = shader_push<Constants>;
+
+  // Bounces are iterations of this loop and not recursive traces from the
+  // closest-hit shaders: the pipeline only needs a recursion depth of 1, and
+  // the stack of one hit shader whatever the number of bounces.
+  Ray  ray        = cameraRay();
+  vec3 radiance   = 0;
+  vec3 throughput = 1;
+  uint nbRays     = 0;
+  for(int bounce = 0; bounce <= constants.maxBounces; bounce++) {
+    HitPayload hit = traceHit(ray, bounce == 0 ? MASK_PRIMARY : MASK_REFLECTION);
+    nbRays++;
+    if(hit.hitT < 0) {
+      radiance += throughput * hit.color;
+      break;
+    }
+
+    vec3 position = ray.origin + ray.direction * hit.hitT;
+    vec3 color    = hit.color;
+    if(hit.lit) {
+      nbRays++;
+      if(traceShadow(position, lightDirection(constants, position)))
+        color *= .3f;
+      else
+        color += hit.specular;
+    }
+    radiance += throughput * color;
 
-  imageStore(image, ivec2(glray_LaunchID.xy), 
-    vec4(shader_rayPayload<vec3, 0>, 1.0));
+    throughput *= hit.reflectance;
+    if(max(throughput.x, max(throughput.y, throughput.z)) < 0.01f)
+      break;
+    ray.origin    = position;
+    ray.direction = reflect(ray.direction, hit.normal);
+  }
+
+  // One atomic per launch, not per ray.
+  atomicAdd(rayCounts[constants.frame], nbRays);
+
+  imageStore(image, ivec2(glray_LaunchID.xy), vec4(radiance, 1.0));
+}
+
+// Bin of a shadow ray: the octant of its direction, then the Morton code of
+// the cell of its origin. Origins out of the grid go to its border cells.
+// Same as shadowRayKey() of wavefront_math.cpp.
+inline uint shadowRayKey(Constants constants, vec3 origin, vec3 direction) {
+  uint octant = (direction.x < 0 ? 1 : 0) | (direction.y < 0 ? 2 : 0) | 
+    (direction.z < 0 ? 4 : 0);
+  float last = (1 << WF_GRID_BITS) - 1;
+  uvec3 cell = uvec3(clamp((origin - constants.gridOrigin) * constants.gridScale,
+    vec3(0), vec3(last)));
+
+  uint morton = 0;
+  for(int b = 0; b < WF_GRID_BITS; ++b) {
+    morton |= ((cell.x >> b) & 1) << (3 * b);
+    morton |= ((cell.y >> b) & 1) << (3 * b + 1);
+    morton |= ((cell.z >> b) & 1) << (3 * b + 2);
+  }
+  return (octant << (3 * WF_GRID_BITS)) | morton;
+}
+
+// Wavefront mode, first pass: the camera rays. The hits facing the light are
+// kept and their shadow ray counted in its bin, the other pixels are final.
+// Only the first hit is shaded, without reflections.
+[[spirv::rgen]]
+void rgen_primary_shader() {
+  Constants constants = shader_push<Constants>;
+  Ray ray = cameraRay();
+  HitPayload hit = traceHit(ray, MASK_PRIMARY);
+
+  uint pixel = glray_LaunchID.y * glray_LaunchSize.x + glray_LaunchID.x;
+  uint key = WF_NO_KEY;
+  if(hit.hitT >= 0 && hit.lit) {
+    vec3 position = ray.origin + ray.direction * hit.hitT;
+    key = constants.sortShadows ? 
+      shadowRayKey(constants, position, lightDirection(constants, position).xyz) : 0;
+    atomicAdd(shadowBins[key], 1);
+
+    WavefrontHit wavefrontHit;
+    wavefrontHit.position = vec4(position, 1);
+    wavefrontHit.color    = vec4(hit.color, 0);
+    wavefrontHit.specular = vec4(hit.specular, 0);
+    wavefrontHits[pixel]  = wavefrontHit;
+
+  } else {
+    imageStore(image, ivec2(glray_LaunchID.xy), vec4(hit.color, 1.0));
+  }
+  shadowKeys[pixel] = key;
+  atomicAdd(rayCounts[constants.frame], 1);
+}
+
+// Wavefront mode, last pass: the shadow rays in the order of their bins,
+// launched over the whole image. Neighboring invocations trace neighboring
+// rays going the same way.
+[[spirv::rgen]]
+void rgen_shadow_shader() {
+  uint index = glray_LaunchID.y * glray_LaunchSize.x + glray_LaunchID.x;
+  if(index >= shadowCount[0])
+    return;
+
+  Constants constants = shader_push<Constants>;
+  uint pixel = shadowRays[index];
+  WavefrontHit hit = wavefrontHits[pixel];
+  vec3 position = hit.position.xyz;
+
+  vec3 color = hit.color.xyz;
+  if(traceShadow(position, lightDirection(constants, position)))
+    color *= .3f;
+  else
+    color += hit.specular.xyz;
+
+  uint width = glray_LaunchSize.x;
+  imageStore(image, ivec2(pixel % width, pixel / width), vec4(color, 1.0));
+  atomicAdd(rayCounts[constants.frame], 1);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -77,64 +262,68 @@ void rgen_shader() {
 void rmiss_shader() {
   // Modulate the clear color.
   vec4 clearColor = shader_push<vec4>;
-  shader_rayPayloadIn<vec3, 0> = clearColor.xyz * 0.8f;
+  HitPayload payload { };
+  payload.color = clearColor.xyz * 0.8f;
+  payload.hitT  = -1;
+  shader_rayPayloadIn<HitPayload, 0> = payload;
 }
 
 [[spirv::rmiss]]
 void rmiss_shadow_shader() {
-  // The rmiss shader for the glray_Trace query sent by rchit.
+  // The rmiss shader for the shadow rays sent by rgen.
   shader_rayPayloadIn<bool, 1> = false;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct Constants {
-  float clearColor[4];
-  vec3  lightPosition;
-  float lightIntensity;
-  int   lightType;
-};
-
-[[spirv::rchit]]
-void rchit_shader() {
-  // Object of this instance.
-  SceneDesc desc = sceneDescs[glray_InstanceCustomIndex];
-  int objId = desc.objId;
-
-  mat4 transfo(desc.transfo);
-  mat4 transfoIT(desc.transfoIT);
+// Shading of the hit triangle. One permutation per light type and what the
+// materials of the instance share: kTexture 1 when all are textured, 0 when
+// none is, and kIllum their illumination model. -1 reads them from the
+// material of the triangle. The branches not taken are compiled out.
+template<int kLightType, int kTexture, int kIllum>
+inline void closestHit() {
+  // Buffers of the object, through their device addresses in the shader
+  // record: no descriptor indexing, no lookup of the instance. The transforms
+  // are the ones of the TLAS instance.
+  HitRecord record = hit_record;
+  const Vertex* vertices = (const Vertex*)record.vertexAddress;
+  const int* indices = (const int*)record.indexAddress;
+  const WaveFrontMaterial* materials = (const WaveFrontMaterial*)record.materialAddress;
+  const int* matIndices = (const int*)record.matIndexAddress;
+  int matOverride = record.matOverride;
 
   // Get the push constants.
   Constants constants = shader_push<Constants>;
 
-  // Note that nonuniformEXT is implicitly added by Circle when using a 
-  // dynamic non-uniform index into a resource array.
-  int indx = indices[objId].i[3 * glray_PrimitiveID + 0];
-  int indy = indices[objId].i[3 * glray_PrimitiveID + 1];
-  int indz = indices[objId].i[3 * glray_PrimitiveID + 2];
+  // The record is the one of the geometry: the primitive IDs start at 0 in
+  // each geometry of the LOD.
+  int primId = record.primOffset + glray_PrimitiveID;
+  int indx = indices[3 * primId + 0];
+  int indy = indices[3 * primId + 1];
+  int indz = indices[3 * primId + 2];
 
-  Vertex v0 = vertices[objId].v[indx];
-  Vertex v1 = vertices[objId].v[indy];
-  Vertex v2 = vertices[objId].v[indz]; 
+  Vertex v0 = vertices[indx];
+  Vertex v1 = vertices[indy];
+  Vertex v2 = vertices[indz]; 
 
   vec3 bary(1 - hit_attribs.x - hit_attribs.y, hit_attribs.x, hit_attribs.y);
 
   // Interpolate vertex normals.
   vec3 normal = mat3(v0.nrm, v1.nrm, v2.nrm) * bary;
-  normal = normalize((transfoIT * vec4(normal, 0)).xyz);
+  // The inverse transpose of the object-to-world matrix.
+  normal = normalize(transpose(mat3(glray_WorldToObject)) * normal);
 
   // Interpolate vertex positions.
   vec3 worldPos = mat3(v0.pos, v1.pos, v2.pos) * bary;
-  worldPos = (transfo * vec4(worldPos, 1)).xyz;
+  worldPos = glray_ObjectToWorld * vec4(worldPos, 1);
 
-  vec3 L = normalize(constants.lightPosition - worldPos);
+  vec3 L;
   float lightIntensity = constants.lightIntensity;
-  float d = 100000.0f;
 
-  if(constants.lightType == 0) {
+  if constexpr(kLightType == 0) {
     // Point light.
     vec3 lDir = constants.lightPosition - worldPos;
-    d = length(lDir);
+    float d = length(lDir);
     lightIntensity = constants.lightIntensity / (d * d);
     L = normalize(lDir);
 
@@ -142,74 +331,107 @@ void rchit_shader() {
     // Directional light.
     L = normalize(constants.lightPosition);
   }
-  // Non-uniform accesses.
-  int matIdx = matIndices[objId].i[glray_PrimitiveID];
-  WaveFrontMaterial mat = materials[objId].m[matIdx];
+  int matIdx = matOverride >= 0 ? matOverride : matIndices[primId];
+  WaveFrontMaterial mat = materials[matIdx];
+  // Reflection of illum 3 and above, which the permutations fold to 2.
+  bool reflective = mat.illum >= 3;
+  if constexpr(kIllum >= 0)
+    mat.illum = kIllum;  // Folds the tests of computeDiffuse and computeSpecular
 
   // Diffuse.
   vec3 diffuse = computeDiffuse(mat, L, normal);
-  if(mat.textureId >= 0) {
-    // Interpolate vertex uv coordinates.
-    vec2 uv = mat3x2(vec2(v0.uv), vec2(v1.uv), vec2(v2.uv)) * bary;
-
-    // Nonuniform access to textureSamplers resource array.
-    int txtId = mat.textureId + desc.txtOffset;
-    diffuse *= textureLod(textureSamplers[txtId], uv, 0).xyz;
+  if constexpr(kTexture != 0) {
+    if(kTexture > 0 || mat.textureId >= 0) {
+      // Interpolate vertex uv coordinates.
+      vec2 uv = mat3x2(vec2(v0.uv), vec2(v1.uv), vec2(v2.uv)) * bary;
+
+      // Nonuniform access to textureSamplers resource array.
+      int txtId = mat.textureId + record.txtOffset;
+      diffuse *= textureLod(textureSamplers[txtId], uv, 0).xyz;
+    }
   }
 
-  vec3 specular = 0;
-  float attenuation = 1;
-
-  if(dot(normal, L) > 0) {
-    float tMin = .001f;
-    float tMax = d;
-    vec3 origin = glray_WorldRayOrigin + glray_WorldRayDirection * glray_HitT;
-
-    uint flags = gl_RayFlagsTerminateOnFirstHit | gl_RayFlagsOpaque | 
-      gl_RayFlagsSkipClosestHitShader;
-
-    // Mark the fragment as shadowed. rmiss_shadow_shadow will reset this to
-    // false.
-    shader_rayPayload<bool, 1> = true;
-
-    glray_Trace(
-      topLevelAS,  // acceleration structure
-      flags,       // rayFlags
-      0xFF,        // cullMask
-      0,           // sbtRecordOffset
-      0,           // sbtRecordStride
-      1,           // missIndex
-      origin,      // ray origin
-      tMin,        // ray min range
-      L,           // ray direction
-      tMax,        // ray max range
-      1            // payload (location = 1)
-    );
-
-    bool b = shader_rayPayload<bool, 1>;
-    if(b) {
-      attenuation = .3;
-    } else {
-      specular = computeSpecular(mat, glray_WorldRayDirection, L, normal);
-    }
+  // The shadow ray is traced by rgen, which adds the specular when the light
+  // is not blocked.
+  HitPayload payload { };
+  payload.color = lightIntensity * diffuse;
+  payload.hitT  = glray_HitT;
+  payload.lit   = dot(normal, L) > 0;
+  if(payload.lit)
+    payload.specular = lightIntensity * 
+      computeSpecular(mat, glray_WorldRayDirection, L, normal);
+  payload.normal = dot(normal, glray_WorldRayDirection) > 0 ? -normal : normal;
+  if(reflective)
+    payload.reflectance = mat.specular;
+  shader_rayPayloadIn<HitPayload, 0> = payload;
+}
+
+// The BLAS of the instance is one LOD of the model, its geometry 0 the opaque
+// triangles of the LOD and geometry 1 the alpha-tested ones, both using this
+// shader. kMaterial is the material permutation, see shaders.hxx.
+template<int kLightType, int kMaterial>
+[[spirv::rchit]]
+void rchit_shader() {
+  constexpr int kTexture = kMaterial > 0 ? (kMaterial - 1) / 3 : -1;
+  constexpr int kIllum   = kMaterial > 0 ? (kMaterial - 1) % 3 : -1;
+  closestHit<kLightType, kTexture, kIllum>();
+}
+
+// Alpha test of the triangles of materials with a dissolve below 1: the
+// dissolve times the alpha of the texture. The ray goes through the parts
+// below one half, for the camera and the shadow rays.
+[[spirv::rahit]]
+void rahit_alpha_shader() {
+  HitRecord record = hit_record;
+  const Vertex* vertices = (const Vertex*)record.vertexAddress;
+  const int* indices = (const int*)record.indexAddress;
+  const WaveFrontMaterial* materials = (const WaveFrontMaterial*)record.materialAddress;
+  const int* matIndices = (const int*)record.matIndexAddress;
+
+  int primId = record.primOffset + glray_PrimitiveID;
+  int matIdx = record.matOverride >= 0 ? record.matOverride : matIndices[primId];
+  WaveFrontMaterial mat = materials[matIdx];
+
+  float alpha = mat.dissolve;
+  if(mat.textureId >= 0) {
+    vec2 uv0 = vec2(vertices[indices[3 * primId + 0]].uv);
+    vec2 uv1 = vec2(vertices[indices[3 * primId + 1]].uv);
+    vec2 uv2 = vec2(vertices[indices[3 * primId + 2]].uv);
+    vec3 bary(1 - hit_attribs.x - hit_attribs.y, hit_attribs.x, hit_attribs.y);
+    vec2 uv = mat3x2(uv0, uv1, uv2) * bary;
+
+    int txtId = mat.textureId + record.txtOffset;
+    alpha *= textureLod(textureSamplers[txtId], uv, 0).w;
   }
 
-  shader_rayPayloadIn<vec3, 0> = 
-    lightIntensity * attenuation * (diffuse + specular);
+  if(alpha < 0.5f)
+    glray_IgnoreIntersection();
+}
+
+// The closest-hit permutations are instantiated at compile time.
+static raytrace_shaders_t makeRaytraceShaders() {
+  raytrace_shaders_t shaders {
+    __spirv_data,
+    __spirv_size,
+    @spirv(rgen_shader),
+    @spirv(rgen_primary_shader),
+    @spirv(rgen_shadow_shader),
+    @spirv(rmiss_shader),
+
+    // NVIDIA Bug 3092604:
+    // rmiss shader never invoked from rchit if more than 1 rmiss is in the
+    // SPIR-V module. The rmiss_shadow_shader is compiled in rmiss_shadow.cxx
+    // until this bug ins fixed.
+    0, // @spirv(rmiss_shadow_shader),
+  };
+
+  @meta for(int l = 0; l < RT_NB_LIGHT_TYPES; l++) {
+    @meta for(int m = 0; m < RT_NB_MATERIAL_PERMUTATIONS; m++)
+      shaders.rchit[l][m] = @spirv(rchit_shader<l, m>);
+  }
+  shaders.rahit_alpha = @spirv(rahit_alpha_shader);
+  return shaders;
 }
 
 // This struct hash external linkage.
-raytrace_shaders_t raytrace_shaders {
-  __spirv_data,
-  __spirv_size,
-  @spirv(rgen_shader),
-  @spirv(rmiss_shader),
-
-  // NVIDIA Bug 3092604:
-  // rmiss shader never invoked from rchit if more than 1 rmiss is in the
-  // SPIR-V module. The rmiss_shadow_shader is compiled in rmiss_shadow.cxx
-  // until this bug ins fixed.
-  0, // @spirv(rmiss_shadow_shader),
-
-  @spirv(rchit_shader)
-}; 
\ No newline at end of file
+raytrace_shaders_t raytrace_shaders = makeRaytraceShaders(); 
\ No newline at end of file
@@ -6,7 +6,7 @@ type_t shader_rayPayloadIn;
 
 [[spirv::rmiss]]
 void rmiss_shadow_shader() {
-  // The rmiss shader for the glray_Trace query sent by rchit.
+  // The rmiss shader for the shadow rays sent by rgen.
   shader_rayPayloadIn<bool, 1> = false;
 }
 
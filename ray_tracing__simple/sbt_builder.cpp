@@ -0,0 +1,143 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "nvh/alignment.hpp"
+#include "sbt_builder.h"
+
+void SbtBuilder::setup(const vk::Device&                                        device,
+                       const vk::PhysicalDeviceRayTracingPipelinePropertiesKHR& properties,
+                       PoolAllocator*                                           allocator,
+                       UploadService*                                           uploads)
+{
+  m_device  = device;
+  m_alloc   = allocator;
+  m_uploads = uploads;
+  m_debug.setup(device);
+  m_properties.handleSize      = properties.shaderGroupHandleSize;
+  m_properties.handleAlignment = properties.shaderGroupHandleAlignment;
+  m_properties.baseAlignment   = properties.shaderGroupBaseAlignment;
+  m_properties.maxStride       = properties.maxShaderGroupStride;
+}
+
+void SbtBuilder::destroy()
+{
+  m_alloc->destroy(m_buffer);
+  m_regions = {};
+  clear();
+}
+
+void SbtBuilder::clear()
+{
+  for(auto& records : m_records)
+    records.clear();
+  m_data.clear();
+}
+
+uint32_t SbtBuilder::addRecord(Region region, uint32_t group, const void* data, uint32_t dataSize)
+{
+  Record record;
+  record.group      = group;
+  record.dataOffset = static_cast<uint32_t>(m_data.size());
+  record.dataSize   = dataSize;
+  if(dataSize > 0)
+  {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    m_data.insert(m_data.end(), bytes, bytes + dataSize);
+  }
+  m_records[region].push_back(record);
+  return static_cast<uint32_t>(m_records[region].size() - 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The table is written on the host then uploaded. Buffer device addresses are only guaranteed
+// to follow the alignment of the memory requirements: the table starts at the first multiple of
+// the base alignment in its buffer.
+//
+uint64_t SbtBuilder::create(vk::Pipeline pipeline, uint32_t nbGroups)
+{
+  std::array<uint32_t, eNbRegions> nbRecords{};
+  std::array<uint32_t, eNbRegions> maxDataSizes{};
+  for(int r = 0; r < eNbRegions; r++)
+  {
+    nbRecords[r] = static_cast<uint32_t>(m_records[r].size());
+    for(const Record& record : m_records[r])
+      maxDataSizes[r] = std::max(maxDataSizes[r], record.dataSize);
+  }
+  m_layout = computeLayout(m_properties, nbRecords, maxDataSizes);
+
+  // Handles of all the groups, one after the other
+  uint32_t             handleSize = m_properties.handleSize;
+  std::vector<uint8_t> handles(nbGroups * handleSize);
+  vk::Result result = m_device.getRayTracingShaderGroupHandlesKHR(pipeline, 0, nbGroups,
+                                                                  handles.size(), handles.data());
+  if(result != vk::Result::eSuccess)
+    throw std::runtime_error("Cannot get the shader group handles");
+
+  std::vector<uint8_t> table(m_layout.totalSize, 0);
+  for(int r = 0; r < eNbRegions; r++)
+  {
+    for(size_t i = 0; i < m_records[r].size(); i++)
+    {
+      const Record& record = m_records[r][i];
+      if(record.group >= nbGroups)
+        throw std::runtime_error("Shader record of group " + std::to_string(record.group)
+                                 + ", the pipeline has " + std::to_string(nbGroups));
+      uint8_t* dst = table.data() + m_layout.offset[r] + i * m_layout.stride[r];
+      memcpy(dst, handles.data() + record.group * handleSize, handleSize);
+      if(record.dataSize > 0)
+        memcpy(dst + handleSize, m_data.data() + record.dataOffset, record.dataSize);
+    }
+  }
+
+  m_alloc->destroy(m_buffer);
+  m_buffer = m_alloc->createBuffer(m_layout.totalSize + m_properties.baseAlignment,
+                                   vk::BufferUsageFlagBits::eTransferDst
+                                       | vk::BufferUsageFlagBits::eShaderDeviceAddress
+                                       | vk::BufferUsageFlagBits::eShaderBindingTableKHR);
+  m_debug.setObjectName(m_buffer.buffer, "SBT");
+  vk::DeviceAddress address = m_device.getBufferAddress({m_buffer.buffer});
+  vk::DeviceAddress start   = nvh::align_up(address, vk::DeviceAddress(m_properties.baseAlignment));
+  m_uploads->uploadBuffer(m_buffer, start - address, table.data(), table.size());
+
+  for(int r = 0; r < eNbRegions; r++)
+  {
+    m_regions[r] = vk::StridedDeviceAddressRegionKHR();
+    if(m_layout.size[r] == 0)
+      continue;
+    m_regions[r].setDeviceAddress(start + m_layout.offset[r]);
+    m_regions[r].setStride(m_layout.stride[r]);
+    m_regions[r].setSize(m_layout.size[r]);
+  }
+  // The size of the raygen region is its stride: one shader
+  m_regions[eRaygen].setSize(m_regions[eRaygen].stride);
+  return m_uploads->flush();
+}
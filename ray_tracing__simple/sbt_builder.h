@@ -0,0 +1,147 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <array>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "nvvk/debug_util_vk.hpp"
+
+#include "pool_allocator.h"
+#include "upload_service.h"
+
+//--------------------------------------------------------------------------------------------------
+// Shader binding table of a ray tracing pipeline
+// - Each record of the four regions (raygen, miss, hit, callable) is the handle of a group of
+//   the pipeline, followed by optional data: the shader record read by the shaders
+// - The stride of a region fits its largest record and is a multiple of the handle alignment,
+//   each region starts at a multiple of the base alignment. The raygen stride is a multiple of
+//   the base alignment too, so that each raygen record can be launched, see getRaygenRegion()
+// - The layout only depends on the device properties and on the records: computeLayout() is
+//   plain host code, in sbt_layout.cpp
+// - The table is uploaded to device-local memory, see create()
+//
+class SbtBuilder
+{
+public:
+  enum Region
+  {
+    eRaygen,
+    eMiss,
+    eHit,
+    eCallable,
+    eNbRegions
+  };
+
+  // Of vk::PhysicalDeviceRayTracingPipelinePropertiesKHR
+  struct Properties
+  {
+    uint32_t handleSize{32};
+    uint32_t handleAlignment{32};  // Of the strides
+    uint32_t baseAlignment{64};    // Of the regions
+    uint32_t maxStride{4096};
+  };
+
+  // Bytes from the start of the table. Empty regions have a null stride and size.
+  struct Layout
+  {
+    std::array<vk::DeviceSize, eNbRegions> offset{};
+    std::array<vk::DeviceSize, eNbRegions> stride{};
+    std::array<vk::DeviceSize, eNbRegions> size{};
+    vk::DeviceSize                         totalSize{0};
+  };
+
+  // Number of records and largest data of each region. Throws std::runtime_error when a stride
+  // exceeds the maximum.
+  static Layout computeLayout(const Properties&                       properties,
+                              const std::array<uint32_t, eNbRegions>& nbRecords,
+                              const std::array<uint32_t, eNbRegions>& maxDataSizes);
+
+  void setup(const vk::Device&                                        device,
+             const vk::PhysicalDeviceRayTracingPipelinePropertiesKHR& properties,
+             PoolAllocator*                                           allocator,
+             UploadService*                                           uploads);
+  void destroy();
+
+  // Removes the records, the table is unchanged until the next create()
+  void clear();
+  // Record of group `group` of the pipeline, with `dataSize` bytes of shader record data. Returns
+  // the index of the record in its region.
+  uint32_t addRecord(Region      region,
+                     uint32_t    group,
+                     const void* data     = nullptr,
+                     uint32_t    dataSize = 0);
+  template <typename T>
+  uint32_t addRecord(Region region, uint32_t group, const T& data)
+  {
+    return addRecord(region, group, &data, static_cast<uint32_t>(sizeof(T)));
+  }
+
+  // Writes the handles of the groups of the pipeline and the data of the records in a new table,
+  // replacing the previous one: no frame in flight may use it anymore. The table is usable once
+  // the returned upload ticket completed.
+  uint64_t create(vk::Pipeline pipeline, uint32_t nbGroups);
+
+  // Regions for vkCmdTraceRaysKHR. The raygen region is its first record.
+  const std::array<vk::StridedDeviceAddressRegionKHR, eNbRegions>& getRegions() const
+  {
+    return m_regions;
+  }
+  // Raygen region of another raygen record, to launch that shader
+  vk::StridedDeviceAddressRegionKHR getRaygenRegion(uint32_t record) const
+  {
+    vk::StridedDeviceAddressRegionKHR region = m_regions[eRaygen];
+    region.setDeviceAddress(region.deviceAddress + record * region.stride);
+    return region;
+  }
+  const Layout& getLayout() const { return m_layout; }
+  uint32_t getNbRecords(Region region) const
+  {
+    return static_cast<uint32_t>(m_records[region].size());
+  }
+
+private:
+  struct Record
+  {
+    uint32_t group{0};
+    uint32_t dataOffset{0};  // In m_data
+    uint32_t dataSize{0};
+  };
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  UploadService*  m_uploads{nullptr};
+  nvvk::DebugUtil m_debug;
+  Properties      m_properties;
+
+  std::array<std::vector<Record>, eNbRegions> m_records;
+  std::vector<uint8_t>                        m_data;
+
+  Layout                                                    m_layout;
+  nvvk::Buffer                                              m_buffer;
+  std::array<vk::StridedDeviceAddressRegionKHR, eNbRegions> m_regions{};
+};
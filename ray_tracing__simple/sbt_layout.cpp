@@ -0,0 +1,66 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "nvh/alignment.hpp"
+#include "sbt_builder.h"
+
+//--------------------------------------------------------------------------------------------------
+// The regions follow each other in the order of Region
+//
+SbtBuilder::Layout SbtBuilder::computeLayout(const Properties&                       properties,
+                                             const std::array<uint32_t, eNbRegions>& nbRecords,
+                                             const std::array<uint32_t, eNbRegions>& maxDataSizes)
+{
+  Layout         layout;
+  vk::DeviceSize offset = 0;
+  for(int r = 0; r < eNbRegions; r++)
+  {
+    if(nbRecords[r] == 0)
+      continue;
+    // Each raygen record is launched as its own region, which must start at a multiple of the
+    // base alignment
+    uint32_t alignment =
+        r == eRaygen ? std::max(properties.handleAlignment, properties.baseAlignment) :
+                       properties.handleAlignment;
+    vk::DeviceSize stride = nvh::align_up(properties.handleSize + maxDataSizes[r], alignment);
+    if(stride > properties.maxStride)
+      throw std::runtime_error("Shader record of " + std::to_string(maxDataSizes[r])
+                               + " bytes over the maximum stride");
+
+    offset           = nvh::align_up(offset, properties.baseAlignment);
+    layout.offset[r] = offset;
+    layout.stride[r] = stride;
+    layout.size[r]   = stride * nbRecords[r];
+    offset += layout.size[r];
+  }
+  layout.totalSize = offset;
+  return layout;
+}
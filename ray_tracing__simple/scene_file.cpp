@@ -0,0 +1,490 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+
+#include "nvh/nvprint.hpp"
+#include "scene_file.h"
+
+static_assert(sizeof(SceneFile::Instance) == 64, "Instance is the record of the binary form");
+
+namespace {
+const char     kMagic[8]     = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t kVersion      = 1;
+const size_t   kBlockSize    = 1 << 20;  // Bytes of text per block parsed
+const size_t   kRecordBatch  = 1 << 16;  // Binary instances read at once
+const uint32_t kModelDynamic = 0x1;      // Flag of the models in the binary form
+const float    kPi           = 3.14159265f;
+
+struct BinaryHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t nbModels;
+  uint64_t nbInstances;
+};
+
+// Statements of a block of lines, and the first error in it
+struct ParsedBlock
+{
+  std::vector<SceneFile::Model>    models;
+  std::vector<SceneFile::Instance> instances;
+  uint32_t                         nbLines{0};
+  uint32_t                         errorLine{0};  // From 1 in the block, 0 if none
+  std::string                      error;
+};
+
+bool isSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Tokens of a line, without its comment. A token between double quotes can have spaces.
+struct LineCursor
+{
+  const char* p;
+  const char* end;
+
+  bool next(std::string_view& token)
+  {
+    while(p < end && isSpace(*p))
+      p++;
+    if(p == end)
+      return false;
+    if(*p == '"')
+    {
+      const char* begin = ++p;
+      while(p < end && *p != '"')
+        p++;
+      token = std::string_view(begin, p - begin);
+      p     = std::min(p + 1, end);
+      return true;
+    }
+    const char* begin = p;
+    while(p < end && !isSpace(*p))
+      p++;
+    token = std::string_view(begin, p - begin);
+    return true;
+  }
+
+  bool nextFloat(float& value)
+  {
+    std::string_view token;
+    if(!next(token))
+      return false;
+    char* tokenEnd;
+    value = strtof(token.data(), &tokenEnd);
+    return tokenEnd == token.data() + token.size();
+  }
+
+  // Base 0 also reads hexadecimal and octal
+  bool nextInt(long long& value, int base = 10)
+  {
+    std::string_view token;
+    if(!next(token))
+      return false;
+    char* tokenEnd;
+    value = strtoll(token.data(), &tokenEnd, base);
+    return tokenEnd == token.data() + token.size();
+  }
+};
+
+// Parses one statement, returns an error message or nullptr
+const char* parseLine(LineCursor& line, ParsedBlock& out)
+{
+  std::string_view keyword;
+  if(!line.next(keyword))
+    return nullptr;  // Blank or comment
+
+  if(keyword == "model")
+  {
+    SceneFile::Model model;
+    std::string_view token;
+    if(!line.next(token))
+      return "model without path";
+    model.path = std::string(token);
+    while(line.next(token))
+    {
+      if(token != "dynamic")
+        return "unknown model option";
+      model.dynamic = true;
+    }
+    out.models.push_back(std::move(model));
+    return nullptr;
+  }
+
+  if(keyword == "instance")
+  {
+    SceneFile::Instance instance;
+    long long           value;
+    if(!line.nextInt(value) || value < 0 || value > UINT32_MAX)
+      return "instance without a valid model number";
+    instance.model = static_cast<uint32_t>(value);
+    for(float& element : instance.transform)
+    {
+      if(!line.nextFloat(element))
+        return "instance transform needs 12 numbers";
+    }
+    std::string_view option;
+    while(line.next(option))
+    {
+      if(option == "material")
+      {
+        if(!line.nextInt(value) || value < -1 || value > INT32_MAX)
+          return "invalid material";
+        instance.material = static_cast<int32_t>(value);
+      }
+      else if(option == "mask")
+      {
+        if(!line.nextInt(value, 0) || value < 0 || value > 0xFF)
+          return "mask is 8 bits";
+        instance.mask = static_cast<uint32_t>(value);
+      }
+      else
+        return "unknown instance option";
+    }
+    out.instances.push_back(instance);
+    return nullptr;
+  }
+
+  return "unknown statement";
+}
+
+void parseBlock(const std::string& block, ParsedBlock& out)
+{
+  const char* p   = block.data();
+  const char* end = p + block.size();
+  while(p < end)
+  {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    eol             = eol ? eol : end;
+    const char* hash = static_cast<const char*>(memchr(p, '#', eol - p));
+    out.nbLines++;
+
+    LineCursor  line{p, hash ? hash : eol};
+    const char* error = parseLine(line, out);
+    if(error)
+    {
+      out.errorLine = out.nbLines;
+      out.error     = error;
+      return;
+    }
+    p = eol + 1;
+  }
+}
+
+void readExactly(FILE* file, void* data, size_t size, const std::string& filename)
+{
+  if(size > 0 && fread(data, size, 1, file) != 1)
+    throw std::runtime_error(filename + ": truncated scene file");
+}
+}  // namespace
+
+//--------------------------------------------------------------------------------------------------
+// Binary files start with kMagic, anything else is read as text
+//
+void SceneFile::load(const std::string& filename, ThreadPool& pool)
+{
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+    throw std::runtime_error("Cannot open scene file " + filename);
+
+  m_models.clear();
+  m_instances.clear();
+  try
+  {
+    char   magic[sizeof(kMagic)];
+    size_t read = fread(magic, 1, sizeof(magic), file);
+    if(read == sizeof(magic) && memcmp(magic, kMagic, sizeof(magic)) == 0)
+      loadBinary(file, filename);
+    else
+    {
+      rewind(file);
+      loadText(file, filename, pool);
+    }
+  }
+  catch(...)
+  {
+    fclose(file);
+    throw;
+  }
+  fclose(file);
+
+  validate(filename, pool);
+  LOGI("Scene %s: %zu models, %zu instances\n", filename.c_str(), m_models.size(),
+       m_instances.size());
+}
+
+//--------------------------------------------------------------------------------------------------
+// Blocks of text end at a line end, the partial line left over starts the next block. A batch of
+// blocks, one per thread, is parsed in parallel then appended in order: only one batch of text is
+// in memory.
+//
+void SceneFile::loadText(FILE* file, const std::string& filename, ThreadPool& pool)
+{
+  size_t                   nbBlocks = pool.size() + 1;
+  std::vector<std::string> blocks(nbBlocks);
+  std::vector<ParsedBlock> parsed(nbBlocks);
+  std::string              carry;
+  uint32_t                 firstLine = 1;
+  bool                     eof       = false;
+  while(!eof)
+  {
+    size_t n = 0;
+    while(n < nbBlocks && !eof)
+    {
+      std::string& block = blocks[n];
+      block.swap(carry);
+      carry.clear();
+      size_t start = block.size();
+      block.resize(start + kBlockSize);
+      size_t read = fread(&block[start], 1, kBlockSize, file);
+      block.resize(start + read);
+      eof = read < kBlockSize;
+      if(!eof)
+      {
+        size_t lastEol = block.rfind('\n');
+        if(lastEol == std::string::npos)
+        {
+          block.swap(carry);  // Line longer than a block, the next read continues it
+          continue;
+        }
+        carry.assign(block, lastEol + 1, std::string::npos);
+        block.resize(lastEol + 1);
+      }
+      n++;
+    }
+
+    pool.parallelFor(n, 1, [&](size_t begin, size_t end) {
+      for(size_t b = begin; b < end; b++)
+      {
+        parsed[b] = ParsedBlock();
+        parseBlock(blocks[b], parsed[b]);
+      }
+    });
+
+    for(size_t b = 0; b < n; b++)
+    {
+      const ParsedBlock& block = parsed[b];
+      if(block.errorLine)
+        throw std::runtime_error(filename + ":" + std::to_string(firstLine + block.errorLine - 1)
+                                 + ": " + block.error);
+      firstLine += block.nbLines;
+      m_models.insert(m_models.end(), block.models.begin(), block.models.end());
+      m_instances.insert(m_instances.end(), block.instances.begin(), block.instances.end());
+    }
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// The instances are read in batches, so that a corrupted count fails on the missing data instead
+// of allocating it all
+//
+void SceneFile::loadBinary(FILE* file, const std::string& filename)
+{
+  BinaryHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  readExactly(file, &header.version, sizeof(header) - sizeof(header.magic), filename);
+  if(header.version != kVersion)
+    throw std::runtime_error(filename + ": unsupported scene file version "
+                             + std::to_string(header.version));
+
+  m_models.resize(header.nbModels);
+  for(Model& model : m_models)
+  {
+    uint32_t flags, length;
+    readExactly(file, &flags, sizeof(flags), filename);
+    readExactly(file, &length, sizeof(length), filename);
+    if(length > 4096)
+      throw std::runtime_error(filename + ": model path too long");
+    model.path.resize(length);
+    readExactly(file, &model.path[0], length, filename);
+    model.dynamic = (flags & kModelDynamic) != 0;
+  }
+
+  for(uint64_t done = 0; done < header.nbInstances;)
+  {
+    size_t batch = static_cast<size_t>(std::min<uint64_t>(kRecordBatch, header.nbInstances - done));
+    m_instances.resize(m_instances.size() + batch);
+    readExactly(file, &m_instances[done], batch * sizeof(Instance), filename);
+    done += batch;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// References to models, checked once all are declared
+//
+void SceneFile::validate(const std::string& filename, ThreadPool& pool) const
+{
+  std::atomic<size_t> firstInvalid{m_instances.size()};
+  uint32_t            nbModels = static_cast<uint32_t>(m_models.size());
+  pool.parallelFor(m_instances.size(), kRecordBatch, [&](size_t begin, size_t end) {
+    for(size_t i = begin; i < end; i++)
+    {
+      const Instance& instance = m_instances[i];
+      if(instance.model >= nbModels || instance.material < -1 || instance.mask > 0xFF)
+      {
+        size_t current = firstInvalid;
+        while(i < current && !firstInvalid.compare_exchange_weak(current, i))
+        {
+        }
+        return;
+      }
+    }
+  });
+
+  if(firstInvalid < m_instances.size())
+  {
+    const Instance& instance = m_instances[firstInvalid];
+    throw std::runtime_error(filename + ": instance " + std::to_string(firstInvalid) + " has model "
+                             + std::to_string(instance.model) + " of "
+                             + std::to_string(nbModels) + ", material "
+                             + std::to_string(instance.material) + ", mask "
+                             + std::to_string(instance.mask));
+  }
+}
+
+void SceneFile::save(const std::string& filename) const
+{
+  const char* suffix = ".sceneb";
+  bool        binary = filename.size() >= strlen(suffix)
+                && filename.compare(filename.size() - strlen(suffix), strlen(suffix), suffix) == 0;
+
+  FILE* file = fopen(filename.c_str(), binary ? "wb" : "w");
+  if(!file)
+    throw std::runtime_error("Cannot write scene file " + filename);
+
+  if(binary)
+  {
+    BinaryHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version     = kVersion;
+    header.nbModels    = static_cast<uint32_t>(m_models.size());
+    header.nbInstances = m_instances.size();
+    fwrite(&header, sizeof(header), 1, file);
+    for(const Model& model : m_models)
+    {
+      uint32_t flags  = model.dynamic ? kModelDynamic : 0;
+      uint32_t length = static_cast<uint32_t>(model.path.size());
+      fwrite(&flags, sizeof(flags), 1, file);
+      fwrite(&length, sizeof(length), 1, file);
+      fwrite(model.path.data(), 1, length, file);
+    }
+    fwrite(m_instances.data(), sizeof(Instance), m_instances.size(), file);
+  }
+  else
+  {
+    fprintf(file, "# %zu models, %zu instances\n", m_models.size(), m_instances.size());
+    for(const Model& model : m_models)
+      fprintf(file, "model \"%s\"%s\n", model.path.c_str(), model.dynamic ? " dynamic" : "");
+    // 9 digits: the values read back are the same floats
+    for(const Instance& instance : m_instances)
+    {
+      const float* t = instance.transform;
+      fprintf(file, "instance %u %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g",
+              instance.model, t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7], t[8], t[9], t[10],
+              t[11]);
+      if(instance.material >= 0)
+        fprintf(file, " material %d", instance.material);
+      if(instance.mask != 0xFF)
+        fprintf(file, " mask 0x%02X", instance.mask);
+      fprintf(file, "\n");
+    }
+  }
+
+  bool failed = ferror(file) != 0;
+  if(fclose(file) != 0 || failed)
+    throw std::runtime_error("Error writing scene file " + filename);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The models are the ones of the media, about 2 to 4 units large. One per cell of a square grid,
+// randomly moved in its cell, turned and scaled to fit it.
+//
+SceneFile SceneFile::generate(uint32_t nbInstances, uint32_t seed)
+{
+  struct GeneratedModel
+  {
+    const char* path;
+    float       minScale;
+    float       maxScale;
+  };
+  const GeneratedModel models[] = {{"media/scenes/Medieval_building.obj", 0.15f, 0.35f},
+                                   {"media/scenes/cube_multi.obj", 0.5f, 1.f},
+                                   {"media/scenes/sphere.obj", 0.25f, 0.5f},
+                                   {"media/scenes/wuson.obj", 0.3f, 0.6f}};
+  const uint32_t nbGenerated = sizeof(models) / sizeof(models[0]);
+
+  SceneFile scene;
+  scene.m_models.push_back({"media/scenes/plane.obj", false});  // 40 units wide
+  for(const GeneratedModel& model : models)
+    scene.m_models.push_back({model.path, false});
+
+  const float cell   = 2.f;
+  uint32_t    side   = static_cast<uint32_t>(std::ceil(std::sqrt(double(nbInstances))));
+  float       extent = std::max(side, 1u) * cell;
+
+  Instance ground;
+  ground.model         = 0;
+  ground.mask          = 0x05;  // Not hit by the shadow rays
+  ground.transform[0]  = extent / 40.f;
+  ground.transform[10] = extent / 40.f;
+  scene.m_instances.reserve(size_t(nbInstances) + 1);
+  scene.m_instances.push_back(ground);
+
+  std::mt19937                            gen(seed);
+  std::uniform_int_distribution<uint32_t> disModel(0, nbGenerated - 1);
+  std::uniform_real_distribution<float>   disJitter(-0.25f * cell, 0.25f * cell);
+  std::uniform_real_distribution<float>   disAngle(0.f, 2.f * kPi);
+  std::uniform_real_distribution<float>   dis01(0.f, 1.f);
+  for(uint32_t i = 0; i < nbInstances; i++)
+  {
+    uint32_t              m     = disModel(gen);
+    const GeneratedModel& model = models[m];
+    float x     = (float(i % side) + 0.5f) * cell - 0.5f * extent + disJitter(gen);
+    float z     = (float(i / side) + 0.5f) * cell - 0.5f * extent + disJitter(gen);
+    float angle = disAngle(gen);
+    float scale = model.minScale + (model.maxScale - model.minScale) * dis01(gen);
+    float c     = scale * std::cos(angle);
+    float s     = scale * std::sin(angle);
+
+    // Rotation around Y, then the translation
+    Instance instance;
+    instance.model    = m + 1;
+    instance.material = dis01(gen) < 1.f / 16.f ? 0 : -1;
+    const float transform[12] = {c, 0.f, s, x, 0.f, scale, 0.f, 0.f, -s, 0.f, c, z};
+    memcpy(instance.transform, transform, sizeof(transform));
+    scene.m_instances.push_back(instance);
+  }
+  return scene;
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+//--------------------------------------------------------------------------------------------------
+// Scene made of models referenced by path and of instances of them, in a text or a binary file
+// - Text form, one statement per line, `#` starting a comment:
+//     model <path> [dynamic]
+//     instance <model> <3x4 transform, 12 values row by row> [material <m>] [mask <m>]
+//   Models are numbered from 0 in the order they are declared. `material` makes all triangles of
+//   the instance use material m of its model. `mask` tells which rays see the instance, by bits:
+//   1 camera rays, 2 shadow rays, 4 reflected rays. Visible to all by default.
+// - Binary form: a header, the models, then the instances as 64-byte records (little endian)
+// - Files are read in blocks, the blocks of text being parsed in parallel on the thread pool.
+//   The models are only referenced: the renderer loads each of them once, whatever the number of
+//   instances.
+//
+class SceneFile
+{
+public:
+  struct Model
+  {
+    std::string path;  // As written, resolved by the application
+    bool        dynamic{false};
+  };
+
+  // Also the record of the binary form
+  struct Instance
+  {
+    uint32_t model{0};
+    int32_t  material{-1};  // Material of the model used by all triangles, -1 for their own
+    uint32_t mask{0xFF};
+    uint32_t reserved{0};
+    float    transform[12]{1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f};
+  };
+
+  // Text or binary, told by the first bytes. Throws std::runtime_error, with the line of text
+  // files, on malformed statements and references to undeclared models.
+  void load(const std::string& filename, ThreadPool& pool);
+  // Binary form when the name ends with ".sceneb", else text
+  void save(const std::string& filename) const;
+
+  // Synthetic scene for scale tests: nbInstances models of the media on a grid, over a ground
+  // plane. A few instances override their material, the ground casts no shadow.
+  static SceneFile generate(uint32_t nbInstances, uint32_t seed = 42);
+
+  std::vector<Model>    m_models;
+  std::vector<Instance> m_instances;
+
+private:
+  void loadText(FILE* file, const std::string& filename, ThreadPool& pool);
+  void loadBinary(FILE* file, const std::string& filename);
+  void validate(const std::string& filename, ThreadPool& pool) const;
+};
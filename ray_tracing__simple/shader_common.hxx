@@ -30,6 +30,12 @@ template<typename type_t, int location>
 [[using spirv: rayPayloadIn, location(location)]]
 type_t shader_rayPayloadIn;
 
+// Visibility masks of the instances. The cull mask of a ray is the bit of its 
+// type: it only hits the instances visible to that type.
+constexpr uint MASK_PRIMARY    = 0x01;  // Seen by the camera rays.
+constexpr uint MASK_SHADOW     = 0x02;  // Casts shadows.
+constexpr uint MASK_REFLECTION = 0x04;  // Seen by the reflected rays.
+
 struct camera_t {
   mat4 view, proj, viewInv, projInv;
 };
@@ -55,13 +61,53 @@ struct WaveFrontMaterial {
   int   textureId;
 };
 
+// Entry of the object table: device addresses of the buffers of the object,
+// read through buffer references, and the first slot of its textures.
+struct ObjDesc {
+  uint64_t vertexAddress;    // Vertex[]
+  uint64_t indexAddress;     // int[], 3 per triangle, all the LODs
+  uint64_t materialAddress;  // WaveFrontMaterial[]
+  uint64_t matIndexAddress;  // int[], 1 per triangle
+  int      txtOffset;
+  int      padding;
+};
+
+// Shader record of the hit groups: the object of the instance, its LOD and
+// its material override. The ray tracing shaders read no scene description.
+struct HitRecord {
+  uint64_t vertexAddress;    // Vertex[]
+  uint64_t indexAddress;     // int[], 3 per triangle, all the LODs
+  uint64_t materialAddress;  // WaveFrontMaterial[]
+  uint64_t matIndexAddress;  // int[], 1 per triangle
+  int      txtOffset;
+  int      primOffset;  // First triangle of the geometry, in the model.
+  int      matOverride;
+  int      padding;
+};
+
 struct SceneDesc {
   int  objId;
-  int  txtOffset;
-  float transfo[16];
-  float transfoIT[16];
+  int  primOffset;  // First triangle of the LOD, in the indices of the model.
+  int  matOverride;  // Material of all triangles, -1 for their own.
+  int  reserved;
+  vec4 transfo[3];  // Rows of the 3x4 object-to-world matrix.
 };
 
+// Object-to-world matrix of an instance.
+inline mat4 instanceTransform(SceneDesc desc) {
+  return transpose(mat4(desc.transfo[0], desc.transfo[1], desc.transfo[2], 
+    vec4(0, 0, 0, 1)));
+}
+
+// Normal matrix of an instance: the cofactors of its 3x3 part, which are the 
+// inverse transpose scaled by the determinant. Only the sign of the 
+// determinant is kept, the normals being normalized.
+inline mat3 instanceNormalMatrix(SceneDesc desc) {
+  mat3 m = mat3(instanceTransform(desc));
+  mat3 cof(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+  return cof * sign(dot(m[0], cof[0]));
+}
+
 inline vec3 computeDiffuse(WaveFrontMaterial mat, vec3 lightDir, vec3 normal) {
   // Lambertian
   float dotNL = max(dot(normal, lightDir), 0.f);
@@ -1,13 +1,33 @@
 #pragma once
 
+// Closest-hit permutations of raytrace.cxx: per light type, one per material
+// permutation, each in a hit group for the opaque and one for the
+// alpha-tested geometry. Material permutation 0 is the general one, reading
+// the texture and the illumination model of each material. The others are
+// 1 + 3 * textured + illum, for instances whose materials all agree.
+constexpr int RT_NB_LIGHT_TYPES = 2;
+constexpr int RT_NB_MATERIAL_PERMUTATIONS = 7;
+
+// Shadow rays of the wavefront mode are binned by the octant of their
+// direction, then by the Morton code of their origin in a grid of
+// 2^WF_GRID_BITS cells per axis, see wavefront_math.h.
+constexpr int WF_GRID_BITS = 4;
+constexpr int WF_NB_BINS = 8 << (3 * WF_GRID_BITS);
+constexpr unsigned WF_NO_KEY = 0xFFFFFFFFu;  // Pixel without shadow ray
+constexpr int WF_SCAN_SIZE = 1024;  // Threads of the prefix sum of the bins
+
 struct raytrace_shaders_t {
   const char* module_data;
   size_t module_size;
 
   const char* rgen;
+  const char* rgen_primary;  // Wavefront mode
+  const char* rgen_shadow;
   const char* rmiss;
   const char* rmiss_shadow;
-  const char* rchit;
+  // [light type][material permutation]
+  const char* rchit[RT_NB_LIGHT_TYPES][RT_NB_MATERIAL_PERMUTATIONS];
+  const char* rahit_alpha;
 };
 
 extern raytrace_shaders_t raytrace_shaders;
@@ -37,4 +57,24 @@ struct post_shaders_t {
   const char* frag;
 };
 
-extern post_shaders_t post_shaders;
\ No newline at end of file
+extern post_shaders_t post_shaders;
+
+struct cull_shaders_t {
+  const char* module_data;
+  size_t module_size;
+
+  const char* hiz;
+  const char* cull;
+};
+
+extern cull_shaders_t cull_shaders;
+
+struct wavefront_shaders_t {
+  const char* module_data;
+  size_t module_size;
+
+  const char* scan;
+  const char* scatter;
+};
+
+extern wavefront_shaders_t wavefront_shaders;
@@ -0,0 +1,73 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "staging_ring.h"
+#include "nvh/alignment.hpp"
+
+void StagingRing::init(PoolAllocator* allocator, vk::DeviceSize regionSize, uint32_t nbRegions)
+{
+  m_alloc      = allocator;
+  m_regionSize = regionSize;
+  m_nbRegions  = nbRegions;
+  m_region     = 0;
+  m_used       = 0;
+  m_buffer     = m_alloc->createBuffer(regionSize * nbRegions,
+                                   vk::BufferUsageFlagBits::eTransferSrc,
+                                   vk::MemoryPropertyFlagBits::eHostVisible
+                                       | vk::MemoryPropertyFlagBits::eHostCoherent);
+  m_mapped     = reinterpret_cast<uint8_t*>(m_alloc->map(m_buffer));
+}
+
+void StagingRing::deinit()
+{
+  if(!m_mapped)
+    return;
+  m_alloc->unmap(m_buffer);
+  m_alloc->destroy(m_buffer);
+  m_mapped = nullptr;
+}
+
+void StagingRing::beginRegion(uint32_t regionIndex)
+{
+  m_region = regionIndex % m_nbRegions;
+  m_used   = 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Space for `size` bytes in the current region; `bufferOffset` is its offset in getBuffer()
+//
+void* StagingRing::allocate(vk::DeviceSize  size,
+                            vk::DeviceSize& bufferOffset,
+                            vk::DeviceSize  alignment)
+{
+  vk::DeviceSize offset = nvh::align_up(m_used, alignment);
+  if(offset + size > m_regionSize)
+    return nullptr;
+  m_used       = offset + size;
+  bufferOffset = m_region * m_regionSize + offset;
+  return m_mapped + bufferOffset;
+}
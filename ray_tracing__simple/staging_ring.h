@@ -0,0 +1,60 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <vulkan/vulkan.hpp>
+
+#include "pool_allocator.h"
+
+//--------------------------------------------------------------------------------------------------
+// Persistently mapped, host-visible buffer split in regions used in turn
+// - The caller picks the region to fill with beginRegion(), once the GPU is done with what was
+//   written there before (e.g. one region per frame in flight)
+// - allocate() hands out aligned space in that region and returns nullptr when it is full:
+//   the caller keeps the data for a later region
+//
+class StagingRing
+{
+public:
+  void init(PoolAllocator* allocator, vk::DeviceSize regionSize, uint32_t nbRegions);
+  void deinit();
+
+  void  beginRegion(uint32_t regionIndex);
+  void* allocate(vk::DeviceSize size, vk::DeviceSize& bufferOffset, vk::DeviceSize alignment = 16);
+
+  vk::Buffer     getBuffer() const { return m_buffer.buffer; }
+  vk::DeviceSize getRegionSize() const { return m_regionSize; }
+  vk::DeviceSize getUsed() const { return m_used; }  // In the current region
+
+private:
+  PoolAllocator* m_alloc{nullptr};
+  nvvk::Buffer   m_buffer;
+  uint8_t*       m_mapped{nullptr};
+  vk::DeviceSize m_regionSize{0};
+  uint32_t       m_nbRegions{0};
+  uint32_t       m_region{0};
+  vk::DeviceSize m_used{0};
+};
@@ -0,0 +1,57 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdio>
+
+//--------------------------------------------------------------------------------------------------
+// Checks of the host tests: a failed check is printed and the test keeps going, main() returns
+// reportChecks()
+//
+inline int& checkFailures()
+{
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(cond)                                                                                \
+  do                                                                                               \
+  {                                                                                                \
+    if(!(cond))                                                                                    \
+    {                                                                                              \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                             \
+      checkFailures()++;                                                                           \
+    }                                                                                              \
+  } while(false)
+
+inline int reportChecks(const char* name)
+{
+  if(checkFailures() == 0)
+    printf("%s: all checks passed\n", name);
+  else
+    printf("%s: %d checks failed\n", name, checkFailures());
+  return checkFailures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <vector>
+
+#include "cull_math.h"
+#include "test_check.h"
+
+// With an identity mvp the boxes are given in clip space: x and y in [-1, 1], depth in [0, 1]
+static const nvmath::mat4f kIdentity(1);
+
+//--------------------------------------------------------------------------------------------------
+// A box is culled only when all its corners are outside the same clip plane
+//
+static void testFrustum()
+{
+  using nvmath::vec3f;
+  // Inside, crossing the right plane, around the frustum
+  CHECK(isInFrustum(kIdentity, vec3f(-0.5f, -0.5f, 0.2f), vec3f(0.5f, 0.5f, 0.4f)));
+  CHECK(isInFrustum(kIdentity, vec3f(0.5f, -0.5f, 0.2f), vec3f(1.5f, 0.5f, 0.4f)));
+  CHECK(isInFrustum(kIdentity, vec3f(-2.f, -2.f, -1.f), vec3f(2.f, 2.f, 2.f)));
+
+  // Right, left, top, before the near plane, after the far plane
+  CHECK(!isInFrustum(kIdentity, vec3f(2.f, -0.5f, 0.2f), vec3f(3.f, 0.5f, 0.4f)));
+  CHECK(!isInFrustum(kIdentity, vec3f(-3.f, -0.5f, 0.2f), vec3f(-2.f, 0.5f, 0.4f)));
+  CHECK(!isInFrustum(kIdentity, vec3f(-0.5f, 1.5f, 0.2f), vec3f(0.5f, 2.f, 0.4f)));
+  CHECK(!isInFrustum(kIdentity, vec3f(-0.5f, -0.5f, -0.5f), vec3f(0.5f, 0.5f, -0.1f)));
+  CHECK(!isInFrustum(kIdentity, vec3f(-0.5f, -0.5f, 1.5f), vec3f(0.5f, 0.5f, 2.f)));
+
+  // Through the model matrix
+  nvmath::mat4f moved = nvmath::translation_mat4(vec3f(3.f, 0.f, 0.f));
+  CHECK(!isInFrustum(moved, vec3f(-0.5f, -0.5f, 0.2f), vec3f(0.5f, 0.5f, 0.4f)));
+  CHECK(isInFrustum(moved, vec3f(-3.5f, -0.5f, 0.2f), vec3f(-2.5f, 0.5f, 0.4f)));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Each level keeps the farthest depth of the texels it covers, odd sizes included
+//
+static void testBuildHiZ()
+{
+  HiZPyramid hiz;
+  hiz.init(8, 8);
+  CHECK(hiz.nbLevels == 4);
+  CHECK(hiz.getNbTexels() == 64 + 16 + 4 + 1);
+
+  std::vector<float> depth(64, 0.5f);
+  depth[7 * 8 + 7] = 1.f;
+  depth[0]         = 0.1f;
+  buildHiZ(depth.data(), hiz);
+  CHECK(hiz.fetch(0, 7, 7) == 1.f);
+  CHECK(hiz.fetch(1, 3, 3) == 1.f);
+  CHECK(hiz.fetch(1, 0, 0) == 0.5f);  // Farthest, not closest
+  CHECK(hiz.fetch(1, 2, 3) == 0.5f);
+  CHECK(hiz.fetch(2, 1, 1) == 1.f);
+  CHECK(hiz.fetch(3, 0, 0) == 1.f);
+
+  // 5x3: the last texel of a level also covers the remainder
+  HiZPyramid odd;
+  odd.init(5, 3);
+  CHECK(odd.nbLevels == 3);
+  CHECK(odd.getLevelWidth(1) == 2 && odd.getLevelHeight(1) == 1);
+  std::vector<float> oddDepth(15, 0.25f);
+  oddDepth[2 * 5 + 4] = 0.9f;  // (4, 2)
+  buildHiZ(oddDepth.data(), odd);
+  CHECK(odd.fetch(1, 0, 0) == 0.25f);
+  CHECK(odd.fetch(1, 1, 0) == 0.9f);
+  CHECK(odd.fetch(2, 0, 0) == 0.9f);
+}
+
+//--------------------------------------------------------------------------------------------------
+// A wall at depth 0.5 with a hole to the far plane in its top-right texel
+//
+static void testOcclusion()
+{
+  using nvmath::vec3f;
+  HiZPyramid         hiz;
+  std::vector<float> depth(64, 0.5f);
+  depth[7 * 8 + 7] = 1.f;
+  hiz.init(8, 8);
+  buildHiZ(depth.data(), hiz);
+
+  // Texels 4 and 5 in x and y
+  CHECK(isOccluded(hiz, kIdentity, vec3f(0.05f, 0.05f, 0.6f), vec3f(0.45f, 0.45f, 0.7f)));
+  CHECK(!isOccluded(hiz, kIdentity, vec3f(0.05f, 0.05f, 0.3f), vec3f(0.45f, 0.45f, 0.4f)));
+  CHECK(!isOccluded(hiz, kIdentity, vec3f(0.05f, 0.05f, 0.4f), vec3f(0.45f, 0.45f, 0.7f)));
+  // Seen through the hole
+  CHECK(!isOccluded(hiz, kIdentity, vec3f(0.8f, 0.8f, 0.6f), vec3f(0.95f, 0.95f, 0.7f)));
+  // Covering the hole and the wall: the coarser level keeps the hole
+  CHECK(!isOccluded(hiz, kIdentity, vec3f(-0.9f, -0.9f, 0.6f), vec3f(0.95f, 0.95f, 0.7f)));
+  // Partly off screen, clamped to the wall
+  CHECK(isOccluded(hiz, kIdentity, vec3f(-1.5f, -1.5f, 0.6f), vec3f(-0.5f, -0.5f, 0.7f)));
+
+  // w is the depth: a box crossing the near plane is never occluded, even by the closest depth
+  nvmath::mat4f perspective(1);
+  perspective.at(3, 2) = 1.f;
+  perspective.at(3, 3) = 0.f;
+  std::vector<float> closest(64, 0.f);
+  buildHiZ(closest.data(), hiz);
+  CHECK(isOccluded(hiz, perspective, vec3f(-0.1f, -0.1f, 0.5f), vec3f(0.1f, 0.1f, 0.6f)));
+  CHECK(!isOccluded(hiz, perspective, vec3f(-0.1f, -0.1f, -0.5f), vec3f(0.1f, 0.1f, 0.6f)));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Draws kept in input order, through the transforms of their instance
+//
+static void testCullDraws()
+{
+  using nvmath::vec3f;
+  HiZPyramid         hiz;
+  std::vector<float> depth(64, 0.5f);
+  hiz.init(8, 8);
+  buildHiZ(depth.data(), hiz);
+
+  std::vector<nvmath::mat4f> transforms{kIdentity, nvmath::translation_mat4(vec3f(3.f, 0.f, 0.f))};
+  std::vector<CullDraw>      draws(5);
+  for(auto& draw : draws)
+  {
+    draw.bboxMin = vec3f(-0.2f, -0.2f, 0.2f);
+    draw.bboxMax = vec3f(0.2f, 0.2f, 0.3f);
+  }
+  draws[1].instanceId = 1;  // Outside the frustum
+  draws[2].instanceId = 1;
+  draws[2].cullable   = 0;  // Kept anyway
+  draws[3].bboxMin.z  = 0.7f;
+  draws[3].bboxMax.z  = 0.8f;  // Behind the depth
+
+  std::vector<uint32_t> visible;
+  cullDraws(draws, transforms, kIdentity, nullptr, nullptr, visible);
+  CHECK((visible == std::vector<uint32_t>{0, 2, 3, 4}));
+  cullDraws(draws, transforms, kIdentity, &hiz, &kIdentity, visible);
+  CHECK((visible == std::vector<uint32_t>{0, 2, 4}));
+}
+
+int main()
+{
+  testFrustum();
+  testBuildHiZ();
+  testOcclusion();
+  testCullDraws();
+  return reportChecks("cull_math");
+}
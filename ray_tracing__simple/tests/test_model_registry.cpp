@@ -0,0 +1,150 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "model_registry.h"
+#include "test_check.h"
+
+namespace fs = std::filesystem;
+
+static void writeFile(const fs::path& path, const std::string& content)
+{
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary) << content;
+}
+
+// Model in `dir`: an OBJ file, its material library and its texture, in the textures/ directory
+// next to it
+static fs::path writeModel(const fs::path& dir, const std::string& mtl, const std::string& texture)
+{
+  writeFile(dir / "model.obj", "mtllib model.mtl\nv 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+  writeFile(dir / "model.mtl", "newmtl m\n" + mtl + "map_Kd -s 1 1 1 model.png\n");
+  writeFile(dir / "textures" / "model.png", texture);
+  return dir / "model.obj";
+}
+
+//--------------------------------------------------------------------------------------------------
+// The same file under two paths, or a copy of it, is one model. Static and dynamic loads are two.
+//
+static void testSharing(const fs::path& root)
+{
+  fs::path      model = writeModel(root / "a", "Kd 1 1 1\n", "texels");
+  fs::path      copy  = writeModel(root / "b", "Kd 1 1 1\n", "texels");
+  ModelRegistry registry;
+  registry.setTextureDirs({(root / "a" / "textures").string()});
+
+  CHECK(registry.find(model.string(), false) == ModelRegistry::kInvalid);
+  registry.add(model.string(), false, 0);
+  CHECK(registry.find((root / "a" / ".." / "a" / "model.obj").string(), false) == 0);
+  CHECK(registry.find(copy.string(), false) == 0);
+  CHECK(registry.find(model.string(), true) == ModelRegistry::kInvalid);
+  CHECK(registry.getNbShared() == 2);
+  CHECK(registry.getNbModels() == 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The same OBJ file with another material library or another texture is another model
+//
+static void testDependencies(const fs::path& root)
+{
+  fs::path      model    = writeModel(root / "a", "Kd 1 1 1\n", "texels");
+  fs::path      material = writeModel(root / "b", "Kd 1 0 0\n", "texels");
+  ModelRegistry registry;
+  registry.setTextureDirs({(root / "c" / "textures").string(), (root / "a" / "textures").string()});
+
+  registry.add(model.string(), false, 0);
+  CHECK(registry.find(material.string(), false) == ModelRegistry::kInvalid);
+
+  // The first texture directory now has another model.png
+  fs::path texture = writeModel(root / "c", "Kd 1 1 1\n", "other texels");
+  CHECK(registry.find(texture.string(), false) == ModelRegistry::kInvalid);
+  CHECK(registry.find(model.string(), false) == ModelRegistry::kInvalid);
+
+  // Without it, the texture of the model is found in the next directory
+  fs::remove(root / "c" / "textures" / "model.png");
+  CHECK(registry.find(model.string(), false) == 0);
+
+  // A missing texture counts by its name
+  fs::remove(root / "a" / "textures" / "model.png");
+  CHECK(registry.find(model.string(), false) == ModelRegistry::kInvalid);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The model leaves the registry with its last reference
+//
+static void testRefCount(const fs::path& root)
+{
+  fs::path      model = writeModel(root / "a", "Kd 1 1 1\n", "texels");
+  ModelRegistry registry;
+
+  registry.add(model.string(), false, 3);
+  registry.addRef(3, 2);
+  CHECK(registry.getRefCount(3) == 2);
+  CHECK(!registry.release(3));
+  CHECK(registry.find(model.string(), false) == 3);
+  CHECK(registry.release(3));
+  CHECK(registry.getRefCount(3) == 0);
+  CHECK(registry.getNbModels() == 0);
+  CHECK(registry.find(model.string(), false) == ModelRegistry::kInvalid);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Models loaded but never instanced are handed out, the others stay
+//
+static void testUnreferenced(const fs::path& root)
+{
+  fs::path      used   = writeModel(root / "a", "Kd 1 1 1\n", "texels");
+  fs::path      unused = writeModel(root / "b", "Kd 0 0 0\n", "texels");
+  ModelRegistry registry;
+
+  registry.add(used.string(), false, 0);
+  registry.add(unused.string(), false, 1);
+  registry.add(unused.string(), true, 2);
+  registry.addRef(0);
+  std::vector<uint32_t> released = registry.releaseUnreferenced();
+  CHECK(released == std::vector<uint32_t>({1, 2}));
+  CHECK(registry.getNbModels() == 1);
+  CHECK(registry.find(used.string(), false) == 0);
+  CHECK(registry.find(unused.string(), false) == ModelRegistry::kInvalid);
+  CHECK(registry.releaseUnreferenced().empty());
+}
+
+int main()
+{
+  fs::path root  = fs::temp_directory_path() / "test_model_registry";
+  auto     tests = {testSharing, testDependencies, testRefCount, testUnreferenced};
+  for(void (*test)(const fs::path&) : tests)
+  {
+    fs::remove_all(root);
+    test(root);
+  }
+  fs::remove_all(root);
+  return reportChecks("model_registry");
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdexcept>
+
+#include "sbt_builder.h"
+#include "test_check.h"
+
+using Region = SbtBuilder::Region;
+
+// Handles smaller than the base alignment, as on most devices
+static SbtBuilder::Properties properties(uint32_t handleAlignment, uint32_t baseAlignment)
+{
+  SbtBuilder::Properties props;
+  props.handleSize      = 32;
+  props.handleAlignment = handleAlignment;
+  props.baseAlignment   = baseAlignment;
+  props.maxStride       = 4096;
+  return props;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Regions in order, each at a multiple of the base alignment
+//
+static void testRegions()
+{
+  SbtBuilder::Layout layout =
+      SbtBuilder::computeLayout(properties(32, 64), {3, 2, 10, 0}, {0, 0, 16, 0});
+
+  CHECK(layout.offset[Region::eRaygen] == 0);
+  CHECK(layout.stride[Region::eRaygen] == 64);  // Base aligned, see testRaygenRecords()
+  CHECK(layout.size[Region::eRaygen] == 3 * 64);
+
+  CHECK(layout.offset[Region::eMiss] == 192);
+  CHECK(layout.stride[Region::eMiss] == 32);
+  CHECK(layout.size[Region::eMiss] == 2 * 32);
+
+  CHECK(layout.offset[Region::eHit] == 256);
+  CHECK(layout.stride[Region::eHit] == 64);  // Handle and 16 bytes of data
+  CHECK(layout.size[Region::eHit] == 10 * 64);
+
+  CHECK(layout.stride[Region::eCallable] == 0);
+  CHECK(layout.size[Region::eCallable] == 0);
+  CHECK(layout.totalSize == 896);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Each raygen record is launched as a region of its own: it must start at a multiple of the base
+// alignment, whatever the handle alignment and the size of the shader records
+//
+static void testRaygenRecords()
+{
+  const uint32_t handleAlignments[] = {16, 32, 64};
+  const uint32_t baseAlignments[]   = {32, 64, 128};
+  const uint32_t dataSizes[]        = {0, 8, 40, 100};
+  for(uint32_t handleAlignment : handleAlignments)
+  {
+    for(uint32_t baseAlignment : baseAlignments)
+    {
+      for(uint32_t dataSize : dataSizes)
+      {
+        SbtBuilder::Properties props  = properties(handleAlignment, baseAlignment);
+        SbtBuilder::Layout     layout = SbtBuilder::computeLayout(
+            props, {3, 2, 4, 1}, {dataSize, dataSize, dataSize, dataSize});
+        for(uint32_t i = 0; i < 3; i++)
+          CHECK((layout.offset[Region::eRaygen] + i * layout.stride[Region::eRaygen])
+                    % baseAlignment
+                == 0);
+        for(int r = 0; r < Region::eNbRegions; r++)
+        {
+          CHECK(layout.offset[r] % baseAlignment == 0);
+          CHECK(layout.stride[r] % handleAlignment == 0);
+          CHECK(layout.stride[r] >= props.handleSize + dataSize);
+        }
+      }
+    }
+  }
+
+  // Data past the base alignment: two base alignments per record
+  SbtBuilder::Layout layout =
+      SbtBuilder::computeLayout(properties(32, 64), {2, 1, 1, 0}, {40, 0, 0, 0});
+  CHECK(layout.stride[Region::eRaygen] == 128);
+  CHECK(layout.offset[Region::eMiss] == 256);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Empty regions take no space, records over the maximum stride throw
+//
+static void testLimits()
+{
+  SbtBuilder::Layout layout =
+      SbtBuilder::computeLayout(properties(32, 64), {1, 0, 0, 0}, {0, 0, 0, 0});
+  CHECK(layout.totalSize == 64);
+  CHECK(layout.size[Region::eMiss] == 0 && layout.size[Region::eHit] == 0);
+
+  bool thrown = false;
+  try
+  {
+    SbtBuilder::computeLayout(properties(32, 64), {1, 1, 1, 0}, {0, 0, 5000, 0});
+  }
+  catch(const std::runtime_error&)
+  {
+    thrown = true;
+  }
+  CHECK(thrown);
+}
+
+int main()
+{
+  testRegions();
+  testRaygenRecords();
+  testLimits();
+  return reportChecks("sbt_layout");
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <atomic>
+#include <vector>
+
+#include "test_check.h"
+#include "thread_pool.h"
+
+//--------------------------------------------------------------------------------------------------
+// Every index is visited once, whatever the chunk size
+//
+static void testParallelFor()
+{
+  ThreadPool pool(3);
+  for(size_t chunkSize : {1, 7, 64, 1000})
+  {
+    std::vector<std::atomic<int>> visits(1000);
+    pool.parallelFor(visits.size(), chunkSize, [&](size_t begin, size_t end) {
+      for(size_t i = begin; i < end; i++)
+        visits[i]++;
+    });
+    int wrong = 0;
+    for(const auto& v : visits)
+      wrong += v != 1;
+    CHECK(wrong == 0);
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called from pool jobs: the helpers of the inner loops are queued behind workers all waiting in
+// an inner loop, the waiting threads must run them
+//
+static void testNested()
+{
+  ThreadPool        pool(3);
+  std::atomic<long> count{0};
+  for(int iteration = 0; iteration < 50; iteration++)
+  {
+    pool.parallelFor(16, 1, [&](size_t, size_t) {
+      pool.parallelFor(32, 1, [&](size_t begin, size_t end) { count += long(end - begin); });
+    });
+  }
+  CHECK(count == 50 * 16 * 32);
+}
+
+int main()
+{
+  testParallelFor();
+  testNested();
+  return reportChecks("thread_pool");
+}
@@ -0,0 +1,164 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdio>
+#include <vector>
+
+#include "tlsf.h"
+#include "test_check.h"
+
+//--------------------------------------------------------------------------------------------------
+// Blocks are handed out in offset order from a fresh range, and given back to the free lists
+//
+static void testAllocate()
+{
+  Tlsf tlsf(1024);
+  CHECK(tlsf.getCapacity() == 1024);
+  CHECK(tlsf.getNbFreeBlocks() == 1);
+  CHECK(tlsf.getLargestFree() == 1024);
+
+  Tlsf::Handle a = tlsf.allocate(256);
+  Tlsf::Handle b = tlsf.allocate(256);
+  Tlsf::Handle c = tlsf.allocate(200);  // Rounded up to the granularity
+  CHECK(a != Tlsf::kInvalid && b != Tlsf::kInvalid && c != Tlsf::kInvalid);
+  CHECK(tlsf.getOffset(a) == 0);
+  CHECK(tlsf.getOffset(b) == 256);
+  CHECK(tlsf.getOffset(c) == 512);
+  CHECK(tlsf.getSize(c) == 208);
+  CHECK(tlsf.getUsed() == 720);
+  CHECK(tlsf.getNbAllocations() == 3);
+  CHECK(tlsf.getLargestFree() == 304);
+
+  // No block holds it
+  CHECK(tlsf.allocate(512) == Tlsf::kInvalid);
+  CHECK(tlsf.getNbAllocations() == 3);
+
+  std::vector<uint64_t> offsets;
+  tlsf.forEachAllocation([&](Tlsf::Handle, uint64_t offset, uint64_t) {
+    offsets.push_back(offset);
+  });
+  CHECK((offsets == std::vector<uint64_t>{0, 256, 512}));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Freed blocks merge with their free neighbors, on either side
+//
+static void testCoalesce()
+{
+  Tlsf         tlsf(1024);
+  Tlsf::Handle a = tlsf.allocate(256);
+  Tlsf::Handle b = tlsf.allocate(256);
+  Tlsf::Handle c = tlsf.allocate(256);
+  Tlsf::Handle d = tlsf.allocate(256);
+  CHECK(tlsf.getNbFreeBlocks() == 0);
+  CHECK(tlsf.getFragmentation() == 0.f);
+
+  // Two free blocks apart: the free space is scattered
+  tlsf.free(a);
+  tlsf.free(c);
+  CHECK(tlsf.getNbFreeBlocks() == 2);
+  CHECK(tlsf.getLargestFree() == 256);
+  CHECK(tlsf.getFragmentation() == 0.5f);
+  CHECK(tlsf.allocate(512) == Tlsf::kInvalid);
+
+  // b merges with a before it and c after it
+  tlsf.free(b);
+  CHECK(tlsf.getNbFreeBlocks() == 1);
+  CHECK(tlsf.getLargestFree() == 768);
+  CHECK(tlsf.getFragmentation() == 0.f);
+
+  Tlsf::Handle e = tlsf.allocate(768);
+  CHECK(e != Tlsf::kInvalid && tlsf.getOffset(e) == 0);
+  tlsf.free(d);
+  tlsf.free(e);
+  CHECK(tlsf.isEmpty());
+  CHECK(tlsf.getUsed() == 0);
+  CHECK(tlsf.getNbFreeBlocks() == 1);
+  CHECK(tlsf.getLargestFree() == 1024);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The front padding of an aligned block stays free, and merges back when the block is freed
+//
+static void testAlignment()
+{
+  Tlsf         tlsf(4096);
+  Tlsf::Handle a = tlsf.allocate(16);
+  Tlsf::Handle b = tlsf.allocate(100, 256);
+  CHECK(b != Tlsf::kInvalid);
+  CHECK(tlsf.getOffset(b) == 256);
+  CHECK(tlsf.getSize(b) == 112);
+  CHECK(tlsf.getNbFreeBlocks() == 2);  // The padding and the back
+
+  Tlsf::Handle c = tlsf.allocate(64);  // Fits in the padding
+  CHECK(tlsf.getOffset(c) < 256);
+
+  tlsf.free(a);
+  tlsf.free(b);
+  tlsf.free(c);
+  CHECK(tlsf.isEmpty());
+  CHECK(tlsf.getNbFreeBlocks() == 1);
+  CHECK(tlsf.getLargestFree() == 4096);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Many allocations of mixed sizes freed in another order: the range is whole again
+//
+static void testChurn()
+{
+  Tlsf                      tlsf(1 << 20);
+  std::vector<Tlsf::Handle> handles;
+  for(uint32_t i = 0; i < 200; i++)
+  {
+    Tlsf::Handle h = tlsf.allocate(16 + (i * 37) % 3000, 16u << (i % 5));
+    CHECK(h != Tlsf::kInvalid);
+    CHECK(tlsf.getOffset(h) % (16u << (i % 5)) == 0);
+    handles.push_back(h);
+  }
+  uint64_t end = 0;
+  tlsf.forEachAllocation([&](Tlsf::Handle, uint64_t offset, uint64_t size) {
+    CHECK(offset >= end);  // In offset order, no overlap
+    end = offset + size;
+  });
+
+  for(uint32_t i = 0; i < 200; i += 2)
+    tlsf.free(handles[i]);
+  for(uint32_t i = 199; i < 200; i -= 2)
+    tlsf.free(handles[i]);
+  CHECK(tlsf.isEmpty());
+  CHECK(tlsf.getNbFreeBlocks() == 1);
+  CHECK(tlsf.getLargestFree() == (1 << 20));
+}
+
+int main()
+{
+  testAllocate();
+  testCoalesce();
+  testAlignment();
+  testChurn();
+  return reportChecks("tlsf");
+}
@@ -0,0 +1,136 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+{
+  if(threadCount == 0)
+  {
+    uint32_t hwThreads = std::thread::hardware_concurrency();
+    threadCount        = hwThreads > 1 ? hwThreads - 1 : 1;
+  }
+
+  m_workers.reserve(threadCount);
+  for(uint32_t i = 0; i < threadCount; i++)
+  {
+    m_workers.emplace_back([this]() { workerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_condition.notify_all();
+  for(auto& worker : m_workers)
+  {
+    worker.join();
+  }
+}
+
+void ThreadPool::workerLoop()
+{
+  for(;;)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_condition.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+      if(m_stop && m_jobs.empty())
+        return;
+      job = std::move(m_jobs.front());
+      m_jobs.pop();
+    }
+    job();
+  }
+}
+
+// Runs the next queued job on the calling thread, false when there is none
+bool ThreadPool::runPendingJob()
+{
+  std::function<void()> job;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_jobs.empty())
+      return false;
+    job = std::move(m_jobs.front());
+    m_jobs.pop();
+  }
+  job();
+  return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Chunks are handed out through an atomic counter, so fast threads simply take more of them.
+// The caller participates, and runs queued jobs while its helpers are not done: called from a
+// pool job, its helpers may be queued behind workers all waiting in the same way, and would
+// never run otherwise. A helper that is not queued anymore is running and can be waited on.
+//
+void ThreadPool::parallelFor(size_t                                     count,
+                             size_t                                     chunkSize,
+                             const std::function<void(size_t, size_t)>& fn)
+{
+  if(count == 0)
+    return;
+  chunkSize            = std::max<size_t>(chunkSize, 1);
+  size_t nbChunks      = (count + chunkSize - 1) / chunkSize;
+  size_t nbHelpers     = std::min<size_t>(nbChunks - 1, m_workers.size());
+  auto   nextChunk     = std::make_shared<std::atomic<size_t>>(0);
+  auto   processChunks = [=, &fn]() {
+    for(size_t c = (*nextChunk)++; c < nbChunks; c = (*nextChunk)++)
+    {
+      size_t begin = c * chunkSize;
+      fn(begin, std::min(begin + chunkSize, count));
+    }
+  };
+
+  std::vector<std::future<void>> helpers;
+  helpers.reserve(nbHelpers);
+  for(size_t i = 0; i < nbHelpers; i++)
+  {
+    helpers.emplace_back(submit(processChunks));
+  }
+  processChunks();
+  for(auto& h : helpers)
+  {
+    while(h.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      if(!runPendingJob())
+      {
+        h.wait();
+        break;
+      }
+    }
+  }
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+//--------------------------------------------------------------------------------------------------
+// Small fixed-size pool of worker threads shared by the host-side subsystems
+// - `submit` queues a job and returns a future to wait on it
+// - `parallelFor` splits a range in chunks; the calling thread works on chunks as well, and on
+//   queued jobs while it waits: it can be called from within a pool job
+//
+class ThreadPool
+{
+public:
+  // threadCount == 0 uses one worker per hardware thread, minus the calling thread
+  explicit ThreadPool(uint32_t threadCount = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  template <typename F>
+  std::future<void> submit(F&& job)
+  {
+    auto task   = std::make_shared<std::packaged_task<void()>>(std::forward<F>(job));
+    auto future = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.emplace([task]() { (*task)(); });
+    }
+    m_condition.notify_one();
+    return future;
+  }
+
+  // Calls fn(begin, end) over [0, count) in chunks of `chunkSize` and returns when all are done
+  void parallelFor(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)>& fn);
+
+  uint32_t size() const { return static_cast<uint32_t>(m_workers.size()); }
+
+private:
+  void workerLoop();
+  bool runPendingJob();
+
+  std::vector<std::thread>          m_workers;
+  std::queue<std::function<void()>> m_jobs;
+  std::mutex                        m_mutex;
+  std::condition_variable           m_condition;
+  bool                              m_stop{false};
+};
@@ -0,0 +1,398 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <functional>
+
+#include "nvvk/commands_vk.hpp"
+#include "tlas_builder.h"
+
+void TlasBuilder::setup(const vk::Device& device,
+                        PoolAllocator*    allocator,
+                        uint32_t          queueIndex,
+                        uint32_t          nbFrames)
+{
+  m_device     = device;
+  m_alloc      = allocator;
+  m_queueIndex = queueIndex;
+  m_nbFrames   = std::max(nbFrames, 1u);
+  m_debug.setup(device);
+}
+
+void TlasBuilder::destroy()
+{
+  if(m_mappedInstances)
+  {
+    m_alloc->unmap(m_instBuffer);
+    m_mappedInstances = nullptr;
+  }
+  m_alloc->destroy(m_tlas);
+  m_alloc->destroy(m_instBuffer);
+  m_alloc->destroy(m_scratch);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Convert an Instance in the Vulkan layout: 3x4 row-major transform, packed ids and flags
+//
+VkAccelerationStructureInstanceKHR TlasBuilder::toVkInstance(const Instance&   instance,
+                                                             vk::DeviceAddress blasAddress)
+{
+  VkAccelerationStructureInstanceKHR vkInst = toVkInstanceIds(instance, blasAddress);
+  // The matrices for the instance transforms are row-major, instead of column-major in the
+  // rest of the application
+  nvmath::mat4f transp = nvmath::transpose(instance.transform);
+  // The gInst.transform value only contains 12 values, corresponding to a 4x3 matrix, hence
+  // saving the last row that is anyway always (0,0,0,1). Since the matrix is row-major, we simply
+  // copy the first 12 values of the original 4x4 matrix
+  memcpy(&vkInst.transform, &transp, sizeof(vkInst.transform));
+  return vkInst;
+}
+
+VkAccelerationStructureInstanceKHR TlasBuilder::toVkInstanceIds(const Instance&   instance,
+                                                                vk::DeviceAddress blasAddress)
+{
+  VkAccelerationStructureInstanceKHR vkInst{};
+  vkInst.instanceCustomIndex                    = instance.instanceCustomId;
+  vkInst.mask                                   = instance.mask;
+  vkInst.instanceShaderBindingTableRecordOffset = instance.hitGroupId;
+  vkInst.flags                          = static_cast<VkGeometryInstanceFlagsKHR>(instance.flags);
+  vkInst.accelerationStructureReference = blasAddress;
+  return vkInst;
+}
+
+//--------------------------------------------------------------------------------------------------
+// World bounds of the object-space box (center, half extent) under the transform of the instance
+//
+static void getWorldBounds(const VkAccelerationStructureInstanceKHR& instance,
+                           const nvmath::vec3f&                      center,
+                           const nvmath::vec3f&                      extent,
+                           nvmath::vec3f&                            bbMin,
+                           nvmath::vec3f&                            bbMax)
+{
+  const float(*m)[4] = instance.transform.matrix;
+  for(int r = 0; r < 3; r++)
+  {
+    float c = m[r][3];
+    float e = 0.f;
+    for(int k = 0; k < 3; k++)
+    {
+      c += m[r][k] * center[k];
+      e += std::abs(m[r][k]) * extent[k];
+    }
+    bbMin[r] = c - e;
+    bbMax[r] = c + e;
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// Build the TLAS from the instances
+// - All frame regions of the instance buffer get the instances
+// - The scratch buffer is kept for the updates and rebuilds recorded by cmdUpdate()
+//
+void TlasBuilder::build(const std::vector<Instance>&           instances,
+                        const BlasBuilder&                     blasBuilder,
+                        vk::BuildAccelerationStructureFlagsKHR flags,
+                        ThreadPool*                            pool,
+                        const TransformStore*                  transforms)
+{
+  using vkBU = vk::BufferUsageFlagBits;
+  using vkMP = vk::MemoryPropertyFlagBits;
+  destroy();
+
+  const size_t kChunkSize = 4096;
+  auto         forChunks  = [&](size_t count, const std::function<void(size_t, size_t)>& fn) {
+    if(pool)
+      pool->parallelFor(count, kChunkSize, fn);
+    else
+      fn(0, count);
+  };
+
+  m_flags = flags;
+  m_instances.resize(instances.size());
+  m_localCenters.resize(instances.size());
+  m_localExtents.resize(instances.size());
+  forChunks(instances.size(), [&](size_t begin, size_t end) {
+    for(size_t i = begin; i < end; i++)
+    {
+      vk::DeviceAddress address = blasBuilder.getDeviceAddress(instances[i].blasId);
+      m_instances[i] = transforms ? toVkInstanceIds(instances[i], address)
+                                  : toVkInstance(instances[i], address);
+      m_localCenters[i] = (instances[i].bboxMin + instances[i].bboxMax) * 0.5f;
+      m_localExtents[i] = (instances[i].bboxMax - instances[i].bboxMin) * 0.5f;
+    }
+  });
+  uint32_t       nbInstances = static_cast<uint32_t>(m_instances.size());
+  vk::DeviceSize regionSize  = nbInstances * sizeof(VkAccelerationStructureInstanceKHR);
+  if(transforms)
+  {
+    assert(transforms->size() >= nbInstances);
+    transforms->pack(m_instances.data(), sizeof(VkAccelerationStructureInstanceKHR), 0,
+                     nbInstances, pool);
+  }
+
+  // Persistently mapped, one region per frame in flight
+  m_instBuffer = m_alloc->createBuffer(std::max<vk::DeviceSize>(regionSize * m_nbFrames, 1),
+                                       vkBU::eShaderDeviceAddress
+                                           | vkBU::eAccelerationStructureBuildInputReadOnlyKHR,
+                                       vkMP::eHostVisible | vkMP::eHostCoherent);
+  m_debug.setObjectName(m_instBuffer.buffer, "TLASInstances");
+  m_mappedInstances =
+      reinterpret_cast<VkAccelerationStructureInstanceKHR*>(m_alloc->map(m_instBuffer));
+  forChunks(nbInstances, [&](size_t begin, size_t end) {
+    for(uint32_t f = 0; f < m_nbFrames; f++)
+      memcpy(m_mappedInstances + size_t(f) * nbInstances + begin, &m_instances[begin],
+             (end - begin) * sizeof(VkAccelerationStructureInstanceKHR));
+  });
+  m_changeLog.clear();
+  m_changeLogBase = 0;
+  m_regionLogPos.assign(m_nbFrames, 0);
+  m_dirty        = false;
+  m_needsRebuild = false;
+
+  vk::AccelerationStructureGeometryInstancesDataKHR instancesData;
+  instancesData.setArrayOfPointers(VK_FALSE);
+  instancesData.setData(m_device.getBufferAddress({m_instBuffer.buffer}));
+  vk::AccelerationStructureGeometryKHR topASGeometry;
+  topASGeometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+  topASGeometry.geometry.setInstances(instancesData);
+
+  vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+  buildInfo.setType(vk::AccelerationStructureTypeKHR::eTopLevel);
+  buildInfo.setFlags(flags);
+  buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+  buildInfo.setGeometryCount(1);
+  buildInfo.setPGeometries(&topASGeometry);
+
+  vk::AccelerationStructureBuildSizesInfoKHR sizeInfo =
+      m_device.getAccelerationStructureBuildSizesKHR(vk::AccelerationStructureBuildTypeKHR::eDevice,
+                                                     buildInfo, nbInstances);
+
+  vk::AccelerationStructureCreateInfoKHR createInfo;
+  createInfo.setType(vk::AccelerationStructureTypeKHR::eTopLevel);
+  createInfo.setSize(sizeInfo.accelerationStructureSize);
+  m_tlas = m_alloc->createAcceleration(createInfo);
+  m_debug.setObjectName(m_tlas.accel, "Tlas");
+
+  m_scratch = m_alloc->createBuffer(std::max(sizeInfo.buildScratchSize, sizeInfo.updateScratchSize),
+                                    vkBU::eStorageBuffer | vkBU::eShaderDeviceAddress);
+  buildInfo.setDstAccelerationStructure(m_tlas.accel);
+  buildInfo.setScratchData(m_device.getBufferAddress({m_scratch.buffer}));
+
+  nvvk::CommandPool cmdPool(m_device, m_queueIndex);
+  vk::CommandBuffer cmdBuf = cmdPool.createCommandBuffer();
+
+  vk::AccelerationStructureBuildRangeInfoKHR        buildOffsetInfo{nbInstances, 0, 0, 0};
+  const vk::AccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
+  cmdBuf.buildAccelerationStructuresKHR(1, &buildInfo, &pBuildOffsetInfo);
+
+  cmdPool.submitAndWait(cmdBuf);
+  resetMotion();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Change the transformation of an instance
+// - Only the host copy is changed, the frame regions get it in cmdUpdate()
+// - The instance is one of the last build: the motion is measured from where it was then
+//
+void TlasBuilder::setTransform(uint32_t instanceId, const nvmath::mat4f& transform)
+{
+  assert(instanceId < m_instances.size() && instanceId < m_buildMin.size());
+  VkAccelerationStructureInstanceKHR& instance = m_instances[instanceId];
+  nvmath::mat4f                       transp   = nvmath::transpose(transform);
+  memcpy(&instance.transform, &transp, sizeof(instance.transform));
+  m_changeLog.push_back(instanceId);
+  m_dirty = true;
+
+  // Distance from the bounds the instance had when the BVH was built, by the corner that moved
+  // the most
+  nvmath::vec3f bbMin, bbMax;
+  getWorldBounds(instance, m_localCenters[instanceId], m_localExtents[instanceId], bbMin, bbMax);
+  float motion = std::max(nvmath::length(bbMin - m_buildMin[instanceId]),
+                          nvmath::length(bbMax - m_buildMax[instanceId]));
+  m_totalMotion += motion - m_motion[instanceId];
+  m_motion[instanceId] = motion;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Point an instance to another BLAS, or activate it with the BLAS built after the TLAS
+//
+void TlasBuilder::setBlasAddress(uint32_t instanceId, vk::DeviceAddress blasAddress)
+{
+  m_instances[instanceId].accelerationStructureReference = blasAddress;
+  m_changeLog.push_back(instanceId);
+  m_dirty        = true;
+  m_needsRebuild = true;
+}
+
+void TlasBuilder::setMask(uint32_t instanceId, uint32_t mask)
+{
+  m_instances[instanceId].mask = mask;
+  m_changeLog.push_back(instanceId);
+  m_dirty = true;
+}
+
+void TlasBuilder::setHitGroup(uint32_t instanceId, uint32_t hitGroupId)
+{
+  m_instances[instanceId].instanceShaderBindingTableRecordOffset = hitGroupId;
+  m_changeLog.push_back(instanceId);
+  m_dirty = true;
+}
+
+float TlasBuilder::getDegradation() const
+{
+  if(m_instances.empty())
+    return 0.f;
+  return static_cast<float>(m_totalMotion / (double(m_instances.size()) * m_sceneExtent));
+}
+
+//--------------------------------------------------------------------------------------------------
+// Reference bounds for the motion, taken at each build
+//
+void TlasBuilder::resetMotion()
+{
+  size_t nbInstances = m_instances.size();
+  m_buildMin.resize(nbInstances);
+  m_buildMax.resize(nbInstances);
+  m_motion.assign(nbInstances, 0.f);
+  m_totalMotion = 0;
+
+  nvmath::vec3f bbMin(FLT_MAX), bbMax(-FLT_MAX);
+  for(size_t i = 0; i < nbInstances; i++)
+  {
+    getWorldBounds(m_instances[i], m_localCenters[i], m_localExtents[i], m_buildMin[i],
+                   m_buildMax[i]);
+    for(int c = 0; c < 3; c++)
+    {
+      bbMin[c] = std::min(bbMin[c], m_buildMin[i][c]);
+      bbMax[c] = std::max(bbMax[c], m_buildMax[i][c]);
+    }
+  }
+  m_sceneExtent = nbInstances ? std::max(nvmath::length(bbMax - bbMin), 1.f) : 1.f;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Write the instances changed since this frame region was last used. The GPU is done with the
+// region: the frame it was used by was waited on before recording this one.
+//
+void TlasBuilder::syncFrameRegion(uint32_t frameIndex)
+{
+  VkAccelerationStructureInstanceKHR* region =
+      m_mappedInstances + size_t(frameIndex) * m_instances.size();
+  for(size_t i = m_regionLogPos[frameIndex] - m_changeLogBase; i < m_changeLog.size(); i++)
+  {
+    uint32_t id = m_changeLog[i];
+    region[id]  = m_instances[id];
+  }
+  m_regionLogPos[frameIndex] = m_changeLogBase + m_changeLog.size();
+
+  // Forget the changes all regions have
+  size_t oldest = *std::min_element(m_regionLogPos.begin(), m_regionLogPos.end());
+  m_changeLog.erase(m_changeLog.begin(), m_changeLog.begin() + (oldest - m_changeLogBase));
+  m_changeLogBase = oldest;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Record the update of the TLAS in the frame command buffer
+// - Nothing is recorded if no instance changed
+// - Refitting keeps the BVH of the last build: past the rebuild threshold, rebuild instead
+//
+void TlasBuilder::cmdUpdate(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex)
+{
+  if(!m_dirty || !m_tlas.accel)
+    return;
+  frameIndex = frameIndex % m_nbFrames;
+  syncFrameRegion(frameIndex);
+  m_dirty = false;
+
+  bool canUpdate = (m_flags & vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate)
+                   == vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate;
+  bool rebuild   = !canUpdate || m_needsRebuild || getDegradation() > m_rebuildThreshold;
+  m_needsRebuild = false;
+
+  uint32_t          nbInstances = static_cast<uint32_t>(m_instances.size());
+  vk::DeviceAddress instAddress =
+      m_device.getBufferAddress({m_instBuffer.buffer})
+      + vk::DeviceSize(frameIndex) * nbInstances * sizeof(VkAccelerationStructureInstanceKHR);
+
+  vk::AccelerationStructureGeometryInstancesDataKHR instancesData;
+  instancesData.setArrayOfPointers(VK_FALSE);
+  instancesData.setData(instAddress);
+  vk::AccelerationStructureGeometryKHR topASGeometry;
+  topASGeometry.setGeometryType(vk::GeometryTypeKHR::eInstances);
+  topASGeometry.geometry.setInstances(instancesData);
+
+  vk::AccelerationStructureBuildGeometryInfoKHR buildInfo;
+  buildInfo.setType(vk::AccelerationStructureTypeKHR::eTopLevel);
+  buildInfo.setFlags(m_flags);
+  buildInfo.setGeometryCount(1);
+  buildInfo.setPGeometries(&topASGeometry);
+  buildInfo.setDstAccelerationStructure(m_tlas.accel);
+  buildInfo.setScratchData(m_device.getBufferAddress({m_scratch.buffer}));
+  if(rebuild)
+  {
+    buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eBuild);
+  }
+  else
+  {
+    buildInfo.setMode(vk::BuildAccelerationStructureModeKHR::eUpdate);
+    buildInfo.setSrcAccelerationStructure(m_tlas.accel);
+  }
+
+  // Previous frames trace the TLAS and use the scratch buffer
+  vk::MemoryBarrier barrier;
+  barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR
+                           | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR
+                           | vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR
+                             | vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                         vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, {}, {barrier},
+                         {}, {});
+
+  vk::AccelerationStructureBuildRangeInfoKHR        buildOffsetInfo{nbInstances, 0, 0, 0};
+  const vk::AccelerationStructureBuildRangeInfoKHR* pBuildOffsetInfo = &buildOffsetInfo;
+  cmdBuf.buildAccelerationStructuresKHR(1, &buildInfo, &pBuildOffsetInfo);
+
+  // The TLAS is ready before tracing rays
+  barrier.setSrcAccessMask(vk::AccessFlagBits::eAccelerationStructureWriteKHR);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eAccelerationStructureReadKHR);
+  cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                         vk::PipelineStageFlagBits::eRayTracingShaderKHR, {}, {barrier}, {}, {});
+
+  if(rebuild)
+  {
+    m_nbRebuilds++;
+    resetMotion();
+  }
+  else
+  {
+    m_nbUpdates++;
+  }
+}
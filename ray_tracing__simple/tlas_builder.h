@@ -0,0 +1,147 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <vulkan/vulkan.hpp>
+
+#include "nvmath/nvmath.h"
+#include "nvvk/debug_util_vk.hpp"
+
+#include "blas_builder.h"
+#include "pool_allocator.h"
+#include "thread_pool.h"
+#include "transform_store.h"
+
+//--------------------------------------------------------------------------------------------------
+// Builds the top-level acceleration structure over the BLAS of a BlasBuilder
+// - The instances live in a persistently mapped buffer, with one region per frame in flight
+// - setTransform() only touches the host copy of an instance and logs the change; cmdUpdate()
+//   writes the changed instances in the region of the frame and records a TLAS update in the
+//   frame command buffer
+// - Updates keep the BVH topology of the last build. When the accumulated motion since that
+//   build passes the rebuild threshold, cmdUpdate() records a full rebuild instead. The motion
+//   of an instance is how far its world bounds moved from the ones it had at the build: a
+//   rotation or a scale counts as much as a translation.
+// - Instances of a BLAS not ready at build time are inactive. setBlasAddress() activates them
+//   once it is: an update cannot activate an instance, cmdUpdate() then records a rebuild.
+// - The build converts the instances over chunks on the thread pool. With a TransformStore, the
+//   transforms are packed from it in batches instead of being transposed one by one.
+//
+class TlasBuilder
+{
+public:
+  // Instance of a BLAS in the TLAS
+  struct Instance
+  {
+    uint32_t                     blasId{0};            // Index of the BLAS in the BlasBuilder
+    uint32_t                     instanceCustomId{0};  // Instance Index (gl_InstanceCustomIndexEXT)
+    uint32_t                     hitGroupId{0};        // Hit group index in the SBT
+    uint32_t                     mask{0xFF};           // Visibility mask, AND-ed with ray mask
+    vk::GeometryInstanceFlagsKHR flags{vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable};
+    nvmath::mat4f                transform{nvmath::mat4f(1)};  // Identity
+    // Object-space bounds of the BLAS, for the motion of the instance
+    nvmath::vec3f                bboxMin{0.f};
+    nvmath::vec3f                bboxMax{0.f};
+  };
+
+  void setup(const vk::Device& device,
+             PoolAllocator*    allocator,
+             uint32_t          queueIndex,
+             uint32_t          nbFrames);
+  void destroy();
+
+  // Full build, waits for completion. Use eAllowUpdate in flags for animated instances.
+  // The transform of instance i is transforms[i] when given, the one of the Instance otherwise.
+  void build(const std::vector<Instance>&           instances,
+             const BlasBuilder&                     blasBuilder,
+             vk::BuildAccelerationStructureFlagsKHR flags,
+             ThreadPool*                            pool       = nullptr,
+             const TransformStore*                  transforms = nullptr);
+
+  // Instance animation
+  void setTransform(uint32_t instanceId, const nvmath::mat4f& transform);
+  void cmdUpdate(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex);
+  // BLAS were refit: the bounds of their instances changed, the next cmdUpdate() refits the TLAS
+  void markDirty() { m_dirty = true; }
+  // The BLAS of the instance is ready, or changed
+  void setBlasAddress(uint32_t instanceId, vk::DeviceAddress blasAddress);
+  // Visibility of the instance to the rays, an update is enough
+  void setMask(uint32_t instanceId, uint32_t mask);
+  // Hit record of the instance in the SBT, an update is enough
+  void setHitGroup(uint32_t instanceId, uint32_t hitGroupId);
+
+  // Average motion of the instance bounds since the last build, relative to the size of the scene
+  float getDegradation() const;
+  void  setRebuildThreshold(float threshold) { m_rebuildThreshold = threshold; }
+  uint32_t getNbUpdates() const { return m_nbUpdates; }
+  uint32_t getNbRebuilds() const { return m_nbRebuilds; }
+
+  vk::AccelerationStructureKHR getAccelerationStructure() const { return m_tlas.accel; }
+
+  static VkAccelerationStructureInstanceKHR toVkInstance(const Instance&   instance,
+                                                         vk::DeviceAddress blasAddress);
+
+private:
+  // All but the transform
+  static VkAccelerationStructureInstanceKHR toVkInstanceIds(const Instance&   instance,
+                                                            vk::DeviceAddress blasAddress);
+
+  void syncFrameRegion(uint32_t frameIndex);
+  void resetMotion();
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  nvvk::DebugUtil m_debug;
+  uint32_t        m_queueIndex{0};
+  uint32_t        m_nbFrames{1};
+
+  nvvk::AccelKHR                         m_tlas;
+  vk::BuildAccelerationStructureFlagsKHR m_flags;
+  nvvk::Buffer                           m_scratch;     // Large enough for a build or an update
+  nvvk::Buffer                           m_instBuffer;  // nbFrames regions of instances
+  VkAccelerationStructureInstanceKHR*    m_mappedInstances{nullptr};
+
+  // Host copy of the instances, and changes not yet in all frame regions
+  std::vector<VkAccelerationStructureInstanceKHR> m_instances;
+  std::vector<uint32_t>                           m_changeLog;
+  size_t              m_changeLogBase{0};     // Log position of m_changeLog[0]
+  std::vector<size_t> m_regionLogPos;         // Log position reached by each frame region
+  bool                m_dirty{false};         // Changes since last build or update
+  bool                m_needsRebuild{false};  // Changes an update cannot do
+
+  // Motion since the last build: object-space bounds as center and half extent, world bounds at
+  // the build
+  std::vector<nvmath::vec3f> m_localCenters;
+  std::vector<nvmath::vec3f> m_localExtents;
+  std::vector<nvmath::vec3f> m_buildMin;
+  std::vector<nvmath::vec3f> m_buildMax;
+  std::vector<float>         m_motion;
+  double                     m_totalMotion{0};
+  float                      m_sceneExtent{1.f};
+  float                      m_rebuildThreshold{0.1f};
+  uint32_t                   m_nbUpdates{0};
+  uint32_t                   m_nbRebuilds{0};
+};
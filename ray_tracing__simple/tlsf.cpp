@@ -0,0 +1,289 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "tlsf.h"
+
+namespace {
+uint32_t highestBit(uint64_t v)
+{
+  uint32_t bit = 0;
+  while(v >>= 1)
+    bit++;
+  return bit;
+}
+
+uint32_t lowestBit(uint64_t v)
+{
+  uint32_t bit = 0;
+  while(!(v & 1))
+  {
+    v >>= 1;
+    bit++;
+  }
+  return bit;
+}
+
+uint64_t alignUp(uint64_t v, uint64_t alignment)
+{
+  return (v + alignment - 1) & ~(alignment - 1);
+}
+}  // namespace
+
+void Tlsf::init(uint64_t capacity)
+{
+  m_nodes.clear();
+  m_unusedNodes.clear();
+  m_flBitmap = 0;
+  std::fill(std::begin(m_slBitmap), std::end(m_slBitmap), 0u);
+  for(auto& heads : m_freeHeads)
+    std::fill(std::begin(heads), std::end(heads), kNone);
+
+  m_capacity      = capacity & ~(kGranularity - 1);
+  m_used          = 0;
+  m_free          = 0;
+  m_nbAllocations = 0;
+  m_nbFreeBlocks  = 0;
+  m_firstNode     = kNone;
+  if(m_capacity == 0)
+    return;
+
+  m_firstNode          = newNode();
+  m_nodes[m_firstNode] = {0, m_capacity};
+  insertFree(m_firstNode);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Size class of a block: first level is the highest bit, second level the next kSlLog2 bits
+//
+void Tlsf::mapping(uint64_t size, uint32_t& fl, uint32_t& sl)
+{
+  fl = highestBit(size);
+  sl = fl < kSlLog2 ? 0 : static_cast<uint32_t>((size >> (fl - kSlLog2)) - kSlCount);
+}
+
+uint32_t Tlsf::newNode()
+{
+  if(!m_unusedNodes.empty())
+  {
+    uint32_t node = m_unusedNodes.back();
+    m_unusedNodes.pop_back();
+    m_nodes[node] = Node();
+    return node;
+  }
+  m_nodes.emplace_back();
+  return static_cast<uint32_t>(m_nodes.size() - 1);
+}
+
+void Tlsf::releaseNode(uint32_t node)
+{
+  m_unusedNodes.push_back(node);
+}
+
+void Tlsf::insertFree(uint32_t node)
+{
+  Node& n = m_nodes[node];
+  uint32_t fl, sl;
+  mapping(n.size, fl, sl);
+  n.free     = true;
+  n.prevFree = kNone;
+  n.nextFree = m_freeHeads[fl][sl];
+  if(n.nextFree != kNone)
+    m_nodes[n.nextFree].prevFree = node;
+  m_freeHeads[fl][sl] = node;
+  m_flBitmap |= 1ull << fl;
+  m_slBitmap[fl] |= 1u << sl;
+  m_free += n.size;
+  m_nbFreeBlocks++;
+}
+
+void Tlsf::removeFree(uint32_t node)
+{
+  Node& n = m_nodes[node];
+  uint32_t fl, sl;
+  mapping(n.size, fl, sl);
+  if(n.prevFree != kNone)
+    m_nodes[n.prevFree].nextFree = n.nextFree;
+  else
+    m_freeHeads[fl][sl] = n.nextFree;
+  if(n.nextFree != kNone)
+    m_nodes[n.nextFree].prevFree = n.prevFree;
+
+  if(m_freeHeads[fl][sl] == kNone)
+  {
+    m_slBitmap[fl] &= ~(1u << sl);
+    if(m_slBitmap[fl] == 0)
+      m_flBitmap &= ~(1ull << fl);
+  }
+  n.free     = false;
+  n.prevFree = kNone;
+  n.nextFree = kNone;
+  m_free -= n.size;
+  m_nbFreeBlocks--;
+}
+
+//--------------------------------------------------------------------------------------------------
+// A free block of at least `size` bytes: the size is rounded up to the next size class, so that
+// any block of the lists searched is large enough
+//
+uint32_t Tlsf::findFree(uint64_t size) const
+{
+  uint32_t fl = highestBit(size);
+  if(fl >= kSlLog2)
+    size += (1ull << (fl - kSlLog2)) - 1;
+  uint32_t sl;
+  mapping(size, fl, sl);
+  if(fl >= kFlCount)
+    return kNone;
+
+  uint32_t slMap = m_slBitmap[fl] & (~0u << sl);
+  if(slMap == 0)
+  {
+    uint64_t flMap = fl + 1 < kFlCount ? m_flBitmap & (~0ull << (fl + 1)) : 0;
+    if(flMap == 0)
+      return kNone;
+    fl    = lowestBit(flMap);
+    slMap = m_slBitmap[fl];
+  }
+  return m_freeHeads[fl][lowestBit(slMap)];
+}
+
+//--------------------------------------------------------------------------------------------------
+// Split a block in two: the front part of `size` bytes is returned, the back part keeps the
+// state of the node (used by the caller) and is linked after it
+//
+uint32_t Tlsf::splitFront(uint32_t node, uint64_t size)
+{
+  uint32_t front = newNode();
+  Node&    f     = m_nodes[front];
+  Node&    n     = m_nodes[node];
+  f.offset       = n.offset;
+  f.size         = size;
+  f.prevPhys     = n.prevPhys;
+  f.nextPhys     = node;
+  if(n.prevPhys != kNone)
+    m_nodes[n.prevPhys].nextPhys = front;
+  else
+    m_firstNode = front;
+  n.prevPhys = front;
+  n.offset += size;
+  n.size -= size;
+  return front;
+}
+
+Tlsf::Handle Tlsf::allocate(uint64_t size, uint64_t alignment)
+{
+  assert((alignment & (alignment - 1)) == 0);
+  size      = alignUp(std::max<uint64_t>(size, 1), kGranularity);
+  alignment = std::max(alignment, kGranularity);
+
+  // The worst front padding is alignment - kGranularity
+  uint32_t node = findFree(size + alignment - kGranularity);
+  if(node == kNone)
+    return kInvalid;
+  removeFree(node);
+
+  // Front padding goes back to the free lists
+  uint64_t padding = alignUp(m_nodes[node].offset, alignment) - m_nodes[node].offset;
+  if(padding > 0)
+    insertFree(splitFront(node, padding));
+
+  // Remaining back part too
+  if(m_nodes[node].size > size)
+  {
+    uint32_t back = splitFront(node, size);
+    std::swap(back, node);
+    insertFree(back);
+  }
+
+  m_used += m_nodes[node].size;
+  m_nbAllocations++;
+  return node;
+}
+
+void Tlsf::free(Handle handle)
+{
+  assert(handle < m_nodes.size() && !m_nodes[handle].free);
+  m_used -= m_nodes[handle].size;
+  m_nbAllocations--;
+
+  // Merge with the free neighbors
+  uint32_t node = handle;
+  uint32_t prev = m_nodes[node].prevPhys;
+  if(prev != kNone && m_nodes[prev].free)
+  {
+    removeFree(prev);
+    m_nodes[node].offset = m_nodes[prev].offset;
+    m_nodes[node].size += m_nodes[prev].size;
+    m_nodes[node].prevPhys = m_nodes[prev].prevPhys;
+    if(m_nodes[node].prevPhys != kNone)
+      m_nodes[m_nodes[node].prevPhys].nextPhys = node;
+    else
+      m_firstNode = node;
+    releaseNode(prev);
+  }
+  uint32_t next = m_nodes[node].nextPhys;
+  if(next != kNone && m_nodes[next].free)
+  {
+    removeFree(next);
+    m_nodes[node].size += m_nodes[next].size;
+    m_nodes[node].nextPhys = m_nodes[next].nextPhys;
+    if(m_nodes[node].nextPhys != kNone)
+      m_nodes[m_nodes[node].nextPhys].prevPhys = node;
+    releaseNode(next);
+  }
+  insertFree(node);
+}
+
+uint64_t Tlsf::getLargestFree() const
+{
+  if(m_flBitmap == 0)
+    return 0;
+  uint32_t fl      = highestBit(m_flBitmap);
+  uint32_t sl      = highestBit(m_slBitmap[fl]);
+  uint64_t largest = 0;
+  for(uint32_t node = m_freeHeads[fl][sl]; node != kNone; node = m_nodes[node].nextFree)
+    largest = std::max(largest, m_nodes[node].size);
+  return largest;
+}
+
+float Tlsf::getFragmentation() const
+{
+  return m_free > 0 ? 1.f - float(double(getLargestFree()) / double(m_free)) : 0.f;
+}
+
+void Tlsf::forEachAllocation(
+    const std::function<void(Handle, uint64_t offset, uint64_t size)>& fn) const
+{
+  for(uint32_t node = m_firstNode; node != kNone; node = m_nodes[node].nextPhys)
+  {
+    if(!m_nodes[node].free)
+      fn(node, m_nodes[node].offset, m_nodes[node].size);
+  }
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+//--------------------------------------------------------------------------------------------------
+// Two-Level Segregated Fit allocation policy over a range of `capacity` bytes
+// - Only offsets are managed: there is no Vulkan here, the policy can be exercised on the host
+// - Free blocks are kept in lists by size class: a first level per power of two, split in
+//   kSlCount second-level classes. Finding and releasing a block are O(1)
+// - Sizes and offsets are multiples of kGranularity; larger alignments are honored by
+//   splitting off the front of the block found
+// - Freed blocks are merged with their free neighbors
+//
+class Tlsf
+{
+public:
+  using Handle = uint32_t;
+
+  static constexpr Handle   kInvalid     = ~0u;
+  static constexpr uint64_t kGranularity = 16;
+
+  explicit Tlsf(uint64_t capacity = 0) { init(capacity); }
+  void init(uint64_t capacity);
+
+  // kInvalid when no free block can hold `size` bytes at `alignment` (a power of two)
+  Handle allocate(uint64_t size, uint64_t alignment = kGranularity);
+  void   free(Handle handle);
+
+  uint64_t getOffset(Handle handle) const { return m_nodes[handle].offset; }
+  uint64_t getSize(Handle handle) const { return m_nodes[handle].size; }
+
+  uint64_t getCapacity() const { return m_capacity; }
+  uint64_t getUsed() const { return m_used; }
+  uint32_t getNbAllocations() const { return m_nbAllocations; }
+  uint32_t getNbFreeBlocks() const { return m_nbFreeBlocks; }
+  uint64_t getLargestFree() const;
+  bool     isEmpty() const { return m_nbAllocations == 0; }
+  // 0 when the free space is one block, close to 1 when it is scattered in small blocks
+  float getFragmentation() const;
+
+  // Allocations in offset order
+  void forEachAllocation(
+      const std::function<void(Handle, uint64_t offset, uint64_t size)>& fn) const;
+
+private:
+  static constexpr uint32_t kSlLog2  = 4;
+  static constexpr uint32_t kSlCount = 1u << kSlLog2;
+  static constexpr uint32_t kFlCount = 64;
+  static constexpr uint32_t kNone    = ~0u;
+
+  struct Node
+  {
+    uint64_t offset{0};
+    uint64_t size{0};
+    uint32_t prevPhys{kNone};  // Neighbors in the range
+    uint32_t nextPhys{kNone};
+    uint32_t prevFree{kNone};  // Neighbors in the free list of its size class
+    uint32_t nextFree{kNone};
+    bool     free{false};
+  };
+
+  static void mapping(uint64_t size, uint32_t& fl, uint32_t& sl);
+  uint32_t    newNode();
+  void        releaseNode(uint32_t node);
+  void        insertFree(uint32_t node);
+  void        removeFree(uint32_t node);
+  uint32_t    findFree(uint64_t size) const;
+  uint32_t    splitFront(uint32_t node, uint64_t size);  // Returns the front part
+
+  std::vector<Node>     m_nodes;
+  std::vector<uint32_t> m_unusedNodes;
+  uint32_t              m_firstNode{kNone};
+  uint64_t              m_flBitmap{0};
+  uint32_t              m_slBitmap[kFlCount]{};
+  uint32_t              m_freeHeads[kFlCount][kSlCount];
+
+  uint64_t m_capacity{0};
+  uint64_t m_used{0};
+  uint64_t m_free{0};
+  uint32_t m_nbAllocations{0};
+  uint32_t m_nbFreeBlocks{0};
+};
@@ -0,0 +1,369 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <random>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "nvh/nvprint.hpp"
+#include "transform_store.h"
+
+// Chunks of the thread pool, a multiple of the SIMD width
+static constexpr size_t kChunkSize = 4096;
+
+void TransformStore::resize(uint32_t nbInstances)
+{
+  // Identity for the new instances
+  for(int e = 0; e < 12; e++)
+    m_elements[e].resize(nbInstances, e % 5 == 0 ? 1.f : 0.f);
+}
+
+void TransformStore::set(uint32_t instanceId, const nvmath::mat4f& transform)
+{
+  float m[16];  // Column-major
+  memcpy(m, &transform, sizeof(m));
+  for(int r = 0; r < 3; r++)
+    for(int c = 0; c < 4; c++)
+      m_elements[r * 4 + c][instanceId] = m[c * 4 + r];
+}
+
+static nvmath::mat4f toMat4(const std::vector<float> (&elements)[12], uint32_t instanceId)
+{
+  float m[16] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 1.f};
+  for(int r = 0; r < 3; r++)
+    for(int c = 0; c < 4; c++)
+      m[c * 4 + r] = elements[r * 4 + c][instanceId];
+  nvmath::mat4f transform(1);
+  memcpy(&transform, m, sizeof(m));
+  return transform;
+}
+
+nvmath::mat4f TransformStore::get(uint32_t instanceId) const
+{
+  return toMat4(m_elements, instanceId);
+}
+
+nvmath::mat4f TransformStore::getInverse(uint32_t instanceId) const
+{
+  return toMat4(m_inverses, instanceId);
+}
+
+bool TransformStore::hasSimd()
+{
+#if defined(__AVX2__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Affine inverse: the 3x3 part is inverted from its cofactors, the translation is moved back by
+// it. Singular transforms get a null inverse.
+//
+void TransformStore::computeInverses(ThreadPool* pool, bool useSimd)
+{
+  for(auto& inverse : m_inverses)
+    inverse.resize(m_elements[0].size());
+
+  bool simd   = useSimd && hasSimd();
+  auto kernel = [&](size_t begin, size_t end) {
+    if(simd)
+      invertSimd(begin, end);
+    else
+      invertScalar(begin, end);
+  };
+  if(pool)
+    pool->parallelFor(size(), kChunkSize, kernel);
+  else
+    kernel(0, size());
+}
+
+void TransformStore::invertScalar(size_t begin, size_t end)
+{
+  const std::vector<float>* a = m_elements;
+  std::vector<float>*       b = m_inverses;
+  for(size_t i = begin; i < end; i++)
+  {
+    float a00 = a[0][i], a01 = a[1][i], a02 = a[2][i];
+    float a10 = a[4][i], a11 = a[5][i], a12 = a[6][i];
+    float a20 = a[8][i], a21 = a[9][i], a22 = a[10][i];
+
+    float c00 = a11 * a22 - a12 * a21;
+    float c01 = a12 * a20 - a10 * a22;
+    float c02 = a10 * a21 - a11 * a20;
+    float det = a00 * c00 + a01 * c01 + a02 * c02;
+    float inv = det != 0.f ? 1.f / det : 0.f;
+
+    // Inverse: transposed cofactors over the determinant
+    float b00 = c00 * inv;
+    float b01 = (a02 * a21 - a01 * a22) * inv;
+    float b02 = (a01 * a12 - a02 * a11) * inv;
+    float b10 = c01 * inv;
+    float b11 = (a00 * a22 - a02 * a20) * inv;
+    float b12 = (a02 * a10 - a00 * a12) * inv;
+    float b20 = c02 * inv;
+    float b21 = (a01 * a20 - a00 * a21) * inv;
+    float b22 = (a00 * a11 - a01 * a10) * inv;
+
+    float t0 = a[3][i], t1 = a[7][i], t2 = a[11][i];
+    b[0][i]  = b00;
+    b[1][i]  = b01;
+    b[2][i]  = b02;
+    b[3][i]  = -(b00 * t0 + b01 * t1 + b02 * t2);
+    b[4][i]  = b10;
+    b[5][i]  = b11;
+    b[6][i]  = b12;
+    b[7][i]  = -(b10 * t0 + b11 * t1 + b12 * t2);
+    b[8][i]  = b20;
+    b[9][i]  = b21;
+    b[10][i] = b22;
+    b[11][i] = -(b20 * t0 + b21 * t1 + b22 * t2);
+  }
+}
+
+void TransformStore::invertSimd(size_t begin, size_t end)
+{
+#if defined(__AVX2__)
+  const std::vector<float>* a    = m_elements;
+  std::vector<float>*       b    = m_inverses;
+  const __m256              zero = _mm256_setzero_ps();
+  const __m256              one  = _mm256_set1_ps(1.f);
+  // a * b - c * d
+  auto diffOfProducts = [](__m256 a, __m256 b, __m256 c, __m256 d) {
+    return _mm256_sub_ps(_mm256_mul_ps(a, b), _mm256_mul_ps(c, d));
+  };
+  auto dot3 = [](__m256 a0, __m256 b0, __m256 a1, __m256 b1, __m256 a2, __m256 b2) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a0, b0), _mm256_mul_ps(a1, b1)),
+                         _mm256_mul_ps(a2, b2));
+  };
+
+  size_t i = begin;
+  for(; i + 8 <= end; i += 8)
+  {
+    __m256 a00 = _mm256_loadu_ps(&a[0][i]), a01 = _mm256_loadu_ps(&a[1][i]);
+    __m256 a02 = _mm256_loadu_ps(&a[2][i]), a10 = _mm256_loadu_ps(&a[4][i]);
+    __m256 a11 = _mm256_loadu_ps(&a[5][i]), a12 = _mm256_loadu_ps(&a[6][i]);
+    __m256 a20 = _mm256_loadu_ps(&a[8][i]), a21 = _mm256_loadu_ps(&a[9][i]);
+    __m256 a22 = _mm256_loadu_ps(&a[10][i]);
+
+    __m256 c00 = diffOfProducts(a11, a22, a12, a21);
+    __m256 c01 = diffOfProducts(a12, a20, a10, a22);
+    __m256 c02 = diffOfProducts(a10, a21, a11, a20);
+    __m256 det = dot3(a00, c00, a01, c01, a02, c02);
+    __m256 inv = _mm256_and_ps(_mm256_div_ps(one, det), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+
+    __m256 b00 = _mm256_mul_ps(c00, inv);
+    __m256 b01 = _mm256_mul_ps(diffOfProducts(a02, a21, a01, a22), inv);
+    __m256 b02 = _mm256_mul_ps(diffOfProducts(a01, a12, a02, a11), inv);
+    __m256 b10 = _mm256_mul_ps(c01, inv);
+    __m256 b11 = _mm256_mul_ps(diffOfProducts(a00, a22, a02, a20), inv);
+    __m256 b12 = _mm256_mul_ps(diffOfProducts(a02, a10, a00, a12), inv);
+    __m256 b20 = _mm256_mul_ps(c02, inv);
+    __m256 b21 = _mm256_mul_ps(diffOfProducts(a01, a20, a00, a21), inv);
+    __m256 b22 = _mm256_mul_ps(diffOfProducts(a00, a11, a01, a10), inv);
+
+    __m256 t0 = _mm256_loadu_ps(&a[3][i]);
+    __m256 t1 = _mm256_loadu_ps(&a[7][i]);
+    __m256 t2 = _mm256_loadu_ps(&a[11][i]);
+    _mm256_storeu_ps(&b[0][i], b00);
+    _mm256_storeu_ps(&b[1][i], b01);
+    _mm256_storeu_ps(&b[2][i], b02);
+    _mm256_storeu_ps(&b[3][i], _mm256_sub_ps(zero, dot3(b00, t0, b01, t1, b02, t2)));
+    _mm256_storeu_ps(&b[4][i], b10);
+    _mm256_storeu_ps(&b[5][i], b11);
+    _mm256_storeu_ps(&b[6][i], b12);
+    _mm256_storeu_ps(&b[7][i], _mm256_sub_ps(zero, dot3(b10, t0, b11, t1, b12, t2)));
+    _mm256_storeu_ps(&b[8][i], b20);
+    _mm256_storeu_ps(&b[9][i], b21);
+    _mm256_storeu_ps(&b[10][i], b22);
+    _mm256_storeu_ps(&b[11][i], _mm256_sub_ps(zero, dot3(b20, t0, b21, t1, b22, t2)));
+  }
+  invertScalar(i, end);
+#else
+  invertScalar(begin, end);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// From the arrays to 12 consecutive floats per instance
+//
+void TransformStore::pack(void*       dst,
+                          size_t      stride,
+                          uint32_t    first,
+                          uint32_t    count,
+                          ThreadPool* pool,
+                          bool        useSimd) const
+{
+  // Shifted so that instance i is written at base + i * stride
+  uint8_t* base   = static_cast<uint8_t*>(dst) - size_t(first) * stride;
+  bool     simd   = useSimd && hasSimd();
+  auto     kernel = [&](size_t begin, size_t end) {
+    if(simd)
+      packSimd(base, stride, first + begin, first + end);
+    else
+      packScalar(base, stride, first + begin, first + end);
+  };
+  if(pool)
+    pool->parallelFor(count, kChunkSize, kernel);
+  else
+    kernel(0, count);
+}
+
+void TransformStore::packScalar(uint8_t* dst, size_t stride, size_t begin, size_t end) const
+{
+  for(size_t i = begin; i < end; i++)
+  {
+    float* out = reinterpret_cast<float*>(dst + i * stride);
+    for(int e = 0; e < 12; e++)
+      out[e] = m_elements[e][i];
+  }
+}
+
+//--------------------------------------------------------------------------------------------------
+// 8 instances at a time: elements 0 to 7 are an 8x8 transpose, elements 8 to 11 a 4x8 one
+//
+void TransformStore::packSimd(uint8_t* dst, size_t stride, size_t begin, size_t end) const
+{
+#if defined(__AVX2__)
+  size_t i = begin;
+  for(; i + 8 <= end; i += 8)
+  {
+    __m256 e[12];
+    for(int k = 0; k < 12; k++)
+      e[k] = _mm256_loadu_ps(&m_elements[k][i]);
+
+    // Pairs of elements, then quads, then the lanes: row k is instance i + k
+    __m256 t0 = _mm256_unpacklo_ps(e[0], e[1]);
+    __m256 t1 = _mm256_unpackhi_ps(e[0], e[1]);
+    __m256 t2 = _mm256_unpacklo_ps(e[2], e[3]);
+    __m256 t3 = _mm256_unpackhi_ps(e[2], e[3]);
+    __m256 t4 = _mm256_unpacklo_ps(e[4], e[5]);
+    __m256 t5 = _mm256_unpackhi_ps(e[4], e[5]);
+    __m256 t6 = _mm256_unpacklo_ps(e[6], e[7]);
+    __m256 t7 = _mm256_unpackhi_ps(e[6], e[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44);
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44);
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, 0x44);
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, 0x44);
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+    __m256 rows[8] = {_mm256_permute2f128_ps(s0, s4, 0x20), _mm256_permute2f128_ps(s1, s5, 0x20),
+                      _mm256_permute2f128_ps(s2, s6, 0x20), _mm256_permute2f128_ps(s3, s7, 0x20),
+                      _mm256_permute2f128_ps(s0, s4, 0x31), _mm256_permute2f128_ps(s1, s5, 0x31),
+                      _mm256_permute2f128_ps(s2, s6, 0x31), _mm256_permute2f128_ps(s3, s7, 0x31)};
+
+    // Last column: instance i + k in the low lane of u[k], i + 4 + k in the high lane
+    __m256 v0   = _mm256_unpacklo_ps(e[8], e[9]);
+    __m256 v1   = _mm256_unpackhi_ps(e[8], e[9]);
+    __m256 v2   = _mm256_unpacklo_ps(e[10], e[11]);
+    __m256 v3   = _mm256_unpackhi_ps(e[10], e[11]);
+    __m256 u[4] = {_mm256_shuffle_ps(v0, v2, 0x44), _mm256_shuffle_ps(v0, v2, 0xEE),
+                   _mm256_shuffle_ps(v1, v3, 0x44), _mm256_shuffle_ps(v1, v3, 0xEE)};
+
+    for(int k = 0; k < 8; k++)
+    {
+      float* out = reinterpret_cast<float*>(dst + (i + k) * stride);
+      _mm256_storeu_ps(out, rows[k]);
+      __m128 last = k < 4 ? _mm256_castps256_ps128(u[k]) : _mm256_extractf128_ps(u[k - 4], 1);
+      _mm_storeu_ps(out + 8, last);
+    }
+  }
+  packScalar(dst, stride, i, end);
+#else
+  packScalar(dst, stride, begin, end);
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Best of a few runs of each variant. The reference is the per-instance nvmath inverse transpose
+// of a 4x4 matrix, as done when the instances were loaded.
+//
+void TransformStore::benchmark(uint32_t nbInstances, ThreadPool& pool)
+{
+  TransformStore store;
+  store.resize(nbInstances);
+
+  std::mt19937                          gen(42);
+  std::uniform_real_distribution<float> disPos(-500.f, 500.f);
+  std::uniform_real_distribution<float> disScale(0.5f, 5.f);
+  std::uniform_real_distribution<float> disAngle(0.f, 2.f * nv_pi);
+  std::vector<nvmath::mat4f>            matrices(nbInstances);
+  for(uint32_t i = 0; i < nbInstances; i++)
+  {
+    nvmath::mat4f mat =
+        nvmath::translation_mat4(nvmath::vec3f(disPos(gen), disPos(gen), disPos(gen)));
+    mat         = mat * nvmath::rotation_mat4_y(disAngle(gen));
+    mat         = mat * nvmath::scale_mat4(nvmath::vec3f(disScale(gen)));
+    matrices[i] = mat;
+    store.set(i, mat);
+  }
+
+  // Records of the size of VkAccelerationStructureInstanceKHR
+  const size_t         stride = 64;
+  std::vector<uint8_t> packed(size_t(nbInstances) * stride);
+
+  auto time = [&](const char* name, const std::function<void()>& fn) {
+    double bestMs = 1e30;
+    for(int iteration = 0; iteration < 10; iteration++)
+    {
+      auto startTime = std::chrono::high_resolution_clock::now();
+      fn();
+      std::chrono::duration<double, std::milli> duration =
+          std::chrono::high_resolution_clock::now() - startTime;
+      bestMs = std::min(bestMs, duration.count());
+    }
+    LOGI("%-24s %8.3f ms, %10.0f instances/ms\n", name, bestMs, nbInstances / bestMs);
+  };
+
+  LOGI("Transforming %u instances\n", nbInstances);
+  std::vector<nvmath::mat4f> reference(nbInstances);
+  time("nvmath inverse", [&]() {
+    for(uint32_t i = 0; i < nbInstances; i++)
+      reference[i] = nvmath::transpose(nvmath::invert(matrices[i]));
+  });
+  time("inverse, scalar", [&]() { store.computeInverses(nullptr, false); });
+  if(hasSimd())
+    time("inverse, AVX2", [&]() { store.computeInverses(nullptr, true); });
+  time(hasSimd() ? "inverse, AVX2, threaded" : "inverse, scalar, threaded",
+       [&]() { store.computeInverses(&pool, true); });
+
+  uint8_t* dst = packed.data();
+  time("pack, scalar", [&]() { store.pack(dst, stride, 0, nbInstances, nullptr, false); });
+  if(hasSimd())
+    time("pack, AVX2", [&]() { store.pack(dst, stride, 0, nbInstances, nullptr, true); });
+  time(hasSimd() ? "pack, AVX2, threaded" : "pack, scalar, threaded",
+       [&]() { store.pack(dst, stride, 0, nbInstances, &pool, true); });
+}
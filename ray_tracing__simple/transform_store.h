@@ -0,0 +1,83 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nvmath/nvmath.h"
+
+#include "thread_pool.h"
+
+//--------------------------------------------------------------------------------------------------
+// Affine transforms of the instances, in a structure of arrays for the batch kernels
+// - Each transform is a 3x4 row-major matrix, the last row being (0, 0, 0, 1): one array per
+//   element, element (r, c) in array 4 * r + c
+// - computeInverses() inverts all the transforms. The normal matrix of an instance, the inverse
+//   transpose of the 3x3 part, is the transposed 3x3 part of its inverse.
+// - pack() writes the transforms in the 3x4 row-major layout of VkTransformMatrixKHR, at any
+//   stride: straight into the mapped TLAS instances, or into the scene description
+// - The batch operations run over chunks of instances on the thread pool. Built with AVX2
+//   (INSTANCE_CULLER_AVX2 in CMake), the chunks are processed 8 instances at a time
+//
+class TransformStore
+{
+public:
+  void     resize(uint32_t nbInstances);
+  uint32_t size() const { return static_cast<uint32_t>(m_elements[0].size()); }
+
+  void          set(uint32_t instanceId, const nvmath::mat4f& transform);
+  nvmath::mat4f get(uint32_t instanceId) const;
+
+  // Inverses of all the transforms. Without pool, runs on the calling thread.
+  void          computeInverses(ThreadPool* pool, bool useSimd = true);
+  nvmath::mat4f getInverse(uint32_t instanceId) const;
+
+  // Writes the transforms of [first, first + count) as 12 floats, the one of instance `first + i`
+  // at `dst + i * stride`
+  void pack(void*       dst,
+            size_t      stride,
+            uint32_t    first,
+            uint32_t    count,
+            ThreadPool* pool,
+            bool        useSimd = true) const;
+
+  static bool hasSimd();
+
+  // Random transforms: logs instances inverted and packed per millisecond, single thread and SIMD
+  // or not, then SIMD over the thread pool
+  static void benchmark(uint32_t nbInstances, ThreadPool& pool);
+
+private:
+  void invertScalar(size_t begin, size_t end);
+  void invertSimd(size_t begin, size_t end);
+  void packScalar(uint8_t* dst, size_t stride, size_t begin, size_t end) const;
+  void packSimd(uint8_t* dst, size_t stride, size_t begin, size_t end) const;
+
+  std::vector<float> m_elements[12];  // Transforms
+  std::vector<float> m_inverses[12];  // Their inverses, after computeInverses()
+};
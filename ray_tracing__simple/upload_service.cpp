@@ -0,0 +1,377 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+
+#include "nvh/nvprint.hpp"
+#include "nvvk/images_vk.hpp"
+#include "upload_service.h"
+
+void UploadService::setup(const vk::Device& device,
+                          PoolAllocator*    allocator,
+                          uint32_t          graphicsQueueFamily,
+                          vk::Queue         graphicsQueue,
+                          uint32_t          transferQueueFamily,
+                          vk::Queue         transferQueue,
+                          vk::DeviceSize    regionSize,
+                          uint32_t          nbRegions)
+{
+  m_device         = device;
+  m_alloc          = allocator;
+  m_graphicsFamily = graphicsQueueFamily;
+  m_graphicsQueue  = graphicsQueue;
+  // Without a transfer queue, the graphics queue does it all
+  m_transferFamily = transferQueue ? transferQueueFamily : graphicsQueueFamily;
+  m_transferQueue  = transferQueue ? transferQueue : graphicsQueue;
+  m_nbRegions      = nbRegions;
+
+  auto poolFlags = vk::CommandPoolCreateFlagBits::eTransient
+                   | vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+  m_graphicsCmdPool = m_device.createCommandPool({poolFlags, m_graphicsFamily});
+  m_transferCmdPool = m_device.createCommandPool({poolFlags, m_transferFamily});
+
+  vk::SemaphoreTypeCreateInfo timelineInfo(vk::SemaphoreType::eTimeline, 0);
+  vk::SemaphoreCreateInfo     semaphoreInfo;
+  semaphoreInfo.setPNext(&timelineInfo);
+  m_transferTimeline = m_device.createSemaphore(semaphoreInfo);
+  m_graphicsTimeline = m_device.createSemaphore(semaphoreInfo);
+
+  m_ring.init(m_alloc, regionSize, nbRegions);
+
+  LOGI("Uploads: %s queue (family %u)\n", hasTransferQueue() ? "transfer" : "graphics",
+       m_transferFamily);
+}
+
+void UploadService::destroy()
+{
+  waitIdle();
+  while(!m_batches.empty())
+  {
+    retire(m_batches.front());
+    m_batches.pop_front();
+  }
+  m_ring.deinit();
+  m_device.destroy(m_transferTimeline);
+  m_device.destroy(m_graphicsTimeline);
+  m_device.destroy(m_graphicsCmdPool);
+  m_device.destroy(m_transferCmdPool);
+}
+
+//--------------------------------------------------------------------------------------------------
+// The batch being recorded, started when needed: its ring region must no longer be read by
+// the transfer queue
+//
+UploadService::Batch& UploadService::currentBatch()
+{
+  if(m_recording)
+    return m_batches.back();
+
+  uint32_t region = m_nbBatches % m_nbRegions;
+  for(const auto& batch : m_batches)
+  {
+    if(batch.region == region)
+      waitValue(m_transferTimeline, batch.transferValue);
+  }
+  m_ring.beginRegion(region);
+
+  Batch batch;
+  batch.region      = region;
+  batch.transferCmd = m_device.allocateCommandBuffers(
+      {m_transferCmdPool, vk::CommandBufferLevel::ePrimary, 1})[0];
+  batch.transferCmd.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  m_batches.push_back(batch);
+  m_recording = true;
+  m_nbBatches++;
+  return m_batches.back();
+}
+
+//--------------------------------------------------------------------------------------------------
+// Staging space for `size` bytes: in the ring, in a new batch when the region is full, or in a
+// buffer of its own when larger than a region
+//
+void* UploadService::allocateStaging(vk::DeviceSize  size,
+                                     vk::Buffer&     buffer,
+                                     vk::DeviceSize& offset)
+{
+  Batch& batch = currentBatch();
+  if(size > m_ring.getRegionSize())
+  {
+    nvvk::Buffer staging = m_alloc->createBuffer(size, vk::BufferUsageFlagBits::eTransferSrc,
+                                                 vk::MemoryPropertyFlagBits::eHostVisible
+                                                     | vk::MemoryPropertyFlagBits::eHostCoherent);
+    batch.largeStaging.push_back(staging);
+    buffer = staging.buffer;
+    offset = 0;
+    return m_alloc->map(staging);
+  }
+
+  void* ptr = m_ring.allocate(size, offset);
+  if(ptr == nullptr)
+  {
+    flush();
+    currentBatch();
+    ptr = m_ring.allocate(size, offset);
+  }
+  buffer = m_ring.getBuffer();
+  return ptr;
+}
+
+void UploadService::uploadBuffer(const nvvk::Buffer& buffer,
+                                 vk::DeviceSize      offset,
+                                 const void*         data,
+                                 vk::DeviceSize      size)
+{
+  if(size == 0)
+    return;
+  vk::Buffer     src;
+  vk::DeviceSize srcOffset;
+  memcpy(allocateStaging(size, src, srcOffset), data, size);
+
+  Batch& batch = currentBatch();
+  batch.transferCmd.copyBuffer(src, buffer.buffer, {vk::BufferCopy(srcOffset, offset, size)});
+  // Concurrent buffers of the allocator need no ownership transfer
+  if(needsOwnershipTransfer() && !m_alloc->sharesBuffers())
+  {
+    batch.bufferOwnership.emplace_back(vk::AccessFlags(), vk::AccessFlags(), m_transferFamily,
+                                       m_graphicsFamily, buffer.buffer, offset, size);
+  }
+  m_uploadedBytes += size;
+}
+
+void UploadService::uploadImage(const nvvk::Image&         image,
+                                const vk::ImageCreateInfo& info,
+                                const void*                data,
+                                vk::DeviceSize             size,
+                                vk::ImageLayout            layout)
+{
+  vk::Buffer     src;
+  vk::DeviceSize srcOffset;
+  memcpy(allocateStaging(size, src, srcOffset), data, size);
+
+  Batch&                    batch = currentBatch();
+  vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, info.mipLevels, 0,
+                                  info.arrayLayers);
+  vk::ImageMemoryBarrier    barrier;
+  barrier.setImage(image.image);
+  barrier.setSubresourceRange(range);
+  barrier.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+  barrier.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED);
+  barrier.setOldLayout(vk::ImageLayout::eUndefined);
+  barrier.setNewLayout(vk::ImageLayout::eTransferDstOptimal);
+  barrier.setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+  batch.transferCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                    vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, {barrier});
+
+  vk::BufferImageCopy region;
+  region.setBufferOffset(srcOffset);
+  region.setImageSubresource({vk::ImageAspectFlagBits::eColor, 0, 0, info.arrayLayers});
+  region.setImageExtent(info.extent);
+  batch.transferCmd.copyBufferToImage(src, image.image, vk::ImageLayout::eTransferDstOptimal,
+                                      {region});
+
+  // Final layout: on the transfer queue, or with the ownership transfer
+  barrier.setOldLayout(vk::ImageLayout::eTransferDstOptimal);
+  barrier.setNewLayout(layout);
+  if(needsOwnershipTransfer())
+  {
+    barrier.setSrcQueueFamilyIndex(m_transferFamily);
+    barrier.setDstQueueFamilyIndex(m_graphicsFamily);
+    barrier.setDstAccessMask({});
+    batch.imageOwnership.push_back(barrier);
+  }
+  else
+  {
+    barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    barrier.setDstAccessMask({});
+    batch.transferCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                      vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {},
+                                      {barrier});
+  }
+
+  if(info.mipLevels > 1)
+  {
+    assert(layout == vk::ImageLayout::eShaderReadOnlyOptimal);
+    batch.mips.push_back({image.image, info.format, {info.extent.width, info.extent.height},
+                          info.mipLevels, layout});
+  }
+  m_uploadedBytes += size;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Release the resources of the batch and submit it on the transfer queue
+//
+uint64_t UploadService::flush()
+{
+  if(!m_recording)
+    return m_lastTicket;
+  Batch& batch = m_batches.back();
+  m_recording  = false;
+
+  if(!batch.bufferOwnership.empty() || !batch.imageOwnership.empty())
+  {
+    for(auto& barrier : batch.bufferOwnership)
+      barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    for(auto& barrier : batch.imageOwnership)
+      barrier.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    batch.transferCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                      vk::PipelineStageFlagBits::eBottomOfPipe, {}, {},
+                                      batch.bufferOwnership, batch.imageOwnership);
+  }
+  batch.transferCmd.end();
+
+  batch.transferValue = ++m_lastTransferValue;
+  batch.graphicsValue = ++m_lastTicket;
+
+  vk::TimelineSemaphoreSubmitInfo timelineInfo;
+  timelineInfo.setSignalSemaphoreValueCount(1);
+  timelineInfo.setPSignalSemaphoreValues(&batch.transferValue);
+  vk::SubmitInfo submitInfo;
+  submitInfo.setPNext(&timelineInfo);
+  submitInfo.setCommandBufferCount(1);
+  submitInfo.setPCommandBuffers(&batch.transferCmd);
+  submitInfo.setSignalSemaphoreCount(1);
+  submitInfo.setPSignalSemaphores(&m_transferTimeline);
+  m_transferQueue.submit({submitInfo}, {});
+
+  update();
+  return batch.graphicsValue;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Graphics side of a batch: acquire the resources, generate the mip levels
+// - Submitted in the order of the batches, the tickets increase on the graphics timeline
+//
+void UploadService::submitGraphics(Batch& batch)
+{
+  batch.graphicsCmd = m_device.allocateCommandBuffers(
+      {m_graphicsCmdPool, vk::CommandBufferLevel::ePrimary, 1})[0];
+  batch.graphicsCmd.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+  if(!batch.bufferOwnership.empty() || !batch.imageOwnership.empty())
+  {
+    auto dstAccess = vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite;
+    for(auto& barrier : batch.bufferOwnership)
+      barrier.setSrcAccessMask({}).setDstAccessMask(dstAccess);
+    for(auto& barrier : batch.imageOwnership)
+      barrier.setSrcAccessMask({}).setDstAccessMask(dstAccess);
+    batch.graphicsCmd.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe,
+                                      vk::PipelineStageFlagBits::eAllCommands, {}, {},
+                                      batch.bufferOwnership, batch.imageOwnership);
+  }
+  for(const auto& mip : batch.mips)
+    nvvk::cmdGenerateMipmaps(batch.graphicsCmd, mip.image, mip.format, mip.extent, mip.mipLevels);
+  batch.graphicsCmd.end();
+
+  vk::PipelineStageFlags          waitStage = vk::PipelineStageFlagBits::eAllCommands;
+  vk::TimelineSemaphoreSubmitInfo timelineInfo;
+  timelineInfo.setWaitSemaphoreValueCount(1);
+  timelineInfo.setPWaitSemaphoreValues(&batch.transferValue);
+  timelineInfo.setSignalSemaphoreValueCount(1);
+  timelineInfo.setPSignalSemaphoreValues(&batch.graphicsValue);
+  vk::SubmitInfo submitInfo;
+  submitInfo.setPNext(&timelineInfo);
+  submitInfo.setWaitSemaphoreCount(1);
+  submitInfo.setPWaitSemaphores(&m_transferTimeline);
+  submitInfo.setPWaitDstStageMask(&waitStage);
+  submitInfo.setCommandBufferCount(1);
+  submitInfo.setPCommandBuffers(&batch.graphicsCmd);
+  submitInfo.setSignalSemaphoreCount(1);
+  submitInfo.setPSignalSemaphores(&m_graphicsTimeline);
+  m_graphicsQueue.submit({submitInfo}, {});
+  batch.graphicsSubmitted = true;
+}
+
+void UploadService::retire(Batch& batch)
+{
+  if(batch.transferCmd)
+    m_device.freeCommandBuffers(m_transferCmdPool, batch.transferCmd);
+  if(batch.graphicsCmd)
+    m_device.freeCommandBuffers(m_graphicsCmdPool, batch.graphicsCmd);
+  for(auto& staging : batch.largeStaging)
+    m_alloc->destroy(staging);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Called once per frame
+// - The graphics side of a batch is only submitted once its transfer completed: the frames
+//   submitted after it on the graphics queue never wait for the transfer queue
+//
+void UploadService::update()
+{
+  uint64_t transferCounter = m_device.getSemaphoreCounterValue(m_transferTimeline);
+  for(auto& batch : m_batches)
+  {
+    if(batch.transferValue == 0)  // Recording
+      break;
+    if(batch.graphicsSubmitted)
+      continue;
+    if(hasTransferQueue() && transferCounter < batch.transferValue)
+      break;  // Neither are the next ones
+    submitGraphics(batch);
+  }
+
+  uint64_t graphicsCounter = m_device.getSemaphoreCounterValue(m_graphicsTimeline);
+  while(!m_batches.empty() && m_batches.front().graphicsSubmitted
+        && graphicsCounter >= m_batches.front().graphicsValue)
+  {
+    retire(m_batches.front());
+    m_batches.pop_front();
+  }
+}
+
+bool UploadService::isComplete(uint64_t ticket) const
+{
+  return m_device.getSemaphoreCounterValue(m_graphicsTimeline) >= ticket;
+}
+
+void UploadService::waitValue(vk::Semaphore timeline, uint64_t value) const
+{
+  vk::SemaphoreWaitInfo waitInfo({}, 1, &timeline, &value);
+  vk::Result            result = m_device.waitSemaphores(waitInfo, UINT64_MAX);
+  assert(result == vk::Result::eSuccess);
+}
+
+void UploadService::wait(uint64_t ticket)
+{
+  // The graphics side of the batches up to the ticket may not be submitted yet
+  for(auto& batch : m_batches)
+  {
+    if(batch.transferValue == 0 || batch.graphicsValue > ticket)
+      break;
+    if(!batch.graphicsSubmitted)
+    {
+      waitValue(m_transferTimeline, batch.transferValue);
+      submitGraphics(batch);
+    }
+  }
+  waitValue(m_graphicsTimeline, ticket);
+  update();
+}
+
+void UploadService::waitIdle()
+{
+  wait(flush());
+}
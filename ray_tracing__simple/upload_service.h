@@ -0,0 +1,159 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <deque>
+#include <vulkan/vulkan.hpp>
+
+#include "pool_allocator.h"
+#include "staging_ring.h"
+
+//--------------------------------------------------------------------------------------------------
+// Uploads buffers and images through a transfer queue, off the graphics queue
+// - Data is copied in a staging ring right away; the copies are recorded in a batch that
+//   flush() submits on the transfer queue. Data larger than a ring region gets its own staging.
+// - With a transfer queue of another family, the resources are released by the transfer queue
+//   and acquired by the graphics queue: the queue-family ownership transfer of exclusive
+//   resources. Mip levels are generated on the graphics side, transfer queues cannot blit.
+//   Buffers of an allocator sharing them between the queue families skip the transfer.
+// - One timeline semaphore per queue orders it all: the transfer submission of a batch signals
+//   the transfer timeline, the graphics submission acquiring it waits on that value and signals
+//   the graphics timeline. The graphics value is the ticket of the batch: a ticket completes once
+//   the resources are acquired and the mip levels generated.
+// - update() submits the graphics side of batches whose transfer completed, so that frames
+//   submitted meanwhile never wait for an upload. wait() blocks until a ticket completed.
+//
+// All calls are made from the thread submitting to the graphics queue.
+//
+class UploadService
+{
+public:
+  void setup(const vk::Device& device,
+             PoolAllocator*    allocator,
+             uint32_t          graphicsQueueFamily,
+             vk::Queue         graphicsQueue,
+             uint32_t          transferQueueFamily,
+             vk::Queue         transferQueue,
+             vk::DeviceSize    regionSize = 32ull << 20,
+             uint32_t          nbRegions  = 3);
+  void destroy();
+
+  // Record uploads in the current batch: the destination content is undefined until the
+  // ticket of the batch completed
+  void uploadBuffer(const nvvk::Buffer& buffer,
+                    vk::DeviceSize      offset,
+                    const void*         data,
+                    vk::DeviceSize      size);
+  // First mip level from `data`, the others generated; all levels end up in `layout`
+  void uploadImage(const nvvk::Image&         image,
+                   const vk::ImageCreateInfo& info,
+                   const void*                data,
+                   vk::DeviceSize             size,
+                   vk::ImageLayout            layout = vk::ImageLayout::eShaderReadOnlyOptimal);
+
+  // Device-local resources created with their content
+  template <typename T>
+  nvvk::Buffer createBuffer(const std::vector<T>& data, vk::BufferUsageFlags usage)
+  {
+    vk::DeviceSize size = sizeof(T) * data.size();
+    nvvk::Buffer   buffer =
+        m_alloc->createBuffer(size, usage | vk::BufferUsageFlagBits::eTransferDst);
+    uploadBuffer(buffer, 0, data.data(), size);
+    return buffer;
+  }
+  nvvk::Image createImage(const vk::ImageCreateInfo& info, const void* data, vk::DeviceSize size)
+  {
+    vk::ImageCreateInfo createInfo = info;
+    createInfo.usage |= vk::ImageUsageFlagBits::eTransferDst;
+    nvvk::Image image = m_alloc->createImage(createInfo);
+    uploadImage(image, createInfo, data, size);
+    return image;
+  }
+
+  // Submit the current batch on the transfer queue, returns its ticket
+  uint64_t flush();
+  // Submit the graphics side of the batches done on the transfer queue, retire completed ones
+  void update();
+  bool isComplete(uint64_t ticket) const;
+  void wait(uint64_t ticket);
+  void waitIdle();
+
+  bool           hasTransferQueue() const { return m_transferQueue != m_graphicsQueue; }
+  // Timeline of the tickets
+  vk::Semaphore  getSemaphore() const { return m_graphicsTimeline; }
+  vk::DeviceSize getUploadedBytes() const { return m_uploadedBytes; }
+
+private:
+  struct MipGeneration
+  {
+    vk::Image       image;
+    vk::Format      format;
+    vk::Extent2D    extent;
+    uint32_t        mipLevels;
+    vk::ImageLayout layout;
+  };
+
+  struct Batch
+  {
+    vk::CommandBuffer                    transferCmd;
+    vk::CommandBuffer                    graphicsCmd;
+    uint32_t                             region{0};
+    uint64_t                             transferValue{0};  // On the transfer timeline
+    uint64_t                             graphicsValue{0};  // Ticket, on the graphics timeline
+    bool                                 graphicsSubmitted{false};
+    std::vector<vk::BufferMemoryBarrier> bufferOwnership;  // Released, then acquired
+    std::vector<vk::ImageMemoryBarrier>  imageOwnership;
+    std::vector<MipGeneration>           mips;
+    std::vector<nvvk::Buffer>            largeStaging;  // Data larger than a ring region
+  };
+
+  Batch& currentBatch();
+  void*  allocateStaging(vk::DeviceSize size, vk::Buffer& buffer, vk::DeviceSize& offset);
+  void   submitGraphics(Batch& batch);
+  void   retire(Batch& batch);
+  void   waitValue(vk::Semaphore timeline, uint64_t value) const;
+  bool   needsOwnershipTransfer() const { return m_transferFamily != m_graphicsFamily; }
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  uint32_t        m_graphicsFamily{0};
+  uint32_t        m_transferFamily{0};
+  vk::Queue       m_graphicsQueue;
+  vk::Queue       m_transferQueue;
+  vk::CommandPool m_graphicsCmdPool;
+  vk::CommandPool m_transferCmdPool;
+  vk::Semaphore   m_transferTimeline;
+  vk::Semaphore   m_graphicsTimeline;
+  uint64_t        m_lastTransferValue{0};
+  uint64_t        m_lastTicket{0};
+
+  StagingRing       m_ring;
+  uint32_t          m_nbRegions{0};
+  uint32_t          m_nbBatches{0};  // Batches started, picks the ring region
+  std::deque<Batch> m_batches;       // In flight, oldest first; the last one may be recording
+  bool              m_recording{false};
+  vk::DeviceSize    m_uploadedBytes{0};
+};
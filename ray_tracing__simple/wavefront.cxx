@@ -0,0 +1,75 @@
+#include "shader_common.hxx"
+
+// Binning of the shadow rays of the wavefront mode, between the two ray
+// tracing passes of raytrace.cxx. Same buffers as its bindings 4 to 7, the
+// host reference is in wavefront_math.cpp.
+[[using spirv: buffer, binding(0)]]
+uint shadowKeys[];   // Per pixel, WF_NO_KEY without shadow ray.
+
+[[using spirv: buffer, binding(1)]]
+uint shadowBins[];   // Rays per bin, then the first ray of each bin.
+
+[[using spirv: buffer, binding(2)]]
+uint shadowRays[];   // Pixels, by bin.
+
+[[using spirv: buffer, binding(3)]]
+uint shadowCount[];
+
+[[spirv::shared]]
+uint scanSums[WF_SCAN_SIZE];
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Exclusive prefix sum of the counts of the bins, in a single workgroup: each
+// thread sums a run of bins, the sums of the runs are scanned in shared
+// memory.
+[[using spirv: comp, local_size(WF_SCAN_SIZE)]]
+void scan_shader() {
+  constexpr uint kBinsPerThread = WF_NB_BINS / WF_SCAN_SIZE;
+  uint id    = glcomp_LocalInvocationID.x;
+  uint first = id * kBinsPerThread;
+
+  uint sum = 0;
+  for(uint i = 0; i < kBinsPerThread; ++i)
+    sum += shadowBins[first + i];
+  scanSums[id] = sum;
+  barrier();
+
+  for(uint step = 1; step < WF_SCAN_SIZE; step *= 2) {
+    uint value = id >= step ? scanSums[id - step] : 0;
+    barrier();
+    scanSums[id] += value;
+    barrier();
+  }
+
+  uint offset = scanSums[id] - sum;
+  for(uint i = 0; i < kBinsPerThread; ++i) {
+    uint count = shadowBins[first + i];
+    shadowBins[first + i] = offset;
+    offset += count;
+  }
+  if(id == WF_SCAN_SIZE - 1)
+    shadowCount[0] = offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Each shadow ray takes the next slot of its bin. The order within a bin is
+// the order of the atomics.
+[[using spirv: comp, local_size(64)]]
+void scatter_shader() {
+  uint pixel = glcomp_GlobalInvocationID.x;
+  if(pixel >= shader_push<uint>)
+    return;
+
+  uint key = shadowKeys[pixel];
+  if(key != WF_NO_KEY)
+    shadowRays[atomicAdd(shadowBins[key], 1)] = pixel;
+}
+
+wavefront_shaders_t wavefront_shaders {
+  __spirv_data,
+  __spirv_size,
+  @spirv(scan_shader),
+  @spirv(scatter_shader)
+};
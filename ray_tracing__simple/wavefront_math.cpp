@@ -0,0 +1,198 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <random>
+
+#include "nvh/nvprint.hpp"
+#include "wavefront_math.h"
+
+ShadowBinGrid ShadowBinGrid::centered(const nvmath::vec3f& center, float extent)
+{
+  ShadowBinGrid grid;
+  grid.origin = center - nvmath::vec3f(0.5f * extent);
+  grid.scale  = float(1 << WF_GRID_BITS) / std::max(extent, 1e-6f);
+  return grid;
+}
+
+// Bit b of x, y and z goes to bit 3b, 3b + 1 and 3b + 2
+uint32_t mortonCode3(uint32_t x, uint32_t y, uint32_t z)
+{
+  uint32_t code = 0;
+  for(uint32_t b = 0; b < WF_GRID_BITS; b++)
+  {
+    code |= ((x >> b) & 1) << (3 * b);
+    code |= ((y >> b) & 1) << (3 * b + 1);
+    code |= ((z >> b) & 1) << (3 * b + 2);
+  }
+  return code;
+}
+
+uint32_t shadowRayKey(const ShadowBinGrid& grid, const ShadowRay& ray)
+{
+  uint32_t octant = (ray.direction.x < 0.f ? 1 : 0) | (ray.direction.y < 0.f ? 2 : 0)
+                    | (ray.direction.z < 0.f ? 4 : 0);
+  float         last = float((1 << WF_GRID_BITS) - 1);
+  nvmath::vec3f cell = (ray.origin - grid.origin) * grid.scale;
+  uint32_t      x    = static_cast<uint32_t>(std::min(std::max(cell.x, 0.f), last));
+  uint32_t      y    = static_cast<uint32_t>(std::min(std::max(cell.y, 0.f), last));
+  uint32_t      z    = static_cast<uint32_t>(std::min(std::max(cell.z, 0.f), last));
+  return (octant << (3 * WF_GRID_BITS)) | mortonCode3(x, y, z);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Counting sort: rays per bin, exclusive prefix sum, then each ray takes the next slot of its bin.
+// The GPU does the same with an atomic per ray, which does not keep the order within a bin.
+//
+void binShadowRays(const std::vector<uint32_t>& keys, std::vector<uint32_t>& order)
+{
+  std::vector<uint32_t> bins(WF_NB_BINS, 0);
+  for(uint32_t key : keys)
+  {
+    if(key != WF_NO_KEY)
+      bins[key]++;
+  }
+  uint32_t offset = 0;
+  for(uint32_t& bin : bins)
+  {
+    uint32_t count = bin;
+    bin            = offset;
+    offset += count;
+  }
+  order.resize(offset);
+  for(uint32_t i = 0; i < static_cast<uint32_t>(keys.size()); i++)
+  {
+    if(keys[i] != WF_NO_KEY)
+      order[bins[keys[i]]++] = i;
+  }
+}
+
+RayCoherence measureCoherence(const std::vector<ShadowRay>& rays,
+                              const std::vector<uint32_t>&  keys,
+                              const std::vector<uint32_t>&  order,
+                              uint32_t                      groupSize)
+{
+  RayCoherence          coherence;
+  uint32_t              nbGroups = 0;
+  std::vector<uint32_t> groupKeys;
+  for(size_t first = 0; first < order.size(); first += groupSize)
+  {
+    size_t last = std::min(first + groupSize, order.size());
+    groupKeys.clear();
+    nvmath::vec3f bboxMin(FLT_MAX), bboxMax(-FLT_MAX), direction(0.f);
+    for(size_t i = first; i < last; i++)
+    {
+      const ShadowRay& ray = rays[order[i]];
+      groupKeys.push_back(keys[order[i]]);
+      bboxMin = nvmath::vec3f(std::min(bboxMin.x, ray.origin.x), std::min(bboxMin.y, ray.origin.y),
+                              std::min(bboxMin.z, ray.origin.z));
+      bboxMax = nvmath::vec3f(std::max(bboxMax.x, ray.origin.x), std::max(bboxMax.y, ray.origin.y),
+                              std::max(bboxMax.z, ray.origin.z));
+      direction += ray.direction;
+    }
+    std::sort(groupKeys.begin(), groupKeys.end());
+    coherence.binsPerGroup +=
+        float(std::unique(groupKeys.begin(), groupKeys.end()) - groupKeys.begin());
+    coherence.originSpread += nvmath::length(bboxMax - bboxMin);
+    coherence.directionSpread += 1.f - nvmath::length(direction) / float(last - first);
+    nbGroups++;
+  }
+  if(nbGroups > 0)
+  {
+    coherence.binsPerGroup /= nbGroups;
+    coherence.originSpread /= nbGroups;
+    coherence.directionSpread /= nbGroups;
+  }
+  return coherence;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Two sets of rays toward a point light, in launch order: the hits of camera rays on a ground
+// with objects, neighbors in the image being neighbors in the scene, and the hits of reflected
+// rays, scattered over the scene whatever their pixel
+//
+void benchmarkShadowBinning(uint32_t nbRays)
+{
+  std::mt19937                          gen(42);
+  std::uniform_real_distribution<float> dis(0.f, 1.f);
+  nvmath::vec3f                         light(10.f, 15.f, 8.f);
+  ShadowBinGrid grid   = ShadowBinGrid::centered(nvmath::vec3f(0.f, 0.f, 0.f), 48.f);
+  uint32_t      width  = 1024;
+  uint32_t      height = std::max(nbRays / width, 1u);
+
+  auto run = [&](const char* name, bool scattered) {
+    std::vector<ShadowRay> rays(width * height);
+    for(uint32_t y = 0; y < height; y++)
+    {
+      for(uint32_t x = 0; x < width; x++)
+      {
+        // Objects cover 30% of the ground, up to 2 units high
+        float      u   = dis(gen);
+        float      v   = dis(gen);
+        float      w   = dis(gen);
+        ShadowRay& ray = rays[y * width + x];
+        if(scattered)
+          ray.origin = nvmath::vec3f(-20.f + 40.f * u, 5.f * v, -20.f + 40.f * w);
+        else
+          ray.origin = nvmath::vec3f(-20.f + 40.f * x / width, u < 0.3f ? 2.f * v : 0.f,
+                                     -20.f + 40.f * y / height);
+        ray.direction = nvmath::normalize(light - ray.origin);
+      }
+    }
+
+    std::vector<uint32_t> keys(rays.size());
+    std::vector<uint32_t> order;
+    double                bestMs = 1e30;
+    for(int iteration = 0; iteration < 10; iteration++)
+    {
+      auto startTime = std::chrono::high_resolution_clock::now();
+      for(size_t i = 0; i < rays.size(); i++)
+        keys[i] = shadowRayKey(grid, rays[i]);
+      binShadowRays(keys, order);
+      auto endTime = std::chrono::high_resolution_clock::now();
+      bestMs =
+          std::min(bestMs, std::chrono::duration<double, std::milli>(endTime - startTime).count());
+    }
+
+    std::vector<uint32_t> launchOrder(rays.size());
+    for(uint32_t i = 0; i < static_cast<uint32_t>(rays.size()); i++)
+      launchOrder[i] = i;
+    RayCoherence before = measureCoherence(rays, keys, launchOrder);
+    RayCoherence after  = measureCoherence(rays, keys, order);
+    LOGI("%s: binned in %.2f ms (%.0f M rays/s)\n", name, bestMs, rays.size() / (bestMs * 1e3));
+    LOGI("  launch order: %5.2f bins, origins over %6.2f, direction spread %.4f per 32 rays\n",
+         before.binsPerGroup, before.originSpread, before.directionSpread);
+    LOGI("  binned:       %5.2f bins, origins over %6.2f, direction spread %.4f per 32 rays\n",
+         after.binsPerGroup, after.originSpread, after.directionSpread);
+  };
+
+  LOGI("Binning %u shadow rays in %u bins\n", width * height, WF_NB_BINS);
+  run("Camera hits", false);
+  run("Reflection hits", true);
+}
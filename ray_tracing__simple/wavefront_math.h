@@ -0,0 +1,84 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nvmath/nvmath.h"
+
+#include "shaders.hxx"
+
+//--------------------------------------------------------------------------------------------------
+// Binning of the shadow rays of the wavefront mode
+// - Host reference of rgen_primary_shader (raytrace.cxx) and of wavefront.cxx: the same keys and
+//   the same counting sort, so the binning can be checked and measured without Vulkan
+// - The key of a ray is the octant of its direction, then the Morton code of the cell of its
+//   origin in a grid of 2^WF_GRID_BITS cells per axis. Rays of a bin leave close points in
+//   similar directions and traverse the same nodes of the BVH.
+// - Origins outside of the grid go to its border cells: still binned, only less finely
+//
+
+struct ShadowRay
+{
+  nvmath::vec3f origin;
+  nvmath::vec3f direction;
+};
+
+// Cell (i, j, k) covers origin + [i, i + 1) / scale on x, and so on
+struct ShadowBinGrid
+{
+  nvmath::vec3f origin{0.f, 0.f, 0.f};
+  float         scale{1.f};  // Cells per unit
+
+  // Cube of `extent` units around `center`, e.g. the camera
+  static ShadowBinGrid centered(const nvmath::vec3f& center, float extent);
+};
+
+// Coherence of rays traced in a given order, by groups of consecutive rays as a GPU traces them
+struct RayCoherence
+{
+  float binsPerGroup{0.f};     // Distinct keys per group
+  float originSpread{0.f};     // Mean diagonal of the bounds of the origins of a group
+  float directionSpread{0.f};  // Mean of 1 - |average direction| of a group, 0 when parallel
+};
+
+uint32_t mortonCode3(uint32_t x, uint32_t y, uint32_t z);
+uint32_t shadowRayKey(const ShadowBinGrid& grid, const ShadowRay& ray);
+
+// Indices of the rays sorted by key, in the order of the rays within a bin. Keys WF_NO_KEY are
+// left out.
+void binShadowRays(const std::vector<uint32_t>& keys, std::vector<uint32_t>& order);
+
+RayCoherence measureCoherence(const std::vector<ShadowRay>& rays,
+                              const std::vector<uint32_t>&  keys,
+                              const std::vector<uint32_t>&  order,
+                              uint32_t                      groupSize = 32);
+
+// Logs the speed of the binning of nbRays synthetic shadow rays and the coherence of their
+// order before and after it
+void benchmarkShadowBinning(uint32_t nbRays);
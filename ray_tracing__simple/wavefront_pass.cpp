@@ -0,0 +1,208 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "nvmath/nvmath.h"
+#include "nvvk/shaders_vk.hpp"
+#include "shaders.hxx"
+#include "wavefront_pass.h"
+
+void WavefrontPass::setup(const vk::Device& device, PoolAllocator* allocator, uint32_t nbFrames)
+{
+  using vkBU = vk::BufferUsageFlagBits;
+  using vkMP = vk::MemoryPropertyFlagBits;
+
+  m_device   = device;
+  m_alloc    = allocator;
+  m_nbFrames = nbFrames;
+  m_debug.setup(device);
+
+  m_bins     = m_alloc->createBuffer(WF_NB_BINS * sizeof(uint32_t),
+                                     vkBU::eStorageBuffer | vkBU::eTransferDst);
+  m_count    = m_alloc->createBuffer(sizeof(uint32_t), vkBU::eStorageBuffer | vkBU::eTransferSrc);
+  m_readback = m_alloc->createBuffer(m_nbFrames * sizeof(uint32_t), vkBU::eTransferDst,
+                                     vkMP::eHostVisible | vkMP::eHostCoherent);
+  m_readbackMapped = reinterpret_cast<uint32_t*>(m_alloc->map(m_readback));
+  memset(m_readbackMapped, 0, m_nbFrames * sizeof(uint32_t));
+  m_debug.setObjectName(m_bins.buffer, "shadowBins");
+  m_debug.setObjectName(m_count.buffer, "shadowCount");
+
+  using vkDS = vk::DescriptorSetLayoutBinding;
+  using vkDT = vk::DescriptorType;
+  using vkSS = vk::ShaderStageFlagBits;
+  m_descSetLayoutBind.addBinding(vkDS(0, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Keys
+  m_descSetLayoutBind.addBinding(vkDS(1, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Bins
+  m_descSetLayoutBind.addBinding(vkDS(2, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Rays
+  m_descSetLayoutBind.addBinding(vkDS(3, vkDT::eStorageBuffer, 1, vkSS::eCompute));  // Count
+  m_descSetLayout = m_descSetLayoutBind.createLayout(m_device);
+  m_descPool      = m_descSetLayoutBind.createPool(m_device, 1);
+  m_descSet       = nvvk::allocateDescriptorSet(m_device, m_descPool, m_descSetLayout);
+
+  createPipelines();
+}
+
+void WavefrontPass::createPipelines()
+{
+  // Number of pixels, for the scatter
+  vk::PushConstantRange pushConstant{vk::ShaderStageFlagBits::eCompute, 0, sizeof(uint32_t)};
+
+  vk::PipelineLayoutCreateInfo layoutInfo;
+  layoutInfo.setSetLayoutCount(1);
+  layoutInfo.setPSetLayouts(&m_descSetLayout);
+  layoutInfo.setPushConstantRangeCount(1);
+  layoutInfo.setPPushConstantRanges(&pushConstant);
+  m_pipelineLayout = m_device.createPipelineLayout(layoutInfo);
+
+  vk::ShaderModule wavefrontSM = nvvk::createShaderModule(
+      m_device, (const uint32_t*)wavefront_shaders.module_data, wavefront_shaders.module_size);
+
+  vk::ComputePipelineCreateInfo pipelineInfo;
+  pipelineInfo.setLayout(m_pipelineLayout);
+  pipelineInfo.setStage(
+      {{}, vk::ShaderStageFlagBits::eCompute, wavefrontSM, wavefront_shaders.scan});
+  if(m_device.createComputePipelines({}, 1, &pipelineInfo, nullptr, &m_scanPipeline)
+     != vk::Result::eSuccess)
+    throw std::runtime_error("Failed to create the shadow bin scan pipeline");
+  pipelineInfo.setStage(
+      {{}, vk::ShaderStageFlagBits::eCompute, wavefrontSM, wavefront_shaders.scatter});
+  if(m_device.createComputePipelines({}, 1, &pipelineInfo, nullptr, &m_scatterPipeline)
+     != vk::Result::eSuccess)
+    throw std::runtime_error("Failed to create the shadow ray scatter pipeline");
+  m_debug.setObjectName(m_scanPipeline, "ShadowBinScan");
+  m_debug.setObjectName(m_scatterPipeline, "ShadowRayScatter");
+
+  m_device.destroy(wavefrontSM);
+}
+
+void WavefrontPass::destroy()
+{
+  m_alloc->unmap(m_readback);
+  m_alloc->destroy(m_hits);
+  m_alloc->destroy(m_keys);
+  m_alloc->destroy(m_bins);
+  m_alloc->destroy(m_rays);
+  m_alloc->destroy(m_count);
+  m_alloc->destroy(m_readback);
+  m_device.destroy(m_scanPipeline);
+  m_device.destroy(m_scatterPipeline);
+  m_device.destroy(m_pipelineLayout);
+  m_device.destroy(m_descPool);
+  m_device.destroy(m_descSetLayout);
+}
+
+//--------------------------------------------------------------------------------------------------
+// New output image, after a resize: no frame in flight may use the previous buffers
+//
+void WavefrontPass::setSize(const vk::Extent2D& size)
+{
+  m_nbPixels = size.width * size.height;
+  m_alloc->destroy(m_hits);
+  m_alloc->destroy(m_keys);
+  m_alloc->destroy(m_rays);
+  m_hits = m_alloc->createBuffer(m_nbPixels * 3 * sizeof(nvmath::vec4f),
+                                 vk::BufferUsageFlagBits::eStorageBuffer);
+  m_keys = m_alloc->createBuffer(m_nbPixels * sizeof(uint32_t),
+                                 vk::BufferUsageFlagBits::eStorageBuffer);
+  m_rays = m_alloc->createBuffer(m_nbPixels * sizeof(uint32_t),
+                                 vk::BufferUsageFlagBits::eStorageBuffer);
+  m_debug.setObjectName(m_hits.buffer, "wavefrontHits");
+  m_debug.setObjectName(m_keys.buffer, "shadowKeys");
+  m_debug.setObjectName(m_rays.buffer, "shadowRays");
+  updateDescriptors();
+}
+
+void WavefrontPass::updateDescriptors()
+{
+  vk::DescriptorBufferInfo keys{m_keys.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo bins{m_bins.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo rays{m_rays.buffer, 0, VK_WHOLE_SIZE};
+  vk::DescriptorBufferInfo count{m_count.buffer, 0, VK_WHOLE_SIZE};
+
+  std::vector<vk::WriteDescriptorSet> writes;
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 0, &keys));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 1, &bins));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 2, &rays));
+  writes.emplace_back(m_descSetLayoutBind.makeWrite(m_descSet, 3, &count));
+  m_device.updateDescriptorSets(static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Before the camera rays. The read back count of the frame is free: prepareFrame() waited for
+// the previous use of its command buffer.
+//
+void WavefrontPass::cmdClear(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex)
+{
+  using vkPS = vk::PipelineStageFlagBits;
+  using vkAF = vk::AccessFlagBits;
+
+  m_nbShadowRays = m_readbackMapped[frameIndex];
+
+  // Previous frames counted and read the bins
+  vk::MemoryBarrier beforeBarrier{vkAF::eShaderRead | vkAF::eShaderWrite, vkAF::eTransferWrite};
+  cmdBuf.pipelineBarrier(vkPS::eRayTracingShaderKHR | vkPS::eComputeShader, vkPS::eTransfer, {},
+                         {beforeBarrier}, {}, {});
+  cmdBuf.fillBuffer(m_bins.buffer, 0, VK_WHOLE_SIZE, 0);
+  vk::MemoryBarrier clearBarrier{vkAF::eTransferWrite, vkAF::eShaderRead | vkAF::eShaderWrite};
+  cmdBuf.pipelineBarrier(vkPS::eTransfer, vkPS::eRayTracingShaderKHR, {}, {clearBarrier}, {}, {});
+}
+
+//--------------------------------------------------------------------------------------------------
+// Between the camera and the shadow rays
+//
+void WavefrontPass::cmdBin(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex)
+{
+  using vkPS = vk::PipelineStageFlagBits;
+  using vkAF = vk::AccessFlagBits;
+
+  // Keys and counts for the binning, hits for the shadow rays
+  vk::MemoryBarrier hitBarrier{vkAF::eShaderWrite, vkAF::eShaderRead | vkAF::eShaderWrite};
+  cmdBuf.pipelineBarrier(vkPS::eRayTracingShaderKHR,
+                         vkPS::eComputeShader | vkPS::eRayTracingShaderKHR, {}, {hitBarrier}, {},
+                         {});
+
+  cmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eCompute, m_pipelineLayout, 0, {m_descSet}, {});
+  cmdBuf.bindPipeline(vk::PipelineBindPoint::eCompute, m_scanPipeline);
+  cmdBuf.dispatch(1, 1, 1);
+  vk::MemoryBarrier scanBarrier{vkAF::eShaderWrite, vkAF::eShaderRead | vkAF::eShaderWrite};
+  cmdBuf.pipelineBarrier(vkPS::eComputeShader, vkPS::eComputeShader, {}, {scanBarrier}, {}, {});
+
+  cmdBuf.bindPipeline(vk::PipelineBindPoint::eCompute, m_scatterPipeline);
+  cmdBuf.pushConstants<uint32_t>(m_pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0,
+                                 m_nbPixels);
+  cmdBuf.dispatch((m_nbPixels + 63) / 64, 1, 1);
+
+  // Sorted rays and their count are read by the shadow rays, the count is also read back
+  vk::MemoryBarrier afterBarrier{vkAF::eShaderWrite, vkAF::eShaderRead | vkAF::eTransferRead};
+  cmdBuf.pipelineBarrier(vkPS::eComputeShader, vkPS::eRayTracingShaderKHR | vkPS::eTransfer, {},
+                         {afterBarrier}, {}, {});
+  cmdBuf.copyBuffer(m_count.buffer, m_readback.buffer,
+                    {vk::BufferCopy(0, frameIndex * sizeof(uint32_t), sizeof(uint32_t))});
+  vk::MemoryBarrier readbackBarrier{vkAF::eTransferWrite, vkAF::eHostRead};
+  cmdBuf.pipelineBarrier(vkPS::eTransfer, vkPS::eHost, {}, {readbackBarrier}, {}, {});
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2014-2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#pragma once
+#include <vulkan/vulkan.hpp>
+
+#include "nvvk/debug_util_vk.hpp"
+#include "nvvk/descriptorsets_vk.hpp"
+
+#include "pool_allocator.h"
+
+//--------------------------------------------------------------------------------------------------
+// Buffers and compute passes of the wavefront mode of the ray tracer, see raytrace.cxx and
+// wavefront.cxx. A frame is:
+// - cmdClear(): the ray counts of the bins are reset
+// - rgen_primary_shader traces the camera rays. It keeps the hits facing the light, with the key
+//   of their shadow ray (wavefront_math.h), and counts the rays of each bin.
+// - cmdBin(): prefix sum of the bins, then the pixels of the shadow rays are written in the order
+//   of the bins
+// - rgen_shadow_shader traces the shadow rays in that order and writes their pixels
+// The ray tracing shaders access the buffers through the ray tracing descriptor set, which has to
+// be updated after setSize().
+//
+class WavefrontPass
+{
+public:
+  void setup(const vk::Device& device, PoolAllocator* allocator, uint32_t nbFrames);
+  void destroy();
+
+  // Buffers per pixel, of the size of the output image
+  void setSize(const vk::Extent2D& size);
+
+  void cmdClear(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex);
+  void cmdBin(const vk::CommandBuffer& cmdBuf, uint32_t frameIndex);
+
+  vk::Buffer getHitBuffer() const { return m_hits.buffer; }
+  vk::Buffer getKeyBuffer() const { return m_keys.buffer; }
+  vk::Buffer getBinBuffer() const { return m_bins.buffer; }
+  vk::Buffer getRayBuffer() const { return m_rays.buffer; }
+  vk::Buffer getCountBuffer() const { return m_count.buffer; }
+  // Shadow rays of a previous frame, read back once its command buffer completed
+  uint32_t getNbShadowRays() const { return m_nbShadowRays; }
+
+private:
+  void createPipelines();
+  void updateDescriptors();
+
+  vk::Device      m_device;
+  PoolAllocator*  m_alloc{nullptr};
+  nvvk::DebugUtil m_debug;
+  uint32_t        m_nbFrames{1};
+  uint32_t        m_nbPixels{0};
+
+  nvvk::DescriptorSetBindings m_descSetLayoutBind;
+  vk::DescriptorPool          m_descPool;
+  vk::DescriptorSetLayout     m_descSetLayout;
+  vk::DescriptorSet           m_descSet;
+  vk::PipelineLayout          m_pipelineLayout;
+  vk::Pipeline                m_scanPipeline;
+  vk::Pipeline                m_scatterPipeline;
+
+  nvvk::Buffer m_hits;      // WavefrontHit of raytrace.cxx per pixel
+  nvvk::Buffer m_keys;      // Key of the shadow ray per pixel
+  nvvk::Buffer m_bins;      // WF_NB_BINS counts, then offsets
+  nvvk::Buffer m_rays;      // Pixels of the shadow rays, sorted by bin
+  nvvk::Buffer m_count;     // Number of shadow rays
+  nvvk::Buffer m_readback;  // Shadow rays of each frame, host visible
+  uint32_t*    m_readbackMapped{nullptr};
+  uint32_t     m_nbShadowRays{0};
+};